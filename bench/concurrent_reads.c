@@ -0,0 +1,182 @@
+/*
+Measure point lookups by a growing number of reader threads while one
+writer thread keeps inserting rows past the ones loaded. The writer
+latches the pages it changes. Readers either latch each page shared on
+the way down, or read it optimistically with table_find_row() and
+check its version after, taking no latch and writing to no shared
+memory. Each run lasts a fixed time and reports lookups and inserts
+per second.
+
+Usage: bench/concurrent_reads [rows] [max_threads] [seconds]
+*/
+#define main db_main
+#include "../db.c"
+#undef main
+
+#define BENCH_FILENAME "bench.db"
+#define BENCH_POOL_FRAMES 32768
+#define BENCH_GROUP_COMMIT 1000
+
+typedef struct {
+  Table* table;
+  bool optimistic;
+  uint32_t num_rows;
+  uint32_t seed;
+  volatile bool* stop;
+  uint64_t operations;
+} Worker;
+
+double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void remove_database() {
+  unlink(BENCH_FILENAME);
+  unlink(BENCH_FILENAME "-wal");
+}
+
+void bench_row(Row* row, uint32_t id) {
+  char email[COLUMN_USERNAME_SIZE + 32];
+  row->id = id;
+  sprintf(row->username, "user%d", id);
+  int email_length = sprintf(email, "person%d@example.com", id);
+  row_set_email(row, email, email_length);
+}
+
+void load_rows(Table* table, uint32_t num_rows) {
+  Statement statement;
+  statement.type = STATEMENT_INSERT;
+  statement.rows_to_insert = NULL;
+  statement.row_to_insert.email = NULL;
+  for (uint32_t id = 1; id <= num_rows; id++) {
+    bench_row(&statement.row_to_insert, id);
+    execute_insert(&statement, table);
+  }
+  free(statement.row_to_insert.email);
+  pager_commit(table->pager);
+}
+
+void* read_rows(void* argument) {
+  Worker* worker = argument;
+  Table* table = worker->table;
+  Row row;
+  row.email = NULL;
+  while (!*worker->stop) {
+    uint32_t id = 1 + rand_r(&worker->seed) % worker->num_rows;
+    pager_enter(table->pager, TREE_READ);
+    LookupResult result =
+        worker->optimistic ? table_find_row(table, id, &row) : LOOKUP_LATCH;
+    if (result == LOOKUP_LATCH) {
+      Cursor* cursor = table_find_shared(table, id);
+      if (cursor_is_at_key(cursor, id)) {
+        result = LOOKUP_FOUND;
+        deserialize_row(table->pager, cursor_value(cursor), &row);
+      }
+      cursor_close(cursor);
+    }
+    pager_exit(table->pager, TREE_READ);
+    if (result != LOOKUP_FOUND) {
+      printf("Lookup did not find id %d.\n", id);
+      exit(EXIT_FAILURE);
+    }
+    worker->operations++;
+  }
+  free(row.email);
+  decoded_leaf_free();
+  return NULL;
+}
+
+void* insert_rows(void* argument) {
+  Worker* worker = argument;
+  Statement statement;
+  statement.type = STATEMENT_INSERT;
+  statement.rows_to_insert = NULL;
+  statement.row_to_insert.email = NULL;
+  while (!*worker->stop) {
+    bench_row(&statement.row_to_insert, ++worker->num_rows);
+    pager_enter(worker->table->pager, TREE_INSERT);
+    execute_insert(&statement, worker->table);
+    pager_exit(worker->table->pager, TREE_INSERT);
+    worker->operations++;
+  }
+  free(statement.row_to_insert.email);
+  decoded_leaf_free();
+  return NULL;
+}
+
+int main(int argc, char* argv[]) {
+  uint32_t num_rows = argc > 1 ? atoi(argv[1]) : 1000000;
+  uint32_t max_threads = argc > 2 ? atoi(argv[2]) : 32;
+  double seconds = argc > 3 ? atof(argv[3]) : 2;
+  if (num_rows == 0 || max_threads == 0 || seconds <= 0) {
+    printf("Usage: %s [rows] [max_threads] [seconds]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  DbOptions options;
+  options.backend = PAGER_BUFFER_POOL;
+  options.pool_frames = BENCH_POOL_FRAMES;
+  options.group_commit = BENCH_GROUP_COMMIT;
+  options.page_size = DEFAULT_PAGE_SIZE;
+  options.compress_pages = false;
+  options.hash_index = false;
+  remove_database();
+  Database* db = db_open(BENCH_FILENAME, &options);
+  Table* table = db->tables[0];
+  load_rows(table, num_rows);
+
+  printf("%d rows, %ld cores, %.1f seconds per run\n", num_rows,
+         sysconf(_SC_NPROCESSORS_ONLN), seconds);
+  printf("%7s %11s %12s %12s %12s\n", "readers", "lookups", "lookups/s",
+         "per_reader", "inserts/s");
+
+  Worker* workers = calloc(max_threads + 1, sizeof(Worker));
+  pthread_t* threads = calloc(max_threads + 1, sizeof(pthread_t));
+  uint32_t next_id = num_rows;
+  for (uint32_t num_readers = 1; num_readers <= max_threads;
+       num_readers *= 2) {
+    for (uint32_t mode = 0; mode < 2; mode++) {
+      bool optimistic = mode == 1;
+      volatile bool stop = false;
+      for (uint32_t i = 0; i <= num_readers; i++) {
+        workers[i].table = table;
+        workers[i].optimistic = optimistic;
+        workers[i].num_rows = i == num_readers ? next_id : num_rows;
+        workers[i].seed = i + 1;
+        workers[i].stop = &stop;
+        workers[i].operations = 0;
+      }
+      for (uint32_t i = 0; i < num_readers; i++) {
+        pthread_create(&threads[i], NULL, read_rows, &workers[i]);
+      }
+      pthread_create(&threads[num_readers], NULL, insert_rows,
+                     &workers[num_readers]);
+
+      double start = now_seconds();
+      usleep((useconds_t)(seconds * 1e6));
+      stop = true;
+      for (uint32_t i = 0; i <= num_readers; i++) {
+        pthread_join(threads[i], NULL);
+      }
+      double elapsed = now_seconds() - start;
+      next_id = workers[num_readers].num_rows;
+
+      uint64_t lookups = 0;
+      for (uint32_t i = 0; i < num_readers; i++) {
+        lookups += workers[i].operations;
+      }
+      printf("%7d %11s %12.0f %12.0f %12.0f\n", num_readers,
+             optimistic ? "optimistic" : "latched", lookups / elapsed,
+             lookups / elapsed / num_readers,
+             workers[num_readers].operations / elapsed);
+    }
+  }
+
+  free(workers);
+  free(threads);
+  db_close(db);
+  remove_database();
+  return 0;
+}
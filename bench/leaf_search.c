@@ -0,0 +1,223 @@
+/*
+Compare finding a key in a full leaf with the binary search over the
+old layout, where each key sits next to its record's offset and size,
+against keys_lower_bound over the separate key array. Each search picks
+one of enough leaves that most start cold, and reports the time and
+the L1 data cache and last level cache misses per search, read from
+the CPU's counters with perf_event_open. Where the counters are not
+available, as in most virtual machines, the misses print as "-".
+
+Usage: bench/leaf_search [searches] [record_size] [megabytes]
+*/
+#define main db_main
+#include "../db.c"
+#undef main
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+const uint32_t BENCH_PAGE_SIZES[] = {4096, 16384, 65536};
+
+typedef struct {
+  int l1d_fd;  // -1 if the counter is not available
+  int llc_fd;
+} CacheCounters;
+
+typedef struct {
+  double ns;
+  double l1d_misses;  // Per search, or -1
+  double llc_misses;
+} SearchCost;
+
+double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int open_counter(uint32_t type, uint64_t config) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+void counters_open(CacheCounters* counters) {
+  counters->l1d_fd = open_counter(
+      PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                              PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                              PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  counters->llc_fd =
+      open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+}
+
+void counter_start(int fd) {
+  if (fd >= 0) {
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+}
+
+/* The count per search, or -1 if the counter is not available */
+double counter_stop(int fd, uint32_t num_searches) {
+  uint64_t count;
+  if (fd < 0) {
+    return -1;
+  }
+  ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+  if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+    return -1;
+  }
+  return (double)count / num_searches;
+}
+
+/* The layout before keys were separated: key, offset, size per slot */
+uint32_t* interleaved_key(void* node, uint32_t cell_num) {
+  return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_SLOT_SIZE;
+}
+
+uint32_t interleaved_find(void* node, uint32_t key) {
+  uint32_t min_index = 0;
+  uint32_t one_past_max_index = *leaf_node_num_cells(node);
+  while (one_past_max_index != min_index) {
+    uint32_t index = (min_index + one_past_max_index) / 2;
+    uint32_t key_at_index = *interleaved_key(node, index);
+    if (key == key_at_index) {
+      return index;
+    }
+    if (key < key_at_index) {
+      one_past_max_index = index;
+    } else {
+      min_index = index + 1;
+    }
+  }
+  return min_index;
+}
+
+/* What leaf_node_find does for a leaf that is not compressed */
+uint32_t separated_find(void* node, uint32_t key) {
+  return keys_lower_bound(leaf_node_key(node, 0), *leaf_node_num_cells(node),
+                          key);
+}
+
+/*
+Fill num_leaves leaves in both layouts with the same keys, as many
+records of record_size as fit. Returns the number of cells in each.
+*/
+uint32_t fill_leaves(void* leaves, void* interleaved, uint32_t num_leaves,
+                     uint32_t record_size) {
+  uint32_t num_cells = 0;
+  for (uint32_t n = 0; n < num_leaves; n++) {
+    void* node = leaves + (size_t)n * page_size;
+    void* old_node = interleaved + (size_t)n * page_size;
+    initialize_leaf_node(node);
+    initialize_leaf_node(old_node);
+    num_cells = 0;
+    while (leaf_node_free_space(node) >= LEAF_NODE_SLOT_SIZE + record_size) {
+      uint32_t key = num_cells * 16 + 15;
+      memset(leaf_node_insert_cell(node, num_cells, key, record_size), 0,
+             record_size);
+      *interleaved_key(old_node, num_cells) = key;
+      num_cells++;
+    }
+    *leaf_node_num_cells(old_node) = num_cells;
+  }
+  return num_cells;
+}
+
+SearchCost time_searches(uint32_t (*find)(void*, uint32_t), void* leaves,
+                         uint32_t num_leaves, uint32_t* keys,
+                         uint32_t* leaf_nums, uint32_t num_searches,
+                         CacheCounters* counters, uint64_t* checksum) {
+  SearchCost cost;
+  uint64_t sum = 0;
+  counter_start(counters->l1d_fd);
+  counter_start(counters->llc_fd);
+  double start = now_seconds();
+  for (uint32_t i = 0; i < num_searches; i++) {
+    void* node = leaves + (size_t)(leaf_nums[i] % num_leaves) * page_size;
+    sum += find(node, keys[i]);
+  }
+  cost.ns = (now_seconds() - start) * 1e9 / num_searches;
+  cost.l1d_misses = counter_stop(counters->l1d_fd, num_searches);
+  cost.llc_misses = counter_stop(counters->llc_fd, num_searches);
+  *checksum = sum;
+  return cost;
+}
+
+void print_misses(double misses) {
+  if (misses < 0) {
+    printf(" %8s", "-");
+  } else {
+    printf(" %8.2f", misses);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  uint32_t num_searches = argc > 1 ? atoi(argv[1]) : 10000000;
+  uint32_t record_size = argc > 2 ? atoi(argv[2]) : 64;
+  uint32_t megabytes = argc > 3 ? atoi(argv[3]) : 256;
+  if (num_searches == 0 || record_size == 0 ||
+      record_size > RECORD_MAX_SIZE || megabytes == 0) {
+    printf("Usage: %s [searches] [record_size] [megabytes]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  CacheCounters counters;
+  counters_open(&counters);
+  printf("%d searches, %d byte records, %d MB of leaves, per search:\n",
+         num_searches, record_size, megabytes);
+  printf("%9s %6s %8s %8s %8s %8s %8s %8s\n", "page_size", "cells", "old_ns",
+         "old_l1d", "old_llc", "new_ns", "new_l1d", "new_llc");
+
+  uint32_t* keys = malloc(sizeof(uint32_t) * num_searches);
+  uint32_t* leaf_nums = malloc(sizeof(uint32_t) * num_searches);
+  uint32_t num_sizes = sizeof(BENCH_PAGE_SIZES) / sizeof(uint32_t);
+  for (uint32_t s = 0; s < num_sizes; s++) {
+    set_page_size(BENCH_PAGE_SIZES[s]);
+    uint32_t num_leaves =
+        (uint32_t)((uint64_t)megabytes * 1024 * 1024 / page_size);
+    size_t bytes = (size_t)num_leaves * page_size;
+    void* leaves = aligned_alloc(page_size, bytes);
+    void* interleaved = aligned_alloc(page_size, bytes);
+    uint32_t num_cells =
+        fill_leaves(leaves, interleaved, num_leaves, record_size);
+
+    srand(1);
+    for (uint32_t i = 0; i < num_searches; i++) {
+      keys[i] = ((uint32_t)rand() % num_cells) * 16 + 15;
+      leaf_nums[i] = (uint32_t)rand();
+    }
+
+    uint64_t sums[2];
+    SearchCost old_cost =
+        time_searches(interleaved_find, interleaved, num_leaves, keys,
+                      leaf_nums, num_searches, &counters, &sums[0]);
+    SearchCost new_cost =
+        time_searches(separated_find, leaves, num_leaves, keys, leaf_nums,
+                      num_searches, &counters, &sums[1]);
+    if (sums[0] != sums[1]) {
+      printf("Searches disagree at page size %d.\n", page_size);
+      exit(EXIT_FAILURE);
+    }
+
+    printf("%9d %6d %8.1f", page_size, num_cells, old_cost.ns);
+    print_misses(old_cost.l1d_misses);
+    print_misses(old_cost.llc_misses);
+    printf(" %8.1f", new_cost.ns);
+    print_misses(new_cost.l1d_misses);
+    print_misses(new_cost.llc_misses);
+    printf("\n");
+    free(leaves);
+    free(interleaved);
+  }
+  free(keys);
+  free(leaf_nums);
+  return 0;
+}
@@ -0,0 +1,135 @@
+/*
+Compare finding the child of a full internal node with the scalar
+binary search over the old layout, where each key sits next to its
+child, against keys_lower_bound over the separate key array. Searches
+run over one node that stays in cache, and over enough nodes that most
+searches start on a cold one.
+
+Usage: bench/node_search [searches] [cold_megabytes]
+Built with -mavx2, the keys are compared 8 at a time instead of 4.
+*/
+#define main db_main
+#include "../db.c"
+#undef main
+
+const uint32_t BENCH_PAGE_SIZES[] = {4096, 16384, 65536};
+
+double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The layout before keys were separated: child, then key, per cell */
+uint32_t* interleaved_key(void* node, uint32_t key_num) {
+  return node + INTERNAL_NODE_HEADER_SIZE + key_num * INTERNAL_NODE_CELL_SIZE +
+         INTERNAL_NODE_CHILD_SIZE;
+}
+
+uint32_t interleaved_find_child(void* node, uint32_t key) {
+  uint32_t min_index = 0;
+  uint32_t max_index = *internal_node_num_keys(node);
+  while (min_index != max_index) {
+    uint32_t index = (min_index + max_index) / 2;
+    if (*interleaved_key(node, index) >= key) {
+      max_index = index;
+    } else {
+      min_index = index + 1;
+    }
+  }
+  return min_index;
+}
+
+/* Fill num_nodes full nodes in both layouts with the same keys */
+void fill_nodes(void* nodes, void* interleaved, uint32_t num_nodes) {
+  for (uint32_t n = 0; n < num_nodes; n++) {
+    void* node = nodes + (size_t)n * page_size;
+    void* old_node = interleaved + (size_t)n * page_size;
+    initialize_internal_node(node);
+    initialize_internal_node(old_node);
+    *internal_node_num_keys(node) = internal_node_max_cells;
+    *internal_node_num_keys(old_node) = internal_node_max_cells;
+    for (uint32_t i = 0; i < internal_node_max_cells; i++) {
+      uint32_t key = i * 16 + 15;
+      *internal_node_key(node, i) = key;
+      *interleaved_key(old_node, i) = key;
+    }
+  }
+}
+
+double time_searches(uint32_t (*find_child)(void*, uint32_t), void* nodes,
+                     uint32_t num_nodes, uint32_t* keys, uint32_t* node_nums,
+                     uint32_t num_searches, uint64_t* checksum) {
+  double start = now_seconds();
+  uint64_t sum = 0;
+  for (uint32_t i = 0; i < num_searches; i++) {
+    void* node = nodes + (size_t)(node_nums[i] % num_nodes) * page_size;
+    sum += find_child(node, keys[i]);
+  }
+  *checksum = sum;
+  return (now_seconds() - start) * 1e9 / num_searches;
+}
+
+int main(int argc, char* argv[]) {
+  uint32_t num_searches = argc > 1 ? atoi(argv[1]) : 10000000;
+  uint32_t cold_megabytes = argc > 2 ? atoi(argv[2]) : 256;
+  if (num_searches == 0 || cold_megabytes == 0) {
+    printf("Usage: %s [searches] [cold_megabytes]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+#if defined(__AVX2__)
+  const char* compare = "AVX2";
+#elif defined(__SSE2__)
+  const char* compare = "SSE2";
+#else
+  const char* compare = "scalar";
+#endif
+  printf("%d searches, %d MB of cold nodes, %s compares, ns per search\n",
+         num_searches, cold_megabytes, compare);
+  printf("%9s %6s %11s %11s %11s %11s\n", "page_size", "keys", "binary_hot",
+         "simd_hot", "binary_cold", "simd_cold");
+
+  uint32_t* keys = malloc(sizeof(uint32_t) * num_searches);
+  uint32_t* node_nums = malloc(sizeof(uint32_t) * num_searches);
+  uint32_t num_sizes = sizeof(BENCH_PAGE_SIZES) / sizeof(uint32_t);
+  for (uint32_t s = 0; s < num_sizes; s++) {
+    set_page_size(BENCH_PAGE_SIZES[s]);
+    uint32_t num_nodes =
+        (uint32_t)((uint64_t)cold_megabytes * 1024 * 1024 / page_size);
+    size_t bytes = (size_t)num_nodes * page_size;
+    void* nodes = aligned_alloc(page_size, bytes);
+    void* interleaved = aligned_alloc(page_size, bytes);
+    fill_nodes(nodes, interleaved, num_nodes);
+
+    srand(1);
+    uint32_t max_key = internal_node_max_cells * 16 + 16;
+    for (uint32_t i = 0; i < num_searches; i++) {
+      keys[i] = (uint32_t)rand() % max_key;
+      node_nums[i] = (uint32_t)rand();
+    }
+
+    uint64_t sums[4];
+    double ns[4];
+    ns[0] = time_searches(interleaved_find_child, interleaved, 1, keys,
+                          node_nums, num_searches, &sums[0]);
+    ns[1] = time_searches(internal_node_find_child, nodes, 1, keys, node_nums,
+                          num_searches, &sums[1]);
+    ns[2] = time_searches(interleaved_find_child, interleaved, num_nodes, keys,
+                          node_nums, num_searches, &sums[2]);
+    ns[3] = time_searches(internal_node_find_child, nodes, num_nodes, keys,
+                          node_nums, num_searches, &sums[3]);
+    if (sums[0] != sums[1] || sums[2] != sums[3]) {
+      printf("Searches disagree at page size %d.\n", page_size);
+      exit(EXIT_FAILURE);
+    }
+
+    printf("%9d %6d %11.1f %11.1f %11.1f %11.1f\n", page_size,
+           internal_node_max_cells, ns[0], ns[1], ns[2], ns[3]);
+    free(nodes);
+    free(interleaved);
+  }
+  free(keys);
+  free(node_nums);
+  return 0;
+}
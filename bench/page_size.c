@@ -0,0 +1,168 @@
+/*
+Compare full scans and random point lookups across page sizes on the
+same rows. Each page size gets a fresh database and a buffer pool of
+the same number of bytes, reopened before each measurement.
+
+Usage: bench/page_size [rows] [lookups] [pool_megabytes]
+*/
+#define main db_main
+#include "../db.c"
+#undef main
+
+#define BENCH_FILENAME "bench.db"
+#define BENCH_BATCH_ROWS 10000
+
+const uint32_t BENCH_PAGE_SIZES[] = {4096, 16384, 65536};
+
+double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void remove_database() {
+  unlink(BENCH_FILENAME);
+  unlink(BENCH_FILENAME "-wal");
+}
+
+void load_rows(DbOptions* options, uint32_t num_rows) {
+  Database* db = db_open(BENCH_FILENAME, options);
+  Table* table = db->tables[0];
+  Row* rows = calloc(BENCH_BATCH_ROWS, sizeof(Row));
+  char email[COLUMN_USERNAME_SIZE + 32];
+  Statement statement;
+  statement.type = STATEMENT_INSERT;
+  statement.rows_to_insert = rows;
+
+  for (uint32_t first = 1; first <= num_rows; first += BENCH_BATCH_ROWS) {
+    uint32_t batch = num_rows - first + 1;
+    if (batch > BENCH_BATCH_ROWS) {
+      batch = BENCH_BATCH_ROWS;
+    }
+    for (uint32_t i = 0; i < batch; i++) {
+      rows[i].id = first + i;
+      sprintf(rows[i].username, "user%d", first + i);
+      int email_length = sprintf(email, "person%d@example.com", first + i);
+      row_set_email(&rows[i], email, email_length);
+    }
+    statement.num_rows_to_insert = batch;
+    if (execute_insert(&statement, table) != EXECUTE_SUCCESS) {
+      printf("Error loading rows.\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  for (uint32_t i = 0; i < BENCH_BATCH_ROWS; i++) {
+    free(rows[i].email);
+  }
+  free(rows);
+  db_close(db);
+}
+
+double scan_rows(DbOptions* options, uint32_t num_rows, uint64_t* misses) {
+  Database* db = db_open(BENCH_FILENAME, options);
+  Table* table = db->tables[0];
+  memset(&table->pager->stats, 0, sizeof(PagerStats));
+  double start = now_seconds();
+
+  Row row;
+  row.email = NULL;
+  uint32_t count = 0;
+  Cursor* cursor = table_start(table);
+  while (!cursor->end_of_table) {
+    row.id = cursor_key(cursor);
+    deserialize_row(table->pager, cursor_value(cursor), &row);
+    count++;
+    cursor_advance(cursor);
+  }
+  free(cursor);
+  free(row.email);
+
+  double elapsed = now_seconds() - start;
+  if (count != num_rows) {
+    printf("Scan found %d rows, expected %d.\n", count, num_rows);
+    exit(EXIT_FAILURE);
+  }
+  *misses = table->pager->stats.misses;
+  db_close(db);
+  return elapsed;
+}
+
+double lookup_rows(DbOptions* options, uint32_t num_rows, uint32_t lookups,
+                   uint64_t* misses) {
+  Database* db = db_open(BENCH_FILENAME, options);
+  Table* table = db->tables[0];
+  pager_advise(table->pager, ACCESS_RANDOM);
+  memset(&table->pager->stats, 0, sizeof(PagerStats));
+  srand(1);
+  double start = now_seconds();
+
+  Row row;
+  row.email = NULL;
+  for (uint32_t i = 0; i < lookups; i++) {
+    uint32_t id = 1 + (uint32_t)rand() % num_rows;
+    Cursor* cursor = table_find(table, id);
+    if (!cursor_is_at_key(cursor, id)) {
+      printf("Lookup did not find id %d.\n", id);
+      exit(EXIT_FAILURE);
+    }
+    deserialize_row(table->pager, cursor_value(cursor), &row);
+    free(cursor);
+  }
+  free(row.email);
+
+  double elapsed = now_seconds() - start;
+  *misses = table->pager->stats.misses;
+  db_close(db);
+  return elapsed;
+}
+
+int main(int argc, char* argv[]) {
+  uint32_t num_rows = argc > 1 ? atoi(argv[1]) : 1000000;
+  uint32_t lookups = argc > 2 ? atoi(argv[2]) : 1000000;
+  uint32_t pool_megabytes = argc > 3 ? atoi(argv[3]) : 16;
+  if (num_rows == 0 || lookups == 0 || pool_megabytes == 0) {
+    printf("Usage: %s [rows] [lookups] [pool_megabytes]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  printf("%d rows, %d lookups, %d MB buffer pool\n", num_rows, lookups,
+         pool_megabytes);
+  printf("%9s %8s %12s %12s %12s %14s\n", "page_size", "pages",
+         "scan_rows/s", "scan_misses", "lookups/s", "lookup_misses");
+
+  uint32_t num_sizes = sizeof(BENCH_PAGE_SIZES) / sizeof(uint32_t);
+  for (uint32_t i = 0; i < num_sizes; i++) {
+    DbOptions options;
+    options.backend = PAGER_BUFFER_POOL;
+    options.group_commit = 1;
+    options.page_size = BENCH_PAGE_SIZES[i];
+    options.compress_pages = false;
+    options.hash_index = false;
+    options.pool_frames = (uint32_t)((uint64_t)pool_megabytes * 1024 * 1024 /
+                                     BENCH_PAGE_SIZES[i]);
+    if (options.pool_frames < MIN_POOL_FRAMES) {
+      options.pool_frames = MIN_POOL_FRAMES;
+    }
+
+    remove_database();
+    load_rows(&options, num_rows);
+
+    uint64_t scan_misses;
+    uint64_t lookup_misses;
+    double scan_seconds = scan_rows(&options, num_rows, &scan_misses);
+    double lookup_seconds =
+        lookup_rows(&options, num_rows, lookups, &lookup_misses);
+
+    Database* db = db_open(BENCH_FILENAME, &options);
+    uint32_t num_pages = db->pager->num_pages;
+    db_close(db);
+
+    printf("%9d %8d %12.0f %12lu %12.0f %14lu\n", BENCH_PAGE_SIZES[i],
+           num_pages, num_rows / scan_seconds, (unsigned long)scan_misses,
+           lookups / lookup_seconds, (unsigned long)lookup_misses);
+  }
+
+  remove_database();
+  return 0;
+}
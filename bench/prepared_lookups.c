@@ -0,0 +1,111 @@
+/*
+Measure point lookups run the way the server runs a request, without
+the socket: a select parsed from text with its row printed, the same
+select prepared once and executed with a text value, and executed with
+a binary value and a binary row. Each way looks up the same random ids
+and reports lookups per second.
+
+Usage: bench/prepared_lookups [rows] [lookups]
+*/
+#define main db_main
+#include "../db.c"
+#undef main
+
+#define BENCH_FILENAME "bench.db"
+#define BENCH_POOL_FRAMES 4096
+#define BENCH_GROUP_COMMIT 1000
+
+double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void remove_database() {
+  unlink(BENCH_FILENAME);
+  unlink(BENCH_FILENAME "-wal");
+}
+
+void load_rows(Table* table, uint32_t num_rows) {
+  Statement statement;
+  statement.type = STATEMENT_INSERT;
+  statement.rows_to_insert = NULL;
+  statement.row_to_insert.email = NULL;
+  char email[COLUMN_USERNAME_SIZE + 32];
+  for (uint32_t id = 1; id <= num_rows; id++) {
+    statement.row_to_insert.id = id;
+    sprintf(statement.row_to_insert.username, "user%d", id);
+    int email_length = sprintf(email, "person%d@example.com", id);
+    row_set_email(&statement.row_to_insert, email, email_length);
+    execute_insert(&statement, table);
+  }
+  free(statement.row_to_insert.email);
+  pager_commit(table->pager);
+}
+
+/* Write the request for one lookup of id the given way */
+size_t lookup_request(uint32_t mode, uint32_t id, char* request) {
+  if (mode == 0) {
+    return sprintf(request, "select where id = %d", id);
+  } else if (mode == 1) {
+    return sprintf(request, "execute find %d", id);
+  }
+  uint32_t value = htonl(id);
+  request[0] = REQUEST_EXECUTE;
+  request[1] = strlen("find");
+  memcpy(request + 2, "find", strlen("find"));
+  memcpy(request + 2 + strlen("find"), &value, sizeof(value));
+  return 2 + strlen("find") + sizeof(value);
+}
+
+int main(int argc, char* argv[]) {
+  uint32_t num_rows = argc > 1 ? atoi(argv[1]) : 100000;
+  uint32_t num_lookups = argc > 2 ? atoi(argv[2]) : 1000000;
+  if (num_rows == 0 || num_lookups == 0) {
+    printf("Usage: %s [rows] [lookups]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  DbOptions options;
+  options.backend = PAGER_BUFFER_POOL;
+  options.pool_frames = BENCH_POOL_FRAMES;
+  options.group_commit = BENCH_GROUP_COMMIT;
+  options.page_size = DEFAULT_PAGE_SIZE;
+  options.compress_pages = false;
+  options.hash_index = false;
+  options.listen_address = NULL;
+  remove_database();
+  Database* db = db_open(BENCH_FILENAME, &options);
+  load_rows(db->tables[0], num_rows);
+
+  Session* session = new_session();
+  ByteBuffer output = {NULL, 0, 0};
+  char prepare[] = "prepare find select where id = ?";
+  server_respond(db, session, prepare, strlen(prepare), &output);
+
+  printf("%d rows, %d lookups per run\n", num_rows, num_lookups);
+  printf("%16s %12s %14s\n", "request", "lookups/s", "response_bytes");
+  const char* names[] = {"text select", "text execute", "binary execute"};
+  char request[64];
+  for (uint32_t mode = 0; mode < 3; mode++) {
+    uint32_t seed = 1;
+    size_t response_bytes = 0;
+    double start = now_seconds();
+    for (uint32_t i = 0; i < num_lookups; i++) {
+      uint32_t id = 1 + rand_r(&seed) % num_rows;
+      size_t length = lookup_request(mode, id, request);
+      output.length = 0;
+      server_respond(db, session, request, length, &output);
+      response_bytes += output.length;
+    }
+    double elapsed = now_seconds() - start;
+    printf("%16s %12.0f %14.1f\n", names[mode], num_lookups / elapsed,
+           (double)response_bytes / num_lookups);
+  }
+
+  free(output.data);
+  session_close(session);
+  db_close(db);
+  remove_database();
+  return 0;
+}
@@ -0,0 +1,168 @@
+/*
+Measure full-table scans by one thread while another keeps inserting
+rows past the ones loaded, with the scans latching each page they read
+and with the scans reading a snapshot. Each run lasts a fixed time and
+reports scans and inserts per second. Rows are inserted in id order,
+so a scan of a snapshot must see ids 1 to n with none missing.
+
+Usage: bench/snapshot_scans [rows] [seconds]
+*/
+#define main db_main
+#include "../db.c"
+#undef main
+
+#define BENCH_FILENAME "bench.db"
+#define BENCH_POOL_FRAMES 4096
+#define BENCH_GROUP_COMMIT 1000
+
+typedef struct {
+  Table* table;
+  TreeAccess access;
+  uint32_t num_rows;
+  volatile bool* stop;
+  uint64_t operations;
+  uint64_t rows_seen;
+} Worker;
+
+double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void remove_database() {
+  unlink(BENCH_FILENAME);
+  unlink(BENCH_FILENAME "-wal");
+}
+
+void bench_row(Row* row, uint32_t id) {
+  char email[COLUMN_USERNAME_SIZE + 32];
+  row->id = id;
+  sprintf(row->username, "user%d", id);
+  int email_length = sprintf(email, "person%d@example.com", id);
+  row_set_email(row, email, email_length);
+}
+
+void load_rows(Table* table, uint32_t num_rows) {
+  Statement statement;
+  statement.type = STATEMENT_INSERT;
+  statement.rows_to_insert = NULL;
+  statement.row_to_insert.email = NULL;
+  for (uint32_t id = 1; id <= num_rows; id++) {
+    bench_row(&statement.row_to_insert, id);
+    execute_insert(&statement, table);
+  }
+  free(statement.row_to_insert.email);
+  pager_commit(table->pager);
+}
+
+void* scan_rows(void* argument) {
+  Worker* worker = argument;
+  Table* table = worker->table;
+  Row row;
+  row.email = NULL;
+  while (!*worker->stop) {
+    pager_enter(table->pager, worker->access);
+    Cursor* cursor = table_start_shared(table);
+    uint32_t count = 0;
+    uint32_t last_id = 0;
+    while (!cursor->end_of_table) {
+      last_id = cursor_key(cursor);
+      deserialize_row(table->pager, cursor_value(cursor), &row);
+      count++;
+      cursor_advance(cursor);
+    }
+    cursor_close(cursor);
+    pager_exit(table->pager, worker->access);
+    if (worker->access == TREE_SNAPSHOT && last_id != count) {
+      printf("Snapshot saw %d rows up to id %d.\n", count, last_id);
+      exit(EXIT_FAILURE);
+    }
+    worker->operations++;
+    worker->rows_seen += count;
+  }
+  free(row.email);
+  decoded_leaf_free();
+  return NULL;
+}
+
+void* insert_rows(void* argument) {
+  Worker* worker = argument;
+  Statement statement;
+  statement.type = STATEMENT_INSERT;
+  statement.rows_to_insert = NULL;
+  statement.row_to_insert.email = NULL;
+  while (!*worker->stop) {
+    bench_row(&statement.row_to_insert, ++worker->num_rows);
+    pager_enter(worker->table->pager, TREE_INSERT);
+    execute_insert(&statement, worker->table);
+    pager_exit(worker->table->pager, TREE_INSERT);
+    worker->operations++;
+  }
+  free(statement.row_to_insert.email);
+  decoded_leaf_free();
+  return NULL;
+}
+
+int main(int argc, char* argv[]) {
+  uint32_t num_rows = argc > 1 ? atoi(argv[1]) : 200000;
+  double seconds = argc > 2 ? atof(argv[2]) : 2;
+  if (num_rows == 0 || seconds <= 0) {
+    printf("Usage: %s [rows] [seconds]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  DbOptions options;
+  options.backend = PAGER_BUFFER_POOL;
+  options.pool_frames = BENCH_POOL_FRAMES;
+  options.group_commit = BENCH_GROUP_COMMIT;
+  options.page_size = DEFAULT_PAGE_SIZE;
+  options.compress_pages = false;
+  options.hash_index = false;
+  remove_database();
+  Database* db = db_open(BENCH_FILENAME, &options);
+  Table* table = db->tables[0];
+  load_rows(table, num_rows);
+
+  printf("%d rows, %ld cores, %.1f seconds per run\n", num_rows,
+         sysconf(_SC_NPROCESSORS_ONLN), seconds);
+  printf("%8s %10s %12s %12s\n", "scan", "scans/s", "rows/scan",
+         "inserts/s");
+
+  const TreeAccess accesses[] = {TREE_READ, TREE_SNAPSHOT};
+  const char* names[] = {"latched", "snapshot"};
+  uint32_t next_id = num_rows;
+  for (uint32_t run = 0; run < 2; run++) {
+    volatile bool stop = false;
+    Worker workers[2];
+    memset(workers, 0, sizeof(workers));
+    for (uint32_t i = 0; i < 2; i++) {
+      workers[i].table = table;
+      workers[i].access = accesses[run];
+      workers[i].num_rows = next_id;
+      workers[i].stop = &stop;
+    }
+    pthread_t threads[2];
+    pthread_create(&threads[0], NULL, scan_rows, &workers[0]);
+    pthread_create(&threads[1], NULL, insert_rows, &workers[1]);
+
+    double start = now_seconds();
+    usleep((useconds_t)(seconds * 1e6));
+    stop = true;
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+    double elapsed = now_seconds() - start;
+    next_id = workers[1].num_rows;
+
+    printf("%8s %10.2f %12.0f %12.0f\n", names[run],
+           workers[0].operations / elapsed,
+           workers[0].operations
+               ? (double)workers[0].rows_seen / workers[0].operations
+               : 0,
+           workers[1].operations / elapsed);
+  }
+
+  db_close(db);
+  remove_database();
+  return 0;
+}
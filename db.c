@@ -1,11 +1,28 @@
+#include <arpa/inet.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 typedef struct {
   char* buffer;
@@ -13,9 +30,19 @@ typedef struct {
   ssize_t input_length;
 } InputBuffer;
 
+typedef struct {
+  char* data;
+  size_t length;
+  size_t capacity;
+} ByteBuffer;
+
 typedef enum {
   EXECUTE_SUCCESS,
   EXECUTE_DUPLICATE_KEY,
+  EXECUTE_KEY_NOT_FOUND,
+  EXECUTE_NO_SUCH_TABLE,
+  EXECUTE_TABLE_EXISTS,
+  EXECUTE_INDEX_EXISTS,
 } ExecuteResult;
 
 typedef enum {
@@ -31,58 +58,406 @@ typedef enum {
   PREPARE_UNRECOGNIZED_STATEMENT
 } PrepareResult;
 
-typedef enum { STATEMENT_INSERT, STATEMENT_SELECT } StatementType;
+typedef enum {
+  STATEMENT_INSERT,
+  STATEMENT_SELECT,
+  STATEMENT_UPDATE,
+  STATEMENT_DELETE,
+  STATEMENT_CREATE_TABLE,
+  STATEMENT_CREATE_INDEX
+} StatementType;
+
+typedef enum { COLUMN_ID, COLUMN_USERNAME, COLUMN_EMAIL } Column;
 
 #define COLUMN_USERNAME_SIZE 32
-#define COLUMN_EMAIL_SIZE 255
+#define COLUMN_EMAIL_SIZE (16 * 1024 * 1024)
+#define TABLE_NAME_MAX_SIZE COLUMN_USERNAME_SIZE  // Names are catalog rows
+#define MAIN_TABLE_NAME "main"
 typedef struct {
   uint32_t id;
   char username[COLUMN_USERNAME_SIZE + 1];
-  char email[COLUMN_EMAIL_SIZE + 1];
+  char* email;  // Owned by the row; NULL or NUL-terminated
+  uint32_t email_length;
 } Row;
 
+/*
+A statement may be prepared with a ? in place of a value, to be bound
+each time it is run. Any value but a table name may be one: an id, a
+username or an email to insert or update, in any row of an insert
+values statement, the id to delete, or the value a select compares a
+column with.
+*/
+#define STATEMENT_MAX_PARAMETERS 8
+typedef enum {
+  PARAMETER_ID,        // The id to insert, update or delete
+  PARAMETER_USERNAME,  // The username to insert or update
+  PARAMETER_EMAIL,     // The email to insert or update
+  PARAMETER_FILTER     // A select's condition value
+} ParameterKind;
+
+typedef struct {
+  ParameterKind kind;
+  Column column;         // only used by filter parameters
+  char* operator;  // only used by filter parameters
+  uint32_t row;    // only used by insert values, the row it is in
+} Parameter;
+
 typedef struct {
   StatementType type;
-  Row row_to_insert;  // only used by insert statement
+  char table_name[TABLE_NAME_MAX_SIZE + 1];
+  Row row_to_insert;  // only used by insert and update statements
+  uint32_t id_to_delete;  // only used by delete statement
+  Row* rows_to_insert;    // only used by insert values, NULL otherwise
+  uint32_t num_rows_to_insert;
+  /* Keys selected are range_start <= id < range_end */
+  uint64_t range_start;  // only used by select statement
+  uint64_t range_end;    // only used by select statement
+  /*
+  A select may also have one condition on username or email: the value
+  equals filter_value, or starts with it if filter_prefix is set
+  */
+  Column filter_column;  // COLUMN_ID if there is none
+  char* filter_value;    // Points into the input buffer
+  uint32_t filter_length;
+  bool filter_prefix;
+  Column column_to_index;  // only used by create index statement
+  Parameter parameters[STATEMENT_MAX_PARAMETERS];  // In order of the ?s
+  uint32_t num_parameters;
+  ByteBuffer* results;  // A select encodes its rows here; NULL prints them
 } Statement;
 
-#define size_of_attribute(Struct, Attribute) sizeof(((Struct*)0)->Attribute)
+/*
+ * Record Layout
+ * A row is stored as a record: a length byte and the username, then a
+ * varint length and the email. The id is the cell's key and is not
+ * repeated. An email longer than EMAIL_MAX_LOCAL_SIZE keeps only its
+ * first EMAIL_OVERFLOW_PREFIX_SIZE bytes in the record, followed by the
+ * first page of an overflow chain holding the rest.
+ */
+#define VARINT_MAX_SIZE 5
+#define EMAIL_MAX_LOCAL_SIZE 255
+#define EMAIL_OVERFLOW_PREFIX_SIZE 32
+const uint32_t RECORD_LENGTH_SIZE = sizeof(uint8_t);
+const uint32_t RECORD_OVERFLOW_PAGE_SIZE = sizeof(uint32_t);
+const uint32_t RECORD_MAX_SIZE = RECORD_LENGTH_SIZE + COLUMN_USERNAME_SIZE +
+                                 VARINT_MAX_SIZE + EMAIL_MAX_LOCAL_SIZE;
+
+/*
+The page size is chosen when a database is created and read back from
+its file header. It and the layout derived from it are set by
+set_page_size() when a database is opened, so every database open at
+the same time must share one page size. Being variables, they are named
+in lower case, unlike the layout constants that do not depend on it.
+*/
+#define DEFAULT_PAGE_SIZE 4096
+#define MIN_PAGE_SIZE 4096
+#define MAX_PAGE_SIZE 65536  // Leaf record offsets are 16 bits
+uint32_t page_size;  // Set by set_page_size()
+#define DEFAULT_POOL_FRAMES 256
+/*
+Splits pin at most four pages at once; .btree pins one page per
+tree level. Threads running statements at once each need their own:
+a reader pins one path, and a writer that runs alongside readers every
+page it changes, so a pool shared with readers needs to be bigger. A
+writer that runs alone, as every statement from the REPL or the server
+does, pins no more than a split.
+*/
+#define MIN_POOL_FRAMES 8
+#define SNAPSHOT_CACHED_PAGES 16  // Unpinned copies a snapshot keeps
+#define LEAF_HASH_MIN_CAPACITY 1024
+#define INVALID_PAGE_NUM UINT32_MAX
+
+#define WAL_AUTOCHECKPOINT_FRAMES 1000
+#define WAL_FRAMES_PER_WRITE 256  // Two iovecs per frame, well under IOV_MAX
+#define PAGER_MAX_FLUSH_RUN 256
+
+#define IMPORT_RUN_ROWS (1 << 18)  // Rows sorted in memory per run
+#define BUILD_MAX_LEVELS 32
+#define OPTIMISTIC_MAX_RESTARTS 8  // Before a lookup latches instead
+
+/* Address space reserved up front so the mapping never moves */
+#define MMAP_RESERVE_BYTES ((size_t)1 << 36)
+
+typedef enum { PAGER_BUFFER_POOL, PAGER_MMAP } PagerBackend;
+
+typedef enum { ACCESS_NORMAL, ACCESS_SEQUENTIAL, ACCESS_RANDOM } AccessPattern;
+
+typedef enum { LATCH_NONE, LATCH_SHARED, LATCH_EXCLUSIVE } LatchMode;
+
+/*
+How a statement shares its tree with other threads; see pager_enter().
+Any number of readers run alongside one writer.
+*/
+typedef enum {
+  TREE_READ,       // Latches each page it reads
+  TREE_SNAPSHOT,   // Reads the last commit, latching nothing
+  TREE_INSERT,     // The writer, adding one row
+  TREE_WRITE,      // The writer, changing or removing rows
+  TREE_EXCLUSIVE   // Runs alone and latches nothing
+} TreeAccess;
+
+typedef struct {
+  PagerBackend backend;
+  uint32_t pool_frames;   // Number of page frames in the buffer pool
+  uint32_t group_commit;  // Commits to batch into one WAL fsync
+  uint32_t page_size;     // Only used when creating a database
+  bool compress_pages;    // Only used when creating a database
+  bool hash_index;        // Keep a LeafHash for each table
+  const char* listen_address;  // Serve clients there, or NULL for stdin
+} DbOptions;
+
+/*
+ * A frame is one page-sized slot of the buffer pool. A pinned frame
+ * (pin_count > 0) is never evicted, so pointers into it stay valid
+ * until it is unpinned.
+ */
+typedef struct {
+  uint32_t page_num;  // INVALID_PAGE_NUM if the frame holds no page
+  uint32_t pin_count;
+  bool dirty;
+  bool referenced;  // CLOCK reference bit
+  void* data;
+  /*
+  Held shared by readers and exclusively by the writer, always on top
+  of a pin. Taken without the pager's mutex held.
+  */
+  pthread_rwlock_t latch;
+  /*
+  Odd while the writer holds the latch or a page is being loaded, and
+  bumped again after, so that readers that take no latch can tell
+  whether what they read changed (see table_find_row())
+  */
+  uint64_t version;
+} Frame;
+
+typedef struct {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t write_backs;
+  uint64_t pages_flushed;  // Pages written to the main file
+  uint64_t flush_writes;   // pwritev() calls used to write them
+} PagerStats;
+
+/*
+ * Write-ahead log. Modified pages are appended to a side file as
+ * full-page redo frames; the main file is only written by checkpoints.
+ */
+typedef struct {
+  int file_descriptor;
+  char* filename;
+  uint32_t num_frames;      // Frames appended since the last checkpoint
+  uint32_t uncommitted_frames;
+  uint32_t* frame_of_page;  // page_num -> 1-based frame number, 0 if none
+  uint32_t frame_of_page_capacity;
+  /*
+  frame_num -> the frame holding the same page before it, 0 if none, so
+  that a snapshot can find the page as it was (see snapshot_read_page())
+  */
+  uint32_t* previous_frame;
+  uint32_t previous_frame_capacity;
+  uint32_t salt[2];
+  uint32_t checksum[2];     // Running checksum of the last frame written
+  uint32_t group_commit;
+  uint32_t pending_commits; // Commits written but not yet fsynced
+  uint64_t commits;
+  uint64_t syncs;
+  uint64_t checkpoints;
+} Wal;
+
+/* Where a page of a compressed database is stored in the main file */
+typedef struct {
+  uint32_t offset;  // In PAGE_EXTENT_UNITs
+  uint32_t size;    // Bytes; 0 if never written, page_size if stored raw
+} PageExtent;
 
-const uint32_t ID_SIZE = size_of_attribute(Row, id);
-const uint32_t USERNAME_SIZE = size_of_attribute(Row, username);
-const uint32_t EMAIL_SIZE = size_of_attribute(Row, email);
-const uint32_t ID_OFFSET = 0;
-const uint32_t USERNAME_OFFSET = ID_OFFSET + ID_SIZE;
-const uint32_t EMAIL_OFFSET = USERNAME_OFFSET + USERNAME_SIZE;
-const uint32_t ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
+/*
+A leaf cell held outside of any page while cells are being moved
+between leaves
+*/
+typedef struct {
+  uint32_t key;
+  uint32_t record_size;
+  void* record;
+} LeafCell;
 
-const uint32_t PAGE_SIZE = 4096;
-#define TABLE_MAX_PAGES 100
+/*
+The cells of the compressed leaf a thread decoded last, kept so that a
+cursor decodes each leaf once however many of its cells it reads
+*/
+typedef struct {
+  void* pager;  // Whose page it holds, NULL if none
+  uint32_t page_num;
+  uint64_t version;  // leaf_version when it was decoded
+  uint32_t num_cells;
+  LeafCell* cells;
+  uint32_t cells_capacity;
+  void* records;  // Room for cells_capacity records
+} DecodedLeaf;
 
 typedef struct {
   int file_descriptor;
   uint32_t file_length;
   uint32_t num_pages;
-  void* pages[TABLE_MAX_PAGES];
+  Wal* wal;
+  PagerBackend backend;
+  AccessPattern access_pattern;
+  /*
+  mmap backend: the file is mapped MAP_PRIVATE, so modified pages stay
+  in memory until a checkpoint writes them with pwritev()
+  */
+  void* map;
+  uint32_t mapped_pages;
+  uint8_t* map_dirty;  // One byte per mapped page
+  uint32_t* map_dirty_list;
+  uint32_t num_map_dirty;
+  /* buffer pool backend */
+  uint32_t num_frames;
+  Frame* frames;
+  uint32_t clock_hand;
+  uint32_t* page_table;  // page_num -> frame index, INVALID_PAGE_NUM if none
+  uint32_t page_table_capacity;
+  uint32_t** retired_page_tables;  // Outgrown, freed at close
+  uint32_t num_retired_page_tables;
+  /* Compressed databases */
+  bool compressed;
+  PageExtent* page_map;  // page_num -> extent, page_map_pages entries
+  uint32_t page_map_pages;
+  PageExtent page_map_extent;  // Where the page map itself is stored
+  void* compressed_page;       // Room for one stored page
+  PagerStats stats;
+  bool hash_index;
+  uint32_t* free_counts;  // page_num -> times freed, with --hash-index
+  uint32_t free_counts_capacity;
+  /*
+  Threads. mutex guards the pager's own state: the frames and page
+  table, the WAL, the stats and the free counts. What is on a page is
+  guarded by its frame's latch, or by tree_latch for statements that do
+  not latch pages.
+  */
+  pthread_mutex_t mutex;  // Recursive
+  pthread_rwlock_t tree_latch;
+  pthread_mutex_t writer_mutex;  // Held for the whole of each write
+  TreeAccess writer_access;  // Of the write running, if it latches pages
+  uint32_t* writer_pages;    // Pages the writer holds exclusively
+  uint32_t num_writer_pages;
+  uint32_t writer_pages_capacity;
+  uint32_t num_snapshots;  // Open in any thread; checkpoints wait for 0
 } Pager;
 
+/*
+Each thread decodes into its own DecodedLeaf. leaf_version counts the
+compressed leaves marked dirty, so a decoded leaf is dropped once any
+of them may have changed.
+*/
+__thread DecodedLeaf decoded_leaf;
+uint64_t leaf_version;
+
+/* A page as a snapshot sees it, copied out for the snapshot alone */
+typedef struct {
+  uint32_t page_num;
+  uint32_t pin_count;
+  void* data;
+} SnapshotPage;
+
+/*
+A view of a pager's pages as of the last commit before it began. Pages
+written since are read as they were from the WAL, or from the main
+file, which checkpoints leave alone while any snapshot is open. Its
+copies never change, so up to SNAPSHOT_CACHED_PAGES of them are kept
+after they are unpinned.
+*/
+typedef struct {
+  Pager* pager;
+  uint32_t read_frame;  // The last WAL frame it sees
+  SnapshotPage* pages;
+  uint32_t num_pages;
+  uint32_t pages_capacity;
+} Snapshot;
+
+/* The snapshot the calling thread reads through, if any */
+__thread Snapshot* thread_snapshot;
+
+/*
+A map from a table's ids to the leaves they were last found in, kept
+in memory with --hash-index. It is filled from the leaves the first
+time an id is looked up, so later lookups read that one leaf instead
+of descending the tree. When the id is no longer there, the
+lookup descends as before and records where it found it. An entry also
+remembers how often its page had been freed, and is ignored once that
+changes, since the page may have come back in another table.
+*/
+typedef struct {
+  uint32_t id;
+  uint32_t page_num;    // 0 marks an empty slot; page 0 is the header
+  uint32_t free_count;  // The page's free count when the entry was put
+} LeafHashEntry;
+
 typedef struct {
+  LeafHashEntry* entries;
+  uint32_t capacity;  // A power of two, kept at least twice count
+  uint32_t count;
+} LeafHash;
+
+typedef struct Table {
   Pager* pager;
   uint32_t root_page_num;
+  uint32_t table_id;  // Key of its catalog row, or one of the two below
+  char name[TABLE_NAME_MAX_SIZE + 1];
+  struct Table* catalog;  // Where its root is recorded, for created tables
+  struct Table** indexes;  // The table's indexes, each kept as a Table too
+  uint32_t num_indexes;
+  Column indexed_column;  // For an index: the column its keys come from
+  LeafHash* leaf_hash;    // NULL until an id is looked up
 } Table;
 
+/*
+A database file holds the main table, whose root the file header
+records, and the tables created since. Those are listed in the catalog,
+a table of its own whose root the header also records.
+*/
+typedef struct {
+  Pager* pager;
+  Table* catalog;  // NULL until the first table is created
+  Table** tables;  // tables[0] is the main table
+  uint32_t num_tables;
+  uint32_t next_table_id;
+  char* filename;     // To open it again (see db_reopen())
+  DbOptions options;
+} Database;
+
 typedef struct {
   Table* table;
   uint32_t page_num;
   uint32_t cell_num;
   bool end_of_table;  // Indicates a position one past the last element
+  LatchMode latch;    // How it holds its page; LATCH_NONE if not at all
 } Cursor;
 
 void print_row(Row* row) {
   printf("(%d, %s, %s)\n", row->id, row->username, row->email);
 }
 
-typedef enum { NODE_INTERNAL, NODE_LEAF } NodeType;
+/*
+Where an error that leaves the database unusable goes: NULL to exit,
+as the REPL does. The server points it at the request it is running,
+so that only that request fails (see server_respond()).
+*/
+jmp_buf* failure_jump = NULL;
+
+_Noreturn void db_fail() {
+  if (failure_jump != NULL) {
+    longjmp(*failure_jump, 1);
+  }
+  exit(EXIT_FAILURE);
+}
+
+typedef enum {
+  NODE_INTERNAL,
+  NODE_LEAF,
+  NODE_INDEX_INTERNAL,
+  NODE_INDEX_LEAF
+} NodeType;
 
 /*
  * Common Node Header Layout
@@ -110,13 +485,19 @@ const uint32_t INTERNAL_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
 
 /*
  * Internal Node Body Layout
+ * The keys are kept together in one array after the header, and the
+ * child left of each key in a second array after room for every key,
+ * so a search reads only the keys.
  */
 const uint32_t INTERNAL_NODE_KEY_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_CELL_SIZE =
     INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;
-/* Keep this small for testing */
-const uint32_t INTERNAL_NODE_MAX_CELLS = 3;
+uint32_t internal_node_space_for_cells;  // Set by set_page_size()
+uint32_t internal_node_max_cells;
+uint32_t internal_node_children_offset;
+/* Searches narrow to this many keys before comparing them all at once */
+#define KEY_SEARCH_WINDOW 32
 
 /*
  * Leaf Node Header Layout
@@ -126,25 +507,174 @@ const uint32_t LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
 const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t);
 const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET =
     LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE;
-const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
-                                       LEAF_NODE_NUM_CELLS_SIZE +
-                                       LEAF_NODE_NEXT_LEAF_SIZE;
+const uint32_t LEAF_NODE_CELL_CONTENT_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_CELL_CONTENT_OFFSET =
+    LEAF_NODE_NEXT_LEAF_OFFSET + LEAF_NODE_NEXT_LEAF_SIZE;
+const uint32_t LEAF_NODE_FRAGMENTED_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_FRAGMENTED_OFFSET =
+    LEAF_NODE_CELL_CONTENT_OFFSET + LEAF_NODE_CELL_CONTENT_SIZE;
+const uint32_t LEAF_NODE_HEADER_SIZE =
+    COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE +
+    LEAF_NODE_NEXT_LEAF_SIZE + LEAF_NODE_CELL_CONTENT_SIZE +
+    LEAF_NODE_FRAGMENTED_SIZE;
 
 /*
  * Leaf Node Body Layout
+ * A directory grows up from the header: the keys of the cells in key
+ * order, then where each cell's record is, in the same order. Keeping
+ * the keys apart lets a search read only them. Records grow down from
+ * the end of the page in any order. Space freed in the middle of the
+ * records is counted as fragmented and reclaimed by compacting the
+ * page when an insert needs it.
  */
 const uint32_t LEAF_NODE_KEY_SIZE = sizeof(uint32_t);
-const uint32_t LEAF_NODE_KEY_OFFSET = 0;
-const uint32_t LEAF_NODE_VALUE_SIZE = ROW_SIZE;
-const uint32_t LEAF_NODE_VALUE_OFFSET =
-    LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
-const uint32_t LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE;
-const uint32_t LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
-const uint32_t LEAF_NODE_MAX_CELLS =
-    LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
-const uint32_t LEAF_NODE_RIGHT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) / 2;
-const uint32_t LEAF_NODE_LEFT_SPLIT_COUNT =
-    (LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT;
+const uint32_t LEAF_NODE_RECORD_OFFSET_SIZE = sizeof(uint16_t);
+const uint32_t LEAF_NODE_RECORD_OFFSET_OFFSET = 0;
+const uint32_t LEAF_NODE_RECORD_SIZE_SIZE = sizeof(uint16_t);
+const uint32_t LEAF_NODE_RECORD_SIZE_OFFSET =
+    LEAF_NODE_RECORD_OFFSET_OFFSET + LEAF_NODE_RECORD_OFFSET_SIZE;
+const uint32_t LEAF_NODE_LOCATION_SIZE =
+    LEAF_NODE_RECORD_OFFSET_SIZE + LEAF_NODE_RECORD_SIZE_SIZE;
+/* Directory bytes per cell */
+const uint32_t LEAF_NODE_SLOT_SIZE =
+    LEAF_NODE_KEY_SIZE + LEAF_NODE_LOCATION_SIZE;
+uint32_t leaf_node_space_for_cells;  // Set by set_page_size()
+/*
+Non-root leaves below a third full, and internal nodes below half full,
+are rebalanced with a sibling
+*/
+uint32_t leaf_node_min_fill;
+uint32_t internal_node_min_keys;
+
+/*
+ * Compressed Leaf Layout
+ * A compressed leaf keeps the leaf header, with cell_content set to 0
+ * and the fragmented field holding the size of its cells. The cells
+ * follow the header as one stream, each encoded against the one before
+ * it: the key as the difference from the previous key, and the username
+ * and the email bytes kept in the record as the length of the prefix
+ * and the suffix they share with the previous cell's, then the bytes in
+ * between. An overflow page number is copied as is.
+ */
+const uint32_t LEAF_NODE_ENCODED_SIZE_OFFSET = LEAF_NODE_FRAGMENTED_OFFSET;
+const uint32_t LEAF_CELL_MAX_ENCODED_SIZE =
+    RECORD_MAX_SIZE + 7 * VARINT_MAX_SIZE;
+
+/*
+ * Index Node Layout
+ * An index is a B-tree of fixed-size entries: the first INDEX_KEY_SIZE
+ * bytes of a column value, padded with NULs, then the id of the row.
+ * Entries sort by those bytes and then by id, so each is unique and the
+ * rows sharing a value or a prefix are next to each other. A longer
+ * value is cut short, so rows found through an index are checked
+ * against the whole value. An index leaf keeps the num_cells and
+ * next_leaf fields of a table leaf, then its entries in order. An index
+ * internal node has the header of a table internal node, and each cell
+ * is a child and the max entry under it.
+ */
+#define INDEX_KEY_SIZE EMAIL_OVERFLOW_PREFIX_SIZE  // Never in overflow pages
+typedef struct {
+  uint8_t key[INDEX_KEY_SIZE];
+  uint32_t row_id;
+} IndexEntry;
+const uint32_t INDEX_ENTRY_SIZE = sizeof(IndexEntry);
+const uint32_t INDEX_LEAF_NODE_HEADER_SIZE =
+    LEAF_NODE_NEXT_LEAF_OFFSET + LEAF_NODE_NEXT_LEAF_SIZE;
+const uint32_t INDEX_INTERNAL_NODE_CELL_SIZE =
+    INTERNAL_NODE_CHILD_SIZE + sizeof(IndexEntry);
+uint32_t index_leaf_node_max_entries;  // Set by set_page_size()
+uint32_t index_internal_node_max_cells;
+
+/*
+ * File Header Layout (page 0)
+ */
+#define FILE_HEADER_MAGIC "ToyDB format 4"
+const uint32_t FILE_HEADER_MAGIC_SIZE = 16;
+const uint32_t FILE_HEADER_MAGIC_OFFSET = 0;
+const uint32_t FILE_HEADER_PAGE_SIZE_OFFSET = 16;
+const uint32_t FILE_HEADER_ROOT_PAGE_OFFSET = 20;
+const uint32_t FILE_HEADER_FREELIST_TRUNK_OFFSET = 24;
+const uint32_t FILE_HEADER_FREE_PAGES_OFFSET = 28;
+const uint32_t FILE_HEADER_PAGE_COMPRESSION_OFFSET = 32;
+/* Written by checkpoints of a compressed database, stale in memory */
+const uint32_t FILE_HEADER_PAGE_MAP_OFFSET = 36;
+const uint32_t FILE_HEADER_PAGE_COUNT_OFFSET = 40;
+const uint32_t FILE_HEADER_CATALOG_ROOT_OFFSET = 44;  // 0 if no catalog
+const uint32_t FILE_HEADER_PAGE_NUM = 0;
+
+/*
+ * Catalog Layout
+ * The catalog has one row per created table, keyed by table id: the
+ * table name as the username, and as the email the root page number as
+ * CATALOG_ROOT_DIGITS decimal digits, so that it can be rewritten in
+ * place, then a space and the table's schema. An index has a row of the
+ * same form, with the name of its table and INDEX_SCHEMA_PREFIX and the
+ * column in place of the schema.
+ */
+#define MAIN_TABLE_ID 0
+#define CATALOG_TABLE_ID UINT32_MAX
+#define CATALOG_ROOT_DIGITS 10
+#define TABLE_SCHEMA "id integer, username text, email text"
+#define INDEX_SCHEMA_PREFIX "index on "
+
+/*
+ * Compressed File Layout
+ * A database created with --compress-pages keeps the header page as is
+ * at the start of its main file, and stores every other page as an LZ4
+ * block (or raw, if that is no smaller) in an extent at any offset.
+ * The page map, an array of PageExtents indexed by page number, is
+ * stored in an extent too. Extents start on PAGE_EXTENT_UNIT
+ * boundaries.
+ */
+const uint32_t PAGE_COMPRESSION_LZ4 = 1;
+#define PAGE_EXTENT_UNIT 64
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5      // A block ends with at least 5 literals
+#define LZ4_MATCH_FIND_LIMIT 12  // and its last match starts 12 before that
+#define LZ4_HASH_BITS 12
+
+/*
+ * Overflow Page Layout
+ * Each page of a chain holds the next page number (0 for the last page)
+ * and then as much of the value as fits.
+ */
+const uint32_t OVERFLOW_NEXT_PAGE_OFFSET = 0;
+const uint32_t OVERFLOW_DATA_OFFSET = sizeof(uint32_t);
+uint32_t overflow_data_size;  // Set by set_page_size()
+
+/*
+ * Freelist Trunk Page Layout
+ * A trunk page lists free "leaf" pages and links to the next trunk.
+ * Free leaf pages hold no data.
+ */
+const uint32_t FREELIST_NEXT_TRUNK_OFFSET = 0;
+const uint32_t FREELIST_NUM_LEAVES_OFFSET = 4;
+const uint32_t FREELIST_LEAVES_OFFSET = 8;
+uint32_t freelist_max_leaves;  // Set by set_page_size()
+
+bool is_valid_page_size(uint32_t size) {
+  return size >= MIN_PAGE_SIZE && size <= MAX_PAGE_SIZE &&
+         (size & (size - 1)) == 0;
+}
+
+void set_page_size(uint32_t size) {
+  page_size = size;
+  internal_node_space_for_cells = page_size - INTERNAL_NODE_HEADER_SIZE;
+  internal_node_max_cells =
+      internal_node_space_for_cells / INTERNAL_NODE_CELL_SIZE;
+  internal_node_min_keys = internal_node_max_cells / 2;
+  internal_node_children_offset =
+      INTERNAL_NODE_HEADER_SIZE +
+      internal_node_max_cells * INTERNAL_NODE_KEY_SIZE;
+  leaf_node_space_for_cells = page_size - LEAF_NODE_HEADER_SIZE;
+  leaf_node_min_fill = leaf_node_space_for_cells / 3;
+  overflow_data_size = page_size - OVERFLOW_DATA_OFFSET;
+  freelist_max_leaves = (page_size - FREELIST_LEAVES_OFFSET) / sizeof(uint32_t);
+  index_leaf_node_max_entries =
+      (page_size - INDEX_LEAF_NODE_HEADER_SIZE) / INDEX_ENTRY_SIZE;
+  index_internal_node_max_cells =
+      internal_node_space_for_cells / INDEX_INTERNAL_NODE_CELL_SIZE;
+}
 
 NodeType get_node_type(void* node) {
   uint8_t value = *((uint8_t*)(node + NODE_TYPE_OFFSET));
@@ -176,24 +706,51 @@ uint32_t* internal_node_right_child(void* node) {
   return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
 }
 
-uint32_t* internal_node_cell(void* node, uint32_t cell_num) {
-  return node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
+bool node_is_leaf(void* node) {
+  NodeType type = get_node_type(node);
+  return type == NODE_LEAF || type == NODE_INDEX_LEAF;
+}
+
+/*
+Index internal nodes share the header, but keep each child next to its
+IndexEntry in one cell
+*/
+uint32_t* index_internal_node_cell(void* node, uint32_t cell_num) {
+  return node + INTERNAL_NODE_HEADER_SIZE +
+         cell_num * INDEX_INTERNAL_NODE_CELL_SIZE;
+}
+
+/* The children left of each key, in key order */
+uint32_t* internal_node_children(void* node) {
+  return node + internal_node_children_offset;
 }
 
 uint32_t* internal_node_child(void* node, uint32_t child_num) {
   uint32_t num_keys = *internal_node_num_keys(node);
   if (child_num > num_keys) {
     printf("Tried to access child_num %d > num_keys %d\n", child_num, num_keys);
-    exit(EXIT_FAILURE);
+    db_fail();
   } else if (child_num == num_keys) {
-    return internal_node_right_child(node);
+    uint32_t* right_child = internal_node_right_child(node);
+    if (*right_child == INVALID_PAGE_NUM) {
+      printf("Tried to access right child of node, but was invalid page\n");
+      db_fail();
+    }
+    return right_child;
+  } else if (get_node_type(node) == NODE_INDEX_INTERNAL) {
+    return index_internal_node_cell(node, child_num);
   } else {
-    return internal_node_cell(node, child_num);
+    return internal_node_children(node) + child_num;
   }
 }
 
 uint32_t* internal_node_key(void* node, uint32_t key_num) {
-  return (void*)internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
+  return node + INTERNAL_NODE_HEADER_SIZE + key_num * INTERNAL_NODE_KEY_SIZE;
+}
+
+void* index_internal_node_entry(void* node, uint32_t key_num) {
+  return (void*)index_internal_node_cell(node, key_num) +
+         INTERNAL_NODE_CHILD_SIZE;
 }
 
 uint32_t* leaf_node_num_cells(void* node) {
@@ -204,650 +761,7708 @@ uint32_t* leaf_node_next_leaf(void* node) {
   return node + LEAF_NODE_NEXT_LEAF_OFFSET;
 }
 
-void* leaf_node_cell(void* node, uint32_t cell_num) {
-  return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
+/* Offset of the lowest record; records fill the page from here to the end */
+uint32_t* leaf_node_cell_content(void* node) {
+  return node + LEAF_NODE_CELL_CONTENT_OFFSET;
+}
+
+uint32_t* leaf_node_fragmented(void* node) {
+  return node + LEAF_NODE_FRAGMENTED_OFFSET;
+}
+
+bool leaf_node_is_compressed(void* node) {
+  return *leaf_node_cell_content(node) == 0;
+}
+
+uint32_t* leaf_node_encoded_size(void* node) {
+  return node + LEAF_NODE_ENCODED_SIZE_OFFSET;
 }
 
 uint32_t* leaf_node_key(void* node, uint32_t cell_num) {
-  return leaf_node_cell(node, cell_num);
+  return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_KEY_SIZE;
 }
 
-void* leaf_node_value(void* node, uint32_t cell_num) {
-  return leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_SIZE;
+/* The locations follow the keys, so they move whenever a cell is added */
+void* leaf_node_location(void* node, uint32_t cell_num) {
+  return (void*)leaf_node_key(node, *leaf_node_num_cells(node)) +
+         cell_num * LEAF_NODE_LOCATION_SIZE;
 }
 
-uint32_t get_node_max_key(void* node) {
-  switch (get_node_type(node)) {
-    case NODE_INTERNAL:
-      return *internal_node_key(node, *internal_node_num_keys(node) - 1);
-    case NODE_LEAF:
-      return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
-  }
+uint16_t* leaf_node_record_offset(void* node, uint32_t cell_num) {
+  return leaf_node_location(node, cell_num) + LEAF_NODE_RECORD_OFFSET_OFFSET;
 }
 
-void print_constants() {
-  printf("ROW_SIZE: %d\n", ROW_SIZE);
-  printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
-  printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
-  printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
-  printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
-  printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+uint16_t* leaf_node_record_size(void* node, uint32_t cell_num) {
+  return leaf_node_location(node, cell_num) + LEAF_NODE_RECORD_SIZE_OFFSET;
 }
 
-void* get_page(Pager* pager, uint32_t page_num) {
-  if (page_num > TABLE_MAX_PAGES) {
-    printf("Tried to fetch page number out of bounds. %d > %d\n", page_num,
-           TABLE_MAX_PAGES);
-    exit(EXIT_FAILURE);
-  }
+void* leaf_node_value(void* node, uint32_t cell_num) {
+  return node + *leaf_node_record_offset(node, cell_num);
+}
 
-  if (pager->pages[page_num] == NULL) {
-    // Cache miss. Allocate memory and load from file.
-    void* page = malloc(PAGE_SIZE);
-    uint32_t num_pages = pager->file_length / PAGE_SIZE;
+void* index_leaf_node_entry(void* node, uint32_t entry_num) {
+  return node + INDEX_LEAF_NODE_HEADER_SIZE + entry_num * INDEX_ENTRY_SIZE;
+}
 
-    // We might save a partial page at the end of the file
-    if (pager->file_length % PAGE_SIZE) {
-      num_pages += 1;
-    }
+uint32_t* header_page_size(void* header) {
+  return header + FILE_HEADER_PAGE_SIZE_OFFSET;
+}
 
-    if (page_num <= num_pages) {
-      lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-      ssize_t bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
-      if (bytes_read == -1) {
-        printf("Error reading file: %d\n", errno);
-        exit(EXIT_FAILURE);
-      }
-    }
+uint32_t* header_root_page(void* header) {
+  return header + FILE_HEADER_ROOT_PAGE_OFFSET;
+}
 
-    pager->pages[page_num] = page;
+uint32_t* header_freelist_trunk(void* header) {
+  return header + FILE_HEADER_FREELIST_TRUNK_OFFSET;
+}
 
-    if (page_num >= pager->num_pages) {
-      pager->num_pages = page_num + 1;
-    }
-  }
+uint32_t* header_free_pages(void* header) {
+  return header + FILE_HEADER_FREE_PAGES_OFFSET;
+}
 
-  return pager->pages[page_num];
+uint32_t* header_page_compression(void* header) {
+  return header + FILE_HEADER_PAGE_COMPRESSION_OFFSET;
 }
 
-void indent(uint32_t level) {
-  for (uint32_t i = 0; i < level; i++) {
-    printf("  ");
-  }
+uint32_t* header_page_map(void* header) {
+  return header + FILE_HEADER_PAGE_MAP_OFFSET;
 }
 
-void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level) {
-  void* node = get_page(pager, page_num);
-  uint32_t num_keys, child;
+uint32_t* header_page_count(void* header) {
+  return header + FILE_HEADER_PAGE_COUNT_OFFSET;
+}
 
-  switch (get_node_type(node)) {
-    case (NODE_LEAF):
-      num_keys = *leaf_node_num_cells(node);
-      indent(indentation_level);
-      printf("- leaf (size %d)\n", num_keys);
-      for (uint32_t i = 0; i < num_keys; i++) {
-        indent(indentation_level + 1);
-        printf("- %d\n", *leaf_node_key(node, i));
-      }
-      break;
-    case (NODE_INTERNAL):
-      num_keys = *internal_node_num_keys(node);
-      indent(indentation_level);
-      printf("- internal (size %d)\n", num_keys);
-      for (uint32_t i = 0; i < num_keys; i++) {
-        child = *internal_node_child(node, i);
-        print_tree(pager, child, indentation_level + 1);
+uint32_t* header_catalog_root(void* header) {
+  return header + FILE_HEADER_CATALOG_ROOT_OFFSET;
+}
 
-        indent(indentation_level + 1);
-        printf("- key %d\n", *internal_node_key(node, i));
-      }
-      child = *internal_node_right_child(node);
-      print_tree(pager, child, indentation_level + 1);
-      break;
-  }
+uint32_t* overflow_next_page(void* page) {
+  return page + OVERFLOW_NEXT_PAGE_OFFSET;
 }
 
-void serialize_row(Row* source, void* destination) {
-  memcpy(destination + ID_OFFSET, &(source->id), ID_SIZE);
-  memcpy(destination + USERNAME_OFFSET, &(source->username), USERNAME_SIZE);
-  memcpy(destination + EMAIL_OFFSET, &(source->email), EMAIL_SIZE);
+uint32_t* freelist_next_trunk(void* trunk) {
+  return trunk + FREELIST_NEXT_TRUNK_OFFSET;
 }
 
-void deserialize_row(void* source, Row* destination) {
-  memcpy(&(destination->id), source + ID_OFFSET, ID_SIZE);
-  memcpy(&(destination->username), source + USERNAME_OFFSET, USERNAME_SIZE);
-  memcpy(&(destination->email), source + EMAIL_OFFSET, EMAIL_SIZE);
+uint32_t* freelist_num_leaves(void* trunk) {
+  return trunk + FREELIST_NUM_LEAVES_OFFSET;
 }
 
-void initialize_leaf_node(void* node) {
-  set_node_type(node, NODE_LEAF);
-  set_node_root(node, false);
-  *leaf_node_num_cells(node) = 0;
-  *leaf_node_next_leaf(node) = 0;  // 0 represents no sibling
+uint32_t* freelist_leaf(void* trunk, uint32_t leaf_num) {
+  return trunk + FREELIST_LEAVES_OFFSET + leaf_num * sizeof(uint32_t);
 }
 
-void initialize_internal_node(void* node) {
-  set_node_type(node, NODE_INTERNAL);
-  set_node_root(node, false);
-  *internal_node_num_keys(node) = 0;
+void print_constants() {
+  printf("PAGE_SIZE: %d\n", page_size);
+  printf("RECORD_MAX_SIZE: %d\n", RECORD_MAX_SIZE);
+  printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
+  printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
+  printf("LEAF_NODE_SLOT_SIZE: %d\n", LEAF_NODE_SLOT_SIZE);
+  printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", leaf_node_space_for_cells);
+  printf("LEAF_NODE_MIN_FILL: %d\n", leaf_node_min_fill);
 }
 
-Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key) {
-  void* node = get_page(table->pager, page_num);
-  uint32_t num_cells = *leaf_node_num_cells(node);
+/*
+ * WAL Layout
+ */
+const uint32_t WAL_MAGIC = 0x4c415754;  // "TWAL"
+const uint32_t WAL_HEADER_SIZE = 32;
+const uint32_t WAL_FRAME_HEADER_SIZE = 24;
 
-  Cursor* cursor = malloc(sizeof(Cursor));
-  cursor->table = table;
-  cursor->page_num = page_num;
-  cursor->end_of_table = false;
+/*
+ * WAL frame header: page_num, db_size (number of pages after the commit
+ * for commit frames, 0 otherwise), salt[2], checksum[2]
+ */
+typedef struct {
+  uint32_t page_num;
+  uint32_t db_size;
+  uint32_t salt[2];
+  uint32_t checksum[2];
+} WalFrameHeader;
+
+uint32_t lz4_hash(uint8_t* bytes) {
+  uint32_t value;
+  memcpy(&value, bytes, sizeof(value));
+  return (value * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
 
-  // Binary search
-  uint32_t min_index = 0;
-  uint32_t one_past_max_index = num_cells;
-  while (one_past_max_index != min_index) {
-    uint32_t index = (min_index + one_past_max_index) / 2;
-    uint32_t key_at_index = *leaf_node_key(node, index);
-    if (key == key_at_index) {
-      cursor->cell_num = index;
-      return cursor;
-    }
-    if (key < key_at_index) {
-      one_past_max_index = index;
-    } else {
-      min_index = index + 1;
-    }
+uint8_t* lz4_put_length(uint8_t* destination, uint32_t length) {
+  while (length >= 255) {
+    *destination++ = 255;
+    length -= 255;
   }
-
-  cursor->cell_num = min_index;
-  return cursor;
+  *destination++ = length;
+  return destination;
 }
 
-uint32_t internal_node_find_child(void* node, uint32_t key) {
-  /*
-  Return the index of the child which should contain
-  the given key.
-  */
+uint8_t* lz4_put_sequence(uint8_t* destination, uint8_t* literals,
+                          uint32_t num_literals, uint32_t offset,
+                          uint32_t match_length) {
+  uint8_t* token = destination++;
+  *token = (num_literals < 15 ? num_literals : 15) << 4;
+  if (num_literals >= 15) {
+    destination = lz4_put_length(destination, num_literals - 15);
+  }
+  memcpy(destination, literals, num_literals);
+  destination += num_literals;
+  if (offset == 0) {
+    return destination;  // The last sequence has literals only
+  }
 
-  uint32_t num_keys = *internal_node_num_keys(node);
+  *destination++ = offset & 0xff;
+  *destination++ = offset >> 8;
+  match_length -= LZ4_MIN_MATCH;
+  *token |= match_length < 15 ? match_length : 15;
+  if (match_length >= 15) {
+    destination = lz4_put_length(destination, match_length - 15);
+  }
+  return destination;
+}
 
-  /* Binary search */
-  uint32_t min_index = 0;
-  uint32_t max_index = num_keys; /* there is one more child than key */
+/*
+Compress a page into an LZ4 block: a greedy single pass that takes the
+first match its hash table offers. Returns the block size, or 0 if it
+would not fit in capacity.
+*/
+uint32_t lz4_compress(uint8_t* source, uint32_t length, uint8_t* destination,
+                      uint32_t capacity) {
+  uint32_t table[1 << LZ4_HASH_BITS];
+  memset(table, 0xff, sizeof(table));
+  uint8_t* out = destination;
+  uint8_t* out_end = destination + capacity;
+  uint32_t anchor = 0;
+  uint32_t match_limit =
+      length > LZ4_MATCH_FIND_LIMIT ? length - LZ4_MATCH_FIND_LIMIT : 0;
+
+  for (uint32_t position = 0; position < match_limit;) {
+    uint32_t hash = lz4_hash(source + position);
+    uint32_t candidate = table[hash];
+    table[hash] = position;
+    if (candidate == UINT32_MAX || position - candidate > UINT16_MAX ||
+        memcmp(source + candidate, source + position, LZ4_MIN_MATCH) != 0) {
+      position++;
+      continue;
+    }
 
-  while (min_index != max_index) {
-    uint32_t index = (min_index + max_index) / 2;
-    uint32_t key_to_right = *internal_node_key(node, index);
-    if (key_to_right >= key) {
-      max_index = index;
-    } else {
-      min_index = index + 1;
+    uint32_t match_end = position + LZ4_MIN_MATCH;
+    while (match_end < length - LZ4_LAST_LITERALS &&
+           source[match_end] == source[candidate + match_end - position]) {
+      match_end++;
     }
+    uint32_t num_literals = position - anchor;
+    uint32_t match_length = match_end - position;
+    if (out_end - out <
+        (ptrdiff_t)(num_literals + num_literals / 255 + match_length / 255 +
+                    5)) {
+      return 0;
+    }
+    out = lz4_put_sequence(out, source + anchor, num_literals,
+                           position - candidate, match_length);
+    anchor = position = match_end;
   }
 
-  return min_index;
+  uint32_t num_literals = length - anchor;
+  if (out_end - out < (ptrdiff_t)(num_literals + num_literals / 255 + 2)) {
+    return 0;
+  }
+  out = lz4_put_sequence(out, source + anchor, num_literals, 0, 0);
+  return out - destination;
 }
 
-Cursor* internal_node_find(Table* table, uint32_t page_num, uint32_t key) {
+bool lz4_get_length(uint8_t** source, uint8_t* source_end, uint32_t* length) {
+  uint8_t byte;
+  do {
+    if (*source == source_end) {
+      return false;
+    }
+    byte = *(*source)++;
+    *length += byte;
+  } while (byte == 255);
+  return true;
+}
+
+/*
+Decompress an LZ4 block that must fill exactly length bytes. Returns
+false if the block is corrupt.
+*/
+bool lz4_decompress(uint8_t* source, uint32_t size, uint8_t* destination,
+                    uint32_t length) {
+  uint8_t* source_end = source + size;
+  uint8_t* out = destination;
+  uint8_t* out_end = destination + length;
+  while (source < source_end) {
+    uint8_t token = *source++;
+    uint32_t num_literals = token >> 4;
+    if (num_literals == 15 &&
+        !lz4_get_length(&source, source_end, &num_literals)) {
+      return false;
+    }
+    if (num_literals > source_end - source || num_literals > out_end - out) {
+      return false;
+    }
+    memcpy(out, source, num_literals);
+    source += num_literals;
+    out += num_literals;
+    if (source == source_end) {
+      break;  // The last sequence has no match
+    }
+
+    if (source_end - source < 2) {
+      return false;
+    }
+    uint32_t offset = source[0] | source[1] << 8;
+    source += 2;
+    uint32_t match_length = token & 15;
+    if (match_length == 15 &&
+        !lz4_get_length(&source, source_end, &match_length)) {
+      return false;
+    }
+    match_length += LZ4_MIN_MATCH;
+    if (offset == 0 || offset > out - destination ||
+        match_length > out_end - out) {
+      return false;
+    }
+    uint8_t* match = out - offset;
+    if (offset >= match_length) {
+      memcpy(out, match, match_length);
+    } else {
+      /* The match overlaps the bytes it produces */
+      for (uint32_t i = 0; i < match_length; i++) {
+        out[i] = match[i];
+      }
+    }
+    out += match_length;
+  }
+  return out == out_end;
+}
+
+/*
+Read a page of a compressed database. Pages the map has no extent for
+read as zeros.
+*/
+void pager_read_compressed_page(Pager* pager, uint32_t page_num, void* data) {
+  PageExtent extent = {0, 0};
+  if (page_num < pager->page_map_pages) {
+    extent = pager->page_map[page_num];
+  }
+  if (extent.size == 0) {
+    memset(data, 0, page_size);
+    return;
+  }
+
+  void* destination = extent.size == page_size ? data : pager->compressed_page;
+  if (pread(pager->file_descriptor, destination, extent.size,
+            (off_t)extent.offset * PAGE_EXTENT_UNIT) != extent.size) {
+    printf("Error reading file: %d\n", errno);
+    db_fail();
+  }
+  if (extent.size != page_size &&
+      !lz4_decompress(pager->compressed_page, extent.size, data, page_size)) {
+    printf("Page %d is corrupt.\n", page_num);
+    db_fail();
+  }
+}
+
+void pager_read_page(Pager* pager, uint32_t page_num, void* data) {
+  if (pager->compressed && page_num != FILE_HEADER_PAGE_NUM) {
+    pager_read_compressed_page(pager, page_num, data);
+    return;
+  }
+
+  ssize_t bytes_read = pread(pager->file_descriptor, data, page_size,
+                             (off_t)page_num * page_size);
+  if (bytes_read == -1) {
+    printf("Error reading file: %d\n", errno);
+    db_fail();
+  }
+
+  // Pages past the end of the file (or a partial last page) read as zeros
+  memset(data + bytes_read, 0, page_size - bytes_read);
+}
+
+void wal_checksum(uint32_t* checksum, void* data, uint32_t size) {
+  /*
+  Running Fletcher-style checksum over pairs of 32-bit words. Each
+  frame's checksum covers every frame before it, so a torn or stale
+  frame breaks the chain for everything after it.
+  */
+  uint32_t* words = data;
+  uint32_t s0 = checksum[0];
+  uint32_t s1 = checksum[1];
+  for (uint32_t i = 0; i < size / sizeof(uint32_t); i += 2) {
+    s0 += words[i] + s1;
+    s1 += words[i + 1] + s0;
+  }
+  checksum[0] = s0;
+  checksum[1] = s1;
+}
+
+off_t wal_frame_offset(uint32_t frame_num) {
+  return WAL_HEADER_SIZE +
+         (off_t)(frame_num - 1) * (WAL_FRAME_HEADER_SIZE + page_size);
+}
+
+void wal_set_frame_of_page(Wal* wal, uint32_t page_num, uint32_t frame_num) {
+  if (page_num >= wal->frame_of_page_capacity) {
+    uint32_t new_capacity = wal->frame_of_page_capacity * 2;
+    while (new_capacity <= page_num) {
+      new_capacity *= 2;
+    }
+    wal->frame_of_page =
+        realloc(wal->frame_of_page, new_capacity * sizeof(uint32_t));
+    memset(wal->frame_of_page + wal->frame_of_page_capacity, 0,
+           (new_capacity - wal->frame_of_page_capacity) * sizeof(uint32_t));
+    wal->frame_of_page_capacity = new_capacity;
+  }
+  if (frame_num >= wal->previous_frame_capacity) {
+    wal->previous_frame_capacity = frame_num * 2;
+    wal->previous_frame = realloc(
+        wal->previous_frame, wal->previous_frame_capacity * sizeof(uint32_t));
+  }
+  wal->previous_frame[frame_num] = wal->frame_of_page[page_num];
+  wal->frame_of_page[page_num] = frame_num;
+}
+
+uint32_t wal_find_frame(Wal* wal, uint32_t page_num) {
+  if (page_num >= wal->frame_of_page_capacity) {
+    return 0;
+  }
+  return wal->frame_of_page[page_num];
+}
+
+void wal_reset(Wal* wal) {
+  /*
+  Start a new generation of the log. New salts make any frames left
+  over from the previous generation fail validation.
+  */
+  wal->salt[0]++;
+  wal->salt[1] = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16);
+
+  uint32_t header[WAL_HEADER_SIZE / sizeof(uint32_t)];
+  header[0] = WAL_MAGIC;
+  header[1] = 1;  // Format version
+  header[2] = page_size;
+  header[3] = (uint32_t)wal->checkpoints;
+  header[4] = wal->salt[0];
+  header[5] = wal->salt[1];
+  wal->checksum[0] = 0;
+  wal->checksum[1] = 0;
+  wal_checksum(wal->checksum, header, 24);
+  header[6] = wal->checksum[0];
+  header[7] = wal->checksum[1];
+
+  if (ftruncate(wal->file_descriptor, 0) == -1 ||
+      pwrite(wal->file_descriptor, header, WAL_HEADER_SIZE, 0) == -1) {
+    printf("Error resetting WAL: %d\n", errno);
+    db_fail();
+  }
+
+  wal->num_frames = 0;
+  wal->uncommitted_frames = 0;
+  memset(wal->frame_of_page, 0,
+         wal->frame_of_page_capacity * sizeof(uint32_t));
+}
+
+void wal_read_frame(Wal* wal, uint32_t frame_num, void* data) {
+  ssize_t bytes_read =
+      pread(wal->file_descriptor, data, page_size,
+            wal_frame_offset(frame_num) + WAL_FRAME_HEADER_SIZE);
+  if (bytes_read != page_size) {
+    printf("Error reading WAL frame %d: %d\n", frame_num, errno);
+    db_fail();
+  }
+}
+
+/*
+Append frames for the given pages with a single pwritev() per batch.
+A nonzero db_size marks the last frame as a commit frame.
+*/
+void wal_write_frames(Wal* wal, uint32_t* page_nums, void** pages,
+                      uint32_t count, uint32_t db_size) {
+  const uint32_t frames_per_call = WAL_FRAMES_PER_WRITE;
+  WalFrameHeader* headers = malloc(sizeof(WalFrameHeader) * count);
+  struct iovec* iov = malloc(sizeof(struct iovec) * 2 * frames_per_call);
+
+  for (uint32_t i = 0; i < count; i++) {
+    WalFrameHeader* header = &headers[i];
+    header->page_num = page_nums[i];
+    header->db_size = (i == count - 1) ? db_size : 0;
+    header->salt[0] = wal->salt[0];
+    header->salt[1] = wal->salt[1];
+    wal_checksum(wal->checksum, header, 16);
+    wal_checksum(wal->checksum, pages[i], page_size);
+    header->checksum[0] = wal->checksum[0];
+    header->checksum[1] = wal->checksum[1];
+  }
+
+  for (uint32_t start = 0; start < count; start += frames_per_call) {
+    uint32_t batch = count - start;
+    if (batch > frames_per_call) {
+      batch = frames_per_call;
+    }
+    for (uint32_t i = 0; i < batch; i++) {
+      iov[2 * i].iov_base = &headers[start + i];
+      iov[2 * i].iov_len = WAL_FRAME_HEADER_SIZE;
+      iov[2 * i + 1].iov_base = pages[start + i];
+      iov[2 * i + 1].iov_len = page_size;
+    }
+
+    off_t offset = wal_frame_offset(wal->num_frames + start + 1);
+    ssize_t expected = (ssize_t)batch * (WAL_FRAME_HEADER_SIZE + page_size);
+    if (pwritev(wal->file_descriptor, iov, 2 * batch, offset) != expected) {
+      printf("Error writing WAL: %d\n", errno);
+      db_fail();
+    }
+  }
+
+  for (uint32_t i = 0; i < count; i++) {
+    wal->num_frames++;
+    if (page_nums[i] != INVALID_PAGE_NUM) {
+      wal_set_frame_of_page(wal, page_nums[i], wal->num_frames);
+    }
+  }
+  wal->uncommitted_frames = db_size ? 0 : wal->uncommitted_frames + count;
+
+  free(iov);
+  free(headers);
+}
+
+void wal_sync(Wal* wal) {
+  if (wal->pending_commits == 0) {
+    return;
+  }
+  if (fdatasync(wal->file_descriptor) == -1) {
+    printf("Error syncing WAL: %d\n", errno);
+    db_fail();
+  }
+  wal->syncs++;
+  wal->pending_commits = 0;
+}
+
+/*
+Scan the log and index every frame up to the last valid commit frame.
+Returns the database size recorded by that commit, or 0 if the log
+holds no committed transaction.
+*/
+uint32_t wal_recover(Wal* wal) {
+  uint32_t header[WAL_HEADER_SIZE / sizeof(uint32_t)];
+  ssize_t bytes_read =
+      pread(wal->file_descriptor, header, WAL_HEADER_SIZE, 0);
+
+  uint32_t checksum[2] = {0, 0};
+  if (bytes_read == WAL_HEADER_SIZE) {
+    wal_checksum(checksum, header, 24);
+  }
+  if (bytes_read != WAL_HEADER_SIZE || header[0] != WAL_MAGIC ||
+      header[2] != page_size || header[6] != checksum[0] ||
+      header[7] != checksum[1]) {
+    wal_reset(wal);
+    return 0;
+  }
+  wal->salt[0] = header[4];
+  wal->salt[1] = header[5];
+
+  void* page = malloc(page_size);
+  uint32_t page_nums_capacity = 64;
+  uint32_t* page_nums = malloc(sizeof(uint32_t) * page_nums_capacity);
+  uint32_t num_frames = 0;
+  uint32_t last_commit = 0;
+  uint32_t db_size = 0;
+  uint32_t commit_checksum[2] = {checksum[0], checksum[1]};
+
+  while (true) {
+    WalFrameHeader frame_header;
+    off_t offset = wal_frame_offset(num_frames + 1);
+    if (pread(wal->file_descriptor, &frame_header, WAL_FRAME_HEADER_SIZE,
+              offset) != WAL_FRAME_HEADER_SIZE ||
+        pread(wal->file_descriptor, page, page_size,
+              offset + WAL_FRAME_HEADER_SIZE) != page_size) {
+      break;
+    }
+    if (frame_header.salt[0] != wal->salt[0] ||
+        frame_header.salt[1] != wal->salt[1]) {
+      break;
+    }
+    wal_checksum(checksum, &frame_header, 16);
+    wal_checksum(checksum, page, page_size);
+    if (frame_header.checksum[0] != checksum[0] ||
+        frame_header.checksum[1] != checksum[1]) {
+      break;
+    }
+
+    if (num_frames == page_nums_capacity) {
+      page_nums_capacity *= 2;
+      page_nums = realloc(page_nums, sizeof(uint32_t) * page_nums_capacity);
+    }
+    page_nums[num_frames++] = frame_header.page_num;
+    if (frame_header.db_size != 0) {
+      last_commit = num_frames;
+      db_size = frame_header.db_size;
+      commit_checksum[0] = checksum[0];
+      commit_checksum[1] = checksum[1];
+    }
+  }
+
+  for (uint32_t i = 0; i < last_commit; i++) {
+    if (page_nums[i] != INVALID_PAGE_NUM) {
+      wal_set_frame_of_page(wal, page_nums[i], i + 1);
+    }
+  }
+  wal->num_frames = last_commit;
+  wal->checksum[0] = commit_checksum[0];
+  wal->checksum[1] = commit_checksum[1];
+
+  free(page_nums);
+  free(page);
+  return db_size;
+}
+
+Wal* wal_open(const char* db_filename, uint32_t group_commit) {
+  Wal* wal = malloc(sizeof(Wal));
+  wal->filename = malloc(strlen(db_filename) + 5);
+  sprintf(wal->filename, "%s-wal", db_filename);
+
+  wal->file_descriptor =
+      open(wal->filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+  if (wal->file_descriptor == -1) {
+    printf("Unable to open WAL file\n");
+    db_fail();
+  }
+
+  wal->num_frames = 0;
+  wal->uncommitted_frames = 0;
+  wal->frame_of_page_capacity = 64;
+  wal->frame_of_page = calloc(wal->frame_of_page_capacity, sizeof(uint32_t));
+  wal->previous_frame_capacity = 0;
+  wal->previous_frame = NULL;
+  wal->salt[0] = 0;
+  wal->salt[1] = 0;
+  wal->group_commit = group_commit;
+  wal->pending_commits = 0;
+  wal->commits = 0;
+  wal->syncs = 0;
+  wal->checkpoints = 0;
+  return wal;
+}
+
+void wal_close(Wal* wal) {
+  close(wal->file_descriptor);
+  free(wal->frame_of_page);
+  free(wal->previous_frame);
+  free(wal->filename);
+  free(wal);
+}
+
+void pager_grow_page_table(Pager* pager, uint32_t page_num) {
+  if (page_num < pager->page_table_capacity) {
+    return;
+  }
+
+  uint32_t new_capacity = pager->page_table_capacity * 2;
+  while (new_capacity <= page_num) {
+    new_capacity *= 2;
+  }
+  uint32_t* page_table = malloc(new_capacity * sizeof(uint32_t));
+  memcpy(page_table, pager->page_table,
+         pager->page_table_capacity * sizeof(uint32_t));
+  for (uint32_t i = pager->page_table_capacity; i < new_capacity; i++) {
+    page_table[i] = INVALID_PAGE_NUM;
+  }
+
+  /*
+  Readers may be looking up pages in the old table without the mutex,
+  so it is kept until the pager closes. The new table is published
+  before its capacity.
+  */
+  pager->retired_page_tables =
+      realloc(pager->retired_page_tables,
+              sizeof(uint32_t*) * (pager->num_retired_page_tables + 1));
+  pager->retired_page_tables[pager->num_retired_page_tables++] =
+      pager->page_table;
+  __atomic_store_n(&pager->page_table, page_table, __ATOMIC_RELEASE);
+  __atomic_store_n(&pager->page_table_capacity, new_capacity,
+                   __ATOMIC_RELEASE);
+}
+
+uint32_t pager_find_victim(Pager* pager) {
+  /*
+  CLOCK replacement. Sweep the frames, giving every referenced frame a
+  second chance. Two full sweeps without finding an unpinned frame
+  means every frame is pinned.
+  */
+  for (uint32_t i = 0; i < 2 * pager->num_frames; i++) {
+    uint32_t frame_index = pager->clock_hand;
+    Frame* frame = &pager->frames[frame_index];
+    pager->clock_hand = (pager->clock_hand + 1) % pager->num_frames;
+
+    if (frame->page_num == INVALID_PAGE_NUM) {
+      return frame_index;
+    }
+    if (frame->pin_count > 0) {
+      continue;
+    }
+    if (frame->referenced) {
+      frame->referenced = false;
+      continue;
+    }
+    return frame_index;
+  }
+
+  printf("Buffer pool exhausted: all %d frames are pinned.\n",
+         pager->num_frames);
+  db_fail();
+}
+
+void pager_evict(Pager* pager, uint32_t frame_index) {
+  Frame* frame = &pager->frames[frame_index];
+  if (frame->page_num == INVALID_PAGE_NUM) {
+    return;
+  }
+
+  if (frame->dirty) {
+    /*
+    The main file only changes at checkpoints, so a dirty victim is
+    spilled to the WAL. It becomes durable with the next commit frame.
+    */
+    wal_write_frames(pager->wal, &frame->page_num, &frame->data, 1, 0);
+    pager->stats.write_backs++;
+  }
+  pager->page_table[frame->page_num] = INVALID_PAGE_NUM;
+  pager->stats.evictions++;
+
+  frame->page_num = INVALID_PAGE_NUM;
+  frame->dirty = false;
+}
+
+/* Map the file out to num_pages pages, growing the file to match */
+void pager_grow_map(Pager* pager, uint32_t num_pages) {
+  /*
+  Extend the file first: touching a mapped page past the end of the
+  file raises SIGBUS. The new range is mapped at a fixed address inside
+  the reservation, so existing page pointers stay valid.
+  */
+  if ((size_t)num_pages * page_size > MMAP_RESERVE_BYTES) {
+    printf("Database exceeds the %lu byte mmap reservation.\n",
+           (unsigned long)MMAP_RESERVE_BYTES);
+    db_fail();
+  }
+
+  off_t file_length = lseek(pager->file_descriptor, 0, SEEK_END);
+  if (file_length < (off_t)num_pages * page_size &&
+      ftruncate(pager->file_descriptor, (off_t)num_pages * page_size) == -1) {
+    printf("Error extending db file: %d\n", errno);
+    db_fail();
+  }
+
+  size_t offset = (size_t)pager->mapped_pages * page_size;
+  void* mapped = mmap(pager->map + offset,
+                      (size_t)(num_pages - pager->mapped_pages) * page_size,
+                      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                      pager->file_descriptor, offset);
+  if (mapped == MAP_FAILED) {
+    printf("Error mapping db file: %d\n", errno);
+    db_fail();
+  }
+
+  pager->map_dirty = realloc(pager->map_dirty, num_pages);
+  pager->map_dirty_list =
+      realloc(pager->map_dirty_list, num_pages * sizeof(uint32_t));
+  memset(pager->map_dirty + pager->mapped_pages, 0,
+         num_pages - pager->mapped_pages);
+  pager->mapped_pages = num_pages;
+}
+
+void pager_map_file(Pager* pager) {
+  pager->map = mmap(NULL, MMAP_RESERVE_BYTES, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (pager->map == MAP_FAILED) {
+    printf("Error reserving address space: %d\n", errno);
+    db_fail();
+  }
+  if (pager->num_pages > 0) {
+    pager_grow_map(pager, pager->num_pages);
+  }
+}
+
+/*
+Tell the kernel how upcoming page accesses will look: readahead for
+scans, none for point lookups. Only issues a syscall when the pattern
+changes.
+*/
+void pager_advise(Pager* pager, AccessPattern pattern) {
+  pthread_mutex_lock(&pager->mutex);
+  if (pager->access_pattern == pattern) {
+    pthread_mutex_unlock(&pager->mutex);
+    return;
+  }
+  pager->access_pattern = pattern;
+
+  if (pager->backend == PAGER_MMAP) {
+    if (pager->mapped_pages > 0) {
+      madvise(pager->map, (size_t)pager->mapped_pages * page_size,
+              pattern == ACCESS_SEQUENTIAL ? MADV_SEQUENTIAL : MADV_RANDOM);
+    }
+  } else {
+    posix_fadvise(pager->file_descriptor, 0, 0,
+                  pattern == ACCESS_SEQUENTIAL ? POSIX_FADV_SEQUENTIAL
+                                               : POSIX_FADV_RANDOM);
+  }
+  pthread_mutex_unlock(&pager->mutex);
+}
+
+/* Pin a page in the pool, or in the map, loading it if needed */
+void* pager_pin_page(Pager* pager, uint32_t page_num) {
+  pthread_mutex_lock(&pager->mutex);
+  if (pager->backend == PAGER_MMAP) {
+    if (page_num >= pager->mapped_pages) {
+      pager_grow_map(pager, page_num + 1);
+    }
+    if (page_num >= pager->num_pages) {
+      pager->num_pages = page_num + 1;
+    }
+    pthread_mutex_unlock(&pager->mutex);
+    return pager->map + (size_t)page_num * page_size;
+  }
+
+  pager_grow_page_table(pager, page_num);
+
+  uint32_t frame_index = pager->page_table[page_num];
+  if (frame_index != INVALID_PAGE_NUM) {
+    pager->stats.hits++;
+  } else {
+    // Cache miss. Claim a frame and load the page from file.
+    pager->stats.misses++;
+    frame_index = pager_find_victim(pager);
+    pager_evict(pager, frame_index);
+
+    Frame* frame = &pager->frames[frame_index];
+    __atomic_add_fetch(&frame->version, 1, __ATOMIC_ACQ_REL);
+    uint32_t wal_frame_num = wal_find_frame(pager->wal, page_num);
+    if (wal_frame_num != 0) {
+      wal_read_frame(pager->wal, wal_frame_num, frame->data);
+    } else {
+      pager_read_page(pager, page_num, frame->data);
+    }
+    __atomic_store_n(&frame->page_num, page_num, __ATOMIC_RELAXED);
+    __atomic_store_n(&pager->page_table[page_num], frame_index,
+                     __ATOMIC_RELAXED);
+    __atomic_add_fetch(&frame->version, 1, __ATOMIC_RELEASE);
+
+    if (page_num >= pager->num_pages) {
+      pager->num_pages = page_num + 1;
+    }
+  }
+
+  Frame* frame = &pager->frames[frame_index];
+  frame->pin_count++;
+  frame->referenced = true;
+  pthread_mutex_unlock(&pager->mutex);
+  return frame->data;
+}
+
+void pager_unpin_page(Pager* pager, uint32_t page_num) {
+  if (pager->backend == PAGER_MMAP) {
+    return;  // Mapped pages never move
+  }
+
+  pthread_mutex_lock(&pager->mutex);
+  uint32_t frame_index = pager->page_table[page_num];
+  if (frame_index == INVALID_PAGE_NUM ||
+      pager->frames[frame_index].pin_count == 0) {
+    printf("Tried to unpin page %d which is not pinned\n", page_num);
+    db_fail();
+  }
+  pager->frames[frame_index].pin_count--;
+  pthread_mutex_unlock(&pager->mutex);
+}
+
+/* The frame holding a page returned by get_page() */
+Frame* pager_frame(Pager* pager, void* page) {
+  return &pager->frames[(page - pager->frames[0].data) / page_size];
+}
+
+bool pager_page_dirty(Pager* pager, uint32_t page_num) {
+  return page_num < pager->page_table_capacity &&
+         pager->page_table[page_num] != INVALID_PAGE_NUM &&
+         pager->frames[pager->page_table[page_num]].dirty;
+}
+
+/* The calling thread's snapshot of pager, or NULL if it has none */
+Snapshot* pager_snapshot(Pager* pager) {
+  if (thread_snapshot != NULL && thread_snapshot->pager == pager) {
+    return thread_snapshot;
+  }
+  return NULL;
+}
+
+/*
+Start reading pager's pages, on the calling thread, as of its last
+commit. The writer's changes since, whether still in the pool or
+spilled to the WAL, are not committed and so are not seen.
+*/
+void snapshot_begin(Pager* pager) {
+  Snapshot* snapshot = malloc(sizeof(Snapshot));
+  snapshot->pager = pager;
+  pthread_mutex_lock(&pager->mutex);
+  snapshot->read_frame =
+      pager->wal->num_frames - pager->wal->uncommitted_frames;
+  pager->num_snapshots++;
+  pthread_mutex_unlock(&pager->mutex);
+  snapshot->pages = NULL;
+  snapshot->num_pages = 0;
+  snapshot->pages_capacity = 0;
+  decoded_leaf.pager = NULL;  // It may hold a newer version of a leaf
+  thread_snapshot = snapshot;
+}
+
+void snapshot_end(Pager* pager) {
+  Snapshot* snapshot = pager_snapshot(pager);
+  thread_snapshot = NULL;
+  for (uint32_t i = 0; i < snapshot->num_pages; i++) {
+    free(snapshot->pages[i].data);
+  }
+  free(snapshot->pages);
+  free(snapshot);
+  decoded_leaf.pager = NULL;  // Or an older one
+  pthread_mutex_lock(&pager->mutex);
+  pager->num_snapshots--;
+  pthread_mutex_unlock(&pager->mutex);
+}
+
+/*
+Copy a page as the snapshot sees it. While the page has not been
+written since the snapshot began, the pool's copy is current; it is
+loaded if need be, copied under a shared latch and used if it was not
+marked dirty meanwhile. Otherwise the WAL holds every version committed
+since the last checkpoint, chained by previous_frame, and the main file
+the one before them.
+*/
+void snapshot_read_page(Snapshot* snapshot, uint32_t page_num, void* data) {
+  Pager* pager = snapshot->pager;
+  Wal* wal = pager->wal;
+  pthread_mutex_lock(&pager->mutex);
+  uint32_t frame_num = wal_find_frame(wal, page_num);
+  if (frame_num <= snapshot->read_frame && !pager_page_dirty(pager, page_num)) {
+    Frame* frame = pager_frame(pager, pager_pin_page(pager, page_num));
+    pthread_mutex_unlock(&pager->mutex);
+    pthread_rwlock_rdlock(&frame->latch);
+    memcpy(data, frame->data, page_size);
+    pthread_rwlock_unlock(&frame->latch);
+    pthread_mutex_lock(&pager->mutex);
+    bool unchanged =
+        !frame->dirty && wal_find_frame(wal, page_num) == frame_num;
+    pager_unpin_page(pager, page_num);
+    if (unchanged) {
+      pthread_mutex_unlock(&pager->mutex);
+      return;
+    }
+    frame_num = wal_find_frame(wal, page_num);
+  }
+
+  while (frame_num > snapshot->read_frame) {
+    frame_num = wal->previous_frame[frame_num];
+  }
+  if (frame_num != 0) {
+    wal_read_frame(wal, frame_num, data);
+  } else {
+    pager_read_page(pager, page_num, data);
+  }
+  pthread_mutex_unlock(&pager->mutex);
+}
+
+/*
+Pin the snapshot's copy of a page, reading it if it has none. The
+copies are kept least recently used first.
+*/
+void* snapshot_get_page(Snapshot* snapshot, uint32_t page_num) {
+  SnapshotPage page;
+  uint32_t i = 0;
+  while (i < snapshot->num_pages &&
+         snapshot->pages[i].page_num != page_num) {
+    i++;
+  }
+  if (i < snapshot->num_pages) {
+    page = snapshot->pages[i];
+    memmove(&snapshot->pages[i], &snapshot->pages[i + 1],
+            sizeof(SnapshotPage) * (snapshot->num_pages - i - 1));
+    snapshot->num_pages--;
+  } else {
+    page.page_num = page_num;
+    page.pin_count = 0;
+    page.data = malloc(page_size);
+    snapshot_read_page(snapshot, page_num, page.data);
+  }
+
+  if (snapshot->num_pages == snapshot->pages_capacity) {
+    snapshot->pages_capacity = snapshot->pages_capacity * 2 + 8;
+    snapshot->pages = realloc(snapshot->pages,
+                              sizeof(SnapshotPage) * snapshot->pages_capacity);
+  }
+  page.pin_count++;
+  snapshot->pages[snapshot->num_pages++] = page;
+  return page.data;
+}
+
+/* Unpin a copy, and drop the least recently used if too many are kept */
+void snapshot_unpin_page(Snapshot* snapshot, uint32_t page_num) {
+  uint32_t i = 0;
+  while (i < snapshot->num_pages &&
+         snapshot->pages[i].page_num != page_num) {
+    i++;
+  }
+  if (i == snapshot->num_pages || snapshot->pages[i].pin_count == 0) {
+    printf("Tried to unpin page %d which is not pinned\n", page_num);
+    db_fail();
+  }
+  snapshot->pages[i].pin_count--;
+
+  if (snapshot->num_pages > SNAPSHOT_CACHED_PAGES) {
+    for (i = 0; i < snapshot->num_pages; i++) {
+      if (snapshot->pages[i].pin_count == 0) {
+        free(snapshot->pages[i].data);
+        memmove(&snapshot->pages[i], &snapshot->pages[i + 1],
+                sizeof(SnapshotPage) * (snapshot->num_pages - i - 1));
+        snapshot->num_pages--;
+        return;
+      }
+    }
+  }
+}
+
+/*
+Return the page, from this thread's snapshot if it reads one, or else
+loading it into the buffer pool on a miss. The page is pinned until
+the caller releases it with unpin_page().
+*/
+void* get_page(Pager* pager, uint32_t page_num) {
+  Snapshot* snapshot = pager_snapshot(pager);
+  if (snapshot != NULL) {
+    return snapshot_get_page(snapshot, page_num);
+  }
+  return pager_pin_page(pager, page_num);
+}
+
+void unpin_page(Pager* pager, uint32_t page_num) {
+  Snapshot* snapshot = pager_snapshot(pager);
+  if (snapshot != NULL) {
+    snapshot_unpin_page(snapshot, page_num);
+  } else {
+    pager_unpin_page(pager, page_num);
+  }
+}
+
+/*
+Pin a page and latch it. The latch is waited for after the pager's
+mutex is let go of, so a thread waiting for a latch never holds up
+other threads' misses. The mmap backend has no frames, so its pages
+are only pinned; writes there run alone instead. A snapshot's copies
+are its own, so they are only pinned too.
+*/
+bool pager_latches(Pager* pager) {
+  return pager->backend == PAGER_BUFFER_POOL && pager_snapshot(pager) == NULL;
+}
+
+void* latch_page(Pager* pager, uint32_t page_num, LatchMode mode) {
+  void* page = get_page(pager, page_num);
+  if (pager_latches(pager)) {
+    Frame* frame = pager_frame(pager, page);
+    if (mode == LATCH_SHARED) {
+      pthread_rwlock_rdlock(&frame->latch);
+    } else {
+      pthread_rwlock_wrlock(&frame->latch);
+      __atomic_add_fetch(&frame->version, 1, __ATOMIC_ACQ_REL);
+    }
+  }
+  return page;
+}
+
+/* Latch a page shared, or return NULL if that would mean waiting */
+void* try_latch_page(Pager* pager, uint32_t page_num) {
+  void* page = get_page(pager, page_num);
+  if (pager_latches(pager) &&
+      pthread_rwlock_tryrdlock(&pager_frame(pager, page)->latch) != 0) {
+    unpin_page(pager, page_num);
+    return NULL;
+  }
+  return page;
+}
+
+/* Only the writer can hold a latch while its frame's version is odd */
+void unlatch_page(Pager* pager, uint32_t page_num) {
+  if (pager_latches(pager)) {
+    pthread_mutex_lock(&pager->mutex);
+    Frame* frame = &pager->frames[pager->page_table[page_num]];
+    pthread_mutex_unlock(&pager->mutex);
+    if (__atomic_load_n(&frame->version, __ATOMIC_RELAXED) % 2 == 1) {
+      __atomic_add_fetch(&frame->version, 1, __ATOMIC_RELEASE);
+    }
+    pthread_rwlock_unlock(&frame->latch);
+  }
+  unpin_page(pager, page_num);
+}
+
+bool pager_writer_latching(Pager* pager) {
+  if (pager_snapshot(pager) != NULL) {
+    return false;  // The writer is another thread
+  }
+  return pager->writer_access == TREE_INSERT ||
+         pager->writer_access == TREE_WRITE;
+}
+
+/*
+Latch a page exclusively until the write ends, unless the writer holds
+it already. Returns whether it was latched now.
+*/
+bool pager_hold_page(Pager* pager, uint32_t page_num) {
+  for (uint32_t i = 0; i < pager->num_writer_pages; i++) {
+    if (pager->writer_pages[i] == page_num) {
+      return false;
+    }
+  }
+  latch_page(pager, page_num, LATCH_EXCLUSIVE);
+  if (pager->num_writer_pages == pager->writer_pages_capacity) {
+    pager->writer_pages_capacity = pager->writer_pages_capacity * 2 + 8;
+    pager->writer_pages =
+        realloc(pager->writer_pages,
+                sizeof(uint32_t) * pager->writer_pages_capacity);
+  }
+  pager->writer_pages[pager->num_writer_pages++] = page_num;
+  return true;
+}
+
+/* Let go of a page the writer holds before the write ends */
+void pager_release_page(Pager* pager, uint32_t page_num) {
+  for (uint32_t i = 0; i < pager->num_writer_pages; i++) {
+    if (pager->writer_pages[i] == page_num) {
+      pager->writer_pages[i] =
+          pager->writer_pages[--pager->num_writer_pages];
+      unlatch_page(pager, page_num);
+      return;
+    }
+  }
+}
+
+/*
+Record that a pinned page was modified. Only dirty pages are logged
+at commit and written back to the main file at checkpoint.
+*/
+void pager_mark_dirty_unlatched(Pager* pager, uint32_t page_num) {
+  pthread_mutex_lock(&pager->mutex);
+  if (pager->backend == PAGER_MMAP) {
+    if (!pager->map_dirty[page_num]) {
+      pager->map_dirty[page_num] = 1;
+      pager->map_dirty_list[pager->num_map_dirty++] = page_num;
+    }
+    pthread_mutex_unlock(&pager->mutex);
+    return;
+  }
+
+  uint32_t frame_index = pager->page_table[page_num];
+  if (frame_index == INVALID_PAGE_NUM ||
+      pager->frames[frame_index].pin_count == 0) {
+    printf("Tried to modify page %d which is not pinned\n", page_num);
+    db_fail();
+  }
+  pager->frames[frame_index].dirty = true;
+  pthread_mutex_unlock(&pager->mutex);
+}
+
+/*
+While the writer latches pages, it latches each page it is about to
+change. Only changes readers never look at, like a node's parent
+pointer, use pager_mark_dirty_unlatched() directly.
+*/
+void pager_mark_dirty(Pager* pager, uint32_t page_num) {
+  if (pager_writer_latching(pager)) {
+    pager_hold_page(pager, page_num);
+  }
+  pager_mark_dirty_unlatched(pager, page_num);
+
+  void* page = pager->backend == PAGER_MMAP
+                   ? pager->map + (size_t)page_num * page_size
+                   : pager->frames[pager->page_table[page_num]].data;
+  if (get_node_type(page) == NODE_LEAF && leaf_node_is_compressed(page)) {
+    __atomic_add_fetch(&leaf_version, 1, __ATOMIC_RELEASE);
+  }
+}
+
+/* Note that a page was freed, so LeafHash entries for it go stale */
+void pager_count_free(Pager* pager, uint32_t page_num) {
+  if (!pager->hash_index) {
+    return;
+  }
+  pthread_mutex_lock(&pager->mutex);
+  if (page_num >= pager->free_counts_capacity) {
+    uint32_t capacity = pager->free_counts_capacity * 2;
+    if (capacity <= page_num) {
+      capacity = page_num + 1;
+    }
+    pager->free_counts =
+        realloc(pager->free_counts, capacity * sizeof(uint32_t));
+    memset(pager->free_counts + pager->free_counts_capacity, 0,
+           (capacity - pager->free_counts_capacity) * sizeof(uint32_t));
+    pager->free_counts_capacity = capacity;
+  }
+  pager->free_counts[page_num]++;
+  pthread_mutex_unlock(&pager->mutex);
+}
+
+uint32_t pager_free_count(Pager* pager, uint32_t page_num) {
+  pthread_mutex_lock(&pager->mutex);
+  uint32_t count = page_num < pager->free_counts_capacity
+                       ? pager->free_counts[page_num]
+                       : 0;
+  pthread_mutex_unlock(&pager->mutex);
+  return count;
+}
+
+/*
+Shrink the database to num_pages. Pages past the new end are dropped
+without being logged; the main file is cut short at the next checkpoint.
+*/
+void pager_truncate(Pager* pager, uint32_t num_pages) {
+  if (pager->backend == PAGER_MMAP) {
+    uint32_t num_dirty = 0;
+    for (uint32_t i = 0; i < pager->num_map_dirty; i++) {
+      uint32_t page_num = pager->map_dirty_list[i];
+      if (page_num < num_pages) {
+        pager->map_dirty_list[num_dirty++] = page_num;
+      } else {
+        pager->map_dirty[page_num] = 0;
+      }
+    }
+    pager->num_map_dirty = num_dirty;
+
+    if (pager->mapped_pages > num_pages) {
+      // Give the tail back to the PROT_NONE reservation
+      size_t offset = (size_t)num_pages * page_size;
+      void* reserved =
+          mmap(pager->map + offset,
+               (size_t)(pager->mapped_pages - num_pages) * page_size,
+               PROT_NONE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+      if (reserved == MAP_FAILED) {
+        printf("Error unmapping db file: %d\n", errno);
+        db_fail();
+      }
+      pager->mapped_pages = num_pages;
+    }
+  }
+
+  for (uint32_t i = 0; i < pager->num_frames; i++) {
+    Frame* frame = &pager->frames[i];
+    if (frame->page_num == INVALID_PAGE_NUM || frame->page_num < num_pages) {
+      continue;
+    }
+    if (frame->pin_count > 0) {
+      printf("Tried to truncate page %d which is pinned\n", frame->page_num);
+      db_fail();
+    }
+    pager->page_table[frame->page_num] = INVALID_PAGE_NUM;
+    frame->page_num = INVALID_PAGE_NUM;
+    frame->dirty = false;
+  }
+
+  for (uint32_t page_num = num_pages; page_num < pager->num_pages;
+       page_num++) {
+    pager_count_free(pager, page_num);
+  }
+  pager->num_pages = num_pages;
+}
+
+uint32_t leaf_node_max_key(void* node);
+LeafCell leaf_node_cell(Pager* pager, uint32_t page_num, void* node,
+                        uint32_t cell_num);
+
+/*
+The max key of an internal node is the max key of its rightmost
+subtree, so walk down the right spine until we reach a leaf.
+*/
+uint32_t get_node_max_key(Pager* pager, void* node) {
+  if (get_node_type(node) == NODE_LEAF) {
+    return leaf_node_max_key(node);
+  }
+
+  uint32_t page_num = *internal_node_right_child(node);
+  while (true) {
+    void* child = get_page(pager, page_num);
+    if (get_node_type(child) == NODE_LEAF) {
+      uint32_t max_key = leaf_node_max_key(child);
+      unpin_page(pager, page_num);
+      return max_key;
+    }
+    uint32_t next_page_num = *internal_node_right_child(child);
+    unpin_page(pager, page_num);
+    page_num = next_page_num;
+  }
+}
+
+void indent(uint32_t level) {
+  for (uint32_t i = 0; i < level; i++) {
+    printf("  ");
+  }
+}
+
+void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level) {
+  void* node = get_page(pager, page_num);
+  uint32_t num_keys, child;
+
+  switch (get_node_type(node)) {
+    case (NODE_LEAF):
+      num_keys = *leaf_node_num_cells(node);
+      indent(indentation_level);
+      printf("- leaf (size %d%s)\n", num_keys,
+             leaf_node_is_compressed(node) ? ", compressed" : "");
+      for (uint32_t i = 0; i < num_keys; i++) {
+        indent(indentation_level + 1);
+        printf("- %d\n", leaf_node_cell(pager, page_num, node, i).key);
+      }
+      break;
+    case (NODE_INTERNAL):
+      num_keys = *internal_node_num_keys(node);
+      indent(indentation_level);
+      printf("- internal (size %d)\n", num_keys);
+      for (uint32_t i = 0; i < num_keys; i++) {
+        child = *internal_node_child(node, i);
+        print_tree(pager, child, indentation_level + 1);
+
+        indent(indentation_level + 1);
+        printf("- key %d\n", *internal_node_key(node, i));
+      }
+      child = *internal_node_right_child(node);
+      print_tree(pager, child, indentation_level + 1);
+      break;
+    default:
+      /* Index nodes never appear in a table's tree */
+      printf("Page %d is corrupt.\n", page_num);
+      db_fail();
+  }
+
+  unpin_page(pager, page_num);
+}
+
+/*
+Unsigned LEB128: seven bits per byte, low bits first, high bit set on
+all but the last byte
+*/
+uint32_t varint_size(uint32_t value) {
+  uint32_t size = 1;
+  while (value >= 0x80) {
+    value >>= 7;
+    size++;
+  }
+  return size;
+}
+
+uint32_t put_varint(uint8_t* destination, uint32_t value) {
+  uint32_t size = 0;
+  while (value >= 0x80) {
+    destination[size++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  destination[size++] = value;
+  return size;
+}
+
+uint32_t get_varint(uint8_t* source, uint32_t* value) {
+  uint32_t size = 0;
+  *value = 0;
+  do {
+    *value |= (uint32_t)(source[size] & 0x7f) << (7 * size);
+  } while (source[size++] & 0x80);
+  return size;
+}
+
+uint32_t row_record_size(Row* row) {
+  uint32_t size = RECORD_LENGTH_SIZE + strlen(row->username) +
+                  varint_size(row->email_length);
+  if (row->email_length > EMAIL_MAX_LOCAL_SIZE) {
+    return size + EMAIL_OVERFLOW_PREFIX_SIZE + RECORD_OVERFLOW_PAGE_SIZE;
+  }
+  return size + row->email_length;
+}
+
+/* Bytes of an email kept in the record itself */
+uint32_t email_local_length(uint32_t email_length) {
+  return email_length > EMAIL_MAX_LOCAL_SIZE ? EMAIL_OVERFLOW_PREFIX_SIZE
+                                             : email_length;
+}
+
+void row_set_email(Row* row, const char* email, uint32_t email_length) {
+  row->email = realloc(row->email, email_length + 1);
+  memcpy(row->email, email, email_length);
+  row->email[email_length] = '\0';
+  row->email_length = email_length;
+}
+
+/*
+Return the offset within the record of its overflow page number, or 0
+if the whole email is in the record
+*/
+uint32_t record_overflow_offset(void* source) {
+  uint8_t* record = source;
+  uint32_t offset = RECORD_LENGTH_SIZE + record[0];
+  uint32_t email_length;
+  offset += get_varint(record + offset, &email_length);
+  if (email_length <= EMAIL_MAX_LOCAL_SIZE) {
+    return 0;
+  }
+  return offset + EMAIL_OVERFLOW_PREFIX_SIZE;
+}
+
+/* The size of a record that has no overflow chain */
+uint32_t record_inline_size(void* source) {
+  uint8_t* record = source;
+  uint32_t offset = RECORD_LENGTH_SIZE + record[0];
+  uint32_t email_length;
+  offset += get_varint(record + offset, &email_length);
+  return offset + email_length;
+}
+
+/* Returns 0 if the record has no overflow chain */
+uint32_t record_overflow_page(void* record) {
+  uint32_t offset = record_overflow_offset(record);
+  uint32_t page_num = 0;
+  if (offset != 0) {
+    memcpy(&page_num, record + offset, RECORD_OVERFLOW_PAGE_SIZE);
+  }
+  return page_num;
+}
+
+uint32_t overflow_write(Pager* pager, const char* data, uint32_t length);
+void overflow_read(Pager* pager, uint32_t page_num, char* destination,
+                   uint32_t length);
+
+/*
+Write a row's record. A long email is written to a new overflow chain,
+so the record must then be stored or its chain freed.
+*/
+void serialize_row(Pager* pager, Row* source, void* destination) {
+  uint8_t* record = destination;
+  uint8_t username_length = strlen(source->username);
+  record[0] = username_length;
+  memcpy(record + RECORD_LENGTH_SIZE, source->username, username_length);
+  record += RECORD_LENGTH_SIZE + username_length;
+  record += put_varint(record, source->email_length);
+  if (source->email_length <= EMAIL_MAX_LOCAL_SIZE) {
+    memcpy(record, source->email, source->email_length);
+    return;
+  }
+
+  memcpy(record, source->email, EMAIL_OVERFLOW_PREFIX_SIZE);
+  uint32_t page_num =
+      overflow_write(pager, source->email + EMAIL_OVERFLOW_PREFIX_SIZE,
+                     source->email_length - EMAIL_OVERFLOW_PREFIX_SIZE);
+  memcpy(record + EMAIL_OVERFLOW_PREFIX_SIZE, &page_num,
+         RECORD_OVERFLOW_PAGE_SIZE);
+}
+
+/*
+Fill in the username and email. The id comes from the cell's key. The
+record is read in full before any overflow page is fetched, so it may
+point into an unpinned page.
+*/
+void deserialize_row(Pager* pager, void* source, Row* destination) {
+  uint8_t* record = source;
+  memcpy(destination->username, record + RECORD_LENGTH_SIZE, record[0]);
+  destination->username[record[0]] = '\0';
+  record += RECORD_LENGTH_SIZE + record[0];
+  uint32_t email_length;
+  record += get_varint(record, &email_length);
+  if (email_length <= EMAIL_MAX_LOCAL_SIZE) {
+    row_set_email(destination, (char*)record, email_length);
+    return;
+  }
+
+  uint32_t page_num;
+  memcpy(&page_num, record + EMAIL_OVERFLOW_PREFIX_SIZE,
+         RECORD_OVERFLOW_PAGE_SIZE);
+  row_set_email(destination, (char*)record, EMAIL_OVERFLOW_PREFIX_SIZE);
+  destination->email = realloc(destination->email, email_length + 1);
+  destination->email[email_length] = '\0';
+  destination->email_length = email_length;
+  overflow_read(pager, page_num,
+                destination->email + EMAIL_OVERFLOW_PREFIX_SIZE,
+                email_length - EMAIL_OVERFLOW_PREFIX_SIZE);
+}
+
+/* Make room for size more bytes and return where they go */
+void* buffer_reserve(ByteBuffer* buffer, size_t size) {
+  if (buffer->length + size > buffer->capacity) {
+    buffer->capacity = (buffer->length + size) * 2;
+    buffer->data = realloc(buffer->data, buffer->capacity);
+  }
+  void* space = buffer->data + buffer->length;
+  buffer->length += size;
+  return space;
+}
+
+void buffer_append(ByteBuffer* buffer, const void* data, size_t size) {
+  memcpy(buffer_reserve(buffer, size), data, size);
+}
+
+/*
+A select run through the binary protocol sends each row as its id, 4
+bytes in network byte order, then its record as a leaf stores it with
+the whole email inline. A record without an overflow chain is sent as
+is; any other row is written out in the same form.
+*/
+void result_append_record(ByteBuffer* results, uint32_t id, void* record) {
+  uint32_t size = record_inline_size(record);
+  uint8_t* destination = buffer_reserve(results, sizeof(id) + size);
+  uint32_t network_id = htonl(id);
+  memcpy(destination, &network_id, sizeof(id));
+  memcpy(destination + sizeof(id), record, size);
+}
+
+void result_append_row(ByteBuffer* results, Row* row) {
+  uint8_t username_length = strlen(row->username);
+  uint32_t size = sizeof(row->id) + RECORD_LENGTH_SIZE + username_length +
+                  varint_size(row->email_length) + row->email_length;
+  uint8_t* destination = buffer_reserve(results, size);
+  uint32_t network_id = htonl(row->id);
+  memcpy(destination, &network_id, sizeof(row->id));
+  destination += sizeof(row->id);
+  *destination = username_length;
+  memcpy(destination + RECORD_LENGTH_SIZE, row->username, username_length);
+  destination += RECORD_LENGTH_SIZE + username_length;
+  destination += put_varint(destination, row->email_length);
+  memcpy(destination, row->email, row->email_length);
+}
+
+void initialize_leaf_node(void* node) {
+  set_node_type(node, NODE_LEAF);
+  set_node_root(node, false);
+  *leaf_node_num_cells(node) = 0;
+  *leaf_node_next_leaf(node) = 0;  // 0 represents no sibling
+  *leaf_node_cell_content(node) = page_size;
+  *leaf_node_fragmented(node) = 0;
+}
+
+/*
+Free space in a leaf, counting fragments between records. A compressed
+leaf has none: it is expanded before it is written to.
+*/
+uint32_t leaf_node_free_space(void* node) {
+  if (leaf_node_is_compressed(node)) {
+    return 0;
+  }
+  uint32_t slots_end =
+      LEAF_NODE_HEADER_SIZE + *leaf_node_num_cells(node) * LEAF_NODE_SLOT_SIZE;
+  return *leaf_node_cell_content(node) - slots_end +
+         *leaf_node_fragmented(node);
+}
+
+uint32_t leaf_node_used_space(void* node) {
+  return leaf_node_space_for_cells - leaf_node_free_space(node);
+}
+
+/*
+Move every record to the end of the page so that all free space is
+in one gap between the slots and the records.
+*/
+void leaf_node_defragment(void* node) {
+  void* copy = malloc(page_size);
+  memcpy(copy, node, page_size);
+
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint32_t cell_content = page_size;
+  for (uint32_t i = 0; i < num_cells; i++) {
+    uint32_t record_size = *leaf_node_record_size(node, i);
+    cell_content -= record_size;
+    memcpy(node + cell_content, leaf_node_value(copy, i), record_size);
+    *leaf_node_record_offset(node, i) = cell_content;
+  }
+  *leaf_node_cell_content(node) = cell_content;
+  *leaf_node_fragmented(node) = 0;
+  free(copy);
+}
+
+/*
+Add a slot at cell_num and reserve record_size bytes for its record,
+returning where to write the record. The caller checks that the leaf
+has the free space.
+*/
+void* leaf_node_insert_cell(void* node, uint32_t cell_num, uint32_t key,
+                            uint32_t record_size) {
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint32_t slots_end =
+      LEAF_NODE_HEADER_SIZE + (num_cells + 1) * LEAF_NODE_SLOT_SIZE;
+  if (slots_end + record_size > *leaf_node_cell_content(node)) {
+    leaf_node_defragment(node);
+  }
+
+  uint32_t record_offset = *leaf_node_cell_content(node) - record_size;
+  *leaf_node_cell_content(node) = record_offset;
+  /*
+  With one more key, the locations start one key later. The ones from
+  cell_num on also move past the new location.
+  */
+  void* locations = leaf_node_location(node, 0);
+  memmove(locations + LEAF_NODE_KEY_SIZE +
+              (cell_num + 1) * LEAF_NODE_LOCATION_SIZE,
+          locations + cell_num * LEAF_NODE_LOCATION_SIZE,
+          (num_cells - cell_num) * LEAF_NODE_LOCATION_SIZE);
+  memmove(locations + LEAF_NODE_KEY_SIZE, locations,
+          cell_num * LEAF_NODE_LOCATION_SIZE);
+  memmove(leaf_node_key(node, cell_num + 1), leaf_node_key(node, cell_num),
+          (num_cells - cell_num) * LEAF_NODE_KEY_SIZE);
+  *leaf_node_num_cells(node) = num_cells + 1;
+  *leaf_node_key(node, cell_num) = key;
+  *leaf_node_record_offset(node, cell_num) = record_offset;
+  *leaf_node_record_size(node, cell_num) = record_size;
+  return node + record_offset;
+}
+
+void leaf_node_remove_cell(void* node, uint32_t cell_num) {
+  uint32_t num_cells = *leaf_node_num_cells(node) - 1;
+  uint32_t record_offset = *leaf_node_record_offset(node, cell_num);
+  uint32_t record_size = *leaf_node_record_size(node, cell_num);
+  if (record_offset == *leaf_node_cell_content(node)) {
+    *leaf_node_cell_content(node) += record_size;
+  } else {
+    *leaf_node_fragmented(node) += record_size;
+  }
+  /* The reverse of leaf_node_insert_cell, keys first */
+  void* locations = leaf_node_location(node, 0);
+  memmove(leaf_node_key(node, cell_num), leaf_node_key(node, cell_num + 1),
+          (num_cells - cell_num) * LEAF_NODE_KEY_SIZE);
+  memmove(locations - LEAF_NODE_KEY_SIZE, locations,
+          cell_num * LEAF_NODE_LOCATION_SIZE);
+  memmove(locations - LEAF_NODE_KEY_SIZE + cell_num * LEAF_NODE_LOCATION_SIZE,
+          locations + (cell_num + 1) * LEAF_NODE_LOCATION_SIZE,
+          (num_cells - cell_num) * LEAF_NODE_LOCATION_SIZE);
+  *leaf_node_num_cells(node) = num_cells;
+}
+
+uint32_t leaf_cell_size(LeafCell* cell) {
+  return LEAF_NODE_SLOT_SIZE + cell->record_size;
+}
+
+/*
+Copy a leaf's cells out to cells, with the records in scratch, which
+must hold page_size bytes. Returns the number of cells.
+*/
+uint32_t leaf_node_copy_cells(void* node, void* scratch, LeafCell* cells) {
+  memcpy(scratch, node, page_size);
+  uint32_t num_cells = *leaf_node_num_cells(scratch);
+  for (uint32_t i = 0; i < num_cells; i++) {
+    cells[i].key = *leaf_node_key(scratch, i);
+    cells[i].record_size = *leaf_node_record_size(scratch, i);
+    cells[i].record = leaf_node_value(scratch, i);
+  }
+  return num_cells;
+}
+
+/*
+Replace a leaf's cells, keeping the rest of its header
+*/
+void leaf_node_set_cells(void* node, LeafCell* cells, uint32_t num_cells) {
+  *leaf_node_num_cells(node) = 0;
+  *leaf_node_cell_content(node) = page_size;
+  *leaf_node_fragmented(node) = 0;
+  for (uint32_t i = 0; i < num_cells; i++) {
+    memcpy(leaf_node_insert_cell(node, i, cells[i].key, cells[i].record_size),
+           cells[i].record, cells[i].record_size);
+  }
+}
+
+/*
+Divide sorted cells into as few leaves as hold them, with about the
+same number of bytes in each. Sets ends[n] to one past the last cell of
+leaf n and returns the number of leaves.
+*/
+uint32_t leaf_cells_partition(LeafCell* cells, uint32_t num_cells,
+                              uint32_t* ends) {
+  uint64_t remaining = 0;
+  for (uint32_t i = 0; i < num_cells; i++) {
+    remaining += leaf_cell_size(&cells[i]);
+  }
+
+  uint32_t num_leaves = 0;
+  uint32_t leaves_left = 1;
+  uint32_t end = 0;
+  do {
+    uint32_t leaves_needed =
+        (remaining + leaf_node_space_for_cells - 1) / leaf_node_space_for_cells;
+    if (leaves_left < leaves_needed) {
+      leaves_left = leaves_needed;
+    }
+    uint64_t target = remaining / leaves_left;
+
+    /* Stop at the cell boundary closest to the target */
+    uint32_t bytes = 0;
+    uint32_t start = end;
+    while (end < num_cells) {
+      uint32_t cell_size = leaf_cell_size(&cells[end]);
+      if (bytes + cell_size > leaf_node_space_for_cells ||
+          (end > start && leaves_left > 1 &&
+           bytes + cell_size / 2 > target)) {
+        break;
+      }
+      bytes += cell_size;
+      end++;
+    }
+    ends[num_leaves++] = end;
+    remaining -= bytes;
+    if (leaves_left > 1) {
+      leaves_left--;
+    }
+  } while (end < num_cells);
+  return num_leaves;
+}
+
+/* The strings of a record, which compressed leaves encode separately */
+typedef struct {
+  uint8_t* username;
+  uint32_t username_length;
+  uint32_t email_length;
+  uint8_t* email;  // The bytes kept in the record
+  uint32_t email_local_length;
+} RecordStrings;
+
+void record_strings(void* record, RecordStrings* strings) {
+  uint8_t* bytes = record;
+  strings->username = bytes + RECORD_LENGTH_SIZE;
+  strings->username_length = bytes[0];
+  bytes = strings->username + strings->username_length;
+  strings->email = bytes + get_varint(bytes, &strings->email_length);
+  strings->email_local_length = email_local_length(strings->email_length);
+}
+
+/*
+Encode bytes as the lengths of the prefix and the suffix they share
+with previous, then the bytes in between
+*/
+uint32_t encode_shared(uint8_t* destination, uint8_t* bytes, uint32_t length,
+                       uint8_t* previous, uint32_t previous_length) {
+  uint32_t max_shared = length < previous_length ? length : previous_length;
+  uint32_t prefix = 0;
+  while (prefix < max_shared && bytes[prefix] == previous[prefix]) {
+    prefix++;
+  }
+  uint32_t suffix = 0;
+  while (prefix + suffix < max_shared &&
+         bytes[length - 1 - suffix] == previous[previous_length - 1 - suffix]) {
+    suffix++;
+  }
+
+  uint32_t size = put_varint(destination, prefix);
+  size += put_varint(destination + size, suffix);
+  memcpy(destination + size, bytes + prefix, length - prefix - suffix);
+  return size + length - prefix - suffix;
+}
+
+uint32_t decode_shared(uint8_t* source, uint8_t* destination, uint32_t length,
+                       uint8_t* previous, uint32_t previous_length) {
+  uint32_t prefix, suffix;
+  uint32_t size = get_varint(source, &prefix);
+  size += get_varint(source + size, &suffix);
+  uint32_t middle = length - prefix - suffix;
+  memcpy(destination, previous, prefix);
+  memcpy(destination + prefix, source + size, middle);
+  memcpy(destination + prefix + middle, previous + previous_length - suffix,
+         suffix);
+  return size + middle;
+}
+
+/*
+Encode a cell against the cell before it, or against an empty cell if
+previous is NULL. Returns the encoded size, at most
+LEAF_CELL_MAX_ENCODED_SIZE.
+*/
+uint32_t leaf_cell_encode(LeafCell* previous, LeafCell* cell,
+                          uint8_t* destination) {
+  RecordStrings strings;
+  RecordStrings previous_strings = {(uint8_t*)"", 0, 0, (uint8_t*)"", 0};
+  uint32_t previous_key = 0;
+  record_strings(cell->record, &strings);
+  if (previous != NULL) {
+    record_strings(previous->record, &previous_strings);
+    previous_key = previous->key;
+  }
+
+  uint32_t size = put_varint(destination, cell->key - previous_key);
+  size += put_varint(destination + size, strings.username_length);
+  size += encode_shared(destination + size, strings.username,
+                        strings.username_length, previous_strings.username,
+                        previous_strings.username_length);
+  size += put_varint(destination + size, strings.email_length);
+  size += encode_shared(destination + size, strings.email,
+                        strings.email_local_length, previous_strings.email,
+                        previous_strings.email_local_length);
+  if (strings.email_length > EMAIL_MAX_LOCAL_SIZE) {
+    memcpy(destination + size, strings.email + strings.email_local_length,
+           RECORD_OVERFLOW_PAGE_SIZE);
+    size += RECORD_OVERFLOW_PAGE_SIZE;
+  }
+  return size;
+}
+
+/*
+Decode a cell encoded against previous, writing its record to record.
+Returns the encoded size.
+*/
+uint32_t leaf_cell_decode(uint8_t* source, LeafCell* previous, LeafCell* cell,
+                          void* record) {
+  RecordStrings previous_strings = {(uint8_t*)"", 0, 0, (uint8_t*)"", 0};
+  uint32_t previous_key = 0;
+  if (previous != NULL) {
+    record_strings(previous->record, &previous_strings);
+    previous_key = previous->key;
+  }
+
+  uint32_t key_delta, username_length, email_length;
+  uint32_t size = get_varint(source, &key_delta);
+  size += get_varint(source + size, &username_length);
+  uint8_t* destination = record;
+  destination[0] = username_length;
+  destination += RECORD_LENGTH_SIZE;
+  size += decode_shared(source + size, destination, username_length,
+                        previous_strings.username,
+                        previous_strings.username_length);
+  destination += username_length;
+  size += get_varint(source + size, &email_length);
+  destination += put_varint(destination, email_length);
+  uint32_t local_length = email_local_length(email_length);
+  size += decode_shared(source + size, destination, local_length,
+                        previous_strings.email,
+                        previous_strings.email_local_length);
+  destination += local_length;
+  if (email_length > EMAIL_MAX_LOCAL_SIZE) {
+    memcpy(destination, source + size, RECORD_OVERFLOW_PAGE_SIZE);
+    destination += RECORD_OVERFLOW_PAGE_SIZE;
+    size += RECORD_OVERFLOW_PAGE_SIZE;
+  }
+
+  cell->key = previous_key + key_delta;
+  cell->record_size = destination - (uint8_t*)record;
+  cell->record = record;
+  return size;
+}
+
+/*
+Write cells to a leaf in compressed form. The caller checks that they
+fit.
+*/
+void leaf_node_set_compressed_cells(void* node, LeafCell* cells,
+                                    uint32_t num_cells) {
+  uint8_t* destination = node + LEAF_NODE_HEADER_SIZE;
+  uint32_t size = 0;
+  for (uint32_t i = 0; i < num_cells; i++) {
+    size += leaf_cell_encode(i > 0 ? &cells[i - 1] : NULL, &cells[i],
+                             destination + size);
+  }
+  *leaf_node_num_cells(node) = num_cells;
+  *leaf_node_cell_content(node) = 0;
+  *leaf_node_encoded_size(node) = size;
+}
+
+/*
+Return a compressed leaf's cells, decoding it unless it is the leaf
+decoded last. They stay valid until another leaf is decoded.
+*/
+DecodedLeaf* leaf_node_decode(Pager* pager, uint32_t page_num, void* node) {
+  DecodedLeaf* decoded = &decoded_leaf;
+  uint64_t version = __atomic_load_n(&leaf_version, __ATOMIC_ACQUIRE);
+  if (decoded->pager == pager && decoded->page_num == page_num &&
+      decoded->version == version) {
+    return decoded;
+  }
+
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  if (num_cells > decoded->cells_capacity) {
+    decoded->cells_capacity = num_cells;
+    decoded->cells = realloc(decoded->cells, sizeof(LeafCell) * num_cells);
+    decoded->records =
+        realloc(decoded->records, (size_t)RECORD_MAX_SIZE * num_cells);
+  }
+  uint8_t* source = node + LEAF_NODE_HEADER_SIZE;
+  void* record = decoded->records;
+  for (uint32_t i = 0; i < num_cells; i++) {
+    LeafCell* cell = &decoded->cells[i];
+    source += leaf_cell_decode(source, i > 0 ? cell - 1 : NULL, cell, record);
+    record += cell->record_size;
+  }
+  decoded->pager = pager;
+  decoded->page_num = page_num;
+  decoded->version = version;
+  decoded->num_cells = num_cells;
+  return decoded;
+}
+
+/* Free the calling thread's DecodedLeaf, before the thread exits */
+void decoded_leaf_free() {
+  free(decoded_leaf.cells);
+  free(decoded_leaf.records);
+  memset(&decoded_leaf, 0, sizeof(DecodedLeaf));
+}
+
+/* A cell of either kind of leaf */
+LeafCell leaf_node_cell(Pager* pager, uint32_t page_num, void* node,
+                        uint32_t cell_num) {
+  if (leaf_node_is_compressed(node)) {
+    return leaf_node_decode(pager, page_num, node)->cells[cell_num];
+  }
+  LeafCell cell;
+  cell.key = *leaf_node_key(node, cell_num);
+  cell.record_size = *leaf_node_record_size(node, cell_num);
+  cell.record = leaf_node_value(node, cell_num);
+  return cell;
+}
+
+/*
+The max key of a leaf with cells. Only the keys of a compressed leaf
+are decoded, and it is not cached.
+*/
+uint32_t leaf_node_max_key(void* node) {
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  if (!leaf_node_is_compressed(node)) {
+    return *leaf_node_key(node, num_cells - 1);
+  }
+
+  uint8_t* source = node + LEAF_NODE_HEADER_SIZE;
+  uint32_t key = 0;
+  for (uint32_t i = 0; i < num_cells; i++) {
+    uint32_t key_delta, length, prefix, suffix;
+    source += get_varint(source, &key_delta);
+    key += key_delta;
+    source += get_varint(source, &length);
+    source += get_varint(source, &prefix);
+    source += get_varint(source, &suffix);
+    source += length - prefix - suffix;
+    source += get_varint(source, &length);
+    bool overflow = length > EMAIL_MAX_LOCAL_SIZE;
+    length = email_local_length(length);
+    source += get_varint(source, &prefix);
+    source += get_varint(source, &suffix);
+    source += length - prefix - suffix;
+    if (overflow) {
+      source += RECORD_OVERFLOW_PAGE_SIZE;
+    }
+  }
+  return key;
+}
+
+void initialize_internal_node(void* node) {
+  set_node_type(node, NODE_INTERNAL);
+  set_node_root(node, false);
+  *internal_node_num_keys(node) = 0;
+  /*
+  Necessary because page 0 is the file header; by not initializing an
+  internal node's right child to an invalid page number when
+  initializing the node, we may end up with 0 as the node's right
+  child, which makes the node a parent of the header
+  */
+  *internal_node_right_child(node) = INVALID_PAGE_NUM;
+}
+
+uint32_t hash_id(uint32_t id) {
+  id ^= id >> 16;
+  id *= 0x85ebca6b;
+  id ^= id >> 13;
+  id *= 0xc2b2ae35;
+  id ^= id >> 16;
+  return id;
+}
+
+void leaf_hash_init(LeafHash* hash, uint32_t capacity) {
+  hash->entries = calloc(capacity, sizeof(LeafHashEntry));
+  hash->capacity = capacity;
+  hash->count = 0;
+}
+
+/* The entry holding the id, or the empty entry where it would go */
+LeafHashEntry* leaf_hash_entry(LeafHash* hash, uint32_t id) {
+  uint32_t mask = hash->capacity - 1;
+  uint32_t slot = hash_id(id) & mask;
+  while (hash->entries[slot].page_num != 0 && hash->entries[slot].id != id) {
+    slot = (slot + 1) & mask;
+  }
+  return &hash->entries[slot];
+}
+
+void leaf_hash_put(Pager* pager, LeafHash* hash, uint32_t id,
+                   uint32_t page_num) {
+  if ((hash->count + 1) * 2 > hash->capacity) {
+    LeafHash old = *hash;
+    leaf_hash_init(hash, old.capacity * 2);
+    for (uint32_t i = 0; i < old.capacity; i++) {
+      if (old.entries[i].page_num != 0) {
+        *leaf_hash_entry(hash, old.entries[i].id) = old.entries[i];
+        hash->count++;
+      }
+    }
+    free(old.entries);
+  }
+
+  LeafHashEntry* entry = leaf_hash_entry(hash, id);
+  if (entry->page_num == 0) {
+    entry->id = id;
+    hash->count++;
+  }
+  entry->page_num = page_num;
+  entry->free_count = pager_free_count(pager, page_num);
+}
+
+uint32_t table_first_leaf(Table* table) {
+  uint32_t page_num = table->root_page_num;
+  void* node = get_page(table->pager, page_num);
+  while (get_node_type(node) == NODE_INTERNAL) {
+    uint32_t child_num = *internal_node_child(node, 0);
+    unpin_page(table->pager, page_num);
+    page_num = child_num;
+    node = get_page(table->pager, page_num);
+  }
+  unpin_page(table->pager, page_num);
+  return page_num;
+}
+
+/*
+Return the table's LeafHash, filling it from the leaves on first use.
+The leaves are walked twice, counting the ids first so the hash is
+sized once instead of growing through every power of two. The leaves
+are read without latches, so the writer is kept out meanwhile; the
+writer itself never fills it while it latches pages.
+*/
+LeafHash* table_leaf_hash(Table* table) {
+  Pager* pager = table->pager;
+  pthread_mutex_lock(&pager->mutex);
+  LeafHash* filled = table->leaf_hash;
+  pthread_mutex_unlock(&pager->mutex);
+  if (filled != NULL) {
+    return filled;
+  }
+
+  pthread_mutex_lock(&pager->writer_mutex);
+  if (table->leaf_hash != NULL) {
+    pthread_mutex_unlock(&pager->writer_mutex);
+    return table->leaf_hash;  // Filled by another reader meanwhile
+  }
+  uint32_t first_leaf = table_first_leaf(table);
+  uint32_t num_ids = 0;
+  for (uint32_t page_num = first_leaf; page_num != 0;) {
+    void* node = get_page(pager, page_num);
+    num_ids += *leaf_node_num_cells(node);
+    uint32_t next_page_num = *leaf_node_next_leaf(node);
+    unpin_page(pager, page_num);
+    page_num = next_page_num;
+  }
+
+  uint32_t capacity = LEAF_HASH_MIN_CAPACITY;
+  while (capacity < num_ids * 2 + 2) {
+    capacity *= 2;
+  }
+  LeafHash* hash = malloc(sizeof(LeafHash));
+  leaf_hash_init(hash, capacity);
+
+  for (uint32_t page_num = first_leaf; page_num != 0;) {
+    void* node = get_page(pager, page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    for (uint32_t i = 0; i < num_cells; i++) {
+      uint32_t key = leaf_node_cell(pager, page_num, node, i).key;
+      leaf_hash_put(pager, hash, key, page_num);
+    }
+    uint32_t next_page_num = *leaf_node_next_leaf(node);
+    unpin_page(pager, page_num);
+    page_num = next_page_num;
+  }
+
+  pthread_mutex_lock(&pager->mutex);
+  table->leaf_hash = hash;
+  pthread_mutex_unlock(&pager->mutex);
+  pthread_mutex_unlock(&pager->writer_mutex);
+  return hash;
+}
+
+/*
+Count the keys below key, comparing 8 (AVX2) or 4 (SSE2) keys at a time
+and the rest one by one. SSE2 and AVX2 only compare signed integers, so
+both sides have their top bit flipped first.
+*/
+uint32_t keys_below(const uint32_t* keys, uint32_t num_keys, uint32_t key) {
+  uint32_t count = 0;
+  uint32_t i = 0;
+#if defined(__AVX2__)
+  __m256i bias = _mm256_set1_epi32(INT32_MIN);
+  __m256i target = _mm256_xor_si256(_mm256_set1_epi32(key), bias);
+  __m256i counts = _mm256_setzero_si256();
+  for (; i + 8 <= num_keys; i += 8) {
+    __m256i block = _mm256_loadu_si256((const __m256i*)(keys + i));
+    /* Lanes that compare true are -1 */
+    counts = _mm256_sub_epi32(
+        counts, _mm256_cmpgt_epi32(target, _mm256_xor_si256(block, bias)));
+  }
+  uint32_t lanes[8];
+  _mm256_storeu_si256((__m256i*)lanes, counts);
+  for (uint32_t lane = 0; lane < 8; lane++) {
+    count += lanes[lane];
+  }
+#elif defined(__SSE2__)
+  __m128i bias = _mm_set1_epi32(INT32_MIN);
+  __m128i target = _mm_xor_si128(_mm_set1_epi32(key), bias);
+  __m128i counts = _mm_setzero_si128();
+  for (; i + 4 <= num_keys; i += 4) {
+    __m128i block = _mm_loadu_si128((const __m128i*)(keys + i));
+    /* Lanes that compare true are -1 */
+    counts = _mm_sub_epi32(counts,
+                           _mm_cmpgt_epi32(target, _mm_xor_si128(block, bias)));
+  }
+  uint32_t lanes[4];
+  _mm_storeu_si128((__m128i*)lanes, counts);
+  count = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+  for (; i < num_keys; i++) {
+    count += keys[i] < key;
+  }
+  return count;
+}
+
+/*
+Return the index of the first of the sorted keys that is >= key, or
+num_keys if there is none. Binary search narrows the range down to
+KEY_SEARCH_WINDOW keys, which fit in two cache lines and are then
+counted without branches.
+*/
+uint32_t keys_lower_bound(const uint32_t* keys, uint32_t num_keys,
+                          uint32_t key) {
+  uint32_t min_index = 0;
+  uint32_t max_index = num_keys;
+  while (max_index - min_index > KEY_SEARCH_WINDOW) {
+    uint32_t index = (min_index + max_index) / 2;
+    if (keys[index] >= key) {
+      max_index = index;
+    } else {
+      min_index = index + 1;
+    }
+  }
+  return min_index + keys_below(keys + min_index, max_index - min_index, key);
+}
+
+Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key) {
+  void* node = get_page(table->pager, page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+
+  Cursor* cursor = malloc(sizeof(Cursor));
+  cursor->table = table;
+  cursor->page_num = page_num;
+  cursor->end_of_table = false;
+  cursor->latch = LATCH_NONE;
+
+  if (!leaf_node_is_compressed(node)) {
+    cursor->cell_num =
+        keys_lower_bound(leaf_node_key(node, 0), num_cells, key);
+    unpin_page(table->pager, page_num);
+    return cursor;
+  }
+
+  // Binary search over the decoded cells
+  uint32_t min_index = 0;
+  uint32_t one_past_max_index = num_cells;
+  while (one_past_max_index != min_index) {
+    uint32_t index = (min_index + one_past_max_index) / 2;
+    uint32_t key_at_index =
+        leaf_node_cell(table->pager, page_num, node, index).key;
+    if (key == key_at_index) {
+      cursor->cell_num = index;
+      unpin_page(table->pager, page_num);
+      return cursor;
+    }
+    if (key < key_at_index) {
+      one_past_max_index = index;
+    } else {
+      min_index = index + 1;
+    }
+  }
+
+  cursor->cell_num = min_index;
+  unpin_page(table->pager, page_num);
+  return cursor;
+}
+
+uint32_t internal_node_find_child(void* node, uint32_t key) {
+  /*
+  Return the index of the child which should contain
+  the given key. There is one more child than key.
+  */
+  return keys_lower_bound(internal_node_key(node, 0),
+                          *internal_node_num_keys(node), key);
+}
+
+/*
+Return the index of the given child page within its parent. The right
+child's index is num_keys.
+*/
+uint32_t internal_node_child_index(void* node, uint32_t child_page_num) {
+  uint32_t num_keys = *internal_node_num_keys(node);
+  for (uint32_t i = 0; i <= num_keys; i++) {
+    if (*internal_node_child(node, i) == child_page_num) {
+      return i;
+    }
+  }
+  printf("Page %d is not a child of its parent\n", child_page_num);
+  db_fail();
+}
+
+Cursor* internal_node_find(Table* table, uint32_t page_num, uint32_t key) {
+  void* node = get_page(table->pager, page_num);
+
+  uint32_t child_index = internal_node_find_child(node, key);
+  uint32_t child_num = *internal_node_child(node, child_index);
+  unpin_page(table->pager, page_num);
+
+  void* child = get_page(table->pager, child_num);
+  NodeType child_type = get_node_type(child);
+  unpin_page(table->pager, child_num);
+  switch (child_type) {
+    case NODE_LEAF:
+      return leaf_node_find(table, child_num, key);
+    case NODE_INTERNAL:
+      return internal_node_find(table, child_num, key);
+    default:
+      /* Index nodes never appear in a table's tree */
+      printf("Page %d is corrupt.\n", child_num);
+      db_fail();
+  }
+}
+
+bool cursor_is_at_key(Cursor* cursor, uint32_t key);
+
+/* Record where a descent found the key, if the table has a LeafHash */
+void table_hash_found(Table* table, Cursor* cursor, uint32_t key) {
+  Pager* pager = table->pager;
+  if (!pager->hash_index || pager_snapshot(pager) != NULL) {
+    return;
+  }
+  pthread_mutex_lock(&pager->mutex);
+  if (table->leaf_hash != NULL && cursor_is_at_key(cursor, key)) {
+    leaf_hash_put(pager, table->leaf_hash, key, cursor->page_num);
+  }
+  pthread_mutex_unlock(&pager->mutex);
+}
+
+/*
+Look for the key in the leaf the table's LeafHash last found it in,
+latching the leaf as latch says. Return NULL if the hash has no entry,
+or the page was freed since or is no longer a leaf holding the key.
+The hash describes the pages as they are now, so under a snapshot it
+is not used.
+*/
+Cursor* table_find_hashed(Table* table, uint32_t key, LatchMode latch) {
+  Pager* pager = table->pager;
+  if (pager_snapshot(pager) != NULL) {
+    return NULL;
+  }
+  LeafHash* hash = table_leaf_hash(table);
+  pthread_mutex_lock(&pager->mutex);
+  LeafHashEntry entry = *leaf_hash_entry(hash, key);
+  pthread_mutex_unlock(&pager->mutex);
+  uint32_t page_num = entry.page_num;
+  if (page_num == 0 ||
+      entry.free_count != pager_free_count(pager, page_num)) {
+    return NULL;
+  }
+
+  void* node = latch == LATCH_NONE ? get_page(pager, page_num)
+                                   : latch_page(pager, page_num, latch);
+  Cursor* cursor = NULL;
+  if (get_node_type(node) == NODE_LEAF) {
+    cursor = leaf_node_find(table, page_num, key);
+    cursor->latch = latch;
+    if (!cursor_is_at_key(cursor, key)) {
+      free(cursor);
+      cursor = NULL;
+    }
+  }
+  if (latch == LATCH_NONE) {
+    unpin_page(pager, page_num);
+  } else if (cursor == NULL) {
+    unlatch_page(pager, page_num);
+  }
+  return cursor;
+}
+
+/*
+Whether inserting one row below the node leaves its ancestors alone: a
+leaf has room for the largest record, or an internal node for another
+child. A new largest key needs nothing above either, since it goes to
+the rightmost child, which has no key of its own.
+*/
+bool node_has_room_for_insert(void* node) {
+  if (get_node_type(node) == NODE_LEAF) {
+    return !leaf_node_is_compressed(node) &&
+           leaf_node_free_space(node) >= LEAF_NODE_SLOT_SIZE + RECORD_MAX_SIZE;
+  }
+  return *internal_node_num_keys(node) < internal_node_max_cells;
+}
+
+Cursor* table_find_unlatched(Table* table, uint32_t key) {
+  uint32_t root_page_num = table->root_page_num;
+  void* root_node = get_page(table->pager, root_page_num);
+  NodeType root_type = get_node_type(root_node);
+  unpin_page(table->pager, root_page_num);
+
+  if (root_type == NODE_LEAF) {
+    return leaf_node_find(table, root_page_num, key);
+  }
+  return internal_node_find(table, root_page_num, key);
+}
+
+/*
+The writer's descent, latching each node exclusively before its parent.
+An insert lets go of the nodes above one with room for it as soon as it
+gets there, since no split can climb past that node. Other writes keep
+the whole path, as a merge or a new largest key may reach the root.
+Nodes the writer latched earlier in the write stay latched.
+
+Only the writer changes the tree, so an insert first descends without
+latching anything and latches just the leaf. Only if the leaf has no
+room does it descend again, latching the path. Readers that do not
+latch (see table_find_row()) then only restart for the leaves it
+writes to.
+*/
+Cursor* table_find_exclusive(Table* table, uint32_t key) {
+  Pager* pager = table->pager;
+  bool inserting = pager->writer_access == TREE_INSERT;
+  if (inserting) {
+    Cursor* cursor = table_find_unlatched(table, key);
+    bool newly_latched = pager_hold_page(pager, cursor->page_num);
+    void* node = get_page(pager, cursor->page_num);
+    bool has_room = node_has_room_for_insert(node);
+    unpin_page(pager, cursor->page_num);
+    if (has_room) {
+      return cursor;
+    }
+    if (newly_latched) {
+      pager_release_page(pager, cursor->page_num);
+    }
+    free(cursor);
+  }
+
+  uint32_t latched[BUILD_MAX_LEVELS];  // By this descent, root first
+  uint32_t num_latched = 0;
+  uint32_t page_num = table->root_page_num;
+  while (true) {
+    bool newly_latched = pager_hold_page(pager, page_num);
+    void* node = get_page(pager, page_num);
+    if (inserting && node_has_room_for_insert(node)) {
+      for (uint32_t i = 0; i < num_latched; i++) {
+        pager_release_page(pager, latched[i]);
+      }
+      num_latched = 0;
+    }
+    if (newly_latched) {
+      latched[num_latched++] = page_num;
+    }
+    if (get_node_type(node) == NODE_LEAF) {
+      unpin_page(pager, page_num);
+      return leaf_node_find(table, page_num, key);
+    }
+    uint32_t child_num =
+        *internal_node_child(node, internal_node_find_child(node, key));
+    unpin_page(pager, page_num);
+    page_num = child_num;
+  }
+}
+
+/*
+Return the position of the given key.
+If the key is not present, return the position
+where it should be inserted
+*/
+Cursor* table_find(Table* table, uint32_t key) {
+  Cursor* cursor;
+  if (pager_writer_latching(table->pager)) {
+    cursor = table_find_exclusive(table, key);
+  } else {
+    cursor = table_find_unlatched(table, key);
+  }
+  table_hash_found(table, cursor, key);
+  return cursor;
+}
+
+/*
+A reader's descent, latching each node shared before letting go of its
+parent. The cursor holds its leaf latched and pinned until
+cursor_close().
+*/
+Cursor* table_find_shared(Table* table, uint32_t key) {
+  Pager* pager = table->pager;
+  uint32_t page_num = table->root_page_num;
+  void* node = latch_page(pager, page_num, LATCH_SHARED);
+  while (get_node_type(node) == NODE_INTERNAL) {
+    uint32_t child_num =
+        *internal_node_child(node, internal_node_find_child(node, key));
+    void* child = latch_page(pager, child_num, LATCH_SHARED);
+    unlatch_page(pager, page_num);
+    page_num = child_num;
+    node = child;
+  }
+  Cursor* cursor = leaf_node_find(table, page_num, key);
+  cursor->latch = LATCH_SHARED;
+  table_hash_found(table, cursor, key);
+  return cursor;
+}
+
+/*
+Find a row by id for a lookup that only wants that row. With
+--hash-index this tries the leaf the table's LeafHash points at first,
+unless the writer latches pages: it must reach the leaf through its
+parents so as to latch them first.
+*/
+Cursor* table_find_id(Table* table, uint32_t key) {
+  if (table->pager->hash_index && !pager_writer_latching(table->pager)) {
+    Cursor* cursor = table_find_hashed(table, key, LATCH_NONE);
+    if (cursor != NULL) {
+      return cursor;
+    }
+  }
+  return table_find(table, key);
+}
+
+/* A reader's table_find_id(), returning a cursor as table_find_shared() */
+Cursor* table_find_id_shared(Table* table, uint32_t key) {
+  if (table->pager->hash_index) {
+    Cursor* cursor = table_find_hashed(table, key, LATCH_SHARED);
+    if (cursor != NULL) {
+      return cursor;
+    }
+  }
+  return table_find_shared(table, key);
+}
+
+typedef enum {
+  LOOKUP_FOUND,
+  LOOKUP_NOT_FOUND,
+  LOOKUP_RESTART,  // A node changed while it was read
+  LOOKUP_LATCH     // It has to be looked up with latches instead
+} LookupResult;
+
+/*
+The frame holding a page and its version, without pinning it or taking
+the mutex. Returns NULL if the page is not in the pool or the writer
+holds it.
+*/
+Frame* pager_frame_optimistic(Pager* pager, uint32_t page_num,
+                              uint64_t* version) {
+  uint32_t capacity =
+      __atomic_load_n(&pager->page_table_capacity, __ATOMIC_ACQUIRE);
+  uint32_t* page_table = __atomic_load_n(&pager->page_table, __ATOMIC_ACQUIRE);
+  if (page_num >= capacity) {
+    return NULL;
+  }
+  uint32_t frame_index =
+      __atomic_load_n(&page_table[page_num], __ATOMIC_RELAXED);
+  if (frame_index == INVALID_PAGE_NUM) {
+    return NULL;
+  }
+  Frame* frame = &pager->frames[frame_index];
+  *version = __atomic_load_n(&frame->version, __ATOMIC_ACQUIRE);
+  if (*version % 2 == 1 ||
+      __atomic_load_n(&frame->page_num, __ATOMIC_RELAXED) != page_num) {
+    return NULL;
+  }
+  return frame;
+}
+
+/*
+Whether nothing was written to the frame since version was read. As in
+a seqlock, every read of the frame's data in between is a relaxed
+atomic load, and the fence keeps them all before the version's reload.
+*/
+bool frame_unchanged(Frame* frame, uint64_t version) {
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&frame->version, __ATOMIC_RELAXED) == version;
+}
+
+/* Read a field of an unlatched page, to check with frame_unchanged() */
+uint32_t optimistic_load(const uint32_t* field) {
+  return __atomic_load_n(field, __ATOMIC_RELAXED);
+}
+
+/* Copy bytes out of an unlatched page, a word at a time where aligned */
+void optimistic_copy(void* destination, const void* source, uint32_t size) {
+  uint8_t* to = destination;
+  const uint8_t* from = source;
+  uint32_t i = 0;
+  for (; i < size && (uintptr_t)(from + i) % sizeof(uint64_t) != 0; i++) {
+    to[i] = __atomic_load_n(from + i, __ATOMIC_RELAXED);
+  }
+  for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+    uint64_t word =
+        __atomic_load_n((const uint64_t*)(from + i), __ATOMIC_RELAXED);
+    memcpy(to + i, &word, sizeof(word));
+  }
+  for (; i < size; i++) {
+    to[i] = __atomic_load_n(from + i, __ATOMIC_RELAXED);
+  }
+}
+
+/* As keys_lower_bound(), on the keys of an unlatched page */
+uint32_t optimistic_lower_bound(const uint32_t* keys, uint32_t num_keys,
+                                uint32_t key) {
+  uint32_t min_index = 0;
+  uint32_t max_index = num_keys;
+  while (max_index - min_index > KEY_SEARCH_WINDOW) {
+    uint32_t index = (min_index + max_index) / 2;
+    if (optimistic_load(&keys[index]) >= key) {
+      max_index = index;
+    } else {
+      min_index = index + 1;
+    }
+  }
+  uint32_t window[KEY_SEARCH_WINDOW];
+  optimistic_copy(window, keys + min_index,
+                  (max_index - min_index) * sizeof(uint32_t));
+  return min_index + keys_below(window, max_index - min_index, key);
+}
+
+NodeType optimistic_node_type(void* node) {
+  return __atomic_load_n((uint8_t*)(node + NODE_TYPE_OFFSET),
+                         __ATOMIC_RELAXED);
+}
+
+/*
+One optimistic descent to the key's leaf, copying its record out. Each
+node is read without a latch and checked against its version after its
+child's version is read, so a node that changed sends the lookup back
+to the root. Counts read from a changing node may be garbage, so they
+are bounded before use, and the record is copied out before the leaf's
+version is checked.
+*/
+LookupResult table_find_record_optimistic(Table* table, uint32_t key,
+                                          void* record) {
+  Pager* pager = table->pager;
+  uint64_t version;
+  Frame* frame = pager_frame_optimistic(pager, table->root_page_num, &version);
+  while (frame != NULL &&
+         optimistic_node_type(frame->data) == NODE_INTERNAL) {
+    void* node = frame->data;
+    uint32_t num_keys = optimistic_load(internal_node_num_keys(node));
+    if (num_keys > internal_node_max_cells) {
+      return LOOKUP_RESTART;
+    }
+    uint32_t index =
+        optimistic_lower_bound(internal_node_key(node, 0), num_keys, key);
+    uint32_t child_num =
+        optimistic_load(index == num_keys ? internal_node_right_child(node)
+                                          : internal_node_children(node) +
+                                                index);
+    uint64_t child_version;
+    Frame* child = pager_frame_optimistic(pager, child_num, &child_version);
+    if (!frame_unchanged(frame, version)) {
+      return LOOKUP_RESTART;
+    }
+    frame = child;
+    version = child_version;
+  }
+  if (frame == NULL) {
+    return LOOKUP_LATCH;
+  }
+
+  void* node = frame->data;
+  if (optimistic_node_type(node) != NODE_LEAF ||
+      optimistic_load(leaf_node_cell_content(node)) == 0) {
+    /* Not a table leaf, or a compressed one */
+    return frame_unchanged(frame, version) ? LOOKUP_LATCH : LOOKUP_RESTART;
+  }
+  uint32_t num_cells = optimistic_load(leaf_node_num_cells(node));
+  if (num_cells > leaf_node_space_for_cells / LEAF_NODE_SLOT_SIZE) {
+    return LOOKUP_RESTART;
+  }
+  uint32_t cell_num =
+      optimistic_lower_bound(leaf_node_key(node, 0), num_cells, key);
+  bool found = cell_num < num_cells &&
+               optimistic_load(leaf_node_key(node, cell_num)) == key;
+  if (found) {
+    /* As leaf_node_location(), with the num_cells already read */
+    void* location = (void*)leaf_node_key(node, num_cells) +
+                     cell_num * LEAF_NODE_LOCATION_SIZE;
+    uint32_t offset = __atomic_load_n(
+        (uint16_t*)(location + LEAF_NODE_RECORD_OFFSET_OFFSET),
+        __ATOMIC_RELAXED);
+    uint32_t size = __atomic_load_n(
+        (uint16_t*)(location + LEAF_NODE_RECORD_SIZE_OFFSET),
+        __ATOMIC_RELAXED);
+    if (size > RECORD_MAX_SIZE || offset + size > page_size) {
+      return LOOKUP_RESTART;
+    }
+    optimistic_copy(record, node + offset, size);
+  }
+  if (!frame_unchanged(frame, version)) {
+    return LOOKUP_RESTART;
+  }
+  return found ? LOOKUP_FOUND : LOOKUP_NOT_FOUND;
+}
+
+/*
+Look up one row without latching or pinning anything, so that readers
+of the same nodes never write to a shared cache line. Gives up with
+LOOKUP_LATCH when a page is not in the pool or the writer holds it,
+when the leaf is compressed or the email overflows, after too many
+restarts, and where pages are not latched at all: on the mmap backend,
+whose writes run alone, and under a snapshot. The record is copied to
+a buffer of RECORD_MAX_SIZE bytes.
+*/
+LookupResult table_find_record(Table* table, uint32_t key, void* record) {
+  if (!pager_latches(table->pager)) {
+    return LOOKUP_LATCH;
+  }
+  for (uint32_t i = 0; i < OPTIMISTIC_MAX_RESTARTS; i++) {
+    LookupResult result = table_find_record_optimistic(table, key, record);
+    if (result == LOOKUP_RESTART) {
+      continue;
+    }
+    if (result == LOOKUP_FOUND && record_overflow_offset(record) != 0) {
+      return LOOKUP_LATCH;
+    }
+    return result;
+  }
+  return LOOKUP_LATCH;
+}
+
+/* As table_find_record(), deserializing the row it finds */
+LookupResult table_find_row(Table* table, uint32_t key, Row* row) {
+  uint8_t record[RECORD_MAX_SIZE];
+  LookupResult result = table_find_record(table, key, record);
+  if (result == LOOKUP_FOUND) {
+    row->id = key;
+    deserialize_row(table->pager, record, row);
+  }
+  return result;
+}
+
+/*
+Return a cursor at the first row with an id >= key
+*/
+Cursor* table_seek(Table* table, uint32_t key) {
+  Cursor* cursor = table_find(table, key);
+  uint32_t page_num = cursor->page_num;
+
   void* node = get_page(table->pager, page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  if (cursor->cell_num >= num_cells) {
+    /* Every key in this leaf is smaller; the next leaf starts past key */
+    uint32_t next_page_num = *leaf_node_next_leaf(node);
+    if (next_page_num == 0) {
+      cursor->end_of_table = true;
+    } else {
+      cursor->page_num = next_page_num;
+      cursor->cell_num = 0;
+    }
+  }
+  unpin_page(table->pager, page_num);
+
+  return cursor;
+}
+
+Cursor* table_start(Table* table) {
+  pager_advise(table->pager, ACCESS_SEQUENTIAL);
+  return table_seek(table, 0);
+}
+
+/*
+Move a cursor latched on a leaf to the first cell at or after key in
+the leaves that follow, latching the next leaf before letting go of
+this one. Waiting for it while holding this leaf could deadlock with
+the writer, which may latch a leaf's left sibling after the leaf, so if
+the next leaf is latched the cursor lets go and seeks key from the root.
+*/
+void cursor_next_leaf_shared(Cursor* cursor, uint32_t key) {
+  Pager* pager = cursor->table->pager;
+  while (true) {
+    void* node = get_page(pager, cursor->page_num);
+    uint32_t next_page_num = *leaf_node_next_leaf(node);
+    unpin_page(pager, cursor->page_num);
+    if (next_page_num == 0) {
+      cursor->end_of_table = true;
+      return;
+    }
+
+    void* next_node = try_latch_page(pager, next_page_num);
+    unlatch_page(pager, cursor->page_num);
+    if (next_node != NULL) {
+      cursor->page_num = next_page_num;
+      cursor->cell_num = 0;
+      return;
+    }
+
+    Cursor* found = table_find_shared(cursor->table, key);
+    *cursor = *found;
+    free(found);
+    node = get_page(pager, cursor->page_num);
+    bool in_leaf = cursor->cell_num < *leaf_node_num_cells(node);
+    unpin_page(pager, cursor->page_num);
+    if (in_leaf) {
+      return;
+    }
+  }
+}
+
+/* A reader's table_seek(), returning a cursor as table_find_shared() */
+Cursor* table_seek_shared(Table* table, uint32_t key) {
+  Cursor* cursor = table_find_shared(table, key);
+  void* node = get_page(table->pager, cursor->page_num);
+  bool in_leaf = cursor->cell_num < *leaf_node_num_cells(node);
+  unpin_page(table->pager, cursor->page_num);
+  if (!in_leaf) {
+    cursor_next_leaf_shared(cursor, key);
+  }
+  return cursor;
+}
+
+Cursor* table_start_shared(Table* table) {
+  pager_advise(table->pager, ACCESS_SEQUENTIAL);
+  return table_seek_shared(table, 0);
+}
+
+/* Let go of the cursor's leaf, if it holds it, and free the cursor */
+void cursor_close(Cursor* cursor) {
+  if (cursor->latch != LATCH_NONE) {
+    unlatch_page(cursor->table->pager, cursor->page_num);
+  }
+  free(cursor);
+}
+
+/*
+The cursor does not hold a pin, so the cell's record is only valid
+until the next call into the pager.
+*/
+LeafCell cursor_cell(Cursor* cursor) {
+  Pager* pager = cursor->table->pager;
+  uint32_t page_num = cursor->page_num;
+  void* page = get_page(pager, page_num);
+  LeafCell cell = leaf_node_cell(pager, page_num, page, cursor->cell_num);
+  unpin_page(pager, page_num);
+  return cell;
+}
+
+void* cursor_value(Cursor* cursor) { return cursor_cell(cursor).record; }
+
+uint32_t cursor_key(Cursor* cursor) { return cursor_cell(cursor).key; }
+
+void cursor_advance(Cursor* cursor) {
+  uint32_t page_num = cursor->page_num;
+  void* node = get_page(cursor->table->pager, page_num);
+
+  if (cursor->latch != LATCH_NONE) {
+    cursor->cell_num += 1;
+    bool in_leaf = cursor->cell_num < *leaf_node_num_cells(node);
+    uint32_t max_key = in_leaf ? 0 : leaf_node_max_key(node);
+    unpin_page(cursor->table->pager, page_num);
+    if (in_leaf) {
+      return;
+    }
+    if (max_key == UINT32_MAX) {
+      cursor->end_of_table = true;
+    } else {
+      cursor_next_leaf_shared(cursor, max_key + 1);
+    }
+    return;
+  }
+
+  cursor->cell_num += 1;
+  if (cursor->cell_num >= (*leaf_node_num_cells(node))) {
+    /* Advance to next leaf node */
+    uint32_t next_page_num = *leaf_node_next_leaf(node);
+    if (next_page_num == 0) {
+      /* This was rightmost leaf */
+      cursor->end_of_table = true;
+    } else {
+      cursor->page_num = next_page_num;
+      cursor->cell_num = 0;
+    }
+  }
+  unpin_page(cursor->table->pager, page_num);
+}
+
+/*
+Write a run of consecutive pages to the main file with one pwritev()
+*/
+void pager_flush(Pager* pager, uint32_t first_page_num, void** pages,
+                 uint32_t count) {
+  struct iovec iov[PAGER_MAX_FLUSH_RUN];
+  for (uint32_t i = 0; i < count; i++) {
+    iov[i].iov_base = pages[i];
+    iov[i].iov_len = page_size;
+  }
+
+  ssize_t bytes_written = pwritev(pager->file_descriptor, iov, count,
+                                  (off_t)first_page_num * page_size);
+  if (bytes_written != (ssize_t)count * page_size) {
+    printf("Error writing: %d\n", errno);
+    db_fail();
+  }
+  if (pager->backend == PAGER_MMAP &&
+      first_page_num + count <= pager->mapped_pages) {
+    /*
+    Drop the private copies; the next access maps the page cache pages
+    that were just written instead of keeping a second copy around.
+    */
+    madvise(pager->map + (size_t)first_page_num * page_size,
+            (size_t)count * page_size, MADV_DONTNEED);
+  }
+  pager->stats.flush_writes++;
+  pager->stats.pages_flushed += count;
+}
+
+/* A stretch of a compressed main file, in PAGE_EXTENT_UNITs */
+typedef struct {
+  uint32_t start;
+  uint32_t end;
+} UnitRange;
+
+typedef struct {
+  UnitRange* gaps;  // Unused stretches, in file order
+  uint32_t num_gaps;
+  uint32_t end;  // Extents past the last gap are appended here
+} FileSpace;
+
+uint32_t page_extent_units(uint32_t size) {
+  return (size + PAGE_EXTENT_UNIT - 1) / PAGE_EXTENT_UNIT;
+}
+
+int compare_unit_ranges(const void* a, const void* b) {
+  uint32_t left = ((const UnitRange*)a)->start;
+  uint32_t right = ((const UnitRange*)b)->start;
+  return (left > right) - (left < right);
+}
+
+/*
+Find the space not used by the header page, the page map or any page
+the map points to
+*/
+void file_space_init(FileSpace* space, Pager* pager) {
+  UnitRange* live = malloc(sizeof(UnitRange) * (pager->page_map_pages + 2));
+  uint32_t num_live = 0;
+  live[num_live].start = 0;
+  live[num_live++].end = page_extent_units(page_size);
+  for (uint32_t i = 0; i <= pager->page_map_pages; i++) {
+    PageExtent* extent = i < pager->page_map_pages ? &pager->page_map[i]
+                                                   : &pager->page_map_extent;
+    if (extent->size > 0) {
+      live[num_live].start = extent->offset;
+      live[num_live++].end = extent->offset + page_extent_units(extent->size);
+    }
+  }
+  qsort(live, num_live, sizeof(UnitRange), compare_unit_ranges);
+
+  space->gaps = malloc(sizeof(UnitRange) * num_live);
+  space->num_gaps = 0;
+  space->end = 0;
+  for (uint32_t i = 0; i < num_live; i++) {
+    if (live[i].start > space->end) {
+      space->gaps[space->num_gaps].start = space->end;
+      space->gaps[space->num_gaps++].end = live[i].start;
+    }
+    if (live[i].end > space->end) {
+      space->end = live[i].end;
+    }
+  }
+  free(live);
+}
+
+/* First fit, else the end of the file */
+uint32_t file_space_allocate(FileSpace* space, uint32_t size) {
+  uint32_t units = page_extent_units(size);
+  for (uint32_t i = 0; i < space->num_gaps; i++) {
+    UnitRange* gap = &space->gaps[i];
+    if (gap->end - gap->start >= units) {
+      gap->start += units;
+      return gap->start - units;
+    }
+  }
+  space->end += units;
+  return space->end - units;
+}
+
+void pager_write_extent(Pager* pager, void* data, PageExtent extent) {
+  if (pwrite(pager->file_descriptor, data, extent.size,
+             (off_t)extent.offset * PAGE_EXTENT_UNIT) != extent.size) {
+    printf("Error writing: %d\n", errno);
+    db_fail();
+  }
+  pager->stats.flush_writes++;
+}
+
+/*
+The checkpoint of a compressed database. Nothing the file header points
+to is overwritten: pages from the WAL get new extents in the gaps or at
+the end of the file, followed by a new page map, and once those are
+durable the header is switched over to the new map. A crash before then
+leaves the old map and its pages intact for the WAL to be replayed on.
+*/
+void pager_checkpoint_compressed(Pager* pager) {
+  Wal* wal = pager->wal;
+  uint32_t num_pages = pager->num_pages;
+  PageExtent* page_map = calloc(num_pages, sizeof(PageExtent));
+  memcpy(page_map, pager->page_map,
+         sizeof(PageExtent) * (pager->page_map_pages < num_pages
+                                   ? pager->page_map_pages
+                                   : num_pages));
+  FileSpace space;
+  file_space_init(&space, pager);
+  void* scratch = malloc(page_size);
+  void* header = malloc(page_size);
+  pager_read_page(pager, FILE_HEADER_PAGE_NUM, header);
+
+  for (uint32_t page_num = 0; page_num < wal->frame_of_page_capacity &&
+                              page_num < num_pages;
+       page_num++) {
+    uint32_t frame_num = wal->frame_of_page[page_num];
+    if (frame_num == 0) {
+      continue;
+    }
+    uint32_t frame_index = page_num < pager->page_table_capacity
+                               ? pager->page_table[page_num]
+                               : INVALID_PAGE_NUM;
+    void* page = scratch;
+    if (frame_index != INVALID_PAGE_NUM &&
+        !pager->frames[frame_index].dirty) {
+      page = pager->frames[frame_index].data;
+    } else {
+      wal_read_frame(wal, frame_num, scratch);
+    }
+    if (page_num == FILE_HEADER_PAGE_NUM) {
+      memcpy(header, page, page_size);
+      continue;
+    }
+
+    PageExtent* extent = &page_map[page_num];
+    void* stored = pager->compressed_page;
+    extent->size = lz4_compress(page, page_size, stored, page_size - 1);
+    if (extent->size == 0) {
+      stored = page;
+      extent->size = page_size;
+    }
+    extent->offset = file_space_allocate(&space, extent->size);
+    pager_write_extent(pager, stored, *extent);
+    pager->stats.pages_flushed++;
+  }
+
+  PageExtent map_extent;
+  map_extent.size = sizeof(PageExtent) * num_pages;
+  map_extent.offset = file_space_allocate(&space, map_extent.size);
+  pager_write_extent(pager, page_map, map_extent);
+  if (fdatasync(pager->file_descriptor) == -1) {
+    printf("Error syncing db file: %d\n", errno);
+    db_fail();
+  }
+
+  *header_page_map(header) = map_extent.offset;
+  *header_page_count(header) = num_pages;
+  if (pwrite(pager->file_descriptor, header, page_size, 0) != page_size ||
+      fdatasync(pager->file_descriptor) == -1) {
+    printf("Error writing: %d\n", errno);
+    db_fail();
+  }
+  pager->stats.flush_writes++;
+  pager->stats.pages_flushed++;
+
+  free(pager->page_map);
+  pager->page_map = page_map;
+  pager->page_map_pages = num_pages;
+  pager->page_map_extent = map_extent;
+
+  /* Space freed by this checkpoint can go once the header is durable */
+  free(space.gaps);
+  file_space_init(&space, pager);
+  if (ftruncate(pager->file_descriptor,
+                (off_t)space.end * PAGE_EXTENT_UNIT) == -1) {
+    printf("Error truncating db file: %d\n", errno);
+    db_fail();
+  }
+  free(space.gaps);
+  free(header);
+  free(scratch);
+}
+
+/*
+The checkpoint of an uncompressed database. Pages are written to their
+own slots in page order, coalesced into contiguous runs.
+*/
+void pager_checkpoint_pages(Pager* pager) {
+  Wal* wal = pager->wal;
+  void* scratch = malloc((size_t)page_size * PAGER_MAX_FLUSH_RUN);
+  void* run[PAGER_MAX_FLUSH_RUN];
+  uint32_t run_start = 0;
+  uint32_t run_length = 0;
+
+  /* Frames for pages past the end of the database were truncated away */
+  for (uint32_t page_num = 0; page_num < wal->frame_of_page_capacity &&
+                              page_num < pager->num_pages;
+       page_num++) {
+    uint32_t frame_num = wal->frame_of_page[page_num];
+    if (frame_num == 0) {
+      continue;
+    }
+    if (run_length > 0 && (page_num != run_start + run_length ||
+                           run_length == PAGER_MAX_FLUSH_RUN)) {
+      pager_flush(pager, run_start, run, run_length);
+      run_length = 0;
+    }
+    if (run_length == 0) {
+      run_start = page_num;
+    }
+
+    /* A clean resident frame already holds the latest committed image */
+    uint32_t frame_index = page_num < pager->page_table_capacity
+                               ? pager->page_table[page_num]
+                               : INVALID_PAGE_NUM;
+    if (pager->backend == PAGER_MMAP && page_num < pager->mapped_pages) {
+      run[run_length] = pager->map + (size_t)page_num * page_size;
+    } else if (frame_index != INVALID_PAGE_NUM &&
+               !pager->frames[frame_index].dirty) {
+      run[run_length] = pager->frames[frame_index].data;
+    } else {
+      run[run_length] = scratch + (size_t)run_length * page_size;
+      wal_read_frame(wal, frame_num, run[run_length]);
+    }
+    run_length++;
+  }
+  if (run_length > 0) {
+    pager_flush(pager, run_start, run, run_length);
+  }
+  free(scratch);
+
+  off_t db_length = (off_t)pager->num_pages * page_size;
+  if (lseek(pager->file_descriptor, 0, SEEK_END) > db_length &&
+      ftruncate(pager->file_descriptor, db_length) == -1) {
+    printf("Error truncating db file: %d\n", errno);
+    db_fail();
+  }
+}
+
+/*
+Fold the WAL back into the main file and start a new log. Only call
+this right after a commit, so that every frame in the log is committed.
+*/
+void pager_checkpoint(Pager* pager) {
+  Wal* wal = pager->wal;
+  pthread_mutex_lock(&pager->mutex);
+  if (wal->num_frames == 0) {
+    pthread_mutex_unlock(&pager->mutex);
+    return;
+  }
+
+  // The log must be durable before the main file is overwritten
+  wal_sync(wal);
+
+  if (pager->compressed) {
+    pager_checkpoint_compressed(pager);
+  } else {
+    pager_checkpoint_pages(pager);
+  }
+
+  if (fdatasync(pager->file_descriptor) == -1) {
+    printf("Error syncing db file: %d\n", errno);
+    db_fail();
+  }
+  wal->checkpoints++;
+  wal_reset(wal);
+  pthread_mutex_unlock(&pager->mutex);
+}
+
+/*
+Make the statement's changes durable: append every dirty frame to the
+WAL, ending with a commit frame. The fsync is shared by up to
+group_commit commits.
+*/
+void pager_commit(Pager* pager) {
+  Wal* wal = pager->wal;
+  pthread_mutex_lock(&pager->mutex);
+  uint32_t max_dirty = pager->backend == PAGER_MMAP ? pager->num_map_dirty
+                                                   : pager->num_frames;
+  uint32_t* page_nums = malloc(sizeof(uint32_t) * (max_dirty + 1));
+  void** pages = malloc(sizeof(void*) * (max_dirty + 1));
+  void* empty_page = NULL;
+  uint32_t count = 0;
+
+  if (pager->backend == PAGER_MMAP) {
+    for (uint32_t i = 0; i < pager->num_map_dirty; i++) {
+      uint32_t page_num = pager->map_dirty_list[i];
+      page_nums[count] = page_num;
+      pages[count++] = pager->map + (size_t)page_num * page_size;
+      pager->map_dirty[page_num] = 0;
+    }
+    pager->num_map_dirty = 0;
+  }
+
+  for (uint32_t i = 0; i < pager->num_frames; i++) {
+    Frame* frame = &pager->frames[i];
+    if (frame->page_num != INVALID_PAGE_NUM && frame->dirty) {
+      page_nums[count] = frame->page_num;
+      pages[count++] = frame->data;
+      frame->dirty = false;
+    }
+  }
+
+  if (count == 0 && wal->uncommitted_frames > 0) {
+    /* Every change was already spilled; write a bare commit frame */
+    empty_page = calloc(1, page_size);
+    page_nums[count] = INVALID_PAGE_NUM;
+    pages[count++] = empty_page;
+  }
+
+  if (count > 0) {
+    wal_write_frames(wal, page_nums, pages, count, pager->num_pages);
+    wal->commits++;
+    wal->pending_commits++;
+    if (wal->pending_commits >= wal->group_commit) {
+      wal_sync(wal);
+    }
+  }
+  free(empty_page);
+  free(pages);
+  free(page_nums);
+
+  /*
+  A snapshot may still need the versions the WAL holds, so they are
+  folded away at the first commit after the last snapshot ends
+  */
+  if (wal->num_frames >= WAL_AUTOCHECKPOINT_FRAMES &&
+      pager->num_snapshots == 0) {
+    pager_checkpoint(pager);
+  }
+  pthread_mutex_unlock(&pager->mutex);
+}
+
+/*
+Writes to ordinary databases on the buffer pool latch pages; writes
+on the mmap backend, which has no frames to latch, run alone. Readers
+there never meet a writer, so they need no snapshot.
+*/
+TreeAccess pager_tree_access(Pager* pager, TreeAccess access) {
+  if (pager->backend == PAGER_MMAP) {
+    if (access == TREE_INSERT || access == TREE_WRITE) {
+      return TREE_EXCLUSIVE;
+    }
+    if (access == TREE_SNAPSHOT) {
+      return TREE_READ;
+    }
+  }
+  return access;
+}
+
+/*
+Start a statement that shares the pager's trees with other threads as
+access says. Readers hold tree_latch shared and latch each page they
+read, so they run alongside each other and alongside the writer.
+Readers of a snapshot read copies of the pages as of the last commit
+instead (see snapshot_begin()), so a long scan neither waits for the
+writer nor sees half of a write. The writer holds writer_mutex. If no
+reader is in the tree it takes tree_latch exclusively and latches
+nothing, as a statement run alone would. Otherwise it holds tree_latch
+shared, latches the path it descends (see table_find()) and every page
+it marks dirty, and keeps them until pager_exit(). Statements that move
+many rows always hold tree_latch exclusively.
+*/
+void pager_enter(Pager* pager, TreeAccess access) {
+  switch (pager_tree_access(pager, access)) {
+    case TREE_READ:
+      pthread_rwlock_rdlock(&pager->tree_latch);
+      break;
+    case TREE_SNAPSHOT:
+      pthread_rwlock_rdlock(&pager->tree_latch);
+      snapshot_begin(pager);
+      break;
+    case TREE_INSERT:
+    case TREE_WRITE:
+      pthread_mutex_lock(&pager->writer_mutex);
+      if (pthread_rwlock_trywrlock(&pager->tree_latch) != 0) {
+        pthread_rwlock_rdlock(&pager->tree_latch);
+        pager->writer_access = access;
+      }
+      break;
+    case TREE_EXCLUSIVE:
+      pthread_rwlock_wrlock(&pager->tree_latch);
+      break;
+  }
+}
+
+void pager_exit(Pager* pager, TreeAccess access) {
+  access = pager_tree_access(pager, access);
+  if (access == TREE_INSERT || access == TREE_WRITE) {
+    pager->writer_access = TREE_EXCLUSIVE;
+    for (uint32_t i = 0; i < pager->num_writer_pages; i++) {
+      unlatch_page(pager, pager->writer_pages[i]);
+    }
+    pager->num_writer_pages = 0;
+  } else if (access == TREE_SNAPSHOT) {
+    snapshot_end(pager);
+  }
+  pthread_rwlock_unlock(&pager->tree_latch);
+  if (access == TREE_INSERT || access == TREE_WRITE) {
+    pthread_mutex_unlock(&pager->writer_mutex);
+  }
+}
+
+/*
+An existing database records its page size in the file header. A new
+one may so far only exist in the WAL, whose header records it too.
+Otherwise the requested size is used.
+*/
+uint32_t pager_page_size(int fd, off_t file_length, Wal* wal,
+                         uint32_t requested) {
+  if (file_length > 0) {
+    char header[FILE_HEADER_PAGE_SIZE_OFFSET + sizeof(uint32_t)];
+    ssize_t bytes_read = pread(fd, header, sizeof(header), 0);
+    if (bytes_read < 0) {
+      printf("Error reading file: %d\n", errno);
+      db_fail();
+    }
+    if ((size_t)bytes_read != sizeof(header) ||
+        strncmp(header + FILE_HEADER_MAGIC_OFFSET, FILE_HEADER_MAGIC,
+                FILE_HEADER_MAGIC_SIZE) != 0 ||
+        !is_valid_page_size(*header_page_size(header))) {
+      printf("File is not a database.\n");
+      db_fail();
+    }
+    return *header_page_size(header);
+  }
+
+  uint32_t wal_header[WAL_HEADER_SIZE / sizeof(uint32_t)];
+  if (pread(wal->file_descriptor, wal_header, WAL_HEADER_SIZE, 0) ==
+          WAL_HEADER_SIZE &&
+      wal_header[0] == WAL_MAGIC && is_valid_page_size(wal_header[2])) {
+    return wal_header[2];
+  }
+  return requested;
+}
+
+/*
+Read how the main file is laid out. Whether pages are compressed is
+recorded in the file header, or for a new database in the header page
+in the WAL; failing both, it is up to the caller.
+*/
+void pager_open_layout(Pager* pager, off_t file_length, bool compress) {
+  void* header = malloc(page_size);
+  uint32_t header_frame_num = wal_find_frame(pager->wal, FILE_HEADER_PAGE_NUM);
+  pager->compressed = false;  // Page 0 is stored as is either way
+  if (file_length > 0) {
+    pager_read_page(pager, FILE_HEADER_PAGE_NUM, header);
+  } else if (header_frame_num != 0) {
+    wal_read_frame(pager->wal, header_frame_num, header);
+  } else {
+    memset(header, 0, page_size);
+    *header_page_compression(header) = compress ? PAGE_COMPRESSION_LZ4 : 0;
+  }
+  pager->compressed = *header_page_compression(header) != 0;
+  pager->page_map = NULL;
+  pager->page_map_pages = 0;
+  pager->page_map_extent.offset = 0;
+  pager->page_map_extent.size = 0;
+  pager->compressed_page = NULL;
+
+  if (!pager->compressed) {
+    pager->num_pages = file_length / page_size;
+    if (file_length % page_size != 0) {
+      printf("Db file is not a whole number of pages. Corrupt file.\n");
+      db_fail();
+    }
+    free(header);
+    return;
+  }
+
+  if (*header_page_compression(header) != PAGE_COMPRESSION_LZ4) {
+    printf("Unknown page compression %d.\n", *header_page_compression(header));
+    db_fail();
+  }
+  if (pager->backend == PAGER_MMAP) {
+    printf("Compressed pages need the buffer pool backend.\n");
+    db_fail();
+  }
+  pager->compressed_page = malloc(page_size);
+  pager->num_pages = 0;
+  if (file_length > 0) {
+    pager->num_pages = *header_page_count(header);
+    pager->page_map_pages = pager->num_pages;
+    pager->page_map_extent.offset = *header_page_map(header);
+    pager->page_map_extent.size = sizeof(PageExtent) * pager->num_pages;
+    pager->page_map = malloc(pager->page_map_extent.size);
+    if (pread(pager->file_descriptor, pager->page_map,
+              pager->page_map_extent.size,
+              (off_t)pager->page_map_extent.offset * PAGE_EXTENT_UNIT) !=
+        pager->page_map_extent.size) {
+      printf("Error reading page map: %d\n", errno);
+      db_fail();
+    }
+  }
+  free(header);
+}
+
+Pager* pager_open(const char* filename, DbOptions* options) {
+  int fd = open(filename,
+                O_RDWR |      // Read/Write mode
+                    O_CREAT,  // Create file if it does not exist
+                S_IWUSR |     // User write permission
+                    S_IRUSR   // User read permission
+                );
+
+  if (fd == -1) {
+    printf("Unable to open file\n");
+    db_fail();
+  }
+
+  off_t file_length = lseek(fd, 0, SEEK_END);
+  Wal* wal = wal_open(filename, options->group_commit);
+  set_page_size(pager_page_size(fd, file_length, wal, options->page_size));
+
+  Pager* pager = malloc(sizeof(Pager));
+  pager->file_descriptor = fd;
+  pager->file_length = file_length;
+
+  pager->backend = options->backend;
+  pager->access_pattern = ACCESS_NORMAL;
+  pager->map = NULL;
+  pager->mapped_pages = 0;
+  pager->map_dirty = NULL;
+  pager->map_dirty_list = NULL;
+  pager->num_map_dirty = 0;
+
+  /* The mmap backend has no frames; the kernel page cache is the pool */
+  uint32_t num_frames =
+      options->backend == PAGER_MMAP ? 0 : options->pool_frames;
+  pager->num_frames = num_frames;
+  pager->frames = malloc(sizeof(Frame) * num_frames);
+  void* pool = num_frames > 0 ? malloc((size_t)page_size * num_frames) : NULL;
+  /* Readers keep the root latched nearly all the time; let the writer in */
+  pthread_rwlockattr_t prefer_writer;
+  pthread_rwlockattr_init(&prefer_writer);
+  pthread_rwlockattr_setkind_np(&prefer_writer,
+                                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  for (uint32_t i = 0; i < num_frames; i++) {
+    pager->frames[i].page_num = INVALID_PAGE_NUM;
+    pager->frames[i].pin_count = 0;
+    pager->frames[i].dirty = false;
+    pager->frames[i].referenced = false;
+    pager->frames[i].data = pool + (size_t)i * page_size;
+    pthread_rwlock_init(&pager->frames[i].latch, &prefer_writer);
+    pager->frames[i].version = 0;
+  }
+  pthread_rwlockattr_destroy(&prefer_writer);
+  pager->clock_hand = 0;
+
+  pager->page_table_capacity = num_frames;
+  pager->page_table = malloc(sizeof(uint32_t) * num_frames);
+  pager->retired_page_tables = NULL;
+  pager->num_retired_page_tables = 0;
+  for (uint32_t i = 0; i < num_frames; i++) {
+    pager->page_table[i] = INVALID_PAGE_NUM;
+  }
+  memset(&pager->stats, 0, sizeof(PagerStats));
+  pager->hash_index = options->hash_index;
+  pager->free_counts = NULL;
+  pager->free_counts_capacity = 0;
+
+  /* Both mutexes are taken again by code already holding them */
+  pthread_mutexattr_t recursive;
+  pthread_mutexattr_init(&recursive);
+  pthread_mutexattr_settype(&recursive, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&pager->mutex, &recursive);
+  pthread_mutex_init(&pager->writer_mutex, &recursive);
+  pthread_mutexattr_destroy(&recursive);
+  pthread_rwlock_init(&pager->tree_latch, NULL);
+  pager->writer_access = TREE_EXCLUSIVE;
+  pager->writer_pages = NULL;
+  pager->num_writer_pages = 0;
+  pager->num_snapshots = 0;
+  pager->writer_pages_capacity = 0;
+  /* A decoded leaf may be of a closed pager that had this address */
+  __atomic_add_fetch(&leaf_version, 1, __ATOMIC_RELEASE);
+
+  pager->wal = wal;
+  /* The last commit records the size of the database, which may shrink */
+  uint32_t wal_db_size = wal_recover(pager->wal);
+  pager_open_layout(pager, file_length, options->compress_pages);
+  if (wal_db_size != 0) {
+    pager->num_pages = wal_db_size;
+  }
+
+  return pager;
+}
+
+Table* table_open(Pager* pager, uint32_t table_id, const char* name,
+                  uint32_t root_page_num, Table* catalog) {
+  Table* table = malloc(sizeof(Table));
+  table->pager = pager;
+  table->root_page_num = root_page_num;
+  table->table_id = table_id;
+  strcpy(table->name, name);
+  table->catalog = catalog;
+  table->indexes = NULL;
+  table->num_indexes = 0;
+  table->indexed_column = COLUMN_ID;
+  table->leaf_hash = NULL;
+  return table;
+}
+
+void table_free(Table* table) {
+  for (uint32_t i = 0; i < table->num_indexes; i++) {
+    table_free(table->indexes[i]);
+  }
+  free(table->indexes);
+  if (table->leaf_hash != NULL) {
+    free(table->leaf_hash->entries);
+    free(table->leaf_hash);
+  }
+  free(table);
+}
+
+void db_add_table(Database* db, Table* table) {
+  db->tables = realloc(db->tables, sizeof(Table*) * (db->num_tables + 1));
+  db->tables[db->num_tables++] = table;
+}
+
+void table_add_index(Table* table, Table* index) {
+  table->indexes =
+      realloc(table->indexes, sizeof(Table*) * (table->num_indexes + 1));
+  table->indexes[table->num_indexes++] = index;
+}
+
+bool column_from_name(const char* name, Column* column) {
+  if (strcmp(name, "id") == 0) {
+    *column = COLUMN_ID;
+  } else if (strcmp(name, "username") == 0) {
+    *column = COLUMN_USERNAME;
+  } else if (strcmp(name, "email") == 0) {
+    *column = COLUMN_EMAIL;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char* column_name(Column column) {
+  switch (column) {
+    case (COLUMN_USERNAME):
+      return "username";
+    case (COLUMN_EMAIL):
+      return "email";
+    case (COLUMN_ID):
+      break;
+  }
+  return "id";
+}
+
+Table* db_find_table(Database* db, const char* name) {
+  for (uint32_t i = 0; i < db->num_tables; i++) {
+    if (strcmp(db->tables[i]->name, name) == 0) {
+      return db->tables[i];
+    }
+  }
+  return NULL;
+}
+
+/*
+Open every table and index the catalog lists. An index's row comes
+after its table's, which was created first.
+*/
+void db_load_catalog(Database* db) {
+  Row row;
+  row.email = NULL;
+  Cursor* cursor = table_start(db->catalog);
+  while (!cursor->end_of_table) {
+    LeafCell cell = cursor_cell(cursor);
+    deserialize_row(db->pager, cell.record, &row);
+    uint32_t root_page_num = strtoul(row.email, NULL, 10);
+    Table* table = table_open(db->pager, cell.key, row.username,
+                              root_page_num, db->catalog);
+    char* schema = row.email + CATALOG_ROOT_DIGITS + 1;
+    if (strncmp(schema, INDEX_SCHEMA_PREFIX,
+                strlen(INDEX_SCHEMA_PREFIX)) == 0) {
+      column_from_name(schema + strlen(INDEX_SCHEMA_PREFIX),
+                       &table->indexed_column);
+      table_add_index(db_find_table(db, row.username), table);
+    } else {
+      db_add_table(db, table);
+    }
+    db->next_table_id = cell.key + 1;
+    cursor_advance(cursor);
+  }
+  free(cursor);
+  free(row.email);
+}
+
+Database* db_open(const char* filename, DbOptions* options) {
+  Pager* pager = pager_open(filename, options);
+
+  // Fold anything recovered from the WAL back into the main file
+  pager_checkpoint(pager);
+  if (pager->backend == PAGER_MMAP) {
+    pager_map_file(pager);
+  }
+
+  if (pager->num_pages == 0) {
+    /*
+    New database file. Page 0 holds the file header and page 1 starts
+    out as the root leaf node.
+    */
+    void* header = get_page(pager, FILE_HEADER_PAGE_NUM);
+    memset(header, 0, page_size);
+    strcpy(header + FILE_HEADER_MAGIC_OFFSET, FILE_HEADER_MAGIC);
+    *header_page_size(header) = page_size;
+    *header_page_compression(header) =
+        pager->compressed ? PAGE_COMPRESSION_LZ4 : 0;
+    *header_root_page(header) = 1;
+    pager_mark_dirty(pager, FILE_HEADER_PAGE_NUM);
+    unpin_page(pager, FILE_HEADER_PAGE_NUM);
+
+    void* root_node = get_page(pager, 1);
+    initialize_leaf_node(root_node);
+    set_node_root(root_node, true);
+    pager_mark_dirty(pager, 1);
+    unpin_page(pager, 1);
+    pager_commit(pager);
+  }
+
+  void* header = get_page(pager, FILE_HEADER_PAGE_NUM);
+  if (strncmp(header + FILE_HEADER_MAGIC_OFFSET, FILE_HEADER_MAGIC,
+              FILE_HEADER_MAGIC_SIZE) != 0) {
+    printf("File is not a database.\n");
+    db_fail();
+  }
+  if (*header_page_size(header) != page_size) {
+    printf("Database page size %d does not match %d.\n",
+           *header_page_size(header), page_size);
+    db_fail();
+  }
+  uint32_t root_page_num = *header_root_page(header);
+  uint32_t catalog_root_page_num = *header_catalog_root(header);
+  unpin_page(pager, FILE_HEADER_PAGE_NUM);
+
+  Database* db = malloc(sizeof(Database));
+  db->pager = pager;
+  db->catalog = NULL;
+  db->tables = NULL;
+  db->num_tables = 0;
+  db->next_table_id = MAIN_TABLE_ID + 1;
+  db->filename = strdup(filename);
+  db->options = *options;
+  db_add_table(db, table_open(pager, MAIN_TABLE_ID, MAIN_TABLE_NAME,
+                              root_page_num, NULL));
+  if (catalog_root_page_num != 0) {
+    db->catalog = table_open(pager, CATALOG_TABLE_ID, "", catalog_root_page_num,
+                             NULL);
+    db_load_catalog(db);
+  }
+  return db;
+}
+
+InputBuffer* new_input_buffer() {
+  InputBuffer* input_buffer = malloc(sizeof(InputBuffer));
+  input_buffer->buffer = NULL;
+  input_buffer->buffer_length = 0;
+  input_buffer->input_length = 0;
+
+  return input_buffer;
+}
+
+void print_prompt() { printf("db > "); }
+
+void read_input(InputBuffer* input_buffer) {
+  ssize_t bytes_read =
+      getline(&(input_buffer->buffer), &(input_buffer->buffer_length), stdin);
+
+  if (bytes_read <= 0) {
+    printf("Error reading input\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Ignore trailing newline
+  input_buffer->input_length = bytes_read - 1;
+  input_buffer->buffer[bytes_read - 1] = 0;
+}
+
+void close_input_buffer(InputBuffer* input_buffer) {
+  free(input_buffer->buffer);
+  free(input_buffer);
+}
+
+/*
+Free what a database holds and close its log, writing nothing. Its file
+must be closed already; db itself is left for the caller.
+*/
+void db_release(Database* db) {
+  Pager* pager = db->pager;
+  wal_close(pager->wal);
+  if (pager->map != NULL) {
+    munmap(pager->map, MMAP_RESERVE_BYTES);
+  }
+  if (pager->num_frames > 0) {
+    free(pager->frames[0].data);
+  }
+  for (uint32_t i = 0; i < pager->num_frames; i++) {
+    pthread_rwlock_destroy(&pager->frames[i].latch);
+  }
+  pthread_mutex_destroy(&pager->mutex);
+  pthread_mutex_destroy(&pager->writer_mutex);
+  pthread_rwlock_destroy(&pager->tree_latch);
+  free(pager->writer_pages);
+  decoded_leaf_free();
+  free(pager->frames);
+  free(pager->page_table);
+  for (uint32_t i = 0; i < pager->num_retired_page_tables; i++) {
+    free(pager->retired_page_tables[i]);
+  }
+  free(pager->retired_page_tables);
+  free(pager->map_dirty);
+  free(pager->free_counts);
+  free(pager->map_dirty_list);
+  free(pager->page_map);
+  free(pager->compressed_page);
+  free(pager);
+  for (uint32_t i = 0; i < db->num_tables; i++) {
+    table_free(db->tables[i]);
+  }
+  free(db->tables);
+  if (db->catalog != NULL) {
+    table_free(db->catalog);
+  }
+  free(db->filename);
+}
+
+void db_close(Database* db) {
+  Pager* pager = db->pager;
+
+  pager_commit(pager);
+  pager_checkpoint(pager);
+  unlink(pager->wal->filename);  // Empty once checkpointed
+
+  int result = close(pager->file_descriptor);
+  if (result == -1) {
+    printf("Error closing db file.\n");
+    exit(EXIT_FAILURE);
+  }
+  db_release(db);
+  free(db);
+}
+
+/*
+Drop a database an error left in an unknown state, writing nothing, and
+open it again from its file in place. What was committed is kept and
+the rest is lost, as if the process had stopped.
+*/
+void db_reopen(Database* db) {
+  char* filename = strdup(db->filename);
+  DbOptions options = db->options;
+  close(db->pager->file_descriptor);
+  db_release(db);
+  Database* reopened = db_open(filename, &options);
+  *db = *reopened;
+  free(reopened);
+  free(filename);
+}
+
+void print_stats(Pager* pager) {
+  uint32_t pinned = 0;
+  uint32_t dirty = 0;
+  for (uint32_t i = 0; i < pager->num_frames; i++) {
+    pinned += (pager->frames[i].pin_count > 0);
+    dirty += (pager->frames[i].page_num != INVALID_PAGE_NUM &&
+              pager->frames[i].dirty);
+  }
+
+  void* header = get_page(pager, FILE_HEADER_PAGE_NUM);
+  uint32_t free_pages = *header_free_pages(header);
+  unpin_page(pager, FILE_HEADER_PAGE_NUM);
+
+  if (pager->backend == PAGER_MMAP) {
+    printf("backend: mmap\n");
+    printf("mapped_pages: %d\n", pager->mapped_pages);
+  } else {
+    printf("backend: buffer pool\n");
+  }
+  printf("page_size: %d\n", page_size);
+  if (pager->compressed) {
+    printf("page_compression: lz4\n");
+    printf("file_bytes: %ld\n",
+           (long)lseek(pager->file_descriptor, 0, SEEK_END));
+  }
+  printf("pages: %d\n", pager->num_pages);
+  printf("free_pages: %d\n", free_pages);
+  printf("pool_frames: %d\n", pager->num_frames);
+  printf("pinned_frames: %d\n", pinned);
+  printf("dirty_frames: %d\n", dirty);
+  printf("hits: %lu\n", (unsigned long)pager->stats.hits);
+  printf("misses: %lu\n", (unsigned long)pager->stats.misses);
+  printf("evictions: %lu\n", (unsigned long)pager->stats.evictions);
+  printf("write_backs: %lu\n", (unsigned long)pager->stats.write_backs);
+  printf("pages_flushed: %lu\n", (unsigned long)pager->stats.pages_flushed);
+  printf("flush_writes: %lu\n", (unsigned long)pager->stats.flush_writes);
+  printf("wal_frames: %d\n", pager->wal->num_frames);
+  printf("commits: %lu\n", (unsigned long)pager->wal->commits);
+  printf("syncs: %lu\n", (unsigned long)pager->wal->syncs);
+  printf("checkpoints: %lu\n", (unsigned long)pager->wal->checkpoints);
+}
+
+void db_vacuum(Database* db);
+void table_import(Table* table, const char* filename, uint32_t fill_factor);
+void table_compress(Table* table);
+
+/*
+The table named by the meta command's argument, the main table if it
+has none. Prints an error and returns NULL if there is no such table.
+*/
+Table* meta_command_table(Database* db, char* name) {
+  if (name == NULL) {
+    return db->tables[0];
+  }
+  Table* table = db_find_table(db, name);
+  if (table == NULL) {
+    printf("Error: No such table '%s'.\n", name);
+  }
+  return table;
+}
+
+/*
+Whether the input is the meta command, alone or followed by a space
+and an argument. *argument is set to the argument, or NULL.
+*/
+bool is_meta_command(char* input, const char* command, char** argument) {
+  size_t length = strlen(command);
+  if (strncmp(input, command, length) != 0 ||
+      (input[length] != '\0' && input[length] != ' ')) {
+    return false;
+  }
+  *argument = input[length] == ' ' ? input + length + 1 : NULL;
+  return true;
+}
+
+MetaCommandResult run_meta_command(InputBuffer* input_buffer, Database* db) {
+  Pager* pager = db->pager;
+  char* argument;
+  if (is_meta_command(input_buffer->buffer, ".btree", &argument)) {
+    Table* table = meta_command_table(db, argument);
+    if (table != NULL) {
+      printf("Tree:\n");
+      print_tree(pager, table->root_page_num, 0);
+    }
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".tables") == 0) {
+    for (uint32_t i = 0; i < db->num_tables; i++) {
+      printf("%s\n", db->tables[i]->name);
+    }
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".stats") == 0) {
+    printf("Stats:\n");
+    print_stats(pager);
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".checkpoint") == 0) {
+    pager_commit(pager);
+    pager_checkpoint(pager);
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".vacuum") == 0) {
+    db_vacuum(db);
+    pager_commit(pager);
+    pager_checkpoint(pager);
+    return META_COMMAND_SUCCESS;
+  } else if (is_meta_command(input_buffer->buffer, ".compress", &argument)) {
+    Table* table = meta_command_table(db, argument);
+    if (table != NULL) {
+      table_compress(table);
+    }
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".import ", 8) == 0) {
+    strtok(input_buffer->buffer, " ");  // The command
+    char* filename = strtok(NULL, " ");
+    char* fill_factor_string = strtok(NULL, " ");
+    char* table_name = strtok(NULL, " ");
+    if (fill_factor_string != NULL && !isdigit(fill_factor_string[0])) {
+      table_name = fill_factor_string;
+      fill_factor_string = NULL;
+    }
+    int fill_factor = fill_factor_string ? atoi(fill_factor_string) : 100;
+    if (filename == NULL || fill_factor < 50 || fill_factor > 100) {
+      printf("Usage: .import <file> [fill factor, 50-100] [table]\n");
+      return META_COMMAND_SUCCESS;
+    }
+    Table* table = meta_command_table(db, table_name);
+    if (table != NULL) {
+      table_import(table, filename, fill_factor);
+    }
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".constants") == 0) {
+    printf("Constants:\n");
+    print_constants();
+    return META_COMMAND_SUCCESS;
+  } else {
+    return META_COMMAND_UNRECOGNIZED_COMMAND;
+  }
+}
+
+/* Meta commands run alone, without latching pages */
+MetaCommandResult do_meta_command(InputBuffer* input_buffer, Database* db) {
+  if (strcmp(input_buffer->buffer, ".exit") == 0) {
+    close_input_buffer(input_buffer);
+    db_close(db);
+    exit(EXIT_SUCCESS);
+  }
+  pager_enter(db->pager, TREE_EXCLUSIVE);
+  MetaCommandResult result = run_meta_command(input_buffer, db);
+  pager_exit(db->pager, TREE_EXCLUSIVE);
+  return result;
+}
+
+PrepareResult prepare_row(char* id_string, char* username, char* email,
+                          Row* row) {
+  if (id_string == NULL || username == NULL || email == NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  int id = atoi(id_string);
+  if (id < 0) {
+    return PREPARE_NEGATIVE_ID;
+  }
+  if (strlen(username) > COLUMN_USERNAME_SIZE) {
+    return PREPARE_STRING_TOO_LONG;
+  }
+  if (strlen(email) > COLUMN_EMAIL_SIZE) {
+    return PREPARE_STRING_TOO_LONG;
+  }
+
+  row->id = id;
+  strcpy(row->username, username);
+  row_set_email(row, email, strlen(email));
+
+  return PREPARE_SUCCESS;
+}
+
+/*
+Record a parameter if token is a ?, and return what the statement is
+prepared with in its place: stand_in, or the token itself if it is a
+value already. Returns NULL for a missing token or one ? too many.
+*/
+char* prepare_parameter(Statement* statement, char* token, ParameterKind kind,
+                        char* stand_in) {
+  if (token == NULL || strcmp(token, "?") != 0) {
+    return token;
+  }
+  if (statement->num_parameters == STATEMENT_MAX_PARAMETERS) {
+    return NULL;
+  }
+  statement->parameters[statement->num_parameters++].kind = kind;
+  return stand_in;
+}
+
+/*
+insert values (id,username,email),(id,username,email),...
+*/
+PrepareResult prepare_insert_values(char* values, Statement* statement) {
+  uint32_t capacity = 16;
+  Row* rows = malloc(sizeof(Row) * capacity);
+  uint32_t num_rows = 0;
+  PrepareResult result = PREPARE_SYNTAX_ERROR;
+
+  char* position = values;
+  while (true) {
+    position += strspn(position, " ");
+    char* close = strchr(position, ')');
+    if (*position != '(' || close == NULL) {
+      break;
+    }
+    *close = '\0';
+
+    if (num_rows == capacity) {
+      capacity *= 2;
+      rows = realloc(rows, sizeof(Row) * capacity);
+    }
+    uint32_t first_parameter = statement->num_parameters;
+    char* id_string = prepare_parameter(
+        statement, strtok(position + 1, ", "), PARAMETER_ID, "0");
+    char* username = prepare_parameter(statement, strtok(NULL, ", "),
+                                       PARAMETER_USERNAME, "");
+    char* email =
+        prepare_parameter(statement, strtok(NULL, ", "), PARAMETER_EMAIL, "");
+    if (strtok(NULL, ", ") != NULL) {
+      break;
+    }
+    for (uint32_t i = first_parameter; i < statement->num_parameters; i++) {
+      statement->parameters[i].row = num_rows;
+    }
+    rows[num_rows].email = NULL;
+    result = prepare_row(id_string, username, email, &rows[num_rows]);
+    if (result != PREPARE_SUCCESS) {
+      break;
+    }
+    num_rows++;
+
+    position = close + 1 + strspn(close + 1, " ");
+    if (*position == '\0') {
+      statement->rows_to_insert = rows;
+      statement->num_rows_to_insert = num_rows;
+      return PREPARE_SUCCESS;
+    }
+    result = PREPARE_SYNTAX_ERROR;
+    if (*position != ',') {
+      break;
+    }
+    position++;
+  }
+
+  for (uint32_t i = 0; i < num_rows; i++) {
+    free(rows[i].email);
+  }
+  free(rows);
+  return result;
+}
+
+PrepareResult prepare_insert(InputBuffer* input_buffer, Statement* statement) {
+  statement->type = STATEMENT_INSERT;
+  if (strncmp(input_buffer->buffer, "insert values ", 14) == 0) {
+    return prepare_insert_values(input_buffer->buffer + 14, statement);
+  }
+
+  strtok(input_buffer->buffer, " ");  // The keyword
+  char* id_string =
+      prepare_parameter(statement, strtok(NULL, " "), PARAMETER_ID, "0");
+  char* username =
+      prepare_parameter(statement, strtok(NULL, " "), PARAMETER_USERNAME, "");
+  char* email =
+      prepare_parameter(statement, strtok(NULL, " "), PARAMETER_EMAIL, "");
+
+  return prepare_row(id_string, username, email, &statement->row_to_insert);
+}
+
+PrepareResult prepare_update(InputBuffer* input_buffer, Statement* statement) {
+  // Same arguments as insert: the id picks the row to overwrite
+  PrepareResult result = prepare_insert(input_buffer, statement);
+  statement->type = STATEMENT_UPDATE;
+  return result;
+}
+
+PrepareResult prepare_delete(InputBuffer* input_buffer, Statement* statement) {
+  statement->type = STATEMENT_DELETE;
+
+  strtok(input_buffer->buffer, " ");  // The keyword
+  char* id_string =
+      prepare_parameter(statement, strtok(NULL, " "), PARAMETER_ID, "0");
+  if (id_string == NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  int id = atoi(id_string);
+  if (id < 0) {
+    return PREPARE_NEGATIVE_ID;
+  }
+  statement->id_to_delete = id;
+
+  return PREPARE_SUCCESS;
+}
+
+/*
+<column> = <value>, or <column> like <prefix>%, on username or email.
+A select takes one such condition.
+*/
+PrepareResult prepare_select_filter(Statement* statement, Column column,
+                                    char* operator, char* value) {
+  if (statement->filter_column != COLUMN_ID) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  uint32_t length = strlen(value);
+  bool prefix = false;
+  if (strcmp(operator, "like") == 0) {
+    prefix = length > 0 && value[length - 1] == '%';
+    length -= prefix;
+    if (memchr(value, '%', length) != NULL) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+  } else if (strcmp(operator, "=") != 0) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  statement->filter_column = column;
+  statement->filter_value = value;
+  statement->filter_length = length;
+  statement->filter_prefix = prefix;
+  return PREPARE_SUCCESS;
+}
+
+/* id <op> <value> */
+PrepareResult select_range_apply(Statement* statement, const char* operator,
+                                 uint64_t value) {
+  uint64_t start = statement->range_start;
+  uint64_t end = statement->range_end;
+  if (strcmp(operator, "=") == 0) {
+    start = value;
+    end = value + 1;
+  } else if (strcmp(operator, ">=") == 0) {
+    start = value;
+  } else if (strcmp(operator, ">") == 0) {
+    start = value + 1;
+  } else if (strcmp(operator, "<") == 0) {
+    end = value;
+  } else if (strcmp(operator, "<=") == 0) {
+    end = value + 1;
+  } else {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  if (start > statement->range_start) {
+    statement->range_start = start;
+  }
+  if (end < statement->range_end) {
+    statement->range_end = end;
+  }
+  return PREPARE_SUCCESS;
+}
+
+PrepareResult prepare_select_range(Statement* statement, char* operator,
+                                   char* value_string) {
+  long long value = atoll(value_string);
+  if (value < 0) {
+    return PREPARE_NEGATIVE_ID;
+  }
+  return select_range_apply(statement, operator, value);
+}
+
+/*
+A condition whose value is a ?. Its operator is checked now, and the
+condition is applied to the statement once the value is bound.
+*/
+PrepareResult prepare_select_parameter(Statement* statement, Column column,
+                                       char* operator) {
+  Statement unbound = *statement;
+  PrepareResult result =
+      column == COLUMN_ID
+          ? select_range_apply(&unbound, operator, 0)
+          : prepare_select_filter(&unbound, column, operator, "");
+  if (result != PREPARE_SUCCESS ||
+      prepare_parameter(statement, "?", PARAMETER_FILTER, "") == NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  Parameter* parameter = &statement->parameters[statement->num_parameters - 1];
+  parameter->column = column;
+  parameter->operator = operator;
+  if (column != COLUMN_ID) {
+    statement->filter_column = column;  // A select takes one such condition
+  }
+  return PREPARE_SUCCESS;
+}
+
+/*
+select [where <condition> [and <condition> ...]]
+Each condition on id narrows the selected key range.
+*/
+PrepareResult prepare_select(InputBuffer* input_buffer, Statement* statement) {
+  statement->type = STATEMENT_SELECT;
+  statement->range_start = 0;
+  statement->range_end = (uint64_t)UINT32_MAX + 1;
+  statement->filter_column = COLUMN_ID;
+
+  char* keyword = strtok(input_buffer->buffer, " ");
+  if (strcmp(keyword, "select") != 0) {
+    return PREPARE_UNRECOGNIZED_STATEMENT;
+  }
+  char* where = strtok(NULL, " ");
+  if (where == NULL) {
+    return PREPARE_SUCCESS;
+  }
+  if (strcmp(where, "where") != 0) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  while (true) {
+    char* column = strtok(NULL, " ");
+    char* operator = strtok(NULL, " ");
+    char* value_string = strtok(NULL, " ");
+    Column filter_column;
+    if (column == NULL || operator == NULL || value_string == NULL ||
+        !column_from_name(column, &filter_column)) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    PrepareResult result;
+    if (strcmp(value_string, "?") == 0) {
+      result = prepare_select_parameter(statement, filter_column, operator);
+    } else if (filter_column == COLUMN_ID) {
+      result = prepare_select_range(statement, operator, value_string);
+    } else {
+      result = prepare_select_filter(statement, filter_column, operator,
+                                     value_string);
+    }
+    if (result != PREPARE_SUCCESS) {
+      return result;
+    }
+
+    char* conjunction = strtok(NULL, " ");
+    if (conjunction == NULL) {
+      return PREPARE_SUCCESS;
+    }
+    if (strcmp(conjunction, "and") != 0) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+  }
+}
+
+bool is_table_name(const char* name, uint32_t length) {
+  if (length == 0 || !(isalpha(name[0]) || name[0] == '_')) {
+    return false;
+  }
+  for (uint32_t i = 1; i < length; i++) {
+    if (!(isalnum(name[i]) || name[i] == '_')) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+A statement names its table right after the keyword: "insert into t",
+"select from t", "delete from t" or "update t". Without one it goes to
+the main table. The name is cut out of the input, which is left as the
+same statement on the main table would be written.
+*/
+PrepareResult prepare_table_name(InputBuffer* input_buffer,
+                                 Statement* statement,
+                                 const char* preposition) {
+  strcpy(statement->table_name, MAIN_TABLE_NAME);
+  char* keyword_end = input_buffer->buffer + strcspn(input_buffer->buffer, " ");
+  char* word = keyword_end + strspn(keyword_end, " ");
+  uint32_t word_length = strcspn(word, " ");
+  if (preposition != NULL) {
+    if (word_length != strlen(preposition) ||
+        strncmp(word, preposition, word_length) != 0) {
+      return PREPARE_SUCCESS;
+    }
+    word += word_length;
+    word += strspn(word, " ");
+    word_length = strcspn(word, " ");
+  } else if (!is_table_name(word, word_length)) {
+    return PREPARE_SUCCESS;
+  }
+
+  if (!is_table_name(word, word_length)) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  if (word_length > TABLE_NAME_MAX_SIZE) {
+    return PREPARE_STRING_TOO_LONG;
+  }
+  memcpy(statement->table_name, word, word_length);
+  statement->table_name[word_length] = '\0';
+  memmove(keyword_end, word + word_length, strlen(word + word_length) + 1);
+  return PREPARE_SUCCESS;
+}
+
+/*
+create index on <table>(<column>)
+Only username and email can be indexed; rows are keyed by id already.
+*/
+PrepareResult prepare_create_index(Statement* statement) {
+  statement->type = STATEMENT_CREATE_INDEX;
+  char* on = strtok(NULL, " ");
+  char* target = strtok(NULL, "");
+  char* open = target != NULL ? strchr(target, '(') : NULL;
+  char* close = open != NULL ? strchr(open, ')') : NULL;
+  if (on == NULL || strcmp(on, "on") != 0 || close == NULL ||
+      close[1 + strspn(close + 1, " ")] != '\0') {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  *open = '\0';
+  *close = '\0';
+  char* name = strtok(target, " ");
+  if (name == NULL || strtok(NULL, " ") != NULL ||
+      !is_table_name(name, strlen(name))) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  char* column = strtok(open + 1, " ");
+  if (column == NULL || strtok(NULL, " ") != NULL ||
+      !column_from_name(column, &statement->column_to_index) ||
+      statement->column_to_index == COLUMN_ID) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  if (strlen(name) > TABLE_NAME_MAX_SIZE) {
+    return PREPARE_STRING_TOO_LONG;
+  }
+  strcpy(statement->table_name, name);
+  return PREPARE_SUCCESS;
+}
+
+/*
+create table <name>
+Every table has the (id, username, email) schema of the main table.
+*/
+PrepareResult prepare_create(InputBuffer* input_buffer, Statement* statement) {
+  statement->type = STATEMENT_CREATE_TABLE;
+  strtok(input_buffer->buffer, " ");  // The keyword
+  char* object = strtok(NULL, " ");
+  if (object != NULL && strcmp(object, "index") == 0) {
+    return prepare_create_index(statement);
+  }
+  char* name = strtok(NULL, " ");
+  if (object == NULL || strcmp(object, "table") != 0 || name == NULL ||
+      strtok(NULL, " ") != NULL || !is_table_name(name, strlen(name))) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  if (strlen(name) > TABLE_NAME_MAX_SIZE) {
+    return PREPARE_STRING_TOO_LONG;
+  }
+  strcpy(statement->table_name, name);
+  return PREPARE_SUCCESS;
+}
+
+PrepareResult prepare_statement(InputBuffer* input_buffer,
+                                Statement* statement) {
+  statement->row_to_insert.email = NULL;
+  statement->rows_to_insert = NULL;
+  statement->num_parameters = 0;
+  statement->results = NULL;
+  if (strncmp(input_buffer->buffer, "create", 6) == 0) {
+    return prepare_create(input_buffer, statement);
+  }
+
+  const char* preposition;
+  PrepareResult (*prepare)(InputBuffer*, Statement*);
+  if (strncmp(input_buffer->buffer, "insert", 6) == 0) {
+    preposition = "into";
+    prepare = prepare_insert;
+  } else if (strncmp(input_buffer->buffer, "update", 6) == 0) {
+    preposition = NULL;
+    prepare = prepare_update;
+  } else if (strncmp(input_buffer->buffer, "delete", 6) == 0) {
+    preposition = "from";
+    prepare = prepare_delete;
+  } else if (strncmp(input_buffer->buffer, "select", 6) == 0) {
+    preposition = "from";
+    prepare = prepare_select;
+  } else {
+    return PREPARE_UNRECOGNIZED_STATEMENT;
+  }
+
+  PrepareResult result =
+      prepare_table_name(input_buffer, statement, preposition);
+  if (result != PREPARE_SUCCESS) {
+    return result;
+  }
+  return prepare(input_buffer, statement);
+}
+
+/*
+Take a page off the freelist, or go onto the end of the database file
+if the freelist is empty. A trunk page whose leaves are all used up is
+handed out itself.
+*/
+uint32_t get_unused_page_num(Pager* pager) {
+  void* header = get_page(pager, FILE_HEADER_PAGE_NUM);
+  uint32_t trunk_page_num = *header_freelist_trunk(header);
+  if (trunk_page_num == 0) {
+    unpin_page(pager, FILE_HEADER_PAGE_NUM);
+    return pager->num_pages;
+  }
+
+  void* trunk = get_page(pager, trunk_page_num);
+  uint32_t num_leaves = *freelist_num_leaves(trunk);
+  uint32_t page_num;
+  pager_mark_dirty(pager, FILE_HEADER_PAGE_NUM);
+  if (num_leaves > 0) {
+    pager_mark_dirty(pager, trunk_page_num);
+    page_num = *freelist_leaf(trunk, num_leaves - 1);
+    *freelist_num_leaves(trunk) = num_leaves - 1;
+  } else {
+    page_num = trunk_page_num;
+    *header_freelist_trunk(header) = *freelist_next_trunk(trunk);
+  }
+  *header_free_pages(header) -= 1;
+
+  unpin_page(pager, trunk_page_num);
+  unpin_page(pager, FILE_HEADER_PAGE_NUM);
+  return page_num;
+}
+
+/*
+Put a page on the freelist. Its contents are no longer needed, so it
+either becomes a leaf of the current trunk or, if that trunk is full,
+the new head trunk.
+*/
+void free_page(Pager* pager, uint32_t page_num) {
+  pager_count_free(pager, page_num);
+  void* header = get_page(pager, FILE_HEADER_PAGE_NUM);
+  pager_mark_dirty(pager, FILE_HEADER_PAGE_NUM);
+  uint32_t trunk_page_num = *header_freelist_trunk(header);
+  *header_free_pages(header) += 1;
+
+  if (trunk_page_num != 0) {
+    void* trunk = get_page(pager, trunk_page_num);
+    uint32_t num_leaves = *freelist_num_leaves(trunk);
+    if (num_leaves < freelist_max_leaves) {
+      pager_mark_dirty(pager, trunk_page_num);
+      *freelist_leaf(trunk, num_leaves) = page_num;
+      *freelist_num_leaves(trunk) = num_leaves + 1;
+      unpin_page(pager, trunk_page_num);
+      unpin_page(pager, FILE_HEADER_PAGE_NUM);
+      return;
+    }
+    unpin_page(pager, trunk_page_num);
+  }
+
+  void* trunk = get_page(pager, page_num);
+  pager_mark_dirty(pager, page_num);
+  *freelist_next_trunk(trunk) = trunk_page_num;
+  *freelist_num_leaves(trunk) = 0;
+  *header_freelist_trunk(header) = page_num;
+  unpin_page(pager, page_num);
+  unpin_page(pager, FILE_HEADER_PAGE_NUM);
+}
+
+/*
+Write a value to a new chain of overflow pages and return its first page
+*/
+uint32_t overflow_write(Pager* pager, const char* data, uint32_t length) {
+  uint32_t first_page_num = 0;
+  uint32_t previous_page_num = 0;
+  for (uint32_t offset = 0; offset < length; offset += overflow_data_size) {
+    uint32_t chunk = length - offset;
+    if (chunk > overflow_data_size) {
+      chunk = overflow_data_size;
+    }
+    uint32_t page_num = get_unused_page_num(pager);
+    void* page = get_page(pager, page_num);
+    pager_mark_dirty(pager, page_num);
+    *overflow_next_page(page) = 0;
+    memcpy(page + OVERFLOW_DATA_OFFSET, data + offset, chunk);
+    unpin_page(pager, page_num);
+
+    if (previous_page_num == 0) {
+      first_page_num = page_num;
+    } else {
+      void* previous = get_page(pager, previous_page_num);
+      *overflow_next_page(previous) = page_num;
+      pager_mark_dirty(pager, previous_page_num);
+      unpin_page(pager, previous_page_num);
+    }
+    previous_page_num = page_num;
+  }
+  return first_page_num;
+}
+
+void overflow_read(Pager* pager, uint32_t page_num, char* destination,
+                   uint32_t length) {
+  for (uint32_t offset = 0; offset < length; offset += overflow_data_size) {
+    uint32_t chunk = length - offset;
+    if (chunk > overflow_data_size) {
+      chunk = overflow_data_size;
+    }
+    void* page = get_page(pager, page_num);
+    memcpy(destination + offset, page + OVERFLOW_DATA_OFFSET, chunk);
+    uint32_t next_page_num = *overflow_next_page(page);
+    unpin_page(pager, page_num);
+    page_num = next_page_num;
+  }
+}
+
+void overflow_free(Pager* pager, uint32_t page_num) {
+  while (page_num != 0) {
+    void* page = get_page(pager, page_num);
+    uint32_t next_page_num = *overflow_next_page(page);
+    unpin_page(pager, page_num);
+    free_page(pager, page_num);
+    page_num = next_page_num;
+  }
+}
+
+/*
+Free the overflow chain of a cell that is being removed or rewritten
+*/
+void leaf_node_free_overflow(Pager* pager, void* node, uint32_t cell_num) {
+  overflow_free(pager, record_overflow_page(leaf_node_value(node, cell_num)));
+}
+
+void set_node_parent(Pager* pager, uint32_t page_num,
+                     uint32_t parent_page_num) {
+  void* node = get_page(pager, page_num);
+  *node_parent(node) = parent_page_num;
+  pager_mark_dirty_unlatched(pager, page_num);
+  unpin_page(pager, page_num);
+}
+
+void create_new_root(Table* table, uint32_t right_child_page_num) {
+  /*
+  Handle splitting the root.
+  Old root copied to new page, becomes left child.
+  Address of right child passed in.
+  Re-initialize root page to contain the new root node.
+  New root node points to two children.
+  */
+
+  void* root = get_page(table->pager, table->root_page_num);
+  void* right_child = get_page(table->pager, right_child_page_num);
+  uint32_t left_child_page_num = get_unused_page_num(table->pager);
+  void* left_child = get_page(table->pager, left_child_page_num);
+  pager_mark_dirty(table->pager, table->root_page_num);
+  pager_mark_dirty(table->pager, right_child_page_num);
+  pager_mark_dirty(table->pager, left_child_page_num);
+
+  /* Left child has data copied from old root */
+  memcpy(left_child, root, page_size);
+  set_node_root(left_child, false);
+
+  if (get_node_type(left_child) == NODE_INTERNAL) {
+    /* The old root's children now hang off the left child */
+    uint32_t num_keys = *internal_node_num_keys(left_child);
+    for (uint32_t i = 0; i <= num_keys; i++) {
+      set_node_parent(table->pager, *internal_node_child(left_child, i),
+                      left_child_page_num);
+    }
+  }
+
+  /* Root node is a new internal node with one key and two children */
+  initialize_internal_node(root);
+  set_node_root(root, true);
+  *internal_node_num_keys(root) = 1;
+  *internal_node_child(root, 0) = left_child_page_num;
+  uint32_t left_child_max_key = get_node_max_key(table->pager, left_child);
+  *internal_node_key(root, 0) = left_child_max_key;
+  *internal_node_right_child(root) = right_child_page_num;
+  *node_parent(left_child) = table->root_page_num;
+  *node_parent(right_child) = table->root_page_num;
+
+  unpin_page(table->pager, left_child_page_num);
+  unpin_page(table->pager, right_child_page_num);
+  unpin_page(table->pager, table->root_page_num);
+}
+
+void update_internal_node_key(void* node, uint32_t old_key, uint32_t new_key) {
+  uint32_t old_child_index = internal_node_find_child(node, old_key);
+  /* The right child has no key of its own */
+  if (old_child_index < *internal_node_num_keys(node)) {
+    *internal_node_key(node, old_child_index) = new_key;
+  }
+}
+
+void internal_node_insert(Table* table, uint32_t parent_page_num,
+                          uint32_t child_page_num);
+
+void internal_node_split_and_insert(Table* table, uint32_t parent_page_num,
+                                    uint32_t child_page_num,
+                                    uint32_t child_max_key) {
+  /*
+  Lay out every child of the full node, plus the new one, in key order.
+  The lower half stays in the old node, the upper half moves to a new
+  sibling, and the sibling is then inserted into the parent, which may
+  split in turn.
+  */
+  Pager* pager = table->pager;
+  void* old_node = get_page(pager, parent_page_num);
+  uint32_t num_keys = *internal_node_num_keys(old_node);
+  uint32_t num_children = num_keys + 2;
+  uint32_t* children = malloc(num_children * sizeof(uint32_t));
+  uint32_t* keys = malloc(num_children * sizeof(uint32_t));
+
+  uint32_t right_child_page_num = *internal_node_right_child(old_node);
+  void* right_child = get_page(pager, right_child_page_num);
+  uint32_t right_child_max_key = get_node_max_key(pager, right_child);
+  unpin_page(pager, right_child_page_num);
+
+  uint32_t count = 0;
+  bool inserted = false;
+  for (uint32_t i = 0; i <= num_keys; i++) {
+    uint32_t page_num = *internal_node_child(old_node, i);
+    uint32_t key = i < num_keys ? *internal_node_key(old_node, i)
+                                : right_child_max_key;
+    if (!inserted && child_max_key < key) {
+      children[count] = child_page_num;
+      keys[count++] = child_max_key;
+      inserted = true;
+    }
+    children[count] = page_num;
+    keys[count++] = key;
+  }
+  if (!inserted) {
+    children[count] = child_page_num;
+    keys[count++] = child_max_key;
+  }
+  uint32_t old_max = keys[num_children - 1];
+
+  uint32_t left_count = num_children / 2;
+  uint32_t new_page_num = get_unused_page_num(pager);
+  void* new_node = get_page(pager, new_page_num);
+  pager_mark_dirty(pager, parent_page_num);
+  pager_mark_dirty(pager, new_page_num);
+  initialize_internal_node(new_node);
+  *node_parent(new_node) = *node_parent(old_node);
+
+  *internal_node_num_keys(old_node) = left_count - 1;
+  for (uint32_t i = 0; i < left_count - 1; i++) {
+    *internal_node_child(old_node, i) = children[i];
+    *internal_node_key(old_node, i) = keys[i];
+  }
+  *internal_node_right_child(old_node) = children[left_count - 1];
+
+  uint32_t right_count = num_children - left_count;
+  *internal_node_num_keys(new_node) = right_count - 1;
+  for (uint32_t i = 0; i < right_count - 1; i++) {
+    *internal_node_child(new_node, i) = children[left_count + i];
+    *internal_node_key(new_node, i) = keys[left_count + i];
+  }
+  *internal_node_right_child(new_node) = children[num_children - 1];
+
+  for (uint32_t i = 0; i < num_children; i++) {
+    if (i >= left_count) {
+      set_node_parent(pager, children[i], new_page_num);
+    } else if (children[i] == child_page_num) {
+      set_node_parent(pager, children[i], parent_page_num);
+    }
+  }
+
+  uint32_t new_max = keys[left_count - 1];
+  bool splitting_root = is_node_root(old_node);
+  uint32_t grandparent_page_num = *node_parent(old_node);
+  free(children);
+  free(keys);
+  unpin_page(pager, new_page_num);
+  unpin_page(pager, parent_page_num);
+
+  if (splitting_root) {
+    create_new_root(table, new_page_num);
+  } else {
+    void* grandparent = get_page(pager, grandparent_page_num);
+    update_internal_node_key(grandparent, old_max, new_max);
+    pager_mark_dirty(pager, grandparent_page_num);
+    unpin_page(pager, grandparent_page_num);
+    internal_node_insert(table, grandparent_page_num, new_page_num);
+  }
+}
+
+void internal_node_insert(Table* table, uint32_t parent_page_num,
+                          uint32_t child_page_num) {
+  /*
+  Add a new child/key pair to parent that corresponds to child
+  */
+
+  void* child = get_page(table->pager, child_page_num);
+  uint32_t child_max_key = get_node_max_key(table->pager, child);
+  unpin_page(table->pager, child_page_num);
+
+  void* parent = get_page(table->pager, parent_page_num);
+  uint32_t index = internal_node_find_child(parent, child_max_key);
+  uint32_t original_num_keys = *internal_node_num_keys(parent);
+
+  if (original_num_keys >= internal_node_max_cells) {
+    unpin_page(table->pager, parent_page_num);
+    internal_node_split_and_insert(table, parent_page_num, child_page_num,
+                                   child_max_key);
+    return;
+  }
+
+  uint32_t right_child_page_num = *internal_node_right_child(parent);
+  void* right_child = get_page(table->pager, right_child_page_num);
+  uint32_t right_child_max_key = get_node_max_key(table->pager, right_child);
+  unpin_page(table->pager, right_child_page_num);
+
+  pager_mark_dirty(table->pager, parent_page_num);
+  *internal_node_num_keys(parent) = original_num_keys + 1;
+
+  if (child_max_key > right_child_max_key) {
+    /* Replace right child */
+    *internal_node_child(parent, original_num_keys) = right_child_page_num;
+    *internal_node_key(parent, original_num_keys) = right_child_max_key;
+    *internal_node_right_child(parent) = child_page_num;
+  } else {
+    /* Make room for the new cell */
+    uint32_t num_moved = original_num_keys - index;
+    memmove(internal_node_key(parent, index + 1),
+            internal_node_key(parent, index),
+            num_moved * INTERNAL_NODE_KEY_SIZE);
+    memmove(internal_node_children(parent) + index + 1,
+            internal_node_children(parent) + index,
+            num_moved * INTERNAL_NODE_CHILD_SIZE);
+    *internal_node_child(parent, index) = child_page_num;
+    *internal_node_key(parent, index) = child_max_key;
+  }
+
+  unpin_page(table->pager, parent_page_num);
+}
+
+void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
+  /*
+  Create a new node and move half the bytes over.
+  Insert the new value in one of the two nodes.
+  Update parent or create a new parent.
+  */
+
+  Pager* pager = cursor->table->pager;
+  void* old_node = get_page(pager, cursor->page_num);
+  uint32_t old_max = get_node_max_key(pager, old_node);
+  uint32_t new_page_num = get_unused_page_num(pager);
+  void* new_node = get_page(pager, new_page_num);
+  pager_mark_dirty(pager, cursor->page_num);
+  pager_mark_dirty(pager, new_page_num);
+  initialize_leaf_node(new_node);
+  *node_parent(new_node) = *node_parent(old_node);
+  *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
+  *leaf_node_next_leaf(old_node) = new_page_num;
+
+  /*
+  All existing cells plus the new one should be divided evenly by size
+  between old (left) and new (right) nodes.
+  */
+  uint32_t num_cells = *leaf_node_num_cells(old_node) + 1;
+  LeafCell* cells = malloc(sizeof(LeafCell) * num_cells);
+  void* scratch = malloc(page_size + RECORD_MAX_SIZE);
+  leaf_node_copy_cells(old_node, scratch, cells);
+  memmove(&cells[cursor->cell_num + 1], &cells[cursor->cell_num],
+          sizeof(LeafCell) * (num_cells - 1 - cursor->cell_num));
+  LeafCell* new_cell = &cells[cursor->cell_num];
+  new_cell->key = key;
+  new_cell->record_size = row_record_size(value);
+  new_cell->record = scratch + page_size;
+  serialize_row(pager, value, new_cell->record);
+
+  uint32_t ends[2];
+  leaf_cells_partition(cells, num_cells, ends);
+  leaf_node_set_cells(old_node, cells, ends[0]);
+  leaf_node_set_cells(new_node, cells + ends[0], num_cells - ends[0]);
+  free(scratch);
+  free(cells);
+
+  bool splitting_root = is_node_root(old_node);
+  uint32_t parent_page_num = *node_parent(old_node);
+  uint32_t new_max = get_node_max_key(pager, old_node);
+  unpin_page(pager, new_page_num);
+  unpin_page(pager, cursor->page_num);
+
+  if (splitting_root) {
+    create_new_root(cursor->table, new_page_num);
+  } else {
+    void* parent = get_page(pager, parent_page_num);
+    update_internal_node_key(parent, old_max, new_max);
+    pager_mark_dirty(pager, parent_page_num);
+    unpin_page(pager, parent_page_num);
+    internal_node_insert(cursor->table, parent_page_num, new_page_num);
+  }
+}
+
+void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value) {
+  void* node = get_page(cursor->table->pager, cursor->page_num);
+
+  uint32_t record_size = row_record_size(value);
+  if (leaf_node_free_space(node) < LEAF_NODE_SLOT_SIZE + record_size) {
+    // Node full
+    unpin_page(cursor->table->pager, cursor->page_num);
+    leaf_node_split_and_insert(cursor, key, value);
+    return;
+  }
+
+  pager_mark_dirty(cursor->table->pager, cursor->page_num);
+  void* record =
+      leaf_node_insert_cell(node, cursor->cell_num, key, record_size);
+  serialize_row(cursor->table->pager, value, record);
+  unpin_page(cursor->table->pager, cursor->page_num);
+}
+
+/*
+Lay sorted cells out over the leaf at page_num and as many new leaves
+after it as they need, then add the new leaves to the parent. old_max
+is the leaf's max key before, 0 if it had no cells. The cells must not
+point into the leaf.
+*/
+void leaf_node_replace_cells(Table* table, uint32_t page_num,
+                             LeafCell* cells, uint32_t total_cells,
+                             uint32_t old_max) {
+  Pager* pager = table->pager;
+  void* node = get_page(pager, page_num);
+  uint32_t* ends = malloc(sizeof(uint32_t) * total_cells);
+  uint32_t num_nodes = leaf_cells_partition(cells, total_cells, ends);
+  uint32_t* page_nums = malloc(sizeof(uint32_t) * num_nodes);
+  page_nums[0] = page_num;
+  uint32_t next_leaf = *leaf_node_next_leaf(node);
+  uint32_t parent_page_num = *node_parent(node);
+  bool splitting_root = is_node_root(node);
+  unpin_page(pager, page_num);
+
+  uint32_t start = 0;
+  for (uint32_t n = 0; n < num_nodes; n++) {
+    if (n > 0) {
+      page_nums[n] = get_unused_page_num(pager);
+    }
+    node = get_page(pager, page_nums[n]);
+    pager_mark_dirty(pager, page_nums[n]);
+    if (n > 0) {
+      initialize_leaf_node(node);
+      *node_parent(node) = parent_page_num;
+    }
+    leaf_node_set_cells(node, cells + start, ends[n] - start);
+    *leaf_node_next_leaf(node) = next_leaf;  // Linked up below
+    unpin_page(pager, page_nums[n]);
+    start = ends[n];
+  }
+  free(ends);
+
+  for (uint32_t n = 0; n + 1 < num_nodes; n++) {
+    node = get_page(pager, page_nums[n]);
+    *leaf_node_next_leaf(node) = page_nums[n + 1];
+    pager_mark_dirty(pager, page_nums[n]);
+    unpin_page(pager, page_nums[n]);
+  }
+
+  if (num_nodes > 1 && !splitting_root) {
+    node = get_page(pager, page_num);
+    uint32_t new_max = get_node_max_key(pager, node);
+    unpin_page(pager, page_num);
+    void* parent = get_page(pager, parent_page_num);
+    update_internal_node_key(parent, old_max, new_max);
+    pager_mark_dirty(pager, parent_page_num);
+    unpin_page(pager, parent_page_num);
+  }
+  for (uint32_t n = 1; n < num_nodes; n++) {
+    if (n == 1 && splitting_root) {
+      create_new_root(table, page_nums[n]);
+      continue;
+    }
+    /*
+    Earlier inserts may have split the parent. The new node goes right
+    before the leaf its max key now routes to, in that leaf's parent.
+    */
+    node = get_page(pager, page_nums[n]);
+    uint32_t max_key = get_node_max_key(pager, node);
+    unpin_page(pager, page_nums[n]);
+    Cursor* next = table_find(table, max_key);
+    node = get_page(pager, next->page_num);
+    parent_page_num = *node_parent(node);
+    unpin_page(pager, next->page_num);
+    free(next);
+    set_node_parent(pager, page_nums[n], parent_page_num);
+    internal_node_insert(table, parent_page_num, page_nums[n]);
+  }
+  free(page_nums);
+}
+
+/*
+Insert sorted rows that all belong in the cursor's leaf. The leaf's
+cells and the new rows are merged, then laid out over as few nodes as
+hold them, so a big batch splits the leaf once rather than once per
+row.
+*/
+void leaf_node_insert_many(Cursor* cursor, Row* rows, uint32_t num_rows) {
+  Pager* pager = cursor->table->pager;
+  uint32_t page_num = cursor->page_num;
+  void* node = get_page(pager, page_num);
+  pager_mark_dirty(pager, page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint32_t total_cells = num_cells + num_rows;
+  uint32_t old_max = num_cells > 0 ? get_node_max_key(pager, node) : 0;
+
+  size_t records_size = 0;
+  for (uint32_t i = 0; i < num_rows; i++) {
+    records_size += row_record_size(&rows[i]);
+  }
+  LeafCell* old_cells = malloc(sizeof(LeafCell) * num_cells);
+  void* scratch = malloc(page_size + records_size);
+  leaf_node_copy_cells(node, scratch, old_cells);
+  LeafCell* cells = malloc(sizeof(LeafCell) * total_cells);
+  void* record = scratch + page_size;
+  uint32_t cell = 0;
+  uint32_t row = 0;
+  for (uint32_t i = 0; i < total_cells; i++) {
+    if (row == num_rows ||
+        (cell < num_cells && old_cells[cell].key < rows[row].id)) {
+      cells[i] = old_cells[cell++];
+    } else {
+      cells[i].key = rows[row].id;
+      cells[i].record_size = row_record_size(&rows[row]);
+      cells[i].record = record;
+      serialize_row(pager, &rows[row++], record);
+      record += cells[i].record_size;
+    }
+  }
+  free(old_cells);
+  unpin_page(pager, page_num);
+
+  leaf_node_replace_cells(cursor->table, page_num, cells, total_cells,
+                          old_max);
+  free(cells);
+  free(scratch);
+}
+
+void leaf_node_rebalance(Table* table, uint32_t page_num);
+
+/*
+Replace a compressed leaf with ordinary leaves holding the same cells,
+so that it can be written to. Returns false if the leaf was not
+compressed.
+*/
+bool leaf_node_expand(Table* table, uint32_t page_num) {
+  Pager* pager = table->pager;
+  void* node = get_page(pager, page_num);
+  if (!leaf_node_is_compressed(node)) {
+    unpin_page(pager, page_num);
+    return false;
+  }
+
+  DecodedLeaf* decoded = leaf_node_decode(pager, page_num, node);
+  uint32_t num_cells = decoded->num_cells;
+  size_t records_size = 0;
+  for (uint32_t i = 0; i < num_cells; i++) {
+    records_size += decoded->cells[i].record_size;
+  }
+  LeafCell* cells = malloc(sizeof(LeafCell) * num_cells);
+  void* scratch = malloc(records_size);
+  void* record = scratch;
+  for (uint32_t i = 0; i < num_cells; i++) {
+    cells[i] = decoded->cells[i];
+    cells[i].record = record;
+    memcpy(record, decoded->cells[i].record, cells[i].record_size);
+    record += cells[i].record_size;
+  }
+  uint32_t old_max = num_cells > 0 ? cells[num_cells - 1].key : 0;
+  unpin_page(pager, page_num);
+
+  leaf_node_replace_cells(table, page_num, cells, num_cells, old_max);
+  free(scratch);
+  free(cells);
+
+  /* The last leaf of a compressed build can be small once expanded */
+  node = get_page(pager, page_num);
+  bool underfull = !is_node_root(node) &&
+                   leaf_node_used_space(node) < leaf_node_min_fill;
+  unpin_page(pager, page_num);
+  if (underfull) {
+    leaf_node_rebalance(table, page_num);
+  }
+  return true;
+}
+
+/*
+Writes go to ordinary leaves only. If the cursor is on a compressed
+leaf, expand it and find the key again.
+*/
+Cursor* cursor_expand_leaf(Cursor* cursor, uint32_t key) {
+  Table* table = cursor->table;
+  if (!leaf_node_expand(table, cursor->page_num)) {
+    return cursor;
+  }
+  free(cursor);
+  return table_find(table, key);
+}
+
+/*
+A node's max key changed. Fix the separator that records it: walk up
+while the node is a right child, since right children have no key.
+*/
+void update_ancestor_max_key(Table* table, uint32_t page_num,
+                             uint32_t new_max) {
+  Pager* pager = table->pager;
+  uint32_t child_page_num = page_num;
+  while (true) {
+    void* child = get_page(pager, child_page_num);
+    bool is_root = is_node_root(child);
+    uint32_t parent_page_num = *node_parent(child);
+    unpin_page(pager, child_page_num);
+    if (is_root) {
+      return;
+    }
+
+    void* parent = get_page(pager, parent_page_num);
+    uint32_t index = internal_node_child_index(parent, child_page_num);
+    if (index < *internal_node_num_keys(parent)) {
+      *internal_node_key(parent, index) = new_max;
+      pager_mark_dirty(pager, parent_page_num);
+      unpin_page(pager, parent_page_num);
+      return;
+    }
+    unpin_page(pager, parent_page_num);
+    child_page_num = parent_page_num;
+  }
+}
+
+/*
+The root is an internal node with a single child left. Pull the child
+up into the root page so the tree loses a level.
+*/
+void collapse_root(Table* table) {
+  Pager* pager = table->pager;
+  uint32_t root_page_num = table->root_page_num;
+  void* root = get_page(pager, root_page_num);
+  uint32_t child_page_num = *internal_node_right_child(root);
+  void* child = get_page(pager, child_page_num);
+  pager_mark_dirty(pager, root_page_num);
+
+  memcpy(root, child, page_size);
+  set_node_root(root, true);
+  if (get_node_type(root) == NODE_INTERNAL) {
+    uint32_t num_keys = *internal_node_num_keys(root);
+    for (uint32_t i = 0; i <= num_keys; i++) {
+      set_node_parent(pager, *internal_node_child(root, i), root_page_num);
+    }
+  }
+
+  unpin_page(pager, child_page_num);
+  unpin_page(pager, root_page_num);
+  free_page(pager, child_page_num);
+}
+
+void internal_node_rebalance(Table* table, uint32_t page_num);
+
+/*
+The child right of left_index was merged into the child at left_index.
+Drop the merged child from the parent, then rebalance the parent if it
+is now below half full.
+*/
+void internal_node_remove_merged(Table* table, uint32_t parent_page_num,
+                                 uint32_t left_index) {
+  Pager* pager = table->pager;
+  void* parent = get_page(pager, parent_page_num);
+  pager_mark_dirty(pager, parent_page_num);
+  uint32_t num_keys = *internal_node_num_keys(parent);
+
+  /*
+  The right slot keeps its key, which is now the merged node's max,
+  and points at the merged node. The left slot goes away.
+  */
+  *internal_node_child(parent, left_index + 1) =
+      *internal_node_child(parent, left_index);
+  uint32_t num_moved = num_keys - 1 - left_index;
+  memmove(internal_node_key(parent, left_index),
+          internal_node_key(parent, left_index + 1),
+          num_moved * INTERNAL_NODE_KEY_SIZE);
+  memmove(internal_node_children(parent) + left_index,
+          internal_node_children(parent) + left_index + 1,
+          num_moved * INTERNAL_NODE_CHILD_SIZE);
+  *internal_node_num_keys(parent) = num_keys - 1;
+
+  bool is_root = is_node_root(parent);
+  unpin_page(pager, parent_page_num);
+
+  if (is_root) {
+    if (num_keys - 1 == 0) {
+      collapse_root(table);
+    }
+  } else if (num_keys - 1 < internal_node_min_keys) {
+    internal_node_rebalance(table, parent_page_num);
+  }
+}
+
+/*
+Pick the sibling to rebalance with: the left one if there is one, so
+the pair is always (left, right) at (left_index, left_index + 1).
+*/
+uint32_t find_rebalance_pair(Table* table, uint32_t page_num,
+                             uint32_t* parent_page_num,
+                             uint32_t* left_page_num,
+                             uint32_t* right_page_num) {
+  Pager* pager = table->pager;
+  void* node = get_page(pager, page_num);
+  *parent_page_num = *node_parent(node);
+  unpin_page(pager, page_num);
+
+  void* parent = get_page(pager, *parent_page_num);
+  uint32_t index = internal_node_child_index(parent, page_num);
+  uint32_t left_index = index > 0 ? index - 1 : 0;
+  *left_page_num = *internal_node_child(parent, left_index);
+  *right_page_num = *internal_node_child(parent, left_index + 1);
+  unpin_page(pager, *parent_page_num);
+  return left_index;
+}
+
+void leaf_node_rebalance(Table* table, uint32_t page_num) {
+  /*
+  Merge with a sibling if both fit in one node; otherwise even out
+  the bytes between the two, which borrows from the sibling.
+  */
+  Pager* pager = table->pager;
+  uint32_t parent_page_num, left_page_num, right_page_num;
+  uint32_t left_index = find_rebalance_pair(
+      table, page_num, &parent_page_num, &left_page_num, &right_page_num);
+
+  /* Expanding a compressed sibling may move this leaf; start over */
+  uint32_t sibling_page_num =
+      left_page_num == page_num ? right_page_num : left_page_num;
+  if (leaf_node_expand(table, sibling_page_num)) {
+    leaf_node_rebalance(table, page_num);
+    return;
+  }
+
+  void* left = get_page(pager, left_page_num);
+  void* right = get_page(pager, right_page_num);
+  pager_mark_dirty(pager, left_page_num);
+  pager_mark_dirty(pager, right_page_num);
+  uint32_t total_cells =
+      *leaf_node_num_cells(left) + *leaf_node_num_cells(right);
+  LeafCell* cells = malloc(sizeof(LeafCell) * total_cells);
+  void* scratch = malloc(2 * page_size);
+  uint32_t left_cells = leaf_node_copy_cells(left, scratch, cells);
+  leaf_node_copy_cells(right, scratch + page_size, cells + left_cells);
+
+  uint32_t ends[2];
+  bool merge = leaf_cells_partition(cells, total_cells, ends) == 1;
+  leaf_node_set_cells(left, cells, ends[0]);
+  if (merge) {
+    *leaf_node_next_leaf(left) = *leaf_node_next_leaf(right);
+  } else {
+    leaf_node_set_cells(right, cells + ends[0], total_cells - ends[0]);
+  }
+  uint32_t left_max = *leaf_node_key(left, ends[0] - 1);
+  free(scratch);
+  free(cells);
+  unpin_page(pager, right_page_num);
+  unpin_page(pager, left_page_num);
+
+  if (merge) {
+    free_page(pager, right_page_num);
+    internal_node_remove_merged(table, parent_page_num, left_index);
+    return;
+  }
+
+  void* parent = get_page(pager, parent_page_num);
+  *internal_node_key(parent, left_index) = left_max;
+  pager_mark_dirty(pager, parent_page_num);
+  unpin_page(pager, parent_page_num);
+}
+
+void internal_node_rebalance(Table* table, uint32_t page_num) {
+  /*
+  Lay out the children of both nodes in key order, like a split does.
+  The separator between them in the parent is the max key of the left
+  node's right child. Then either keep them all in the left node or
+  divide them evenly.
+  */
+  Pager* pager = table->pager;
+  uint32_t parent_page_num, left_page_num, right_page_num;
+  uint32_t left_index = find_rebalance_pair(
+      table, page_num, &parent_page_num, &left_page_num, &right_page_num);
+
+  void* parent = get_page(pager, parent_page_num);
+  uint32_t separator = *internal_node_key(parent, left_index);
+  unpin_page(pager, parent_page_num);
+
+  void* left = get_page(pager, left_page_num);
+  void* right = get_page(pager, right_page_num);
+  pager_mark_dirty(pager, left_page_num);
+  pager_mark_dirty(pager, right_page_num);
+  uint32_t left_keys = *internal_node_num_keys(left);
+  uint32_t right_keys = *internal_node_num_keys(right);
+  uint32_t num_children = left_keys + right_keys + 2;
+  uint32_t* children = malloc(num_children * sizeof(uint32_t));
+  uint32_t* keys = malloc(num_children * sizeof(uint32_t));
+
+  uint32_t count = 0;
+  for (uint32_t i = 0; i <= left_keys; i++) {
+    children[count] = *internal_node_child(left, i);
+    keys[count++] = i < left_keys ? *internal_node_key(left, i) : separator;
+  }
+  for (uint32_t i = 0; i <= right_keys; i++) {
+    children[count] = *internal_node_child(right, i);
+    // The last key is never stored: it belongs to the new right child
+    keys[count++] = i < right_keys ? *internal_node_key(right, i) : 0;
+  }
+
+  bool merge = num_children - 1 <= internal_node_max_cells;
+  uint32_t left_count = merge ? num_children : num_children / 2;
+
+  *internal_node_num_keys(left) = left_count - 1;
+  for (uint32_t i = 0; i < left_count - 1; i++) {
+    *internal_node_child(left, i) = children[i];
+    *internal_node_key(left, i) = keys[i];
+  }
+  *internal_node_right_child(left) = children[left_count - 1];
+
+  if (!merge) {
+    uint32_t right_count = num_children - left_count;
+    *internal_node_num_keys(right) = right_count - 1;
+    for (uint32_t i = 0; i < right_count - 1; i++) {
+      *internal_node_child(right, i) = children[left_count + i];
+      *internal_node_key(right, i) = keys[left_count + i];
+    }
+    *internal_node_right_child(right) = children[num_children - 1];
+  }
+
+  /* Children that changed sides need their parent pointers fixed */
+  for (uint32_t i = 0; i < num_children; i++) {
+    bool was_left = i <= left_keys;
+    bool is_left = i < left_count;
+    if (was_left != is_left) {
+      set_node_parent(pager, children[i],
+                      is_left ? left_page_num : right_page_num);
+    }
+  }
+
+  uint32_t left_max = keys[left_count - 1];
+  free(children);
+  free(keys);
+  unpin_page(pager, right_page_num);
+  unpin_page(pager, left_page_num);
+
+  if (merge) {
+    free_page(pager, right_page_num);
+    internal_node_remove_merged(table, parent_page_num, left_index);
+    return;
+  }
+
+  parent = get_page(pager, parent_page_num);
+  *internal_node_key(parent, left_index) = left_max;
+  pager_mark_dirty(pager, parent_page_num);
+  unpin_page(pager, parent_page_num);
+}
+
+void leaf_node_delete(Cursor* cursor) {
+  Pager* pager = cursor->table->pager;
+  uint32_t page_num = cursor->page_num;
+  void* node = get_page(pager, page_num);
+  pager_mark_dirty(pager, page_num);
+
+  leaf_node_free_overflow(pager, node, cursor->cell_num);
+  leaf_node_remove_cell(node, cursor->cell_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  bool underfull = leaf_node_used_space(node) < leaf_node_min_fill;
+
+  bool is_root = is_node_root(node);
+  bool max_changed = cursor->cell_num == num_cells && num_cells > 0;
+  uint32_t new_max = max_changed ? *leaf_node_key(node, num_cells - 1) : 0;
+  unpin_page(pager, page_num);
+
+  if (is_root) {
+    return;
+  }
+  if (max_changed) {
+    update_ancestor_max_key(cursor->table, page_num, new_max);
+  }
+  if (underfull) {
+    leaf_node_rebalance(cursor->table, page_num);
+  }
+}
+
+/*
+Rewrite the root page number in a created table's catalog row. The
+number has a fixed width, so the record keeps its size.
+*/
+void catalog_set_root(Table* catalog, uint32_t table_id,
+                      uint32_t root_page_num) {
+  Pager* pager = catalog->pager;
+  Cursor* cursor = table_find(catalog, table_id);
+  void* node = get_page(pager, cursor->page_num);
+  pager_mark_dirty(pager, cursor->page_num);
+  RecordStrings strings;
+  record_strings(leaf_node_value(node, cursor->cell_num), &strings);
+  char digits[CATALOG_ROOT_DIGITS + 1];
+  sprintf(digits, "%0*u", CATALOG_ROOT_DIGITS, root_page_num);
+  memcpy(strings.email, digits, CATALOG_ROOT_DIGITS);
+  unpin_page(pager, cursor->page_num);
+  free(cursor);
+}
+
+/* Record a table's new root wherever the database looks it up */
+void table_set_root(Table* table, uint32_t root_page_num) {
+  Pager* pager = table->pager;
+  if (table->catalog != NULL) {
+    catalog_set_root(table->catalog, table->table_id, root_page_num);
+  } else {
+    void* header = get_page(pager, FILE_HEADER_PAGE_NUM);
+    if (table->table_id == CATALOG_TABLE_ID) {
+      *header_catalog_root(header) = root_page_num;
+    } else {
+      *header_root_page(header) = root_page_num;
+    }
+    pager_mark_dirty(pager, FILE_HEADER_PAGE_NUM);
+    unpin_page(pager, FILE_HEADER_PAGE_NUM);
+  }
+  table->root_page_num = root_page_num;
+}
+
+Table* db_table_with_root(Database* db, uint32_t root_page_num) {
+  for (uint32_t i = 0; i < db->num_tables; i++) {
+    Table* table = db->tables[i];
+    if (table->root_page_num == root_page_num) {
+      return table;
+    }
+    for (uint32_t j = 0; j < table->num_indexes; j++) {
+      if (table->indexes[j]->root_page_num == root_page_num) {
+        return table->indexes[j];
+      }
+    }
+  }
+  return db->catalog;
+}
+
+uint32_t table_create_root(Pager* pager) {
+  uint32_t page_num = get_unused_page_num(pager);
+  void* root = get_page(pager, page_num);
+  initialize_leaf_node(root);
+  set_node_root(root, true);
+  pager_mark_dirty(pager, page_num);
+  unpin_page(pager, page_num);
+  return page_num;
+}
+
+/*
+Add a catalog row for a new table or index and return its id, creating
+the catalog first if this is the first one
+*/
+uint32_t catalog_add(Database* db, const char* name, uint32_t root_page_num,
+                     const char* schema) {
+  Pager* pager = db->pager;
+  if (db->catalog == NULL) {
+    db->catalog = table_open(pager, CATALOG_TABLE_ID, "", 0, NULL);
+    table_set_root(db->catalog, table_create_root(pager));
+  }
+
+  char email[CATALOG_ROOT_DIGITS + sizeof(TABLE_SCHEMA) + 1];
+  int email_length =
+      sprintf(email, "%0*u %s", CATALOG_ROOT_DIGITS, root_page_num, schema);
+  Row row;
+  row.id = db->next_table_id++;
+  strcpy(row.username, name);
+  row.email = NULL;
+  row_set_email(&row, email, email_length);
+  Cursor* cursor = table_find(db->catalog, row.id);
+  leaf_node_insert(cursor, row.id, &row);
+  free(cursor);
+  free(row.email);
+  return row.id;
+}
+
+/* Give the table an empty root leaf and a catalog row */
+ExecuteResult execute_create_table(Statement* statement, Database* db) {
+  if (db_find_table(db, statement->table_name) != NULL) {
+    return EXECUTE_TABLE_EXISTS;
+  }
+  Pager* pager = db->pager;
+  uint32_t root_page_num = table_create_root(pager);
+  uint32_t table_id =
+      catalog_add(db, statement->table_name, root_page_num, TABLE_SCHEMA);
+  pager_commit(pager);
+
+  db_add_table(db, table_open(pager, table_id, statement->table_name,
+                              root_page_num, db->catalog));
+  return EXECUTE_SUCCESS;
+}
+
+/*
+Return the leaf whose next_leaf pointer is page_num: the rightmost leaf
+of the nearest subtree to its left. The leftmost leaf has none, and
+INVALID_PAGE_NUM is returned.
+*/
+uint32_t find_previous_leaf(Pager* pager, uint32_t page_num) {
+  uint32_t child_page_num = page_num;
+  while (true) {
+    void* child = get_page(pager, child_page_num);
+    bool is_root = is_node_root(child);
+    uint32_t parent_page_num = *node_parent(child);
+    unpin_page(pager, child_page_num);
+    if (is_root) {
+      return INVALID_PAGE_NUM;
+    }
+
+    void* parent = get_page(pager, parent_page_num);
+    uint32_t index = internal_node_child_index(parent, child_page_num);
+    uint32_t sibling_page_num =
+        index > 0 ? *internal_node_child(parent, index - 1) : INVALID_PAGE_NUM;
+    unpin_page(pager, parent_page_num);
+
+    if (sibling_page_num != INVALID_PAGE_NUM) {
+      /* Walk down the right spine of the left sibling */
+      while (true) {
+        void* node = get_page(pager, sibling_page_num);
+        if (node_is_leaf(node)) {
+          unpin_page(pager, sibling_page_num);
+          return sibling_page_num;
+        }
+        uint32_t next_page_num = *internal_node_right_child(node);
+        unpin_page(pager, sibling_page_num);
+        sibling_page_num = next_page_num;
+      }
+    }
+    child_page_num = parent_page_num;
+  }
+}
+
+/*
+Move a node to another page and repoint everything that refers to it:
+the parent's child pointer (or wherever its table's root is recorded),
+the parent pointers of an internal node's children, and the previous
+leaf's next_leaf pointer.
+*/
+void relocate_page(Database* db, uint32_t source_page_num,
+                   uint32_t destination_page_num) {
+  Pager* pager = db->pager;
+  void* source = get_page(pager, source_page_num);
+  bool is_leaf = node_is_leaf(source);
+  bool is_root = is_node_root(source);
+  uint32_t parent_page_num = *node_parent(source);
+  unpin_page(pager, source_page_num);
+
+  // Look this up while the parent still points at the source page
+  uint32_t previous_leaf_page_num =
+      is_leaf ? find_previous_leaf(pager, source_page_num) : INVALID_PAGE_NUM;
+
+  source = get_page(pager, source_page_num);
+  void* destination = get_page(pager, destination_page_num);
+  pager_mark_dirty(pager, destination_page_num);
+  memcpy(destination, source, page_size);
+  if (!is_leaf) {
+    uint32_t num_keys = *internal_node_num_keys(destination);
+    for (uint32_t i = 0; i <= num_keys; i++) {
+      set_node_parent(pager, *internal_node_child(destination, i),
+                      destination_page_num);
+    }
+  }
+  unpin_page(pager, destination_page_num);
+  unpin_page(pager, source_page_num);
+
+  if (is_root) {
+    table_set_root(db_table_with_root(db, source_page_num),
+                   destination_page_num);
+  } else {
+    void* parent = get_page(pager, parent_page_num);
+    uint32_t num_keys = *internal_node_num_keys(parent);
+    for (uint32_t i = 0; i <= num_keys; i++) {
+      uint32_t* child = internal_node_child(parent, i);
+      if (*child == source_page_num) {
+        *child = destination_page_num;
+      }
+    }
+    pager_mark_dirty(pager, parent_page_num);
+    unpin_page(pager, parent_page_num);
+  }
+
+  if (previous_leaf_page_num != INVALID_PAGE_NUM) {
+    void* previous_leaf = get_page(pager, previous_leaf_page_num);
+    *leaf_node_next_leaf(previous_leaf) = destination_page_num;
+    pager_mark_dirty(pager, previous_leaf_page_num);
+    unpin_page(pager, previous_leaf_page_num);
+  }
+}
+
+/*
+Map each overflow page to the page that points at it: the leaf whose
+record starts the chain, or the previous page of the chain. Other
+pages map to 0.
+*/
+void map_leaf_overflow_owners(Pager* pager, uint32_t page_num,
+                              uint32_t* owners) {
+  void* node = get_page(pager, page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  for (uint32_t i = 0; i < num_cells; i++) {
+    uint32_t owner = page_num;
+    uint32_t overflow_page_num =
+        record_overflow_page(leaf_node_cell(pager, page_num, node, i).record);
+    while (overflow_page_num != 0) {
+      owners[overflow_page_num] = owner;
+      void* page = get_page(pager, overflow_page_num);
+      owner = overflow_page_num;
+      overflow_page_num = *overflow_next_page(page);
+      unpin_page(pager, owner);
+    }
+  }
+  unpin_page(pager, page_num);
+}
+
+void map_table_overflow_owners(Table* table, uint32_t* owners) {
+  Pager* pager = table->pager;
+  Cursor* cursor = table_find(table, 0);
+  uint32_t page_num = cursor->page_num;
+  free(cursor);
+  while (page_num != 0) {
+    map_leaf_overflow_owners(pager, page_num, owners);
+    void* node = get_page(pager, page_num);
+    uint32_t next_page_num = *leaf_node_next_leaf(node);
+    unpin_page(pager, page_num);
+    page_num = next_page_num;
+  }
+}
+
+uint32_t* map_overflow_owners(Database* db) {
+  uint32_t* owners = calloc(db->pager->num_pages, sizeof(uint32_t));
+  for (uint32_t i = 0; i < db->num_tables; i++) {
+    map_table_overflow_owners(db->tables[i], owners);
+  }
+  if (db->catalog != NULL) {
+    map_table_overflow_owners(db->catalog, owners);
+  }
+  return owners;
+}
+
+/*
+Move an overflow page and repoint its owner, either a leaf cell or the
+previous page of the chain
+*/
+void relocate_overflow_page(Pager* pager, uint32_t* owners,
+                            uint32_t source_page_num,
+                            uint32_t destination_page_num) {
+  void* source = get_page(pager, source_page_num);
+  void* destination = get_page(pager, destination_page_num);
+  pager_mark_dirty(pager, destination_page_num);
+  memcpy(destination, source, page_size);
+  uint32_t next_page_num = *overflow_next_page(source);
+  unpin_page(pager, destination_page_num);
+  unpin_page(pager, source_page_num);
+
+  uint32_t owner_page_num = owners[source_page_num];
+  void* owner = get_page(pager, owner_page_num);
+  pager_mark_dirty(pager, owner_page_num);
+  if (owners[owner_page_num] != 0) {
+    *overflow_next_page(owner) = destination_page_num;
+  } else {
+    /* A compressed leaf's records are patched decoded and encoded again */
+    uint32_t num_cells = *leaf_node_num_cells(owner);
+    for (uint32_t i = 0; i < num_cells; i++) {
+      void* record = leaf_node_cell(pager, owner_page_num, owner, i).record;
+      if (record_overflow_page(record) == source_page_num) {
+        memcpy(record + record_overflow_offset(record), &destination_page_num,
+               RECORD_OVERFLOW_PAGE_SIZE);
+      }
+    }
+    if (leaf_node_is_compressed(owner)) {
+      leaf_node_set_compressed_cells(owner, decoded_leaf.cells,
+                                     num_cells);
+    }
+  }
+  unpin_page(pager, owner_page_num);
+
+  owners[destination_page_num] = owner_page_num;
+  owners[source_page_num] = 0;
+  if (next_page_num != 0) {
+    owners[next_page_num] = destination_page_num;
+  }
+}
+
+int compare_page_nums(const void* a, const void* b) {
+  uint32_t left = *(const uint32_t*)a;
+  uint32_t right = *(const uint32_t*)b;
+  return (left > right) - (left < right);
+}
+
+/*
+Compact the file: empty the freelist, move the nodes and overflow pages
+at the end of the file into the lowest free pages, and truncate the
+free tail. The file itself shrinks at the next checkpoint.
+*/
+void db_vacuum(Database* db) {
+  Pager* pager = db->pager;
+  void* header = get_page(pager, FILE_HEADER_PAGE_NUM);
+  uint32_t num_free = *header_free_pages(header);
+  uint32_t trunk_page_num = *header_freelist_trunk(header);
+  if (num_free == 0) {
+    unpin_page(pager, FILE_HEADER_PAGE_NUM);
+    return;
+  }
+  *header_freelist_trunk(header) = 0;
+  *header_free_pages(header) = 0;
+  pager_mark_dirty(pager, FILE_HEADER_PAGE_NUM);
+  unpin_page(pager, FILE_HEADER_PAGE_NUM);
+
+  uint32_t* free_pages = malloc(sizeof(uint32_t) * num_free);
+  bool* is_free = calloc(pager->num_pages, sizeof(bool));
+  uint32_t count = 0;
+  while (trunk_page_num != 0) {
+    /* A page seen twice, as in a cycle, or one too many is corrupt */
+    void* trunk = get_page(pager, trunk_page_num);
+    uint32_t num_leaves = *freelist_num_leaves(trunk);
+    for (uint32_t i = 0; i <= num_leaves; i++) {
+      uint32_t page_num =
+          i == 0 ? trunk_page_num : *freelist_leaf(trunk, i - 1);
+      if (count == num_free || num_leaves > freelist_max_leaves ||
+          page_num == FILE_HEADER_PAGE_NUM || page_num >= pager->num_pages ||
+          is_free[page_num]) {
+        printf("Freelist is corrupt at page %d.\n", trunk_page_num);
+        db_fail();
+      }
+      is_free[page_num] = true;
+      free_pages[count++] = page_num;
+    }
+    uint32_t next_page_num = *freelist_next_trunk(trunk);
+    unpin_page(pager, trunk_page_num);
+    trunk_page_num = next_page_num;
+  }
+  if (count != num_free) {
+    printf("Freelist holds %d pages but the header counts %d.\n", count,
+           num_free);
+    db_fail();
+  }
+  qsort(free_pages, count, sizeof(uint32_t), compare_page_nums);
+  uint32_t* overflow_owners = map_overflow_owners(db);
+
+  uint32_t num_pages = pager->num_pages;
+  uint32_t next_free = 0;
+  while (true) {
+    while (is_free[num_pages - 1]) {
+      num_pages--;
+    }
+    if (next_free == count || free_pages[next_free] >= num_pages) {
+      break;
+    }
+    uint32_t source_page_num = num_pages - 1;
+    uint32_t destination_page_num = free_pages[next_free++];
+    if (overflow_owners[source_page_num] != 0) {
+      relocate_overflow_page(pager, overflow_owners, source_page_num,
+                             destination_page_num);
+    } else {
+      relocate_page(db, source_page_num, destination_page_num);
+      void* node = get_page(pager, destination_page_num);
+      bool is_leaf = get_node_type(node) == NODE_LEAF;
+      unpin_page(pager, destination_page_num);
+      if (is_leaf) {
+        map_leaf_overflow_owners(pager, destination_page_num, overflow_owners);
+      }
+    }
+    is_free[destination_page_num] = false;
+    is_free[source_page_num] = true;
+  }
+
+  free(overflow_owners);
+  free(is_free);
+  free(free_pages);
+  pager_truncate(pager, num_pages);
+}
+
+/*
+ * Bulk loading
+ * .import sorts its input into runs on disk, merges them with the rows
+ * already in the table, and builds a new tree bottom-up: leaves are
+ * packed left to right, and each completed node is appended to its
+ * parent on the level above.
+ */
+typedef struct {
+  uint32_t page_num;          // Node being filled, INVALID_PAGE_NUM if none
+  uint32_t count;             // Cells (leaf) or children (internal) so far
+  uint32_t max_key;           // Max key of the last cell or child added
+  uint32_t pending_page_num;  // Completed node not yet added to the parent
+  uint32_t pending_max_key;
+} BuildLevel;
+
+typedef struct {
+  Table* table;
+  uint32_t leaf_target;      // Bytes of cells per leaf
+  uint32_t internal_target;  // Children per internal node
+  uint32_t last_leaf_page_num;
+  void* record;  // A row being serialized
+  bool compress;        // Build compressed leaves
+  LeafCell last_cell;   // Cell cells are encoded against when compressing
+  uint32_t num_levels;
+  BuildLevel levels[BUILD_MAX_LEVELS];
+} TreeBuilder;
+
+void builder_add_child(TreeBuilder* builder, uint32_t level,
+                       uint32_t child_page_num, uint32_t child_max_key);
+
+/*
+The node being filled on this level is done. The node completed
+before it can now go into the parent; this one waits, so that the
+last two nodes on a level are still together when the build ends.
+*/
+void builder_finish_node(TreeBuilder* builder, uint32_t level) {
+  BuildLevel* build_level = &builder->levels[level];
+  if (build_level->pending_page_num != INVALID_PAGE_NUM) {
+    builder_add_child(builder, level + 1, build_level->pending_page_num,
+                      build_level->pending_max_key);
+  }
+  build_level->pending_page_num = build_level->page_num;
+  build_level->pending_max_key = build_level->max_key;
+  build_level->page_num = INVALID_PAGE_NUM;
+}
+
+uint32_t builder_start_node(TreeBuilder* builder, uint32_t level) {
+  Pager* pager = builder->table->pager;
+  if (level == builder->num_levels) {
+    if (level == BUILD_MAX_LEVELS) {
+      printf("Tree is deeper than %d levels.\n", BUILD_MAX_LEVELS);
+      db_fail();
+    }
+    builder->levels[level].pending_page_num = INVALID_PAGE_NUM;
+    builder->num_levels++;
+  }
+
+  uint32_t page_num = get_unused_page_num(pager);
+  void* node = get_page(pager, page_num);
+  pager_mark_dirty(pager, page_num);
+  if (level == 0) {
+    initialize_leaf_node(node);
+  } else {
+    initialize_internal_node(node);
+  }
+  unpin_page(pager, page_num);
+
+  BuildLevel* build_level = &builder->levels[level];
+  build_level->page_num = page_num;
+  build_level->count = 0;
+  return page_num;
+}
+
+void builder_add_child(TreeBuilder* builder, uint32_t level,
+                       uint32_t child_page_num, uint32_t child_max_key) {
+  Pager* pager = builder->table->pager;
+  BuildLevel* build_level = &builder->levels[level];
+  if (level < builder->num_levels &&
+      build_level->page_num != INVALID_PAGE_NUM &&
+      build_level->count == builder->internal_target) {
+    builder_finish_node(builder, level);
+  }
+  if (level == builder->num_levels ||
+      build_level->page_num == INVALID_PAGE_NUM) {
+    builder_start_node(builder, level);
+  }
+
+  uint32_t page_num = build_level->page_num;
+  void* node = get_page(pager, page_num);
+  pager_mark_dirty(pager, page_num);
+  if (build_level->count > 0) {
+    /* The previous right child becomes a cell keyed by its max key */
+    uint32_t num_keys = *internal_node_num_keys(node);
+    *internal_node_num_keys(node) = num_keys + 1;
+    *internal_node_child(node, num_keys) = *internal_node_right_child(node);
+    *internal_node_key(node, num_keys) = build_level->max_key;
+  }
+  *internal_node_right_child(node) = child_page_num;
+  unpin_page(pager, page_num);
+  set_node_parent(pager, child_page_num, page_num);
+
+  build_level->count++;
+  build_level->max_key = child_max_key;
+}
+
+void builder_add_cell(TreeBuilder* builder, uint32_t key, void* record,
+                      uint32_t record_size) {
+  Pager* pager = builder->table->pager;
+  BuildLevel* build_level = &builder->levels[0];
+  LeafCell cell = {key, record_size, record};
+  uint8_t encoded[LEAF_CELL_MAX_ENCODED_SIZE];
+  uint32_t encoded_size = 0;
+  if (builder->num_levels > 0 && build_level->page_num != INVALID_PAGE_NUM) {
+    void* node = get_page(pager, build_level->page_num);
+    bool full;
+    if (builder->compress) {
+      encoded_size = leaf_cell_encode(&builder->last_cell, &cell, encoded);
+      full = *leaf_node_encoded_size(node) + encoded_size >
+             builder->leaf_target;
+    } else {
+      full = leaf_node_used_space(node) + LEAF_NODE_SLOT_SIZE + record_size >
+             builder->leaf_target;
+    }
+    unpin_page(pager, build_level->page_num);
+    if (full) {
+      builder_finish_node(builder, 0);
+    }
+  }
+  if (builder->num_levels == 0 || build_level->page_num == INVALID_PAGE_NUM) {
+    if (builder->compress) {
+      /* The first cell of a leaf is encoded on its own */
+      encoded_size = leaf_cell_encode(NULL, &cell, encoded);
+    }
+    uint32_t page_num = builder_start_node(builder, 0);
+    if (builder->last_leaf_page_num != INVALID_PAGE_NUM) {
+      void* last_leaf = get_page(pager, builder->last_leaf_page_num);
+      *leaf_node_next_leaf(last_leaf) = page_num;
+      pager_mark_dirty(pager, builder->last_leaf_page_num);
+      unpin_page(pager, builder->last_leaf_page_num);
+    }
+    builder->last_leaf_page_num = page_num;
+  }
+
+  void* node = get_page(pager, build_level->page_num);
+  pager_mark_dirty(pager, build_level->page_num);
+  if (builder->compress) {
+    uint32_t size = *leaf_node_encoded_size(node);
+    memcpy(node + LEAF_NODE_HEADER_SIZE + size, encoded, encoded_size);
+    *leaf_node_num_cells(node) += 1;
+    *leaf_node_cell_content(node) = 0;
+    *leaf_node_encoded_size(node) = size + encoded_size;
+    builder->last_cell.key = key;
+    builder->last_cell.record_size = record_size;
+    memcpy(builder->last_cell.record, record, record_size);
+  } else {
+    memcpy(leaf_node_insert_cell(node, build_level->count, key, record_size),
+           record, record_size);
+  }
+  unpin_page(pager, build_level->page_num);
+
+  build_level->count++;
+  build_level->max_key = key;
+}
+
+void builder_add_row(TreeBuilder* builder, Row* row) {
+  serialize_row(builder->table->pager, row, builder->record);
+  builder_add_cell(builder, row->id, builder->record, row_record_size(row));
+}
+
+void builder_init(TreeBuilder* builder, Table* table, uint32_t fill_factor,
+                  bool compress) {
+  builder->table = table;
+  builder->leaf_target = leaf_node_space_for_cells * fill_factor / 100;
+  builder->internal_target = (internal_node_max_cells + 1) * fill_factor / 100;
+  if (builder->internal_target < internal_node_min_keys + 1) {
+    builder->internal_target = internal_node_min_keys + 1;
+  }
+  builder->last_leaf_page_num = INVALID_PAGE_NUM;
+  builder->record = malloc(RECORD_MAX_SIZE);
+  builder->compress = compress;
+  builder->last_cell.record = malloc(RECORD_MAX_SIZE);
+  builder->num_levels = 0;
+}
+
+/*
+Push the last node of every level into its parent and return the
+root: the first level that ended up with a single node.
+*/
+uint32_t builder_finish(TreeBuilder* builder) {
+  if (builder->num_levels == 0) {
+    return builder_start_node(builder, 0);  // No rows: an empty leaf
+  }
+
+  for (uint32_t level = 0;; level++) {
+    builder_finish_node(builder, level);
+    BuildLevel* build_level = &builder->levels[level];
+    if (level + 1 == builder->num_levels) {
+      return build_level->pending_page_num;
+    }
+    builder_add_child(builder, level + 1, build_level->pending_page_num,
+                      build_level->pending_max_key);
+  }
+}
+
+/*
+Only the last node on each level can be underfull. Rebalance
+those the way deletes do, shallowest first so that every node being
+rebalanced has a parent with a left sibling to offer.
+*/
+void builder_fix_right_spine(Table* table) {
+  Pager* pager = table->pager;
+  while (true) {
+    uint32_t underfull_page_num = INVALID_PAGE_NUM;
+    bool underfull_is_leaf = false;
+    uint32_t page_num = table->root_page_num;
+    while (underfull_page_num == INVALID_PAGE_NUM) {
+      void* node = get_page(pager, page_num);
+      bool is_leaf = get_node_type(node) == NODE_LEAF;
+      bool underfull =
+          is_leaf ? leaf_node_used_space(node) < leaf_node_min_fill
+                  : *internal_node_num_keys(node) < internal_node_min_keys;
+      if (underfull && page_num != table->root_page_num) {
+        underfull_page_num = page_num;
+        underfull_is_leaf = is_leaf;
+      }
+      uint32_t next_page_num =
+          is_leaf ? INVALID_PAGE_NUM : *internal_node_right_child(node);
+      unpin_page(pager, page_num);
+      if (is_leaf) {
+        break;
+      }
+      page_num = next_page_num;
+    }
+
+    if (underfull_page_num == INVALID_PAGE_NUM) {
+      return;
+    }
+    if (underfull_is_leaf) {
+      leaf_node_rebalance(table, underfull_page_num);
+    } else {
+      internal_node_rebalance(table, underfull_page_num);
+    }
+  }
+}
+
+void free_tree(Pager* pager, uint32_t page_num);
+
+/*
+Finish the build and make the new tree the table's, freeing the old
+one. The caller commits.
+*/
+void table_install_tree(Table* table, TreeBuilder* builder) {
+  Pager* pager = table->pager;
+  uint32_t root_page_num = builder_finish(builder);
+  void* root = get_page(pager, root_page_num);
+  set_node_root(root, true);
+  pager_mark_dirty(pager, root_page_num);
+  unpin_page(pager, root_page_num);
+
+  free_tree(pager, table->root_page_num);
+  table_set_root(table, root_page_num);
+
+  builder_fix_right_spine(table);
+  free(builder->record);
+  free(builder->last_cell.record);
+}
+
+void free_tree(Pager* pager, uint32_t page_num) {
+  void* node = get_page(pager, page_num);
+  bool is_leaf = node_is_leaf(node);
+  uint32_t num_keys = is_leaf ? 0 : *internal_node_num_keys(node);
+  unpin_page(pager, page_num);
+
+  for (uint32_t i = 0; !is_leaf && i <= num_keys; i++) {
+    node = get_page(pager, page_num);
+    uint32_t child_page_num = *internal_node_child(node, i);
+    unpin_page(pager, page_num);
+    free_tree(pager, child_page_num);
+  }
+  free_page(pager, page_num);
+}
+
+/*
+A sorted stream of rows feeding the merge: a run file, the rows still
+in memory, or the rows already in the table. Rows already in the table
+are passed on as records, so their overflow chains are neither read
+nor copied.
+*/
+typedef struct {
+  FILE* file;
+  Row* rows;
+  uint32_t num_rows;
+  uint32_t next_row;
+  Cursor* cursor;
+  void* record;  // Current record of the table run
+  uint32_t record_size;
+  Row row;  // Current row, valid unless done; only the id for the table run
+  bool done;
+} ImportRun;
+
+void import_write_row(FILE* file, Row* row) {
+  if (fwrite(&row->id, sizeof(row->id), 1, file) != 1 ||
+      fwrite(row->username, sizeof(row->username), 1, file) != 1 ||
+      fwrite(&row->email_length, sizeof(row->email_length), 1, file) != 1 ||
+      fwrite(row->email, 1, row->email_length, file) != row->email_length) {
+    printf("Error writing temporary file: %d\n", errno);
+    db_fail();
+  }
+}
+
+bool import_read_row(FILE* file, Row* row) {
+  uint32_t email_length;
+  if (fread(&row->id, sizeof(row->id), 1, file) != 1 ||
+      fread(row->username, sizeof(row->username), 1, file) != 1 ||
+      fread(&email_length, sizeof(email_length), 1, file) != 1) {
+    return false;
+  }
+  row->email = realloc(row->email, email_length + 1);
+  if (fread(row->email, 1, email_length, file) != email_length) {
+    printf("Error reading temporary file: %d\n", errno);
+    db_fail();
+  }
+  row->email[email_length] = '\0';
+  row->email_length = email_length;
+  return true;
+}
+
+void import_run_next(ImportRun* run) {
+  if (run->cursor != NULL) {
+    if (run->cursor->end_of_table) {
+      run->done = true;
+      return;
+    }
+    LeafCell cell = cursor_cell(run->cursor);
+    run->row.id = cell.key;
+    run->record_size = cell.record_size;
+    memcpy(run->record, cell.record, cell.record_size);
+    cursor_advance(run->cursor);
+  } else if (run->file != NULL) {
+    if (!import_read_row(run->file, &run->row)) {
+      run->done = true;
+      return;
+    }
+  } else {
+    if (run->next_row == run->num_rows) {
+      run->done = true;
+      return;
+    }
+    run->row = run->rows[run->next_row++];
+  }
+}
+
+int compare_rows_by_id(const void* a, const void* b) {
+  uint32_t left = ((const Row*)a)->id;
+  uint32_t right = ((const Row*)b)->id;
+  return (left > right) - (left < right);
+}
+
+FILE* import_write_run(Row* rows, uint32_t num_rows) {
+  qsort(rows, num_rows, sizeof(Row), compare_rows_by_id);
+  FILE* file = tmpfile();
+  if (file == NULL) {
+    printf("Unable to create a temporary file for sorting: %d\n", errno);
+    db_fail();
+  }
+
+  for (uint32_t i = 0; i < num_rows; i++) {
+    import_write_row(file, &rows[i]);
+  }
+  rewind(file);
+  return file;
+}
+
+/*
+Parse one "id,username,email" line
+*/
+bool import_parse_line(char* line, Row* row) {
+  char* id_string = strtok(line, ",");
+  char* username = strtok(NULL, ",");
+  char* email = strtok(NULL, ",\r\n");
+  if (strtok(NULL, "\r\n") != NULL) {
+    return false;
+  }
+  return prepare_row(id_string, username, email, row) == PREPARE_SUCCESS;
+}
+
+void table_rebuild_indexes(Table* table);
+
+/*
+Load "id,username,email" lines from a file. The input is sorted in
+runs of IMPORT_RUN_ROWS rows, spilled to temporary files when there is
+more than one, and merged with the existing rows into a new tree.
+Nodes are packed to fill_factor percent. Rows whose id is already
+present are skipped.
+*/
+void table_import(Table* table, const char* filename, uint32_t fill_factor) {
+  FILE* input = fopen(filename, "r");
+  if (input == NULL) {
+    printf("Unable to open '%s'.\n", filename);
+    return;
+  }
+
+  Row* rows = calloc(IMPORT_RUN_ROWS, sizeof(Row));
+  uint32_t num_rows = 0;
+  uint32_t runs_capacity = 8;
+  ImportRun* runs = malloc(sizeof(ImportRun) * runs_capacity);
+  uint32_t num_runs = 1;  // runs[0] reads the existing table
+  char* line = NULL;
+  size_t line_capacity = 0;
+  uint32_t line_num = 0;
+  bool parse_error = false;
+
+  while (getline(&line, &line_capacity, input) != -1) {
+    line_num++;
+    if (strspn(line, " \t\r\n") == strlen(line)) {
+      continue;
+    }
+    if (!import_parse_line(line, &rows[num_rows])) {
+      printf("Error: could not import line %d of '%s'.\n", line_num,
+             filename);
+      parse_error = true;
+      break;
+    }
+    if (++num_rows == IMPORT_RUN_ROWS) {
+      if (num_runs == runs_capacity) {
+        runs_capacity *= 2;
+        runs = realloc(runs, sizeof(ImportRun) * runs_capacity);
+      }
+      memset(&runs[num_runs], 0, sizeof(ImportRun));
+      runs[num_runs++].file = import_write_run(rows, num_rows);
+      num_rows = 0;
+    }
+  }
+  free(line);
+  fclose(input);
+
+  if (!parse_error) {
+    if (num_rows > 0) {
+      // The last run stays in memory
+      qsort(rows, num_rows, sizeof(Row), compare_rows_by_id);
+      if (num_runs == runs_capacity) {
+        runs = realloc(runs, sizeof(ImportRun) * ++runs_capacity);
+      }
+      memset(&runs[num_runs], 0, sizeof(ImportRun));
+      runs[num_runs].rows = rows;
+      runs[num_runs++].num_rows = num_rows;
+    }
+    memset(&runs[0], 0, sizeof(ImportRun));
+    runs[0].cursor = table_start(table);
+    runs[0].record = malloc(RECORD_MAX_SIZE);
+    for (uint32_t i = 0; i < num_runs; i++) {
+      import_run_next(&runs[i]);
+    }
+
+    TreeBuilder builder;
+    builder_init(&builder, table, fill_factor, false);
+
+    /* Ties go to the lowest run, so existing rows win over imported ones */
+    uint32_t imported = 0;
+    uint32_t duplicates = 0;
+    bool have_last_id = false;
+    uint32_t last_id = 0;
+    while (true) {
+      ImportRun* next = NULL;
+      for (uint32_t i = 0; i < num_runs; i++) {
+        if (!runs[i].done && (next == NULL || runs[i].row.id < next->row.id)) {
+          next = &runs[i];
+        }
+      }
+      if (next == NULL) {
+        break;
+      }
+      if (have_last_id && next->row.id == last_id) {
+        duplicates++;
+      } else {
+        if (next == &runs[0]) {
+          builder_add_cell(&builder, next->row.id, next->record,
+                           next->record_size);
+        } else {
+          builder_add_row(&builder, &next->row);
+          imported++;
+        }
+        have_last_id = true;
+        last_id = next->row.id;
+      }
+      import_run_next(next);
+    }
+
+    table_install_tree(table, &builder);
+    table_rebuild_indexes(table);
+    pager_commit(table->pager);
+
+    printf("Imported %d rows.\n", imported);
+    if (duplicates > 0) {
+      printf("Skipped %d rows with duplicate keys.\n", duplicates);
+    }
+    free(runs[0].cursor);
+    free(runs[0].record);
+  }
+
+  for (uint32_t i = 1; i < num_runs; i++) {
+    if (runs[i].file != NULL) {
+      fclose(runs[i].file);
+      free(runs[i].row.email);
+    }
+  }
+  free(runs);
+  for (uint32_t i = 0; i < IMPORT_RUN_ROWS; i++) {
+    free(rows[i].email);
+  }
+  free(rows);
+}
+
+/*
+Rebuild the table with compressed leaves: keys are stored as deltas
+and each string as the prefix and suffix it shares with the previous
+row's, which suits tables that are mostly read. A leaf is expanded
+back into ordinary leaves the first time it is written to.
+*/
+void table_compress(Table* table) {
+  ImportRun run;
+  memset(&run, 0, sizeof(ImportRun));
+  run.cursor = table_start(table);
+  run.record = malloc(RECORD_MAX_SIZE);
+  import_run_next(&run);
+
+  TreeBuilder builder;
+  builder_init(&builder, table, 100, true);
+  while (!run.done) {
+    builder_add_cell(&builder, run.row.id, run.record, run.record_size);
+    import_run_next(&run);
+  }
+  table_install_tree(table, &builder);
+  pager_commit(table->pager);
+
+  free(run.cursor);
+  free(run.record);
+}
+
+/*
+ * Secondary indexes
+ * An index holds one entry per row of its table (see Index Node Layout).
+ * Every statement that changes the table changes its indexes too, and a
+ * select with a condition on an indexed column reads the matching
+ * entries instead of every row. Removing an entry never merges leaves:
+ * a leaf left empty stays in the tree until entries land in it again.
+ */
+
+void index_entry_init(IndexEntry* entry, const void* value, uint32_t length,
+                      uint32_t row_id) {
+  memset(entry->key, 0, INDEX_KEY_SIZE);
+  memcpy(entry->key, value, length < INDEX_KEY_SIZE ? length : INDEX_KEY_SIZE);
+  entry->row_id = row_id;
+}
+
+void index_entry_of_row(Table* index, Row* row, IndexEntry* entry) {
+  if (index->indexed_column == COLUMN_USERNAME) {
+    index_entry_init(entry, row->username, strlen(row->username), row->id);
+  } else {
+    index_entry_init(entry, row->email, row->email_length, row->id);
+  }
+}
+
+/* The key bytes are all kept in the record, so no overflow page is read */
+void index_entry_of_record(Table* index, uint32_t row_id, void* record,
+                           IndexEntry* entry) {
+  RecordStrings strings;
+  record_strings(record, &strings);
+  if (index->indexed_column == COLUMN_USERNAME) {
+    index_entry_init(entry, strings.username, strings.username_length, row_id);
+  } else {
+    index_entry_init(entry, strings.email, strings.email_local_length, row_id);
+  }
+}
+
+int compare_index_entries(const void* a, const void* b) {
+  const IndexEntry* left = a;
+  const IndexEntry* right = b;
+  int result = memcmp(left->key, right->key, INDEX_KEY_SIZE);
+  if (result != 0) {
+    return result;
+  }
+  return (left->row_id > right->row_id) - (left->row_id < right->row_id);
+}
+
+void initialize_index_leaf_node(void* node) {
+  set_node_type(node, NODE_INDEX_LEAF);
+  set_node_root(node, false);
+  *leaf_node_num_cells(node) = 0;
+  *leaf_node_next_leaf(node) = 0;  // 0 represents no sibling
+}
+
+void initialize_index_internal_node(void* node) {
+  set_node_type(node, NODE_INDEX_INTERNAL);
+  set_node_root(node, false);
+  *internal_node_num_keys(node) = 0;
+  *internal_node_right_child(node) = INVALID_PAGE_NUM;
+}
+
+uint32_t index_create_root(Pager* pager) {
+  uint32_t page_num = get_unused_page_num(pager);
+  void* root = get_page(pager, page_num);
+  initialize_index_leaf_node(root);
+  set_node_root(root, true);
+  pager_mark_dirty(pager, page_num);
+  unpin_page(pager, page_num);
+  return page_num;
+}
+
+/* Return the position of the first entry >= entry in an index leaf */
+uint32_t index_leaf_node_find(void* node, IndexEntry* entry) {
+  uint32_t min_index = 0;
+  uint32_t one_past_max_index = *leaf_node_num_cells(node);
+  while (one_past_max_index != min_index) {
+    uint32_t index = (min_index + one_past_max_index) / 2;
+    if (compare_index_entries(index_leaf_node_entry(node, index), entry) < 0) {
+      min_index = index + 1;
+    } else {
+      one_past_max_index = index;
+    }
+  }
+  return min_index;
+}
+
+/* Return the index of the child whose subtree would hold the entry */
+uint32_t index_internal_node_find_child(void* node, IndexEntry* entry) {
+  uint32_t min_index = 0;
+  uint32_t max_index = *internal_node_num_keys(node);
+  while (min_index != max_index) {
+    uint32_t index = (min_index + max_index) / 2;
+    if (compare_index_entries(index_internal_node_entry(node, index), entry) <
+        0) {
+      min_index = index + 1;
+    } else {
+      max_index = index;
+    }
+  }
+  return min_index;
+}
+
+uint32_t index_find_leaf(Table* index, IndexEntry* entry) {
+  Pager* pager = index->pager;
+  uint32_t page_num = index->root_page_num;
+  while (true) {
+    void* node = get_page(pager, page_num);
+    if (get_node_type(node) == NODE_INDEX_LEAF) {
+      unpin_page(pager, page_num);
+      return page_num;
+    }
+    uint32_t child_page_num =
+        *internal_node_child(node, index_internal_node_find_child(node, entry));
+    unpin_page(pager, page_num);
+    page_num = child_page_num;
+  }
+}
+
+/* Move a cursor that is past the end of its leaf on to the next entry */
+void index_cursor_settle(Cursor* cursor) {
+  Pager* pager = cursor->table->pager;
+  while (true) {
+    void* node = get_page(pager, cursor->page_num);
+    uint32_t num_entries = *leaf_node_num_cells(node);
+    uint32_t next_page_num = *leaf_node_next_leaf(node);
+    unpin_page(pager, cursor->page_num);
+    if (cursor->cell_num < num_entries) {
+      return;
+    }
+    if (next_page_num == 0) {
+      cursor->end_of_table = true;
+      return;
+    }
+    cursor->page_num = next_page_num;
+    cursor->cell_num = 0;
+  }
+}
+
+/* Return a cursor at the first entry >= entry */
+Cursor* index_seek(Table* index, IndexEntry* entry) {
+  Cursor* cursor = malloc(sizeof(Cursor));
+  cursor->table = index;
+  cursor->page_num = index_find_leaf(index, entry);
+  void* node = get_page(index->pager, cursor->page_num);
+  cursor->cell_num = index_leaf_node_find(node, entry);
+  unpin_page(index->pager, cursor->page_num);
+  cursor->end_of_table = false;
+  cursor->latch = LATCH_NONE;
+  index_cursor_settle(cursor);
+  return cursor;
+}
+
+void index_cursor_advance(Cursor* cursor) {
+  cursor->cell_num++;
+  index_cursor_settle(cursor);
+}
+
+IndexEntry index_cursor_entry(Cursor* cursor) {
+  Pager* pager = cursor->table->pager;
+  void* node = get_page(pager, cursor->page_num);
+  IndexEntry entry;
+  memcpy(&entry, index_leaf_node_entry(node, cursor->cell_num),
+         INDEX_ENTRY_SIZE);
+  unpin_page(pager, cursor->page_num);
+  return entry;
+}
+
+/*
+Move the root's contents to a new page below it, which becomes the
+root's only child. The root can then be split like any other node and
+keeps its page number. Returns the new page.
+*/
+uint32_t index_grow_root(Table* index) {
+  Pager* pager = index->pager;
+  uint32_t root_page_num = index->root_page_num;
+  uint32_t child_page_num = get_unused_page_num(pager);
+  void* root = get_page(pager, root_page_num);
+  void* child = get_page(pager, child_page_num);
+  memcpy(child, root, page_size);
+  set_node_root(child, false);
+  *node_parent(child) = root_page_num;
+  bool is_leaf = node_is_leaf(child);
+  uint32_t num_keys = is_leaf ? 0 : *internal_node_num_keys(child);
+  initialize_index_internal_node(root);
+  set_node_root(root, true);
+  *internal_node_right_child(root) = child_page_num;
+  pager_mark_dirty(pager, root_page_num);
+  pager_mark_dirty(pager, child_page_num);
+  unpin_page(pager, root_page_num);
+
+  for (uint32_t i = 0; !is_leaf && i <= num_keys; i++) {
+    set_node_parent(pager, *internal_node_child(child, i), child_page_num);
+  }
+  unpin_page(pager, child_page_num);
+  return child_page_num;
+}
+
+/*
+Split a full node. The first left_size entries of a leaf, or children
+of an internal node, stay; the rest move to a new sibling on its
+right. The parent is split first if it is full too.
+*/
+void index_split(Table* index, uint32_t page_num, uint32_t left_size) {
+  Pager* pager = index->pager;
+  void* node = get_page(pager, page_num);
+  bool is_root = is_node_root(node);
+  unpin_page(pager, page_num);
+  if (is_root) {
+    page_num = index_grow_root(index);
+  }
+
+  node = get_page(pager, page_num);
+  uint32_t parent_page_num = *node_parent(node);
+  unpin_page(pager, page_num);
+  void* parent = get_page(pager, parent_page_num);
+  uint32_t parent_num_keys = *internal_node_num_keys(parent);
+  unpin_page(pager, parent_page_num);
+  if (parent_num_keys >= index_internal_node_max_cells) {
+    index_split(index, parent_page_num, (parent_num_keys + 1) / 2);
+    node = get_page(pager, page_num);
+    parent_page_num = *node_parent(node);
+    unpin_page(pager, page_num);
+  }
+
+  uint32_t new_page_num = get_unused_page_num(pager);
+  node = get_page(pager, page_num);
+  void* new_node = get_page(pager, new_page_num);
+  IndexEntry separator;
+  uint32_t num_moved_children = 0;
+  if (get_node_type(node) == NODE_INDEX_LEAF) {
+    initialize_index_leaf_node(new_node);
+    uint32_t num_entries = *leaf_node_num_cells(node);
+    memcpy(index_leaf_node_entry(new_node, 0),
+           index_leaf_node_entry(node, left_size),
+           (num_entries - left_size) * INDEX_ENTRY_SIZE);
+    *leaf_node_num_cells(new_node) = num_entries - left_size;
+    *leaf_node_num_cells(node) = left_size;
+    *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(node);
+    *leaf_node_next_leaf(node) = new_page_num;
+    memcpy(&separator, index_leaf_node_entry(node, left_size - 1),
+           INDEX_ENTRY_SIZE);
+  } else {
+    /*
+    The last child that stays becomes the right child, and its max entry
+    goes up to the parent
+    */
+    initialize_index_internal_node(new_node);
+    uint32_t num_keys = *internal_node_num_keys(node);
+    num_moved_children = num_keys + 1 - left_size;
+    memcpy(index_internal_node_cell(new_node, 0),
+           index_internal_node_cell(node, left_size),
+           (num_keys - left_size) * INDEX_INTERNAL_NODE_CELL_SIZE);
+    *internal_node_num_keys(new_node) = num_keys - left_size;
+    *internal_node_right_child(new_node) = *internal_node_right_child(node);
+    memcpy(&separator, index_internal_node_entry(node, left_size - 1),
+           INDEX_ENTRY_SIZE);
+    *internal_node_right_child(node) =
+        *internal_node_child(node, left_size - 1);
+    *internal_node_num_keys(node) = left_size - 1;
+  }
+  *node_parent(new_node) = parent_page_num;
+  pager_mark_dirty(pager, page_num);
+  pager_mark_dirty(pager, new_page_num);
+  unpin_page(pager, page_num);
+
+  for (uint32_t i = 0; i < num_moved_children; i++) {
+    set_node_parent(pager, *internal_node_child(new_node, i), new_page_num);
+  }
+  unpin_page(pager, new_page_num);
+
+  /*
+  The node keeps its cell in the parent with the separator as its max
+  entry. The new node takes the node's old place: its old cell's max
+  entry, or the right child.
+  */
+  parent = get_page(pager, parent_page_num);
+  uint32_t num_keys = *internal_node_num_keys(parent);
+  uint32_t child_index = internal_node_child_index(parent, page_num);
+  void* cell = index_internal_node_cell(parent, child_index);
+  memmove(cell + INDEX_INTERNAL_NODE_CELL_SIZE, cell,
+          (num_keys - child_index) * INDEX_INTERNAL_NODE_CELL_SIZE);
+  *internal_node_num_keys(parent) = num_keys + 1;
+  *index_internal_node_cell(parent, child_index) = page_num;
+  memcpy(index_internal_node_entry(parent, child_index), &separator,
+         INDEX_ENTRY_SIZE);
+  if (child_index == num_keys) {
+    *internal_node_right_child(parent) = new_page_num;
+  } else {
+    *index_internal_node_cell(parent, child_index + 1) = new_page_num;
+  }
+  pager_mark_dirty(pager, parent_page_num);
+  unpin_page(pager, parent_page_num);
+}
+
+void index_insert(Table* index, IndexEntry* entry) {
+  Pager* pager = index->pager;
+  uint32_t page_num = index_find_leaf(index, entry);
+  void* node = get_page(pager, page_num);
+  uint32_t num_entries = *leaf_node_num_cells(node);
+  if (num_entries >= index_leaf_node_max_entries) {
+    /* Entries added in order fill each leaf rather than leaving halves */
+    bool appending =
+        *leaf_node_next_leaf(node) == 0 &&
+        compare_index_entries(entry, index_leaf_node_entry(
+                                         node, num_entries - 1)) > 0;
+    unpin_page(pager, page_num);
+    index_split(index, page_num, appending ? num_entries : num_entries / 2);
+    page_num = index_find_leaf(index, entry);
+    node = get_page(pager, page_num);
+    num_entries = *leaf_node_num_cells(node);
+  }
+
+  uint32_t position = index_leaf_node_find(node, entry);
+  void* destination = index_leaf_node_entry(node, position);
+  memmove(destination + INDEX_ENTRY_SIZE, destination,
+          (num_entries - position) * INDEX_ENTRY_SIZE);
+  memcpy(destination, entry, INDEX_ENTRY_SIZE);
+  *leaf_node_num_cells(node) = num_entries + 1;
+  pager_mark_dirty(pager, page_num);
+  unpin_page(pager, page_num);
+}
+
+/*
+Remove an entry from its leaf. Index leaves are never merged or freed:
+one left empty stays linked in the tree, where scans step over it (see
+index_cursor_settle()) and only entries that sort into it reuse it. An
+index therefore keeps as many pages as it had at its largest, and
+.vacuum cannot return them.
+*/
+void index_delete(Table* index, IndexEntry* entry) {
+  Pager* pager = index->pager;
+  uint32_t page_num = index_find_leaf(index, entry);
+  void* node = get_page(pager, page_num);
+  uint32_t num_entries = *leaf_node_num_cells(node);
+  uint32_t position = index_leaf_node_find(node, entry);
+  void* source = index_leaf_node_entry(node, position);
+  if (position == num_entries || compare_index_entries(source, entry) != 0) {
+    printf("Index has no entry for row %d.\n", entry->row_id);
+    db_fail();
+  }
+  memmove(source, source + INDEX_ENTRY_SIZE,
+          (num_entries - position - 1) * INDEX_ENTRY_SIZE);
+  *leaf_node_num_cells(node) = num_entries - 1;
+  pager_mark_dirty(pager, page_num);
+  unpin_page(pager, page_num);
+}
+
+/* Fill an empty index from the rows already in its table */
+void index_build(Table* index, Table* table) {
+  uint32_t capacity = 1024;
+  uint32_t num_entries = 0;
+  IndexEntry* entries = malloc(sizeof(IndexEntry) * capacity);
+  Cursor* cursor = table_start(table);
+  while (!cursor->end_of_table) {
+    if (num_entries == capacity) {
+      capacity *= 2;
+      entries = realloc(entries, sizeof(IndexEntry) * capacity);
+    }
+    LeafCell cell = cursor_cell(cursor);
+    index_entry_of_record(index, cell.key, cell.record,
+                          &entries[num_entries++]);
+    cursor_advance(cursor);
+  }
+  free(cursor);
+
+  qsort(entries, num_entries, sizeof(IndexEntry), compare_index_entries);
+  for (uint32_t i = 0; i < num_entries; i++) {
+    index_insert(index, &entries[i]);
+  }
+  free(entries);
+}
+
+/* Build the table's indexes again after its tree was replaced */
+void table_rebuild_indexes(Table* table) {
+  for (uint32_t i = 0; i < table->num_indexes; i++) {
+    Table* index = table->indexes[i];
+    free_tree(index->pager, index->root_page_num);
+    table_set_root(index, index_create_root(index->pager));
+    index_build(index, table);
+  }
+}
+
+Table* table_find_index(Table* table, Column column) {
+  for (uint32_t i = 0; i < table->num_indexes; i++) {
+    if (table->indexes[i]->indexed_column == column) {
+      return table->indexes[i];
+    }
+  }
+  return NULL;
+}
+
+void table_index_row(Table* table, Row* row) {
+  for (uint32_t i = 0; i < table->num_indexes; i++) {
+    IndexEntry entry;
+    index_entry_of_row(table->indexes[i], row, &entry);
+    index_insert(table->indexes[i], &entry);
+  }
+}
+
+/*
+Return the entries of the row at the cursor, one per index of its
+table, taken before the row changes. The caller frees them.
+*/
+IndexEntry* table_index_entries(Table* table, Cursor* cursor) {
+  IndexEntry* entries = malloc(sizeof(IndexEntry) * table->num_indexes);
+  LeafCell cell = cursor_cell(cursor);
+  for (uint32_t i = 0; i < table->num_indexes; i++) {
+    index_entry_of_record(table->indexes[i], cell.key, cell.record,
+                          &entries[i]);
+  }
+  return entries;
+}
 
-  uint32_t child_index = internal_node_find_child(node, key);
-  uint32_t child_num = *internal_node_child(node, child_index);
-  void* child = get_page(table->pager, child_num);
-  switch (get_node_type(child)) {
-    case NODE_LEAF:
-      return leaf_node_find(table, child_num, key);
-    case NODE_INTERNAL:
-      return internal_node_find(table, child_num, key);
+void table_unindex_row(Table* table, IndexEntry* entries) {
+  for (uint32_t i = 0; i < table->num_indexes; i++) {
+    index_delete(table->indexes[i], &entries[i]);
+  }
+}
+
+/* Replace the entries of a row whose indexed values changed */
+void table_reindex_row(Table* table, IndexEntry* old_entries, Row* row) {
+  for (uint32_t i = 0; i < table->num_indexes; i++) {
+    IndexEntry entry;
+    index_entry_of_row(table->indexes[i], row, &entry);
+    if (compare_index_entries(&entry, &old_entries[i]) != 0) {
+      index_delete(table->indexes[i], &old_entries[i]);
+      index_insert(table->indexes[i], &entry);
+    }
   }
 }
 
 /*
-Return the position of the given key.
-If the key is not present, return the position
-where it should be inserted
+Build an index on one of a table's columns from the rows it holds, and
+record it in the catalog
 */
-Cursor* table_find(Table* table, uint32_t key) {
-  uint32_t root_page_num = table->root_page_num;
-  void* root_node = get_page(table->pager, root_page_num);
+ExecuteResult execute_create_index(Statement* statement, Database* db) {
+  Table* table = db_find_table(db, statement->table_name);
+  if (table == NULL) {
+    return EXECUTE_NO_SUCH_TABLE;
+  }
+  if (table_find_index(table, statement->column_to_index) != NULL) {
+    return EXECUTE_INDEX_EXISTS;
+  }
 
-  if (get_node_type(root_node) == NODE_LEAF) {
-    return leaf_node_find(table, root_page_num, key);
+  Pager* pager = db->pager;
+  char schema[sizeof(INDEX_SCHEMA_PREFIX) + COLUMN_USERNAME_SIZE];
+  sprintf(schema, "%s%s", INDEX_SCHEMA_PREFIX,
+          column_name(statement->column_to_index));
+  uint32_t root_page_num = index_create_root(pager);
+  uint32_t index_id = catalog_add(db, table->name, root_page_num, schema);
+  Table* index =
+      table_open(pager, index_id, table->name, root_page_num, db->catalog);
+  index->indexed_column = statement->column_to_index;
+  index_build(index, table);
+  pager_commit(pager);
+
+  table_add_index(table, index);
+  return EXECUTE_SUCCESS;
+}
+
+bool cursor_is_at_key(Cursor* cursor, uint32_t key) {
+  void* node = get_page(cursor->table->pager, cursor->page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  unpin_page(cursor->table->pager, cursor->page_num);
+  return cursor->cell_num < num_cells && cursor_key(cursor) == key;
+}
+
+/*
+Return one past the last of the sorted rows, starting at first, that
+belong in the cursor's leaf: those up to the leaf's max key, or all of
+them if this is the rightmost leaf.
+*/
+uint32_t leaf_node_group_end(Cursor* cursor, Row* rows, uint32_t first,
+                             uint32_t num_rows) {
+  Pager* pager = cursor->table->pager;
+  void* node = get_page(pager, cursor->page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  bool rightmost = *leaf_node_next_leaf(node) == 0;
+  uint32_t max_key = num_cells > 0 ? leaf_node_max_key(node) : 0;
+  unpin_page(pager, cursor->page_num);
+
+  uint32_t end = first + 1;
+  while (end < num_rows && (rightmost || rows[end].id <= max_key)) {
+    end++;
+  }
+  return end;
+}
+
+/*
+Insert a batch of rows with one descent per target leaf. The batch is
+sorted and checked for duplicates first, so it is applied all or
+nothing.
+*/
+ExecuteResult execute_insert_values(Statement* statement, Table* table) {
+  Row* rows = statement->rows_to_insert;
+  uint32_t num_rows = statement->num_rows_to_insert;
+  qsort(rows, num_rows, sizeof(Row), compare_rows_by_id);
+  for (uint32_t i = 1; i < num_rows; i++) {
+    if (rows[i].id == rows[i - 1].id) {
+      return EXECUTE_DUPLICATE_KEY;
+    }
+  }
+
+  pager_advise(table->pager, ACCESS_RANDOM);
+  for (uint32_t first = 0; first < num_rows;) {
+    Cursor* cursor = table_find(table, rows[first].id);
+    uint32_t end = leaf_node_group_end(cursor, rows, first, num_rows);
+    for (uint32_t i = first; i < end; i++) {
+      Cursor* found = leaf_node_find(table, cursor->page_num, rows[i].id);
+      bool duplicate = cursor_is_at_key(found, rows[i].id);
+      free(found);
+      if (duplicate) {
+        free(cursor);
+        return EXECUTE_DUPLICATE_KEY;
+      }
+    }
+    free(cursor);
+    first = end;
+  }
+
+  for (uint32_t first = 0; first < num_rows;) {
+    Cursor* cursor =
+        cursor_expand_leaf(table_find(table, rows[first].id), rows[first].id);
+    uint32_t end = leaf_node_group_end(cursor, rows, first, num_rows);
+    leaf_node_insert_many(cursor, rows + first, end - first);
+    free(cursor);
+    first = end;
+  }
+  for (uint32_t i = 0; i < num_rows; i++) {
+    table_index_row(table, &rows[i]);
+  }
+  pager_commit(table->pager);
+
+  return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_insert(Statement* statement, Table* table) {
+  if (statement->rows_to_insert != NULL) {
+    return execute_insert_values(statement, table);
+  }
+
+  Row* row_to_insert = &(statement->row_to_insert);
+  uint32_t key_to_insert = row_to_insert->id;
+  pager_advise(table->pager, ACCESS_RANDOM);
+  Cursor* cursor = table_find(table, key_to_insert);
+
+  if (cursor_is_at_key(cursor, key_to_insert)) {
+    free(cursor);
+    return EXECUTE_DUPLICATE_KEY;
+  }
+
+  cursor = cursor_expand_leaf(cursor, key_to_insert);
+  leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
+  table_index_row(table, row_to_insert);
+  pager_commit(table->pager);
+
+  free(cursor);
+
+  return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_update(Statement* statement, Table* table) {
+  Row* row_to_update = &(statement->row_to_insert);
+  pager_advise(table->pager, ACCESS_RANDOM);
+  Cursor* cursor = table_find_id(table, row_to_update->id);
+  if (!cursor_is_at_key(cursor, row_to_update->id)) {
+    free(cursor);
+    return EXECUTE_KEY_NOT_FOUND;
+  }
+  cursor = cursor_expand_leaf(cursor, row_to_update->id);
+  IndexEntry* old_entries = table_index_entries(table, cursor);
+
+  /*
+  The old overflow chain is freed first. A record that is no bigger is
+  rewritten in place; a bigger one is removed and inserted again, which
+  may split the leaf.
+  */
+  Pager* pager = table->pager;
+  void* node = get_page(pager, cursor->page_num);
+  pager_mark_dirty(pager, cursor->page_num);
+  uint32_t record_size = row_record_size(row_to_update);
+  uint32_t old_record_size = *leaf_node_record_size(node, cursor->cell_num);
+  bool in_place = record_size <= old_record_size;
+  bool underfull = false;
+  leaf_node_free_overflow(pager, node, cursor->cell_num);
+  if (in_place) {
+    void* record = leaf_node_value(node, cursor->cell_num);
+    serialize_row(pager, row_to_update, record);
+    *leaf_node_record_size(node, cursor->cell_num) = record_size;
+    *leaf_node_fragmented(node) += old_record_size - record_size;
+    underfull = !is_node_root(node) &&
+                leaf_node_used_space(node) < leaf_node_min_fill;
   } else {
-    return internal_node_find(table, root_page_num, key);
+    leaf_node_remove_cell(node, cursor->cell_num);
+  }
+  unpin_page(pager, cursor->page_num);
+
+  if (!in_place) {
+    leaf_node_insert(cursor, row_to_update->id, row_to_update);
+  } else if (underfull) {
+    leaf_node_rebalance(table, cursor->page_num);
   }
+  table_reindex_row(table, old_entries, row_to_update);
+  pager_commit(pager);
+
+  free(old_entries);
+  free(cursor);
+  return EXECUTE_SUCCESS;
 }
 
-Cursor* table_start(Table* table) {
-  Cursor* cursor = table_find(table, 0);
+ExecuteResult execute_delete(Statement* statement, Table* table) {
+  pager_advise(table->pager, ACCESS_RANDOM);
+  Cursor* cursor = table_find_id(table, statement->id_to_delete);
+  if (!cursor_is_at_key(cursor, statement->id_to_delete)) {
+    free(cursor);
+    return EXECUTE_KEY_NOT_FOUND;
+  }
 
-  void* node = get_page(table->pager, cursor->page_num);
-  uint32_t num_cells = *leaf_node_num_cells(node);
-  cursor->end_of_table = (num_cells == 0);
+  cursor = cursor_expand_leaf(cursor, statement->id_to_delete);
+  IndexEntry* old_entries = table_index_entries(table, cursor);
+  leaf_node_delete(cursor);
+  table_unindex_row(table, old_entries);
+  pager_commit(table->pager);
 
-  return cursor;
+  free(old_entries);
+  free(cursor);
+  return EXECUTE_SUCCESS;
 }
 
-void* cursor_value(Cursor* cursor) {
-  uint32_t page_num = cursor->page_num;
-  void* page = get_page(cursor->table->pager, page_num);
-  return leaf_node_value(page, cursor->cell_num);
+/* Print a selected row, or encode it if the select has a result buffer */
+void select_output(Statement* statement, Row* row) {
+  if (statement->results == NULL) {
+    print_row(row);
+  } else {
+    result_append_row(statement->results, row);
+  }
 }
 
-void cursor_advance(Cursor* cursor) {
-  uint32_t page_num = cursor->page_num;
-  void* node = get_page(cursor->table->pager, page_num);
+bool row_matches_filter(Statement* statement, Row* row) {
+  const char* value;
+  uint32_t length;
+  switch (statement->filter_column) {
+    case (COLUMN_ID):
+      return true;
+    case (COLUMN_USERNAME):
+      value = row->username;
+      length = strlen(row->username);
+      break;
+    case (COLUMN_EMAIL):
+      value = row->email;
+      length = row->email_length;
+      break;
+    default:
+      return false;
+  }
+  if (statement->filter_prefix ? length < statement->filter_length
+                               : length != statement->filter_length) {
+    return false;
+  }
+  return memcmp(value, statement->filter_value, statement->filter_length) == 0;
+}
 
-  cursor->cell_num += 1;
-  if (cursor->cell_num >= (*leaf_node_num_cells(node))) {
-    /* Advance to next leaf node */
-    uint32_t next_page_num = *leaf_node_next_leaf(node);
-    if (next_page_num == 0) {
-      /* This was rightmost leaf */
-      cursor->end_of_table = true;
-    } else {
-      cursor->page_num = next_page_num;
-      cursor->cell_num = 0;
+/*
+Read the rows of the index entries whose key bytes match: all of them
+for an equal value, or the prefix's for a prefix. Each row is checked
+against the whole condition, as keys may be cut short. Rows come out in
+index order.
+*/
+ExecuteResult execute_select_by_index(Statement* statement, Table* table,
+                                      Table* index) {
+  IndexEntry first;
+  index_entry_init(&first, statement->filter_value, statement->filter_length,
+                   0);
+  uint32_t match_length = INDEX_KEY_SIZE;
+  if (statement->filter_prefix && statement->filter_length < INDEX_KEY_SIZE) {
+    match_length = statement->filter_length;
+  }
+
+  pager_advise(table->pager, ACCESS_RANDOM);
+  Cursor* cursor = index_seek(index, &first);
+  Row row;
+  row.email = NULL;
+  while (!cursor->end_of_table) {
+    IndexEntry entry = index_cursor_entry(cursor);
+    if (memcmp(entry.key, first.key, match_length) != 0) {
+      break;
+    }
+    if (entry.row_id >= statement->range_start &&
+        entry.row_id < statement->range_end) {
+      Cursor* row_cursor = table_find_id(table, entry.row_id);
+      row.id = entry.row_id;
+      deserialize_row(table->pager, cursor_value(row_cursor), &row);
+      free(row_cursor);
+      if (row_matches_filter(statement, &row)) {
+        select_output(statement, &row);
+      }
     }
+    index_cursor_advance(cursor);
   }
+
+  free(row.email);
+  free(cursor);
+  return EXECUTE_SUCCESS;
 }
 
-Pager* pager_open(const char* filename) {
-  int fd = open(filename,
-                O_RDWR |      // Read/Write mode
-                    O_CREAT,  // Create file if it does not exist
-                S_IWUSR |     // User write permission
-                    S_IRUSR   // User read permission
-                );
+/*
+Output the row at id if it meets the select's condition. An encoded
+result takes the record's bytes as they are when the row needs no
+checking and its email has no overflow chain.
+*/
+void select_record(Statement* statement, Table* table, uint32_t id,
+                   void* record, Row* row) {
+  if (statement->results != NULL && statement->filter_column == COLUMN_ID &&
+      record_overflow_offset(record) == 0) {
+    result_append_record(statement->results, id, record);
+    return;
+  }
+  row->id = id;
+  deserialize_row(table->pager, record, row);
+  if (row_matches_filter(statement, row)) {
+    select_output(statement, row);
+  }
+}
 
-  if (fd == -1) {
-    printf("Unable to open file\n");
-    exit(EXIT_FAILURE);
+ExecuteResult execute_select(Statement* statement, Table* table) {
+  if (statement->range_start >= statement->range_end) {
+    return EXECUTE_SUCCESS;
+  }
+  Table* index = table_find_index(table, statement->filter_column);
+  if (statement->filter_column != COLUMN_ID && index != NULL) {
+    return execute_select_by_index(statement, table, index);
   }
 
-  off_t file_length = lseek(fd, 0, SEEK_END);
+  Row row;
+  row.email = NULL;
+  if (statement->range_end == (uint64_t)statement->range_start + 1) {
+    uint8_t record[RECORD_MAX_SIZE];
+    LookupResult result =
+        table_find_record(table, statement->range_start, record);
+    if (result == LOOKUP_FOUND) {
+      select_record(statement, table, statement->range_start, record, &row);
+    }
+    if (result != LOOKUP_LATCH) {
+      free(row.email);
+      return EXECUTE_SUCCESS;
+    }
+  }
 
-  Pager* pager = malloc(sizeof(Pager));
-  pager->file_descriptor = fd;
-  pager->file_length = file_length;
-  pager->num_pages = (file_length / PAGE_SIZE);
+  Cursor* cursor;
+  if (statement->range_start == 0 && statement->range_end > UINT32_MAX) {
+    cursor = table_start_shared(table);
+  } else if (table->pager->hash_index &&
+             statement->range_end == (uint64_t)statement->range_start + 1) {
+    /* A single id; a cursor anywhere else would find nothing to print */
+    cursor = table_find_id_shared(table, statement->range_start);
+    cursor->end_of_table = !cursor_is_at_key(cursor, statement->range_start);
+  } else {
+    /* Seek to the lower bound and stop at the upper one */
+    pager_advise(table->pager, ACCESS_RANDOM);
+    cursor = table_seek_shared(table, statement->range_start);
+  }
 
-  if (file_length % PAGE_SIZE != 0) {
-    printf("Db file is not a whole number of pages. Corrupt file.\n");
-    exit(EXIT_FAILURE);
+  while (!(cursor->end_of_table)) {
+    uint32_t id = cursor_key(cursor);
+    if (id >= statement->range_end) {
+      break;
+    }
+    select_record(statement, table, id, cursor_value(cursor), &row);
+    if ((uint64_t)id + 1 >= statement->range_end) {
+      break;  // Nothing left in range; don't touch the next leaf
+    }
+    cursor_advance(cursor);
   }
 
-  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-    pager->pages[i] = NULL;
+  free(row.email);
+  cursor_close(cursor);
+
+  return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_statement_on(Statement* statement, Database* db) {
+  if (statement->type == STATEMENT_CREATE_TABLE) {
+    return execute_create_table(statement, db);
+  } else if (statement->type == STATEMENT_CREATE_INDEX) {
+    return execute_create_index(statement, db);
+  }
+  Table* table = db_find_table(db, statement->table_name);
+  if (table == NULL) {
+    return EXECUTE_NO_SUCH_TABLE;
   }
 
-  return pager;
+  switch (statement->type) {
+    case (STATEMENT_INSERT):
+      return execute_insert(statement, table);
+    case (STATEMENT_SELECT):
+      return execute_select(statement, table);
+    case (STATEMENT_UPDATE):
+      return execute_update(statement, table);
+    case (STATEMENT_DELETE):
+      return execute_delete(statement, table);
+    case (STATEMENT_CREATE_TABLE):
+    case (STATEMENT_CREATE_INDEX):
+      break;
+  }
+  return EXECUTE_SUCCESS;
 }
 
-Table* db_open(const char* filename) {
-  Pager* pager = pager_open(filename);
+/*
+How a statement shares its table with other threads. A select of one
+id latches the pages it reads; any other select reads a snapshot, so
+that a scan sees one state of the table however long it takes, and the
+index pages, which are never latched, are read safely.
+*/
+TreeAccess statement_access(Statement* statement) {
+  switch (statement->type) {
+    case (STATEMENT_INSERT):
+      return statement->rows_to_insert == NULL ? TREE_INSERT
+                                               : TREE_EXCLUSIVE;
+    case (STATEMENT_SELECT):
+      if (statement->filter_column == COLUMN_ID &&
+          statement->range_end == (uint64_t)statement->range_start + 1) {
+        return TREE_READ;
+      }
+      return TREE_SNAPSHOT;
+    case (STATEMENT_UPDATE):
+    case (STATEMENT_DELETE):
+      return TREE_WRITE;
+    case (STATEMENT_CREATE_TABLE):
+    case (STATEMENT_CREATE_INDEX):
+      break;
+  }
+  return TREE_EXCLUSIVE;
+}
 
-  Table* table = malloc(sizeof(Table));
-  table->pager = pager;
-  table->root_page_num = 0;
+/*
+Run a statement, sharing the database with statements run by other
+threads at the same time. Tables are only added while nothing else
+runs, so every other statement may look its table up.
+*/
+ExecuteResult execute_statement(Statement* statement, Database* db) {
+  Pager* pager = db->pager;
+  TreeAccess access = statement_access(statement);
+  pager_enter(pager, access);
+  ExecuteResult result = execute_statement_on(statement, db);
+  pager_exit(pager, access);
+  return result;
+}
 
-  if (pager->num_pages == 0) {
-    // New database file. Initialize page 0 as leaf node.
-    void* root_node = get_page(pager, 0);
-    initialize_leaf_node(root_node);
-    set_node_root(root_node, true);
+void parse_options(int argc, char* argv[], DbOptions* options) {
+  options->backend = PAGER_BUFFER_POOL;
+  options->pool_frames = DEFAULT_POOL_FRAMES;
+  options->group_commit = 1;
+  options->page_size = DEFAULT_PAGE_SIZE;
+  options->compress_pages = false;
+  options->hash_index = false;
+  options->listen_address = NULL;
+
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "--pool-frames") == 0 && i + 1 < argc) {
+      int frames = atoi(argv[++i]);
+      if (frames < MIN_POOL_FRAMES) {
+        printf("Buffer pool needs at least %d frames.\n", MIN_POOL_FRAMES);
+        exit(EXIT_FAILURE);
+      }
+      options->pool_frames = frames;
+    } else if (strcmp(argv[i], "--group-commit") == 0 && i + 1 < argc) {
+      int commits = atoi(argv[++i]);
+      if (commits <= 0) {
+        printf("Group commit size must be positive.\n");
+        exit(EXIT_FAILURE);
+      }
+      options->group_commit = commits;
+    } else if (strcmp(argv[i], "--page-size") == 0 && i + 1 < argc) {
+      int size = atoi(argv[++i]);
+      if (size <= 0 || !is_valid_page_size(size)) {
+        printf("Page size must be a power of two from %d to %d.\n",
+               MIN_PAGE_SIZE, MAX_PAGE_SIZE);
+        exit(EXIT_FAILURE);
+      }
+      options->page_size = size;
+    } else if (strcmp(argv[i], "--mmap") == 0) {
+      options->backend = PAGER_MMAP;
+    } else if (strcmp(argv[i], "--compress-pages") == 0) {
+      options->compress_pages = true;
+    } else if (strcmp(argv[i], "--hash-index") == 0) {
+      options->hash_index = true;
+    } else if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc) {
+      options->listen_address = argv[++i];
+    } else {
+      printf("Unrecognized option '%s'\n", argv[i]);
+      exit(EXIT_FAILURE);
+    }
   }
+}
 
-  return table;
+void print_prepare_error(PrepareResult result, const char* input) {
+  switch (result) {
+    case (PREPARE_SUCCESS):
+      break;
+    case (PREPARE_NEGATIVE_ID):
+      printf("ID must be positive.\n");
+      break;
+    case (PREPARE_STRING_TOO_LONG):
+      printf("String is too long.\n");
+      break;
+    case (PREPARE_SYNTAX_ERROR):
+      printf("Syntax error. Could not parse statement.\n");
+      break;
+    case (PREPARE_UNRECOGNIZED_STATEMENT):
+      printf("Unrecognized keyword at start of '%s'.\n", input);
+      break;
+  }
 }
 
-InputBuffer* new_input_buffer() {
-  InputBuffer* input_buffer = malloc(sizeof(InputBuffer));
-  input_buffer->buffer = NULL;
-  input_buffer->buffer_length = 0;
-  input_buffer->input_length = 0;
+void print_execute_result(ExecuteResult result, Statement* statement) {
+  switch (result) {
+    case (EXECUTE_SUCCESS):
+      printf("Executed.\n");
+      break;
+    case (EXECUTE_DUPLICATE_KEY):
+      printf("Error: Duplicate key.\n");
+      break;
+    case (EXECUTE_KEY_NOT_FOUND):
+      printf("Error: Key not found.\n");
+      break;
+    case (EXECUTE_NO_SUCH_TABLE):
+      printf("Error: No such table '%s'.\n", statement->table_name);
+      break;
+    case (EXECUTE_TABLE_EXISTS):
+      printf("Error: Table '%s' already exists.\n", statement->table_name);
+      break;
+    case (EXECUTE_INDEX_EXISTS):
+      printf("Error: Index on %s(%s) already exists.\n",
+             statement->table_name, column_name(statement->column_to_index));
+      break;
+  }
+}
 
-  return input_buffer;
+void statement_free(Statement* statement) {
+  free(statement->row_to_insert.email);
+  for (uint32_t i = 0;
+       statement->rows_to_insert != NULL && i < statement->num_rows_to_insert;
+       i++) {
+    free(statement->rows_to_insert[i].email);
+  }
+  free(statement->rows_to_insert);
 }
 
-void print_prompt() { printf("db > "); }
+/*
+ * Prepared Statements
+ * "prepare <name> <statement>" parses a statement once and keeps it
+ * under a name, with a ? for each value left to bind, and
+ * "execute <name> <value> ..." binds values to those in order and runs
+ * it, skipping the parse. Prepared statements belong to a session: the
+ * REPL, or one connection to the server, which can also execute them
+ * with binary values and get back binary rows (see server_execute()).
+ */
+#define PREPARED_NAME_MAX_SIZE 32
 
-void read_input(InputBuffer* input_buffer) {
-  ssize_t bytes_read =
-      getline(&(input_buffer->buffer), &(input_buffer->buffer_length), stdin);
+typedef struct {
+  char* name;
+  char* text;           // The statement, which it points into
+  Statement statement;  // As prepared, with each parameter unset
+  char* filter_value;   // A bound filter value, which it points to
+} PreparedStatement;
 
-  if (bytes_read <= 0) {
-    printf("Error reading input\n");
-    exit(EXIT_FAILURE);
+typedef struct {
+  PreparedStatement* statements;
+  uint32_t num_statements;
+  uint32_t statements_capacity;
+} Session;
+
+/* A value bound to a parameter: an id, or a string for any other */
+typedef struct {
+  uint64_t id;
+  const char* string;
+  uint32_t length;
+} ParameterValue;
+
+Session* new_session() { return calloc(1, sizeof(Session)); }
+
+void prepared_free(PreparedStatement* prepared) {
+  free(prepared->name);
+  free(prepared->text);
+  free(prepared->filter_value);
+  statement_free(&prepared->statement);
+}
+
+void session_close(Session* session) {
+  for (uint32_t i = 0; i < session->num_statements; i++) {
+    prepared_free(&session->statements[i]);
   }
+  free(session->statements);
+  free(session);
+}
 
-  // Ignore trailing newline
-  input_buffer->input_length = bytes_read - 1;
-  input_buffer->buffer[bytes_read - 1] = 0;
+PreparedStatement* session_find(Session* session, const char* name,
+                                uint32_t name_length) {
+  for (uint32_t i = 0; i < session->num_statements; i++) {
+    PreparedStatement* prepared = &session->statements[i];
+    if (strlen(prepared->name) == name_length &&
+        memcmp(prepared->name, name, name_length) == 0) {
+      return prepared;
+    }
+  }
+  return NULL;
 }
 
-void close_input_buffer(InputBuffer* input_buffer) {
-  free(input_buffer->buffer);
-  free(input_buffer);
+/* Whether a parameter is bound to an id rather than a string */
+bool parameter_is_id(Parameter* parameter) {
+  return parameter->kind == PARAMETER_ID ||
+         (parameter->kind == PARAMETER_FILTER &&
+          parameter->column == COLUMN_ID);
 }
 
-void pager_flush(Pager* pager, uint32_t page_num) {
-  if (pager->pages[page_num] == NULL) {
-    printf("Tried to flush null page\n");
-    exit(EXIT_FAILURE);
+/*
+Fill in a copy of a prepared statement with one value per parameter.
+The copy shares the prepared statement's memory, so it is not freed,
+and is good until the statement is bound again.
+*/
+PrepareResult prepared_bind(PreparedStatement* prepared, ParameterValue* values,
+                            Statement* statement) {
+  Statement* unbound = &prepared->statement;
+  for (uint32_t i = 0; i < unbound->num_parameters; i++) {
+    Parameter* parameter = &unbound->parameters[i];
+    ParameterValue* value = &values[i];
+    Row* row = unbound->rows_to_insert != NULL
+                   ? &unbound->rows_to_insert[parameter->row]
+                   : &unbound->row_to_insert;
+    if (parameter->kind == PARAMETER_ID) {
+      row->id = value->id;
+      unbound->id_to_delete = value->id;
+    } else if (parameter->kind == PARAMETER_USERNAME) {
+      if (value->length > COLUMN_USERNAME_SIZE) {
+        return PREPARE_STRING_TOO_LONG;
+      }
+      memcpy(row->username, value->string, value->length);
+      row->username[value->length] = '\0';
+    } else if (parameter->kind == PARAMETER_EMAIL) {
+      if (value->length > COLUMN_EMAIL_SIZE) {
+        return PREPARE_STRING_TOO_LONG;
+      }
+      row_set_email(row, value->string, value->length);
+    }
+  }
+
+  *statement = *unbound;
+  for (uint32_t i = 0; i < unbound->num_parameters; i++) {
+    Parameter* parameter = &unbound->parameters[i];
+    ParameterValue* value = &values[i];
+    PrepareResult result = PREPARE_SUCCESS;
+    if (parameter->kind != PARAMETER_FILTER) {
+      continue;
+    } else if (parameter->column == COLUMN_ID) {
+      result = select_range_apply(statement, parameter->operator, value->id);
+    } else {
+      prepared->filter_value =
+          realloc(prepared->filter_value, value->length + 1);
+      memcpy(prepared->filter_value, value->string, value->length);
+      prepared->filter_value[value->length] = '\0';
+      statement->filter_column = COLUMN_ID;
+      result = prepare_select_filter(statement, parameter->column,
+                                     parameter->operator,
+                                     prepared->filter_value);
+    }
+    if (result != PREPARE_SUCCESS) {
+      return result;
+    }
+  }
+  return PREPARE_SUCCESS;
+}
+
+/* prepare <name> <statement> */
+void run_prepare(InputBuffer* input_buffer, Session* session) {
+  char* name = input_buffer->buffer + strlen("prepare ");
+  name += strspn(name, " ");
+  uint32_t name_length = strcspn(name, " ");
+  char* text = name + name_length + strspn(name + name_length, " ");
+  if (!is_table_name(name, name_length) || *text == '\0') {
+    print_prepare_error(PREPARE_SYNTAX_ERROR, input_buffer->buffer);
+    return;
+  }
+  if (name_length > PREPARED_NAME_MAX_SIZE) {
+    print_prepare_error(PREPARE_STRING_TOO_LONG, input_buffer->buffer);
+    return;
   }
 
-  off_t offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-
-  if (offset == -1) {
-    printf("Error seeking: %d\n", errno);
-    exit(EXIT_FAILURE);
+  PreparedStatement prepared;
+  prepared.name = strndup(name, name_length);
+  prepared.text = strdup(text);
+  prepared.filter_value = NULL;
+  InputBuffer statement_input;
+  statement_input.buffer = prepared.text;
+  statement_input.input_length = strlen(text);
+  statement_input.buffer_length = statement_input.input_length + 1;
+  PrepareResult result =
+      prepare_statement(&statement_input, &prepared.statement);
+  if (result != PREPARE_SUCCESS) {
+    print_prepare_error(result, text);
+    prepared_free(&prepared);
+    return;
   }
 
-  ssize_t bytes_written =
-      write(pager->file_descriptor, pager->pages[page_num], PAGE_SIZE);
-
-  if (bytes_written == -1) {
-    printf("Error writing: %d\n", errno);
-    exit(EXIT_FAILURE);
+  /* Preparing a name again replaces its statement */
+  PreparedStatement* existing = session_find(session, name, name_length);
+  if (existing != NULL) {
+    prepared_free(existing);
+    *existing = prepared;
+  } else {
+    if (session->num_statements == session->statements_capacity) {
+      session->statements_capacity = session->statements_capacity * 2 + 4;
+      session->statements =
+          realloc(session->statements, sizeof(PreparedStatement) *
+                                           session->statements_capacity);
+    }
+    session->statements[session->num_statements++] = prepared;
   }
+  printf("Prepared.\n");
 }
 
-void db_close(Table* table) {
-  Pager* pager = table->pager;
+/* execute <name> <value> ... */
+void run_execute(InputBuffer* input_buffer, Database* db, Session* session) {
+  strtok(input_buffer->buffer, " ");  // The keyword
+  char* name = strtok(NULL, " ");
+  PreparedStatement* prepared =
+      name != NULL ? session_find(session, name, strlen(name)) : NULL;
+  if (prepared == NULL) {
+    printf("No prepared statement '%s'.\n", name != NULL ? name : "");
+    return;
+  }
 
-  for (uint32_t i = 0; i < pager->num_pages; i++) {
-    if (pager->pages[i] == NULL) {
-      continue;
+  Statement* unbound = &prepared->statement;
+  ParameterValue values[STATEMENT_MAX_PARAMETERS];
+  PrepareResult result = PREPARE_SUCCESS;
+  for (uint32_t i = 0; i < unbound->num_parameters; i++) {
+    char* token = strtok(NULL, " ");
+    if (token == NULL) {
+      result = PREPARE_SYNTAX_ERROR;
+      break;
+    }
+    char* end;
+    long long id = strtoll(token, &end, 10);
+    if (parameter_is_id(&unbound->parameters[i]) && *end != '\0') {
+      result = PREPARE_SYNTAX_ERROR;  // An id must be a number
+      break;
+    }
+    if (parameter_is_id(&unbound->parameters[i]) && id < 0) {
+      result = PREPARE_NEGATIVE_ID;
+      break;
     }
-    pager_flush(pager, i);
-    free(pager->pages[i]);
-    pager->pages[i] = NULL;
+    values[i].id = id;
+    values[i].string = token;
+    values[i].length = strlen(token);
+  }
+  if (result == PREPARE_SUCCESS && strtok(NULL, " ") != NULL) {
+    result = PREPARE_SYNTAX_ERROR;
   }
 
-  int result = close(pager->file_descriptor);
-  if (result == -1) {
-    printf("Error closing db file.\n");
-    exit(EXIT_FAILURE);
+  Statement statement;
+  if (result == PREPARE_SUCCESS) {
+    result = prepared_bind(prepared, values, &statement);
   }
-  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-    void* page = pager->pages[i];
-    if (page) {
-      free(page);
-      pager->pages[i] = NULL;
-    }
+  if (result != PREPARE_SUCCESS) {
+    print_prepare_error(result, prepared->text);
+    return;
   }
-  free(pager);
-  free(table);
+  print_execute_result(execute_statement(&statement, db), &statement);
 }
 
-MetaCommandResult do_meta_command(InputBuffer* input_buffer, Table* table) {
-  if (strcmp(input_buffer->buffer, ".exit") == 0) {
-    close_input_buffer(input_buffer);
-    db_close(table);
-    exit(EXIT_SUCCESS);
-  } else if (strcmp(input_buffer->buffer, ".btree") == 0) {
-    printf("Tree:\n");
-    print_tree(table->pager, 0, 0);
-    return META_COMMAND_SUCCESS;
-  } else if (strcmp(input_buffer->buffer, ".constants") == 0) {
-    printf("Constants:\n");
-    print_constants();
-    return META_COMMAND_SUCCESS;
+/* Run one line of input: a meta command, a statement, or a session's */
+void run_input(InputBuffer* input_buffer, Database* db, Session* session) {
+  if (input_buffer->buffer[0] == '.') {
+    switch (do_meta_command(input_buffer, db)) {
+      case (META_COMMAND_SUCCESS):
+        return;
+      case (META_COMMAND_UNRECOGNIZED_COMMAND):
+        printf("Unrecognized command '%s'\n", input_buffer->buffer);
+        return;
+    }
+  }
+  if (strncmp(input_buffer->buffer, "prepare ", 8) == 0) {
+    run_prepare(input_buffer, session);
+    return;
+  }
+  if (strncmp(input_buffer->buffer, "execute ", 8) == 0) {
+    run_execute(input_buffer, db, session);
+    return;
+  }
+
+  Statement statement;
+  PrepareResult result = prepare_statement(input_buffer, &statement);
+  if (result == PREPARE_SUCCESS && statement.num_parameters > 0) {
+    result = PREPARE_SYNTAX_ERROR;  // Only a prepared statement takes a ?
+  }
+  if (result == PREPARE_SUCCESS) {
+    print_execute_result(execute_statement(&statement, db), &statement);
   } else {
-    return META_COMMAND_UNRECOGNIZED_COMMAND;
+    print_prepare_error(result, input_buffer->buffer);
   }
+  statement_free(&statement);
 }
 
-PrepareResult prepare_insert(InputBuffer* input_buffer, Statement* statement) {
-  statement->type = STATEMENT_INSERT;
+/*
+ * Server
+ * With --listen, the database is served to clients over a socket instead
+ * of read from stdin, so that they all share one buffer pool. An address
+ * that is a number is a TCP port on the loopback interface, HOST:PORT is
+ * a TCP port on an IPv4 address, and anything else is the path of a
+ * Unix socket. Each request is one line of input and each response is
+ * what the REPL would have printed for it, both sent as a 4-byte length
+ * in network byte order followed by that many bytes. A client may not
+ * .import, which reads a file on the server's side. One thread runs
+ * every statement, in the order the requests arrive, and an epoll loop
+ * reads and writes the connections in between.
+ *
+ * A request may instead execute a prepared statement with its values in
+ * binary, so that neither the request nor its rows are text. It starts
+ * with REQUEST_EXECUTE, then the statement's name as a length byte and
+ * the name, then a value per parameter: an id as 4 bytes, or a string
+ * as a 4-byte length and the string, all numbers in network byte order.
+ * Its response is a ResponseType byte. Rows follow RESPONSE_ROWS, each
+ * as result_append_record() puts it; either error is followed by a byte
+ * holding its PrepareResult or ExecuteResult.
+ *
+ * An error that would end the REPL, such as a failed write, fails only
+ * the request that hit it: its client is told and disconnected, and the
+ * database is opened again from its file, keeping what was committed.
+ */
+#define SERVER_MAX_EVENTS 64
+#define SERVER_MAX_REQUEST (1 << 20)  // Longest line a client may send
+#define MESSAGE_LENGTH_SIZE sizeof(uint32_t)
+#define REQUEST_EXECUTE 0x01  // No line of text starts with it
 
-  char* keyword = strtok(input_buffer->buffer, " ");
-  char* id_string = strtok(NULL, " ");
-  char* username = strtok(NULL, " ");
-  char* email = strtok(NULL, " ");
+typedef enum {
+  RESPONSE_ROWS,
+  RESPONSE_PREPARE_ERROR,
+  RESPONSE_EXECUTE_ERROR,
+  RESPONSE_FAILED  // The request failed and the connection is closed
+} ResponseType;
 
-  if (id_string == NULL || username == NULL || email == NULL) {
-    return PREPARE_SYNTAX_ERROR;
+typedef struct {
+  int fd;
+  Session* session;
+  ByteBuffer input;   // Received and not yet run
+  ByteBuffer output;  // Responses not yet sent
+  size_t output_sent;
+  bool closing;  // Close once output is sent
+  bool end_of_input;  // The client sent all it will; answer it, then close
+} Connection;
+
+/* Fill in a socket address; see above for the forms it takes */
+socklen_t socket_address(const char* address,
+                         struct sockaddr_storage* storage) {
+  memset(storage, 0, sizeof(*storage));
+  const char* colon = strrchr(address, ':');
+  const char* port = colon != NULL ? colon + 1 : address;
+  bool is_port = *port != '\0' && strspn(port, "0123456789") == strlen(port);
+  if (!is_port) {
+    struct sockaddr_un* unix_address = (struct sockaddr_un*)storage;
+    if (strlen(address) >= sizeof(unix_address->sun_path)) {
+      printf("Socket path is too long.\n");
+      exit(EXIT_FAILURE);
+    }
+    unix_address->sun_family = AF_UNIX;
+    strcpy(unix_address->sun_path, address);
+    return sizeof(struct sockaddr_un);
   }
 
-  int id = atoi(id_string);
-  if (id < 0) {
-    return PREPARE_NEGATIVE_ID;
-  }
-  if (strlen(username) > COLUMN_USERNAME_SIZE) {
-    return PREPARE_STRING_TOO_LONG;
-  }
-  if (strlen(email) > COLUMN_EMAIL_SIZE) {
-    return PREPARE_STRING_TOO_LONG;
+  struct sockaddr_in* inet_address = (struct sockaddr_in*)storage;
+  inet_address->sin_family = AF_INET;
+  inet_address->sin_port = htons(atoi(port));
+  inet_address->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (colon != NULL) {
+    char host[INET_ADDRSTRLEN];
+    size_t host_length = colon - address;
+    if (host_length >= sizeof(host)) {
+      host_length = sizeof(host) - 1;
+    }
+    memcpy(host, address, host_length);
+    host[host_length] = '\0';
+    if (inet_pton(AF_INET, host, &inet_address->sin_addr) != 1) {
+      printf("Invalid address '%s'.\n", address);
+      exit(EXIT_FAILURE);
+    }
   }
-
-  statement->row_to_insert.id = id;
-  strcpy(statement->row_to_insert.username, username);
-  strcpy(statement->row_to_insert.email, email);
-
-  return PREPARE_SUCCESS;
+  return sizeof(struct sockaddr_in);
 }
 
-PrepareResult prepare_statement(InputBuffer* input_buffer,
-                                Statement* statement) {
-  if (strncmp(input_buffer->buffer, "insert", 6) == 0) {
-    return prepare_insert(input_buffer, statement);
-  }
-  if (strcmp(input_buffer->buffer, "select") == 0) {
-    statement->type = STATEMENT_SELECT;
-    return PREPARE_SUCCESS;
+/* Read the next n bytes of a binary request, or NULL if it is too short */
+const char* request_take(const char** position, const char* end, size_t n) {
+  if ((size_t)(end - *position) < n) {
+    return NULL;
   }
-
-  return PREPARE_UNRECOGNIZED_STATEMENT;
+  const char* taken = *position;
+  *position += n;
+  return taken;
 }
 
 /*
-Until we start recycling free pages, new pages will always
-go onto the end of the database file
+Run a binary execute request, appending its response. A select's rows
+are encoded straight into the response.
 */
-uint32_t get_unused_page_num(Pager* pager) { return pager->num_pages; }
-
-void create_new_root(Table* table, uint32_t right_child_page_num) {
-  /*
-  Handle splitting the root.
-  Old root copied to new page, becomes left child.
-  Address of right child passed in.
-  Re-initialize root page to contain the new root node.
-  New root node points to two children.
-  */
-
-  void* root = get_page(table->pager, table->root_page_num);
-  void* right_child = get_page(table->pager, right_child_page_num);
-  uint32_t left_child_page_num = get_unused_page_num(table->pager);
-  void* left_child = get_page(table->pager, left_child_page_num);
+void server_execute(Database* db, Session* session, const char* request,
+                    size_t length, ByteBuffer* response) {
+  const char* end = request + length;
+  const char* position = request + 1;
+  const char* name_length = request_take(&position, end, 1);
+  const char* name =
+      name_length != NULL
+          ? request_take(&position, end, (uint8_t)*name_length)
+          : NULL;
+  PreparedStatement* prepared =
+      name != NULL ? session_find(session, name, (uint8_t)*name_length)
+                   : NULL;
+
+  ParameterValue values[STATEMENT_MAX_PARAMETERS];
+  PrepareResult result =
+      prepared != NULL ? PREPARE_SUCCESS : PREPARE_UNRECOGNIZED_STATEMENT;
+  for (uint32_t i = 0;
+       result == PREPARE_SUCCESS && i < prepared->statement.num_parameters;
+       i++) {
+    uint32_t number;
+    const char* field = request_take(&position, end, sizeof(number));
+    if (field != NULL) {
+      memcpy(&number, field, sizeof(number));
+      number = ntohl(number);
+    }
+    if (field == NULL) {
+      result = PREPARE_SYNTAX_ERROR;
+    } else if (parameter_is_id(&prepared->statement.parameters[i])) {
+      values[i].id = number;
+    } else {
+      values[i].string = request_take(&position, end, number);
+      values[i].length = number;
+      result = values[i].string != NULL ? PREPARE_SUCCESS
+                                        : PREPARE_SYNTAX_ERROR;
+    }
+  }
+  if (result == PREPARE_SUCCESS && position != end) {
+    result = PREPARE_SYNTAX_ERROR;
+  }
 
-  /* Left child has data copied from old root */
-  memcpy(left_child, root, PAGE_SIZE);
-  set_node_root(left_child, false);
+  Statement statement;
+  if (result == PREPARE_SUCCESS) {
+    result = prepared_bind(prepared, values, &statement);
+  }
+  size_t start = response->length;
+  uint8_t header[2] = {RESPONSE_PREPARE_ERROR, result};
+  if (result != PREPARE_SUCCESS) {
+    buffer_append(response, header, sizeof(header));
+    return;
+  }
 
-  /* Root node is a new internal node with one key and two children */
-  initialize_internal_node(root);
-  set_node_root(root, true);
-  *internal_node_num_keys(root) = 1;
-  *internal_node_child(root, 0) = left_child_page_num;
-  uint32_t left_child_max_key = get_node_max_key(left_child);
-  *internal_node_key(root, 0) = left_child_max_key;
-  *internal_node_right_child(root) = right_child_page_num;
-  *node_parent(left_child) = table->root_page_num;
-  *node_parent(right_child) = table->root_page_num;
+  header[0] = RESPONSE_ROWS;
+  buffer_append(response, header, 1);
+  statement.results = response;
+  ExecuteResult execute_result = execute_statement(&statement, db);
+  if (execute_result != EXECUTE_SUCCESS) {
+    response->length = start;
+    header[0] = RESPONSE_EXECUTE_ERROR;
+    header[1] = execute_result;
+    buffer_append(response, header, sizeof(header));
+  }
 }
 
-void internal_node_insert(Table* table, uint32_t parent_page_num,
-                          uint32_t child_page_num) {
-  /*
-  Add a new child/key pair to parent that corresponds to child
-  */
-
-  void* parent = get_page(table->pager, parent_page_num);
-  void* child = get_page(table->pager, child_page_num);
-  uint32_t child_max_key = get_node_max_key(child);
-  uint32_t index = internal_node_find_child(parent, child_max_key);
-
-  uint32_t original_num_keys = *internal_node_num_keys(parent);
-  *internal_node_num_keys(parent) = original_num_keys + 1;
-
-  if (original_num_keys >= INTERNAL_NODE_MAX_CELLS) {
-    printf("Need to implement splitting internal node\n");
-    exit(EXIT_FAILURE);
+/*
+Run a request, coming back with false instead if it hits an error that
+leaves the database unusable (see db_fail()).
+*/
+bool server_run_request(Database* db, Session* session, char* request,
+                        size_t length, ByteBuffer* output) {
+  jmp_buf failure;
+  failure_jump = &failure;
+  if (setjmp(failure) != 0) {
+    failure_jump = NULL;
+    return false;
+  }
+  if (length > 0 && request[0] == REQUEST_EXECUTE) {
+    server_execute(db, session, request, length, output);
+  } else if (strncmp(request, ".import ", 8) == 0) {
+    /* It would read any file the server can, for any client */
+    printf("Error: .import is not allowed over a connection.\n");
+  } else {
+    InputBuffer input_buffer;
+    input_buffer.buffer = request;
+    input_buffer.input_length = strlen(request);
+    input_buffer.buffer_length = input_buffer.input_length + 1;
+    run_input(&input_buffer, db, session);
   }
+  failure_jump = NULL;
+  return true;
+}
 
-  uint32_t right_child_page_num = *internal_node_right_child(parent);
-  void* right_child = get_page(table->pager, right_child_page_num);
+/*
+Run one request and append its response, length first. A text request
+prints, so stdout is pointed at a memory stream while it runs. Returns
+false if the request hit an error that left the database unusable, in
+which case the database has been opened again and the client's
+connection should close.
+*/
+bool server_respond(Database* db, Session* session, char* request,
+                    size_t length, ByteBuffer* output) {
+  size_t prefix_offset = output->length;
+  buffer_reserve(output, MESSAGE_LENGTH_SIZE);
+  bool text = length == 0 || request[0] != REQUEST_EXECUTE;
+  char* printed;
+  size_t printed_length;
+  FILE* console = stdout;
+  if (text) {
+    fflush(stdout);
+    stdout = open_memstream(&printed, &printed_length);
+  }
 
-  if (child_max_key > get_node_max_key(right_child)) {
-    /* Replace right child */
-    *internal_node_child(parent, original_num_keys) = right_child_page_num;
-    *internal_node_key(parent, original_num_keys) =
-        get_node_max_key(right_child);
-    *internal_node_right_child(parent) = child_page_num;
-  } else {
-    /* Make room for the new cell */
-    for (uint32_t i = original_num_keys; i > index; i--) {
-      void* destination = internal_node_cell(parent, i);
-      void* source = internal_node_cell(parent, i - 1);
-      memcpy(destination, source, INTERNAL_NODE_CELL_SIZE);
+  bool failed = !server_run_request(db, session, request, length, output);
+  if (failed && !text) {
+    output->length = prefix_offset + MESSAGE_LENGTH_SIZE;
+    uint8_t header = RESPONSE_FAILED;
+    buffer_append(output, &header, sizeof(header));
+  }
+  if (text) {
+    if (failed) {
+      printf("Error: The request failed. Closing the connection.\n");
     }
-    *internal_node_child(parent, index) = child_page_num;
-    *internal_node_key(parent, index) = child_max_key;
+    fclose(stdout);
+    stdout = console;
+    buffer_append(output, printed, printed_length);
+    free(printed);
+  }
+  uint32_t prefix =
+      htonl(output->length - prefix_offset - MESSAGE_LENGTH_SIZE);
+  memcpy(output->data + prefix_offset, &prefix, MESSAGE_LENGTH_SIZE);
+  if (failed) {
+    db_reopen(db);
   }
+  return !failed;
 }
 
-void update_internal_node_key(void* node, uint32_t old_key, uint32_t new_key) {
-  uint32_t old_child_index = internal_node_find_child(node, old_key);
-  *internal_node_key(node, old_child_index) = new_key;
+void connection_close(int epoll_fd, Connection* connection) {
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+  close(connection->fd);
+  session_close(connection->session);
+  free(connection->input.data);
+  free(connection->output.data);
+  free(connection);
 }
 
-void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
-  /*
-  Create a new node and move half the cells over.
-  Insert the new value in one of the two nodes.
-  Update parent or create a new parent.
-  */
-
-  void* old_node = get_page(cursor->table->pager, cursor->page_num);
-  uint32_t old_max = get_node_max_key(old_node);
-  uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
-  void* new_node = get_page(cursor->table->pager, new_page_num);
-  initialize_leaf_node(new_node);
-  *node_parent(new_node) = *node_parent(old_node);
-  *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
-  *leaf_node_next_leaf(old_node) = new_page_num;
-
-  /*
-  All existing keys plus new key should should be divided
-  evenly between old (left) and new (right) nodes.
-  Starting from the right, move each key to correct position.
-  */
-  for (int32_t i = LEAF_NODE_MAX_CELLS; i >= 0; i--) {
-    void* destination_node;
-    if (i >= LEAF_NODE_LEFT_SPLIT_COUNT) {
-      destination_node = new_node;
-    } else {
-      destination_node = old_node;
+/*
+Send what output the socket takes without blocking, and wait for it
+to be writable only while some is left. Returns false once the
+connection is closed.
+*/
+bool connection_flush(int epoll_fd, Connection* connection) {
+  ByteBuffer* output = &connection->output;
+  while (connection->output_sent < output->length) {
+    ssize_t sent = send(connection->fd, output->data + connection->output_sent,
+                        output->length - connection->output_sent,
+                        MSG_NOSIGNAL);
+    if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (sent == -1) {
+      connection_close(epoll_fd, connection);
+      return false;
     }
-    uint32_t index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
-    void* destination = leaf_node_cell(destination_node, index_within_node);
+    connection->output_sent += sent;
+  }
 
-    if (i == cursor->cell_num) {
-      serialize_row(value,
-                    leaf_node_value(destination_node, index_within_node));
-      *leaf_node_key(destination_node, index_within_node) = key;
-    } else if (i > cursor->cell_num) {
-      memcpy(destination, leaf_node_cell(old_node, i - 1), LEAF_NODE_CELL_SIZE);
-    } else {
-      memcpy(destination, leaf_node_cell(old_node, i), LEAF_NODE_CELL_SIZE);
+  bool drained = connection->output_sent == output->length;
+  if (drained) {
+    output->length = 0;
+    connection->output_sent = 0;
+    if (connection->closing) {
+      connection_close(epoll_fd, connection);
+      return false;
     }
   }
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  if (!drained) {
+    /* A closing connection has nothing left to read, only to send */
+    event.events = connection->closing ? EPOLLOUT : EPOLLIN | EPOLLOUT;
+  }
+  event.data.ptr = connection;
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+  return true;
+}
 
-  /* Update cell count on both leaf nodes */
-  *(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
-  *(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
+/* Run every complete request received, queueing their responses */
+void connection_run_requests(Database* db, Connection* connection) {
+  ByteBuffer* input = &connection->input;
+  size_t start = 0;
+  while (!connection->closing &&
+         input->length - start >= MESSAGE_LENGTH_SIZE) {
+    uint32_t length;
+    memcpy(&length, input->data + start, MESSAGE_LENGTH_SIZE);
+    length = ntohl(length);
+    if (length > SERVER_MAX_REQUEST) {
+      connection->closing = true;
+      break;
+    }
+    if (input->length - start < MESSAGE_LENGTH_SIZE + length) {
+      break;
+    }
 
-  if (is_node_root(old_node)) {
-    return create_new_root(cursor->table, new_page_num);
-  } else {
-    uint32_t parent_page_num = *node_parent(old_node);
-    uint32_t new_max = get_node_max_key(old_node);
-    void* parent = get_page(cursor->table->pager, parent_page_num);
+    /* The request is cut out in place, ending in a NUL for text */
+    char* request = input->data + start + MESSAGE_LENGTH_SIZE;
+    start += MESSAGE_LENGTH_SIZE + length;
+    char next = request[length];
+    request[length] = '\0';
+    if (strcmp(request, ".exit") == 0) {
+      connection->closing = true;  // Ends this client, not the server
+      uint32_t empty = 0;
+      buffer_append(&connection->output, &empty, MESSAGE_LENGTH_SIZE);
+    } else if (!server_respond(db, connection->session, request, length,
+                               &connection->output)) {
+      connection->closing = true;
+    }
+    request[length] = next;
+  }
 
-    update_internal_node_key(parent, old_max, new_max);
-    internal_node_insert(cursor->table, parent_page_num, new_page_num);
-    return;
+  input->length -= start;
+  memmove(input->data, input->data + start, input->length);
+  if (connection->end_of_input) {
+    connection->closing = true;  // Any partial request left never ends
   }
 }
 
-void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value) {
-  void* node = get_page(cursor->table->pager, cursor->page_num);
+/*
+Read what has arrived and run the requests it completes. Requests are
+run after each read, so a length over SERVER_MAX_REQUEST closes the
+connection as soon as it arrives, and the input never holds more than
+one unfinished request. A client that shuts down its side still gets
+the answers to everything it sent before the connection closes.
+Returns false once the connection is closed.
+*/
+bool connection_read(int epoll_fd, Database* db, Connection* connection) {
+  ByteBuffer* input = &connection->input;
+  while (!connection->closing) {
+    /* One byte spare, for the NUL that ends a request */
+    if (input->capacity - input->length < 4096 + 1) {
+      input->capacity = input->capacity * 2 + 4096 + 1;
+      input->data = realloc(input->data, input->capacity);
+    }
+    ssize_t received = recv(connection->fd, input->data + input->length,
+                            input->capacity - input->length - 1, 0);
+    if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (received == 0) {
+      connection->end_of_input = true;
+      break;
+    }
+    if (received == -1) {
+      connection_close(epoll_fd, connection);
+      return false;
+    }
+    input->length += received;
+    connection_run_requests(db, connection);
+  }
 
-  uint32_t num_cells = *leaf_node_num_cells(node);
-  if (num_cells >= LEAF_NODE_MAX_CELLS) {
-    // Node full
-    leaf_node_split_and_insert(cursor, key, value);
-    return;
+  if (connection->end_of_input) {
+    connection_run_requests(db, connection);
   }
+  return connection_flush(epoll_fd, connection);
+}
 
-  if (cursor->cell_num < num_cells) {
-    // Make room for new cell
-    for (uint32_t i = num_cells; i > cursor->cell_num; i--) {
-      memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i - 1),
-             LEAF_NODE_CELL_SIZE);
+void server_accept(int epoll_fd, int listen_fd) {
+  while (true) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd == -1) {
+      return;  // EAGAIN once every waiting client is accepted
     }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    Connection* connection = calloc(1, sizeof(Connection));
+    connection->fd = fd;
+    connection->session = new_session();
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = connection;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
   }
-
-  *(leaf_node_num_cells(node)) += 1;
-  *(leaf_node_key(node, cursor->cell_num)) = key;
-  serialize_row(value, leaf_node_value(node, cursor->cell_num));
 }
 
-ExecuteResult execute_insert(Statement* statement, Table* table) {
-  Row* row_to_insert = &(statement->row_to_insert);
-  uint32_t key_to_insert = row_to_insert->id;
-  Cursor* cursor = table_find(table, key_to_insert);
-
-  void* node = get_page(table->pager, cursor->page_num);
-  uint32_t num_cells = *leaf_node_num_cells(node);
+/*
+Serve clients until SIGINT or SIGTERM, then close the database. The
+signals arrive through a signalfd, so the loop only ever stops between
+requests.
+*/
+void server_run_loop(Database* db, const char* address) {
+  struct sockaddr_storage storage;
+  socklen_t address_length = socket_address(address, &storage);
+  int listen_fd = socket(storage.ss_family,
+                         SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (storage.ss_family == AF_UNIX) {
+    unlink(address);
+  } else {
+    int reuse = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  }
+  if (listen_fd == -1 ||
+      bind(listen_fd, (struct sockaddr*)&storage, address_length) == -1 ||
+      listen(listen_fd, SOMAXCONN) == -1) {
+    printf("Unable to listen on '%s': %d\n", address, errno);
+    exit(EXIT_FAILURE);
+  }
 
-  if (cursor->cell_num < num_cells) {
-    uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
-    if (key_at_index == key_to_insert) {
-      return EXECUTE_DUPLICATE_KEY;
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigprocmask(SIG_BLOCK, &signals, NULL);
+  int signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.ptr = &listen_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+  event.data.ptr = &signal_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &event);
+
+  printf("Listening on %s\n", address);
+  fflush(stdout);
+
+  struct epoll_event events[SERVER_MAX_EVENTS];
+  bool stopping = false;
+  while (!stopping) {
+    int num_events = epoll_wait(epoll_fd, events, SERVER_MAX_EVENTS, -1);
+    if (num_events == -1 && errno != EINTR) {
+      printf("Error waiting for clients: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < num_events; i++) {
+      void* source = events[i].data.ptr;
+      if (source == &listen_fd) {
+        server_accept(epoll_fd, listen_fd);
+      } else if (source == &signal_fd) {
+        stopping = true;
+      } else if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        connection_read(epoll_fd, db, source);
+      } else if (events[i].events & EPOLLOUT) {
+        connection_flush(epoll_fd, source);
+      }
     }
   }
 
-  leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
-
-  free(cursor);
-
-  return EXECUTE_SUCCESS;
+  close(epoll_fd);
+  close(signal_fd);
+  close(listen_fd);
+  if (storage.ss_family == AF_UNIX) {
+    unlink(address);
+  }
+  db_close(db);
 }
 
-ExecuteResult execute_select(Statement* statement, Table* table) {
-  Cursor* cursor = table_start(table);
+bool read_fully(int fd, void* data, size_t size) {
+  while (size > 0) {
+    ssize_t received = read(fd, data, size);
+    if (received <= 0) {
+      return false;
+    }
+    data += received;
+    size -= received;
+  }
+  return true;
+}
 
-  Row row;
-  while (!(cursor->end_of_table)) {
-    deserialize_row(cursor_value(cursor), &row);
-    print_row(&row);
-    cursor_advance(cursor);
+bool write_fully(int fd, const void* data, size_t size) {
+  while (size > 0) {
+    ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+    if (sent <= 0) {
+      return false;
+    }
+    data += sent;
+    size -= sent;
   }
+  return true;
+}
 
-  free(cursor);
+/*
+The client for --connect: the REPL, with each line sent to a server
+and its response printed
+*/
+void client_run(const char* address) {
+  struct sockaddr_storage storage;
+  socklen_t address_length = socket_address(address, &storage);
+  int fd = socket(storage.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1 ||
+      connect(fd, (struct sockaddr*)&storage, address_length) == -1) {
+    printf("Unable to connect to '%s': %d\n", address, errno);
+    exit(EXIT_FAILURE);
+  }
 
-  return EXECUTE_SUCCESS;
-}
+  InputBuffer* input_buffer = new_input_buffer();
+  char* response = NULL;
+  while (true) {
+    print_prompt();
+    read_input(input_buffer);
+    if (strcmp(input_buffer->buffer, ".exit") == 0) {
+      break;
+    }
 
-ExecuteResult execute_statement(Statement* statement, Table* table) {
-  switch (statement->type) {
-    case (STATEMENT_INSERT):
-      return execute_insert(statement, table);
-    case (STATEMENT_SELECT):
-      return execute_select(statement, table);
+    uint32_t length = htonl(input_buffer->input_length);
+    if (!write_fully(fd, &length, MESSAGE_LENGTH_SIZE) ||
+        !write_fully(fd, input_buffer->buffer, input_buffer->input_length) ||
+        !read_fully(fd, &length, MESSAGE_LENGTH_SIZE)) {
+      printf("Lost connection to the server.\n");
+      exit(EXIT_FAILURE);
+    }
+    length = ntohl(length);
+    response = realloc(response, length);
+    if (!read_fully(fd, response, length)) {
+      printf("Lost connection to the server.\n");
+      exit(EXIT_FAILURE);
+    }
+    fwrite(response, 1, length, stdout);
   }
+
+  free(response);
+  close_input_buffer(input_buffer);
+  close(fd);
+  exit(EXIT_SUCCESS);
 }
 
 int main(int argc, char* argv[]) {
@@ -855,51 +8470,28 @@ int main(int argc, char* argv[]) {
     printf("Must supply a database filename.\n");
     exit(EXIT_FAILURE);
   }
+  if (strcmp(argv[1], "--connect") == 0) {
+    if (argc != 3) {
+      printf("Must supply an address to connect to.\n");
+      exit(EXIT_FAILURE);
+    }
+    client_run(argv[2]);
+  }
 
   char* filename = argv[1];
-  Table* table = db_open(filename);
+  DbOptions options;
+  parse_options(argc, argv, &options);
+  Database* db = db_open(filename, &options);
+  if (options.listen_address != NULL) {
+    server_run_loop(db, options.listen_address);
+    return 0;
+  }
 
   InputBuffer* input_buffer = new_input_buffer();
+  Session* session = new_session();
   while (true) {
     print_prompt();
     read_input(input_buffer);
-
-    if (input_buffer->buffer[0] == '.') {
-      switch (do_meta_command(input_buffer, table)) {
-        case (META_COMMAND_SUCCESS):
-          continue;
-        case (META_COMMAND_UNRECOGNIZED_COMMAND):
-          printf("Unrecognized command '%s'\n", input_buffer->buffer);
-          continue;
-      }
-    }
-
-    Statement statement;
-    switch (prepare_statement(input_buffer, &statement)) {
-      case (PREPARE_SUCCESS):
-        break;
-      case (PREPARE_NEGATIVE_ID):
-        printf("ID must be positive.\n");
-        continue;
-      case (PREPARE_STRING_TOO_LONG):
-        printf("String is too long.\n");
-        continue;
-      case (PREPARE_SYNTAX_ERROR):
-        printf("Syntax error. Could not parse statement.\n");
-        continue;
-      case (PREPARE_UNRECOGNIZED_STATEMENT):
-        printf("Unrecognized keyword at start of '%s'.\n",
-               input_buffer->buffer);
-        continue;
-    }
-
-    switch (execute_statement(&statement, table)) {
-      case (EXECUTE_SUCCESS):
-        printf("Executed.\n");
-        break;
-      case (EXECUTE_DUPLICATE_KEY):
-        printf("Error: Duplicate key.\n");
-        break;
-    }
+    run_input(input_buffer, db, session);
   }
 }
@@ -1,27 +1,46 @@
+require 'socket'
+
 describe 'database' do
   before do
-    `rm -rf test.db`
+    `rm -rf test.db test.db-wal test.csv test.sock`
   end
 
-  def run_script(commands)
+  def run_script(commands, options = "", program = "./db test.db")
     raw_output = nil
-    IO.popen("./db test.db", "r+") do |pipe|
-      commands.each do |command|
-        begin
-          pipe.puts command
-        rescue Errno::EPIPE
-          break
+    IO.popen("#{program} #{options}", "r+") do |pipe|
+      # Write from a thread so that neither side blocks on a full pipe
+      writer = Thread.new do
+        commands.each do |command|
+          begin
+            pipe.puts command
+          rescue Errno::EPIPE
+            break
+          end
         end
-      end
 
-      pipe.close_write
+        pipe.close_write
+      end
 
       # Read entire output
       raw_output = pipe.gets(nil)
+      writer.join
     end
     raw_output.split("\n")
   end
 
+  # The longest username and email make a 297-byte cell, 13 to a leaf
+  def wide_row(i)
+    [i, "user#{i}".ljust(32, "_"), "person#{i}@example.com".ljust(255, "_")]
+  end
+
+  def wide_insert(i)
+    "insert #{wide_row(i).join(" ")}"
+  end
+
+  def wide_select(i)
+    "(#{wide_row(i).join(", ")})"
+  end
+
   it 'inserts and retrieves a row' do
     result = run_script([
       "insert 1 user1 person1@example.com",
@@ -57,16 +76,24 @@ describe 'database' do
     ])
   end
 
-  it 'prints error message when table is full' do
-    script = (1..1401).map do |i|
-      "insert #{i} user#{i} person#{i}@example.com"
-    end
+  it 'splits internal nodes once the root fills up' do
+    script = (1..5000).map { |i| wide_insert(i) }
+    script << ".btree"
+    script << "select"
     script << ".exit"
     result = run_script(script)
-    expect(result.last(2)).to match_array([
-      "db > Executed.",
-      "db > Need to implement splitting internal node",
+    expect(result[5000...5003]).to match_array([
+      "db > Tree:",
+      "- internal (size 1)",
+      "  - internal (size 255)",
     ])
+    expect(result.last(3)).to match_array([
+      wide_select(5000),
+      "Executed.",
+      "db > ",
+    ])
+    rows = result.select { |line| line.include?("@example.com_") }
+    expect(rows.length).to eq(5000)
   end
 
   it 'allows inserting strings that are the maximum length' do
@@ -88,7 +115,7 @@ describe 'database' do
 
   it 'prints error message if strings are too long' do
     long_username = "a"*33
-    long_email = "a"*256
+    long_email = "a"*255
     script = [
       "insert 1 #{long_username} #{long_email}",
       "select",
@@ -102,6 +129,50 @@ describe 'database' do
     ])
   end
 
+  it 'keeps long emails in overflow pages and moves them on vacuum' do
+    first_email = "b" * 100_000
+    second_email = "c" * 100_000
+    result = run_script([
+      "insert 1 user1 #{first_email}",
+      "insert 2 user2 #{second_email}",
+      "insert 3 user3 person3@example.com",
+      ".stats",
+      ".exit",
+    ])
+    # The file header, the root and 25 overflow pages per long email
+    expect(result).to include("pages: 52")
+
+    result = run_script(["select where id = 3", "select", ".exit"])
+    expect(result).to match_array([
+      "db > (3, user3, person3@example.com)",
+      "Executed.",
+      "db > (1, user1, #{first_email})",
+      "(2, user2, #{second_email})",
+      "(3, user3, person3@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+
+    result = run_script([
+      "update 1 user1 person1@example.com",
+      ".stats",
+      ".vacuum",
+      ".stats",
+      ".exit",
+    ])
+    expect(result).to include("free_pages: 25", "pages: 27", "free_pages: 0")
+    expect(File.size("test.db")).to eq(27 * 4096)
+
+    result = run_script(["select", ".exit"])
+    expect(result).to match_array([
+      "db > (1, user1, person1@example.com)",
+      "(2, user2, #{second_email})",
+      "(3, user3, person3@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
   it 'prints an error message if id is negative' do
     script = [
       "insert -1 cstack foo@bar.com",
@@ -155,11 +226,9 @@ describe 'database' do
   end
 
   it 'allows printing out the structure of a 3-leaf-node btree' do
-    script = (1..14).map do |i|
-      "insert #{i} user#{i} person#{i}@example.com"
-    end
+    script = (1..14).map { |i| wide_insert(i) }
     script << ".btree"
-    script << "insert 15 user15 person15@example.com"
+    script << wide_insert(15)
     script << ".exit"
     result = run_script(script)
 
@@ -190,39 +259,11 @@ describe 'database' do
 
   it 'allows printing out the structure of a 4-leaf-node btree' do
     script = [
-      "insert 18 user18 person18@example.com",
-      "insert 7 user7 person7@example.com",
-      "insert 10 user10 person10@example.com",
-      "insert 29 user29 person29@example.com",
-      "insert 23 user23 person23@example.com",
-      "insert 4 user4 person4@example.com",
-      "insert 14 user14 person14@example.com",
-      "insert 30 user30 person30@example.com",
-      "insert 15 user15 person15@example.com",
-      "insert 26 user26 person26@example.com",
-      "insert 22 user22 person22@example.com",
-      "insert 19 user19 person19@example.com",
-      "insert 2 user2 person2@example.com",
-      "insert 1 user1 person1@example.com",
-      "insert 21 user21 person21@example.com",
-      "insert 11 user11 person11@example.com",
-      "insert 6 user6 person6@example.com",
-      "insert 20 user20 person20@example.com",
-      "insert 5 user5 person5@example.com",
-      "insert 8 user8 person8@example.com",
-      "insert 9 user9 person9@example.com",
-      "insert 3 user3 person3@example.com",
-      "insert 12 user12 person12@example.com",
-      "insert 27 user27 person27@example.com",
-      "insert 17 user17 person17@example.com",
-      "insert 16 user16 person16@example.com",
-      "insert 13 user13 person13@example.com",
-      "insert 24 user24 person24@example.com",
-      "insert 25 user25 person25@example.com",
-      "insert 28 user28 person28@example.com",
-      ".btree",
-      ".exit",
-    ]
+      18, 7, 10, 29, 23, 4, 14, 30, 15, 26, 22, 19, 2, 1, 21,
+      11, 6, 20, 5, 8, 9, 3, 12, 27, 17, 16, 13, 24, 25, 28,
+    ].map { |i| wide_insert(i) }
+    script << ".btree"
+    script << ".exit"
     result = run_script(script)
 
     expect(result[30...(result.length)]).to match_array([
@@ -278,16 +319,38 @@ describe 'database' do
 
     expect(result).to match_array([
       "db > Constants:",
-      "ROW_SIZE: 293",
+      "PAGE_SIZE: 4096",
+      "RECORD_MAX_SIZE: 293",
       "COMMON_NODE_HEADER_SIZE: 6",
-      "LEAF_NODE_HEADER_SIZE: 14",
-      "LEAF_NODE_CELL_SIZE: 297",
-      "LEAF_NODE_SPACE_FOR_CELLS: 4082",
-      "LEAF_NODE_MAX_CELLS: 13",
+      "LEAF_NODE_HEADER_SIZE: 22",
+      "LEAF_NODE_SLOT_SIZE: 8",
+      "LEAF_NODE_SPACE_FOR_CELLS: 4074",
+      "LEAF_NODE_MIN_FILL: 1358",
       "db > ",
     ])
   end
 
+  it 'packs short rows into one leaf and moves rows that grow' do
+    script = (1..100).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".btree"
+    script += [10, 20, 30].map { |i| "update #{wide_row(i).join(" ")}" }
+    script << ".btree"
+    script << ".exit"
+    result = run_script(script)
+    expect(result).to include("db > Tree:", "- leaf (size 100)")
+    expect(result).to include("- internal (size 1)", "  - key 43")
+
+    result = run_script(["select", ".exit"])
+    expected = (1..100).map do |i|
+      i % 10 == 0 && i <= 30 ? wide_select(i) :
+        "(#{i}, user#{i}, person#{i}@example.com)"
+    end
+    expected[0] = "db > " + expected[0]
+    expect(result).to match_array(expected + ["Executed.", "db > "])
+  end
+
   it 'prints all rows in a multi-level tree' do
     script = []
     (1..15).each do |i|
@@ -315,4 +378,731 @@ describe 'database' do
       "Executed.", "db > ",
     ])
   end
+
+  it 'keeps data in a table larger than the buffer pool' do
+    script = (1..200).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".stats"
+    script << ".exit"
+    result = run_script(script, "--pool-frames 8")
+    expect(result).to include("pool_frames: 8", "pinned_frames: 0")
+
+    result = run_script(["select", ".exit"], "--pool-frames 8")
+    expected = (1..200).map { |i| "(#{i}, user#{i}, person#{i}@example.com)" }
+    expected[0] = "db > " + expected[0]
+    expect(result).to match_array(expected + ["Executed.", "db > "])
+  end
+
+  it 'recovers committed rows from the WAL after a crash' do
+    script = (1..50).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    # No .exit: the process dies at end of input without closing the db
+    run_script(script)
+
+    result = run_script(["select", ".exit"])
+    expected = (1..50).map { |i| "(#{i}, user#{i}, person#{i}@example.com)" }
+    expected[0] = "db > " + expected[0]
+    expect(result).to match_array(expected + ["Executed.", "db > "])
+  end
+
+  it 'shares one WAL fsync between grouped commits' do
+    script = (1..50).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".stats"
+    script << ".exit"
+    result = run_script(script, "--group-commit 100")
+    expect(result).to include("commits: 51", "syncs: 0")
+  end
+
+  it 'does not write the database file in a read-only session' do
+    script = (1..100).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script)
+    contents = File.binread("test.db")
+    mtime = File.mtime("test.db")
+
+    result = run_script(["select", ".stats", ".exit"])
+    expect(result).to include("commits: 0", "pages_flushed: 0")
+    expect(File.binread("test.db")).to eq(contents)
+    expect(File.mtime("test.db")).to eq(mtime)
+  end
+
+  it 'reads and writes the same file through the mmap pager' do
+    script = (1..200).map do |i|
+      "insert #{201 - i} user#{201 - i} person#{201 - i}@example.com"
+    end
+    script << ".stats"
+    script << ".exit"
+    result = run_script(script, "--mmap")
+    expect(result).to include("backend: mmap", "mapped_pages: 5")
+
+    expected = (1..200).map { |i| "(#{i}, user#{i}, person#{i}@example.com)" }
+    expected[0] = "db > " + expected[0]
+    result = run_script(["select", ".exit"])
+    expect(result).to match_array(expected + ["Executed.", "db > "])
+
+    # Crash without closing, then recover through the mmap pager
+    run_script(["insert 201 user201 person201@example.com"], "--mmap")
+    result = run_script(["select", ".exit"], "--mmap")
+    expect(result).to include("(201, user201, person201@example.com)")
+  end
+
+  it 'keeps the page size chosen when the database was created' do
+    script = (1..200).map { |i| wide_insert(i) }
+    # No .exit: the new database is only in the WAL when the process dies
+    run_script(script, "--page-size 16384")
+
+    result = run_script([".stats", ".btree", ".exit"], "--page-size 4096")
+    expect(result).to include(
+      "page_size: 16384",
+      "pages: 9",
+      "- internal (size 6)",
+    )
+    expect(File.size("test.db")).to eq(9 * 16384)
+
+    result = run_script(["select where id = 150", ".exit"])
+    expect(result).to match_array([
+      "db > " + wide_select(150),
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'compresses pages in the main file' do
+    script = (1..500).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script, "--compress-pages")
+
+    # Uncompressed, the 11 pages would take 45056 bytes
+    result = run_script([".stats", ".exit"])
+    expect(result).to include("page_compression: lz4", "pages: 11")
+    expect(File.size("test.db")).to eq(20928)
+
+    # Crash without closing, then recover into the compressed file
+    run_script(["insert 501 user501 person501@example.com"])
+    result = run_script(["select where id >= 499", ".exit"])
+    expect(result).to match_array([
+      "db > (499, user499, person499@example.com)",
+      "(500, user500, person500@example.com)",
+      "(501, user501, person501@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+
+    result = run_script([".exit"], "--mmap")
+    expect(result).to match_array([
+      "Compressed pages need the buffer pool backend.",
+    ])
+  end
+
+  it 'rejects a file without a database header' do
+    File.binwrite("test.db", "\xff" * 4096)
+    result = run_script([".exit"])
+    expect(result).to match_array([
+      "File is not a database.",
+    ])
+  end
+
+  it 'rejects a file written in an older format' do
+    run_script(["insert 1 user1 person1@example.com", ".exit"])
+    # Format 2 interleaved the keys and children of internal nodes, and
+    # format 3 the keys and record locations of leaves
+    ["ToyDB format 2", "ToyDB format 3"].each do |magic|
+      File.open("test.db", "r+b") { |file| file.write(magic.ljust(16, "\0")) }
+      expect(run_script([".exit"])).to eq(["File is not a database."])
+    end
+  end
+
+  it 'updates and deletes rows by id' do
+    result = run_script([
+      "insert 1 user1 person1@example.com",
+      "insert 2 user2 person2@example.com",
+      "update 2 bob bob@example.com",
+      "delete 1",
+      "delete 1",
+      "update 3 user3 person3@example.com",
+      "select",
+      ".exit",
+    ])
+    expect(result).to match_array([
+      "db > Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > Error: Key not found.",
+      "db > Error: Key not found.",
+      "db > (2, bob, bob@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'merges leaves on delete and recycles the freed pages' do
+    script = (1..30).map { |i| wide_insert(i) }
+    script += (1..25).map { |i| "delete #{i}" }
+    script << ".btree"
+    script << ".stats"
+    script += (31..40).map { |i| wide_insert(i) }
+    script << ".stats"
+    script << ".exit"
+    result = run_script(script)
+    expect(result).to include(
+      "db > Tree:",
+      "- leaf (size 5)",
+      "pages: 6",
+      "free_pages: 4",
+      "free_pages: 2",
+    )
+
+    result = run_script([".vacuum", ".stats", ".exit"])
+    expect(result).to include("pages: 4", "free_pages: 0")
+    expect(File.size("test.db")).to eq(4 * 4096)
+  end
+
+  it 'refuses to vacuum a freelist that loops back on itself' do
+    script = (1..30).map { |i| wide_insert(i) }
+    script += (1..25).map { |i| "delete #{i}" }
+    script << ".exit"
+    run_script(script)
+    # Point the freelist's trunk page at itself as the next trunk
+    trunk = File.binread("test.db", 4, 24).unpack1("V")
+    File.open("test.db", "r+b") do |file|
+      file.seek(trunk * 4096)
+      file.write([trunk].pack("V"))
+    end
+
+    result = run_script([".vacuum", ".exit"])
+    expect(result).to eq(["db > Freelist is corrupt at page #{trunk}."])
+  end
+
+  it 'seeks to the start of an id range instead of scanning the table' do
+    script = (1..200).map { |i| wide_insert(i) }
+    script << ".exit"
+    run_script(script)
+
+    result = run_script([
+      "select where id >= 50 and id < 53",
+      "select where id = 7",
+      "select where id > 500",
+      ".stats",
+      ".exit",
+    ])
+    expect(result[0...6]).to match_array([
+      "db > " + wide_select(50),
+      wide_select(51),
+      wide_select(52),
+      "Executed.",
+      "db > " + wide_select(7),
+      "Executed.",
+    ])
+    expect(result[6]).to eq("db > Executed.")
+    # The file header, the root and one leaf per query
+    expect(result).to include("misses: 5")
+  end
+
+  it 'bulk loads a csv file into full leaves' do
+    lines = (1..30).to_a.reverse.map { |i| wide_row(i).join(",") }
+    File.write("test.csv", lines.join("\n") + "\n")
+    result = run_script([
+      wide_insert(5),
+      ".import test.csv",
+      ".btree",
+      ".exit",
+    ])
+    expect(result).to include(
+      "db > Imported 29 rows.",
+      "Skipped 1 rows with duplicate keys.",
+      "- internal (size 2)",
+      "  - leaf (size 13)",
+      "  - key 13",
+      "  - leaf (size 9)",
+      "  - key 22",
+      "  - leaf (size 8)",
+    )
+
+    result = run_script(["select", ".exit"])
+    expected = (1..30).map { |i| wide_select(i) }
+    expected[0] = "db > " + expected[0]
+    expect(result).to match_array(expected + ["Executed.", "db > "])
+  end
+
+  it 'rejects a malformed import without changing the table' do
+    File.write("test.csv", "1,user1,person1@example.com\n2,user2\n")
+    result = run_script([".import test.csv", "select", ".exit"])
+    expect(result).to match_array([
+      "db > Error: could not import line 2 of 'test.csv'.",
+      "db > Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'inserts a batch of rows in one statement' do
+    values = (1..40).to_a.reverse.map { |i| "(#{wide_row(i).join(",")})" }
+    result = run_script([
+      "insert values #{values.join(",")}",
+      "insert values (41,user41,a@b.com),(3,user3,c@d.com)",
+      "insert values (42,user42,a@b.com) (43,user43,c@d.com)",
+      ".btree",
+      ".exit",
+    ])
+    expect(result).to include(
+      "db > Executed.",
+      "db > Error: Duplicate key.",
+      "db > Syntax error. Could not parse statement.",
+      "- internal (size 3)",
+    )
+
+    result = run_script(["select", ".exit"])
+    expected = (1..40).map { |i| wide_select(i) }
+    expected[0] = "db > " + expected[0]
+    expect(result).to match_array(expected + ["Executed.", "db > "])
+  end
+
+  it 'compresses leaves and expands them again on write' do
+    values = (1..300).map { |i| "(#{i},user#{i},person#{i}@example.com)" }
+    long_email = "d" * 10_000
+    result = run_script([
+      "insert values #{values.join(",")}",
+      "insert 301 user301 #{long_email}",
+      ".compress",
+      ".vacuum",
+      ".stats",
+      ".btree",
+      ".exit",
+    ])
+    # The header, one leaf and the long email's three overflow pages.
+    # Uncompressed, the rows need three leaves under an internal node.
+    expect(result).to include("pages: 5", "- leaf (size 301, compressed)")
+
+    result = run_script([
+      "select where id = 150",
+      "select where id >= 299",
+      "delete 150",
+      "update 151 u u@v.com",
+      "select where id >= 149 and id <= 152",
+      ".exit",
+    ])
+    expect(result).to match_array([
+      "db > (150, user150, person150@example.com)",
+      "Executed.",
+      "db > (299, user299, person299@example.com)",
+      "(300, user300, person300@example.com)",
+      "(301, user301, #{long_email})",
+      "Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > (149, user149, person149@example.com)",
+      "(151, u, u@v.com)",
+      "(152, user152, person152@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+
+    result = run_script([".btree", ".exit"])
+    expect(result.grep(/compressed/)).to eq([])
+  end
+
+  it 'keeps tables created by name in one file' do
+    orders = (1..100).map { |i| "(#{i},order#{i},customer#{i}@example.com)" }
+    result = run_script([
+      "create table users",
+      "create table orders",
+      "create table users",
+      "insert into users 1 user1 person1@example.com",
+      "insert into orders values #{orders.join(",")}",
+      "insert 1 main1 main1@example.com",
+      "update users 1 user1 changed@example.com",
+      "delete from orders 100",
+      "select from missing",
+      "select from users",
+      ".tables",
+      ".exit",
+    ])
+    expect(result).to match_array([
+      "db > Executed.",
+      "db > Executed.",
+      "db > Error: Table 'users' already exists.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > Error: No such table 'missing'.",
+      "db > (1, user1, changed@example.com)",
+      "Executed.",
+      "db > main",
+      "users",
+      "orders",
+      "db > ",
+    ])
+
+    # Moving the orders root must update its catalog row
+    run_script([".compress orders", ".vacuum", ".exit"])
+    result = run_script([
+      ".btree orders",
+      "select from orders where id >= 98",
+      "select",
+      ".exit",
+    ])
+    expect(result).to match_array([
+      "db > Tree:",
+      "- leaf (size 99, compressed)",
+      *(1..99).map { |i| "  - #{i}" },
+      "db > (98, order98, customer98@example.com)",
+      "(99, order99, customer99@example.com)",
+      "Executed.",
+      "db > (1, main1, main1@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'finds rows by username and email through indexes' do
+    users = (1..300).map { |i| "(#{i},user#{i % 7},person#{i}@example.com)" }
+    result = run_script([
+      "create table users",
+      "insert into users values #{users.join(",")}",
+      "create index on users(email)",
+      "create index on users (username)",
+      "create index on users(email)",
+      "create index on users(id)",
+      "update users 12 user5 moved@example.org",
+      "delete from users 37",
+      "select from users where email = person120@example.com",
+      "select from users where email like person12%",
+      "select from users where username = user2 and id < 40",
+      ".exit",
+    ])
+    expect(result).to match_array([
+      "db > Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > Error: Index on users(email) already exists.",
+      "db > Syntax error. Could not parse statement.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > (120, user1, person120@example.com)",
+      "Executed.",
+      "db > (120, user1, person120@example.com)",
+      "(121, user2, person121@example.com)",
+      "(122, user3, person122@example.com)",
+      "(123, user4, person123@example.com)",
+      "(124, user5, person124@example.com)",
+      "(125, user6, person125@example.com)",
+      "(126, user0, person126@example.com)",
+      "(127, user1, person127@example.com)",
+      "(128, user2, person128@example.com)",
+      "(129, user3, person129@example.com)",
+      "Executed.",
+      "db > (2, user2, person2@example.com)",
+      "(9, user2, person9@example.com)",
+      "(16, user2, person16@example.com)",
+      "(23, user2, person23@example.com)",
+      "(30, user2, person30@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+
+    # The indexes are reopened from the catalog and kept up to date
+    result = run_script([
+      "insert into users 301 user2 person12@example.net",
+      "select from users where email like person12@%",
+      "select from users where username = user5 and id <= 12",
+      "select from users where username = user2 and id > 290",
+      ".exit",
+    ])
+    expect(result).to match_array([
+      "db > Executed.",
+      "db > (301, user2, person12@example.net)",
+      "Executed.",
+      "db > (5, user5, person5@example.com)",
+      "(12, user5, moved@example.org)",
+      "Executed.",
+      "db > (296, user2, person296@example.com)",
+      "(301, user2, person12@example.net)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'updates and deletes indexed rows in the smallest buffer pool' do
+    # Imported leaves are full, so updates split them and their indexes
+    lines = (1..5000).map { |i| "#{i},user#{i},person#{i}@example.com" }
+    File.write("test.csv", lines.join("\n") + "\n")
+    script = [
+      ".import test.csv",
+      "create index on main(username)",
+      "create index on main(email)",
+    ]
+    script += (1..50).flat_map do |i|
+      ["update #{i * 38 - 1} bob#{i} bob#{i}@example.org", "delete #{i * 40}"]
+    end
+    script += [
+      "select where username = bob2",
+      "select where email = person40@example.com",
+      ".stats",
+      ".exit",
+    ]
+    result = run_script(script, "--pool-frames 8")
+    expect(result).to include(
+      "db > (75, bob2, bob2@example.org)",
+      "pinned_frames: 0",
+    )
+    expect(result.count("db > Executed.")).to eq(2 + 100 + 1)
+  end
+
+  it 'finds ids through the hash index after pages are freed' do
+    script = (1..300).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script)
+
+    # Merging deleted leaves frees pages, which new rows then reuse
+    script = ["select where id = 150"]
+    script += (1..200).map { |i| "delete #{i}" }
+    script += (1001..1100).map { |i| "insert #{i} user#{i} person#{i}@x.org" }
+    script += [
+      "select where id = 150",
+      "update 250 bob bob@example.com",
+      "select where id = 250",
+      "select where id = 1050",
+      ".exit",
+    ]
+    result = run_script(script, "--hash-index")
+    expect(result.first).to eq("db > (150, user150, person150@example.com)")
+    expect(result.last(7)).to match_array([
+      "db > Executed.",
+      "db > Executed.",
+      "db > (250, bob, bob@example.com)",
+      "Executed.",
+      "db > (1050, user1050, person1050@x.org)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'serves clients over a socket from one shared database' do
+    server = IO.popen("./db test.db --listen test.sock")
+    expect(server.gets).to eq("Listening on test.sock\n")
+
+    script = (1..20).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script << ".exit"
+    client = "./db --connect test.sock"
+    result = run_script(script, "", client)
+    expect(result.last).to eq("db > ")
+
+    result = run_script(["select where id = 7", ".btree", ".exit"], "", client)
+    expect(result).to eq([
+      "db > (7, user7, person7@example.com)",
+      "Executed.",
+      "db > Tree:",
+      "- leaf (size 20)",
+    ] + (1..20).map { |i| "  - #{i}" } + ["db > "])
+
+    result = run_script([".import /etc/hostname", ".exit"], "", client)
+    expect(result).to eq([
+      "db > Error: .import is not allowed over a connection.",
+      "db > ",
+    ])
+
+    Process.kill("TERM", server.pid)
+    server.close
+    expect(File.exist?("test.sock")).to eq(false)
+    result = run_script(["select where id = 20", ".exit"])
+    expect(result).to eq([
+      "db > (20, user20, person20@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'answers requests sent before a client shuts down its side' do
+    server = IO.popen("./db test.db --listen test.sock")
+    expect(server.gets).to eq("Listening on test.sock\n")
+    socket = UNIXSocket.new("test.sock")
+    ["insert 1 a b", "insert 2 c d"].each do |request|
+      socket.write([request.bytesize].pack("N") + request)
+    end
+    socket.close_write
+
+    replies = 2.times.map { socket.read(socket.read(4).unpack1("N")) }
+    expect(replies).to eq(["Executed.\n", "Executed.\n"])
+    expect(socket.read).to eq("")
+    socket.close
+    Process.kill("TERM", server.pid)
+    server.close
+
+    result = run_script(["select", ".exit"])
+    expect(result).to eq([
+      "db > (1, a, b)",
+      "(2, c, d)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'closes a connection that announces a request too long' do
+    server = IO.popen("./db test.db --listen test.sock")
+    expect(server.gets).to eq("Listening on test.sock\n")
+    socket = UNIXSocket.new("test.sock")
+    socket.write(["insert 1 a b".bytesize].pack("N") + "insert 1 a b")
+    socket.write([0xFFFFFFFF].pack("N") + "x" * 100)
+    expect(socket.read(socket.read(4).unpack1("N"))).to eq("Executed.\n")
+    expect(socket.read).to eq("")
+    socket.close
+
+    result = run_script(["select", ".exit"], "", "./db --connect test.sock")
+    expect(result).to eq(["db > (1, a, b)", "Executed.", "db > "])
+    Process.kill("TERM", server.pid)
+    server.close
+  end
+
+  it 'fails only the request that finds a corrupt page' do
+    script = (1..200).map { |i| "insert #{i} user#{i} person#{i}@example.com" }
+    script << ".exit"
+    run_script(script)
+    # Page 3 is the leaf holding id 1; mark it an index node
+    File.open("test.db", "r+b") do |file|
+      file.seek(3 * 4096)
+      file.write("\x02")
+    end
+
+    server = IO.popen("./db test.db --listen test.sock")
+    expect(server.gets).to eq("Listening on test.sock\n")
+    request = lambda do |socket, message|
+      socket.write([message.bytesize].pack("N") + message)
+      socket.read(socket.read(4).unpack1("N"))
+    end
+    socket = UNIXSocket.new("test.sock")
+    expect(request.call(socket, "delete 1")).to eq(
+      "Page 3 is corrupt.\n" \
+      "Error: The request failed. Closing the connection.\n")
+    expect(socket.read).to eq("")
+    socket.close
+
+    socket = UNIXSocket.new("test.sock")
+    expect(request.call(socket, "prepare remove delete ?")).to eq(
+      "Prepared.\n")
+    message = [1, 6].pack("CC") + "remove" + [2].pack("N")
+    expect(request.call(socket, message).bytes).to eq([3])
+    expect(socket.read).to eq("")
+    socket.close
+
+    result = run_script([
+      "insert 300 a b",
+      "select where id = 300",
+      "select where id = 150",
+      ".exit",
+    ], "", "./db --connect test.sock")
+    expect(result).to eq([
+      "db > Executed.",
+      "db > (300, a, b)",
+      "Executed.",
+      "db > (150, user150, person150@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+    Process.kill("TERM", server.pid)
+    server.close
+  end
+
+  it 'executes prepared statements with binary values and rows' do
+    server = IO.popen("./db test.db --listen test.sock")
+    expect(server.gets).to eq("Listening on test.sock\n")
+    socket = UNIXSocket.new("test.sock")
+    request = lambda do |message|
+      socket.write([message.bytesize].pack("N") + message)
+      socket.read(socket.read(4).unpack1("N"))
+    end
+    execute = lambda do |name, values|
+      request.call([1, name.size].pack("CC") + name + values)
+    end
+    string = lambda { |value| [value.bytesize].pack("N") + value }
+
+    expect(request.call("prepare add insert ? ? ?")).to eq("Prepared.\n")
+    expect(request.call("prepare find select where id = ?")).to eq(
+      "Prepared.\n")
+    expect(request.call("prepare named select where username = ?")).to eq(
+      "Prepared.\n")
+    (1..3).each do |i|
+      values = [i].pack("N") + string.call("user#{i}") +
+               string.call("person#{i}@example.com")
+      expect(execute.call("add", values)).to eq("\x00")
+    end
+    expect(execute.call("add", [2].pack("N") + string.call("x") +
+                               string.call("y")).bytes).to eq([2, 1])
+
+    # Each row is its id, then its record: username and email lengths first
+    row = [2, 5].pack("NC") + "user2" + [19].pack("C") + "person2@example.com"
+    expect(execute.call("find", [2].pack("N")).b).to eq("\x00".b + row.b)
+    expect(execute.call("find", [9].pack("N"))).to eq("\x00")
+    expect(execute.call("named", string.call("user2")).b).to eq(
+      "\x00".b + row.b)
+    expect(execute.call("lost", "").bytes).to eq([1, 4])
+    expect(execute.call("find", "").bytes).to eq([1, 3])
+    expect(request.call("execute find 3")).to eq(
+      "(3, user3, person3@example.com)\nExecuted.\n")
+
+    socket.close
+    Process.kill("TERM", server.pid)
+    server.close
+  end
+
+  it 'binds parameters in each row of a prepared insert values' do
+    script = [
+      "prepare add insert values (?, ?, ?), (?, fixed, ?)",
+      "execute add 1 a a@example.com 2 b@example.com",
+      "execute add 3 c c@example.com 4 d@example.com",
+      "prepare wide insert values (?,?,?),(?,?,?),(?,?,?)",
+      "select",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result).to eq([
+      "db > Prepared.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > Syntax error. Could not parse statement.",
+      "db > (1, a, a@example.com)",
+      "(2, fixed, b@example.com)",
+      "(3, c, c@example.com)",
+      "(4, fixed, d@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'rejects a value bound to an id that is not a number' do
+    script = [
+      "prepare add insert ? ? ?",
+      "prepare find select where id = ?",
+      "execute add abc a a@example.com",
+      "execute add 5x a a@example.com",
+      "execute find abc",
+      "execute add 5 a a@example.com",
+      "select",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result).to eq([
+      "db > Prepared.",
+      "db > Prepared.",
+      "db > Syntax error. Could not parse statement.",
+      "db > Syntax error. Could not parse statement.",
+      "db > Syntax error. Could not parse statement.",
+      "db > Executed.",
+      "db > (5, a, a@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
 end